@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Readback bandwidth of each copy kernel available on this CPU, for whole planes and for row-wise copies between
+ * different pitches, of large planes split across threads, and of the conversion into each image format. Source
+ * buffers are page-aligned mappings like CAPTURE buffers, but cached; on hardware with uncached CAPTURE memory the
+ * differences between the kernels are larger.
+ */
+
+#include <cstring>
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+extern "C" {
+#include <sys/mman.h>
+#include <va/va.h>
+}
+
+#include "convert.h"
+#include "copy.h"
+#include "format.h"
+
+namespace {
+
+class Mapping {
+public:
+    explicit Mapping(size_t size)
+        : size(size)
+        , data(static_cast<uint8_t*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)))
+    {
+        memset(data, 0x5a, size);
+    }
+    ~Mapping() { munmap(data, size); }
+
+    const size_t size;
+    uint8_t* const data;
+};
+
+/** Copy a luma plane of `width` x `height` from a surface with `source_pitch` into a tightly packed image. */
+void BM_Copy(benchmark::State& state, const CopyKernel* kernel, size_t width, size_t height, size_t source_pitch)
+{
+    Mapping source(source_pitch * height);
+    Mapping destination(width * height);
+
+    for (auto _ : state) {
+        if (source_pitch == width) {
+            kernel->copy(destination.data, source.data, width * height);
+        } else {
+            for (size_t row = 0; row < height; row++) {
+                kernel->copy(destination.data + row * width, source.data + row * source_pitch, width);
+            }
+        }
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * width * height);
+}
+
+/** The same through a `CopyPool`, splitting the plane into row bands. */
+void BM_CopyPool(benchmark::State& state, size_t width, size_t height)
+{
+    Mapping source(width * height);
+    Mapping destination(width * height);
+    CopyPool pool(state.range(0), 0);
+
+    for (auto _ : state) {
+        pool.copy_plane(destination.data, width, source.data, width, width, height);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * width * height);
+}
+
+/** Convert an NV12 picture of `width` x `height` into a tightly packed image of `fourcc`. */
+void BM_Convert(benchmark::State& state, uint32_t fourcc, unsigned bytes_per_pixel, size_t width, size_t height)
+{
+    Mapping source(width * height * 3 / 2);
+    Mapping destination(width * height * bytes_per_pixel);
+
+    const ConvertSource planes = { source.data, width, source.data + width * height, width };
+    ConvertDestination image = { fourcc, { destination.data }, { width * bytes_per_pixel } };
+    if (bytes_per_pixel == 1) {
+        image.planes[1] = destination.data + width * height;
+        image.pitches[1] = (fourcc == VA_FOURCC_NV12) ? width : width / 2;
+        image.planes[2] = (fourcc == VA_FOURCC_NV12) ? nullptr : image.planes[1] + width * height / 4;
+        image.pitches[2] = width / 2;
+    }
+
+    for (auto _ : state) {
+        convert_rows(image, planes, width, 0, height);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * width * height * 3 / 2);
+}
+
+/** Upload an image of the given format into an NV12 picture, the reverse of `BM_Convert`. */
+void BM_Upload(benchmark::State& state, uint32_t fourcc, unsigned bytes_per_pixel, size_t width, size_t height)
+{
+    Mapping source(width * height * bytes_per_pixel);
+    Mapping destination(width * height * 3 / 2);
+
+    UploadSource image = { fourcc, { source.data }, { width * bytes_per_pixel } };
+    if (bytes_per_pixel == 1) {
+        image.planes[1] = source.data + width * height;
+        image.pitches[1] = (fourcc == VA_FOURCC_NV12) ? width : width / 2;
+        image.planes[2] = (fourcc == VA_FOURCC_NV12) ? nullptr : image.planes[1] + width * height / 4;
+        image.pitches[2] = width / 2;
+    }
+    const UploadDestination planes = { destination.data, width, destination.data + width * height, width };
+
+    for (auto _ : state) {
+        upload_rows(planes, image, width, 0, height);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * width * height * 3 / 2);
+}
+
+/** Unpack a 10-bit NV15 picture of `width` x `height` into P010. */
+void BM_UnpackNV15(benchmark::State& state, size_t width, size_t height)
+{
+    const auto pitch = width * 5 / 4;
+    Mapping source(pitch * height * 3 / 2);
+    Mapping destination(width * height * 3);
+
+    const ConvertSource planes = { source.data, pitch, source.data + pitch * height, pitch, VA_FOURCC_NV15 };
+    const ConvertDestination image
+        = { VA_FOURCC_P010, { destination.data, destination.data + 2 * width * height }, { 2 * width, 2 * width } };
+
+    for (auto _ : state) {
+        convert_rows(image, planes, width, 0, height);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * pitch * height * 3 / 2);
+}
+
+/** Detile both planes of a tiled NV12 picture into linear rows. */
+void BM_Detile(benchmark::State& state, unsigned tile_width, unsigned tile_height, size_t width, size_t height)
+{
+    const auto luma_rows = (height + tile_height - 1) / tile_height;
+    const auto chroma_rows = (height / 2 + tile_height - 1) / tile_height;
+    Mapping source(width * (luma_rows + chroma_rows) * tile_height);
+    Mapping destination(width * (luma_rows + chroma_rows) * tile_height);
+
+    for (auto _ : state) {
+        detile_rows(destination.data, source.data, width, tile_width, tile_height, luma_rows);
+        const auto offset = width * luma_rows * tile_height;
+        detile_rows(destination.data + offset, source.data + offset, width, tile_width, tile_height, chroma_rows);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * width * height * 3 / 2);
+}
+
+/** Blend a full plane of `width` x `height` bytes, as for a subpicture covering the picture. */
+void BM_Blend(benchmark::State& state, size_t width, size_t height)
+{
+    Mapping source(width * height);
+    Mapping alpha(width * height);
+    Mapping destination(width * height);
+
+    for (auto _ : state) {
+        for (size_t row = 0; row < height; row++) {
+            blend_row(destination.data + row * width, source.data + row * width, alpha.data + row * width, width);
+        }
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * width * height);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    struct Case {
+        const char* name;
+        size_t width;
+        size_t height;
+        size_t source_pitch;
+    };
+    const Case cases[] = {
+        { "1080p", 1920, 1080, 1920 },
+        { "1080p/strided", 1920, 1080, 2048 },
+        { "2160p", 3840, 2160, 3840 },
+        { "2160p/strided", 3840, 2160, 4096 },
+    };
+
+    for (auto&& kernel : copy_kernels()) {
+        for (auto&& c : cases) {
+            benchmark::RegisterBenchmark((std::string("BM_Copy/") + kernel.name + "/" + c.name).c_str(), BM_Copy,
+                &kernel, c.width, c.height, c.source_pitch);
+        }
+    }
+
+    benchmark::RegisterBenchmark("BM_CopyPool/2160p", BM_CopyPool, 3840, 2160)
+        ->RangeMultiplier(2)
+        ->Range(1, 8)
+        ->UseRealTime();
+    benchmark::RegisterBenchmark("BM_CopyPool/4320p", BM_CopyPool, 7680, 4320)
+        ->RangeMultiplier(2)
+        ->Range(1, 8)
+        ->UseRealTime();
+
+    struct Conversion {
+        const char* name;
+        uint32_t fourcc;
+        unsigned bytes_per_pixel;
+    };
+    const Conversion conversions[] = {
+        { "NV12", VA_FOURCC_NV12, 1 },
+        { "I420", VA_FOURCC_I420, 1 },
+        { "YUY2", VA_FOURCC_YUY2, 2 },
+        { "BGRA", VA_FOURCC_BGRA, 4 },
+    };
+    for (auto&& conversion : conversions) {
+        benchmark::RegisterBenchmark((std::string("BM_Convert/") + conversion.name + "/1080p").c_str(), BM_Convert,
+            conversion.fourcc, conversion.bytes_per_pixel, 1920, 1080);
+        benchmark::RegisterBenchmark((std::string("BM_Upload/") + conversion.name + "/1080p").c_str(), BM_Upload,
+            conversion.fourcc, conversion.bytes_per_pixel, 1920, 1080);
+    }
+    benchmark::RegisterBenchmark("BM_UnpackNV15/1080p", BM_UnpackNV15, 1920, 1080);
+    benchmark::RegisterBenchmark("BM_Detile/4x4/1080p", BM_Detile, 4, 4, 1920, 1080);
+    benchmark::RegisterBenchmark("BM_Detile/32x32/1080p", BM_Detile, 32, 32, 1920, 1080);
+    benchmark::RegisterBenchmark("BM_Blend/1080p", BM_Blend, 1920, 1080);
+
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,1016 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * End-to-end decode benchmark.
+ *
+ * Loads the driver module directly (bypassing libva's display handling) and drives the VA entry points the way a
+ * player does, using synthetic parameter streams. Meant to be run against the fake backend (`LIBVA_V4L2_BACKEND=fake`),
+ * but works with any device the driver finds. Each scenario runs in a child process, since the fake backend reads its
+ * configuration once per process. Results are written as JSON.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <dlfcn.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <va/va.h>
+#include <va/va_backend.h>
+#include <va/va_dec_vp8.h>
+#include <va/va_dec_vp9.h>
+#include <va/va_drmcommon.h>
+}
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+namespace {
+
+using InitFunction = VAStatus (*)(VADriverContextP);
+using Clock = std::chrono::steady_clock;
+
+/** Exit status for `meson test`, when the driver finds no suitable device. */
+constexpr int exit_skipped = 77;
+
+struct Options {
+    std::string driver;
+    std::vector<std::string> codecs = { "mpeg2", "h264", "vp8", "vp9" };
+    unsigned width = 1280;
+    unsigned height = 720;
+    unsigned frames = 300;
+    unsigned slice_size = 32 * 1024;
+    unsigned decode_time_us = 500;
+    std::vector<unsigned> depths = { 1, 2, 4, 8 };
+    std::vector<unsigned> contexts = { 1, 2, 4, 8, 16, 32 };
+    std::optional<std::string> output;
+};
+
+void check(VAStatus status, const char* what)
+{
+    if (status != VA_STATUS_SUCCESS) {
+        throw std::runtime_error(std::string(what) + " failed with status " + std::to_string(status));
+    }
+}
+
+double thread_cpu_us()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+double elapsed_us(Clock::time_point start, Clock::time_point end = Clock::now())
+{
+    return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+double percentile(std::vector<double> values, double p)
+{
+    if (values.empty()) {
+        return 0;
+    }
+    std::ranges::sort(values);
+    return values[std::min(values.size() - 1, static_cast<size_t>(p / 100 * values.size()))];
+}
+
+/**
+ * One VA display worth of driver state.
+ */
+class Display {
+public:
+    explicit Display(InitFunction init)
+    {
+        context.vtable = &vtable;
+        context.vtable_vpp = &vtable_vpp;
+        context.error_callback = [](VADriverContextP, const char* message) { fputs(message, stderr); };
+        context.info_callback = [](VADriverContextP, const char*) {};
+        check(init(&context), "driver initialization");
+    }
+
+    ~Display() { vtable.vaTerminate(&context); }
+
+    Display(const Display&) = delete;
+    Display& operator=(const Display&) = delete;
+
+    VADriverVTable* operator->() { return &vtable; }
+    VADriverContextP get() { return &context; }
+
+private:
+    VADriverContext context = {};
+    VADriverVTable vtable = {};
+    VADriverVTableVPP vtable_vpp = {};
+};
+
+struct BufferData {
+    VABufferType type;
+    std::vector<uint8_t> data;
+};
+
+template <typename T> BufferData buffer_data(VABufferType type, const T& value)
+{
+    const auto bytes = reinterpret_cast<const uint8_t*>(&value);
+    return { type, std::vector<uint8_t>(bytes, bytes + sizeof(value)) };
+}
+
+std::vector<uint8_t> slice_bytes(size_t size, unsigned seed)
+{
+    std::vector<uint8_t> result(size);
+    for (size_t i = 0; i < size; i++) {
+        result[i] = static_cast<uint8_t>((i * 2654435761u + seed) >> 13);
+    }
+    return result;
+}
+
+/**
+ * Synthetic parameter streams: one intra frame followed by frames predicted from their predecessor. The parameters
+ * are consistent enough to pass the driver's translation and the fake device's validation; the slice data is noise.
+ */
+class Stream {
+public:
+    virtual ~Stream() = default;
+    virtual VAProfile profile() const = 0;
+    virtual std::vector<BufferData> frame(unsigned index, VASurfaceID target, VASurfaceID previous) const = 0;
+
+    static std::unique_ptr<Stream> create(const std::string& codec, const Options& options);
+
+    Stream(const Options& options)
+        : width(options.width)
+        , height(options.height)
+        , slice_size(options.slice_size)
+    {
+    }
+
+protected:
+    unsigned width;
+    unsigned height;
+    unsigned slice_size;
+};
+
+class MPEG2Stream : public Stream {
+public:
+    using Stream::Stream;
+
+    VAProfile profile() const override { return VAProfileMPEG2Main; }
+
+    std::vector<BufferData> frame(unsigned index, VASurfaceID, VASurfaceID previous) const override
+    {
+        VAPictureParameterBufferMPEG2 picture = {};
+        picture.horizontal_size = width;
+        picture.vertical_size = height;
+        picture.forward_reference_picture = index ? previous : VA_INVALID_SURFACE;
+        picture.backward_reference_picture = VA_INVALID_SURFACE;
+        picture.picture_coding_type = index ? 2 : 1;
+        picture.f_code = 0x11ff;
+        picture.picture_coding_extension.bits.picture_structure = 3;
+        picture.picture_coding_extension.bits.frame_pred_frame_dct = 1;
+        picture.picture_coding_extension.bits.progressive_frame = 1;
+        picture.picture_coding_extension.bits.is_first_field = 1;
+
+        VAIQMatrixBufferMPEG2 iqmatrix = {};
+        iqmatrix.load_intra_quantiser_matrix = 1;
+        iqmatrix.load_non_intra_quantiser_matrix = 1;
+        std::fill_n(iqmatrix.intra_quantiser_matrix, 64, 16);
+        std::fill_n(iqmatrix.non_intra_quantiser_matrix, 64, 16);
+
+        VASliceParameterBufferMPEG2 slice = {};
+        slice.slice_data_size = slice_size;
+        slice.slice_data_flag = VA_SLICE_DATA_FLAG_ALL;
+        slice.quantiser_scale_code = 8;
+        slice.intra_slice_flag = index == 0;
+
+        return {
+            buffer_data(VAPictureParameterBufferType, picture),
+            buffer_data(VAIQMatrixBufferType, iqmatrix),
+            buffer_data(VASliceParameterBufferType, slice),
+            { VASliceDataBufferType, slice_bytes(slice_size, index) },
+        };
+    }
+};
+
+class H264Stream : public Stream {
+public:
+    using Stream::Stream;
+
+    VAProfile profile() const override { return VAProfileH264Main; }
+
+    std::vector<BufferData> frame(unsigned index, VASurfaceID target, VASurfaceID previous) const override
+    {
+        const VAPictureH264 invalid = { .picture_id = VA_INVALID_SURFACE, .flags = VA_PICTURE_H264_INVALID };
+        const VAPictureH264 reference = {
+            .picture_id = previous,
+            .frame_idx = (index - 1) % 16,
+            .flags = VA_PICTURE_H264_SHORT_TERM_REFERENCE,
+            .TopFieldOrderCnt = static_cast<int32_t>(2 * (index - 1)),
+            .BottomFieldOrderCnt = static_cast<int32_t>(2 * (index - 1)),
+        };
+
+        VAPictureParameterBufferH264 picture = {};
+        picture.CurrPic = {
+            .picture_id = target,
+            .frame_idx = index % 16,
+            .TopFieldOrderCnt = static_cast<int32_t>(2 * index),
+            .BottomFieldOrderCnt = static_cast<int32_t>(2 * index),
+        };
+        std::fill_n(picture.ReferenceFrames, 16, invalid);
+        if (index) {
+            picture.ReferenceFrames[0] = reference;
+        }
+        picture.picture_width_in_mbs_minus1 = (width + 15) / 16 - 1;
+        picture.picture_height_in_mbs_minus1 = (height + 15) / 16 - 1;
+        picture.num_ref_frames = 1;
+        picture.seq_fields.bits.chroma_format_idc = 1;
+        picture.seq_fields.bits.frame_mbs_only_flag = 1;
+        picture.seq_fields.bits.direct_8x8_inference_flag = 1;
+        picture.seq_fields.bits.log2_max_frame_num_minus4 = 0;
+        picture.seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4 = 2;
+        picture.pic_fields.bits.entropy_coding_mode_flag = 1;
+        picture.pic_fields.bits.deblocking_filter_control_present_flag = 1;
+        picture.pic_fields.bits.reference_pic_flag = 1;
+        picture.frame_num = index % 16;
+
+        VAIQMatrixBufferH264 matrix = {};
+        memset(matrix.ScalingList4x4, 16, sizeof(matrix.ScalingList4x4));
+        memset(matrix.ScalingList8x8, 16, sizeof(matrix.ScalingList8x8));
+
+        VASliceParameterBufferH264 slice = {};
+        slice.slice_data_size = slice_size;
+        slice.slice_data_flag = VA_SLICE_DATA_FLAG_ALL;
+        slice.slice_data_bit_offset = 40;
+        slice.slice_type = index ? 0 : 2; // P : I
+        std::fill_n(slice.RefPicList0, 32, invalid);
+        std::fill_n(slice.RefPicList1, 32, invalid);
+        if (index) {
+            slice.RefPicList0[0] = reference;
+        }
+
+        return {
+            buffer_data(VAPictureParameterBufferType, picture),
+            buffer_data(VAIQMatrixBufferType, matrix),
+            buffer_data(VASliceParameterBufferType, slice),
+            { VASliceDataBufferType, slice_bytes(slice_size, index) },
+        };
+    }
+};
+
+class VP8Stream : public Stream {
+public:
+    using Stream::Stream;
+
+    VAProfile profile() const override { return VAProfileVP8Version0_3; }
+
+    std::vector<BufferData> frame(unsigned index, VASurfaceID, VASurfaceID previous) const override
+    {
+        VAPictureParameterBufferVP8 picture = {};
+        picture.frame_width = width;
+        picture.frame_height = height;
+        picture.last_ref_frame = index ? previous : VA_INVALID_SURFACE;
+        picture.golden_ref_frame = index ? previous : VA_INVALID_SURFACE;
+        picture.alt_ref_frame = index ? previous : VA_INVALID_SURFACE;
+        picture.out_of_loop_frame = VA_INVALID_SURFACE;
+        picture.pic_fields.bits.key_frame = index ? 1 : 0; // VA inverts the bitstream's sense
+        picture.pic_fields.bits.mb_no_coeff_skip = 1;
+        picture.loop_filter_level[0] = 20;
+        picture.prob_skip_false = 128;
+        picture.prob_intra = 64;
+        picture.prob_last = 128;
+        picture.prob_gf = 128;
+        picture.bool_coder_ctx = { .range = 255, .value = 0, .count = 0 };
+
+        VAProbabilityDataBufferVP8 probabilities = {};
+        memset(probabilities.dct_coeff_probs, 128, sizeof(probabilities.dct_coeff_probs));
+
+        VAIQMatrixBufferVP8 iqmatrix = {};
+        for (auto&& segment : iqmatrix.quantization_index) {
+            std::fill_n(segment, 6, 40);
+        }
+
+        VASliceParameterBufferVP8 slice = {};
+        slice.slice_data_size = slice_size;
+        slice.slice_data_flag = VA_SLICE_DATA_FLAG_ALL;
+        slice.macroblock_offset = 100;
+        slice.num_of_partitions = 2;
+        slice.partition_size[0] = slice_size / 4;
+        slice.partition_size[1] = slice_size - slice_size / 4;
+
+        return {
+            buffer_data(VAPictureParameterBufferType, picture),
+            buffer_data(VAProbabilityBufferType, probabilities),
+            buffer_data(VAIQMatrixBufferType, iqmatrix),
+            buffer_data(VASliceParameterBufferType, slice),
+            { VASliceDataBufferType, slice_bytes(slice_size, index) },
+        };
+    }
+};
+
+/**
+ * VP9 needs parseable frame headers, since the driver reads them back from the slice data. All frames are key frames
+ * with an all-zero compressed header, which decodes to "no probability updates".
+ */
+class VP9Stream : public Stream {
+public:
+    using Stream::Stream;
+
+    VAProfile profile() const override { return VAProfileVP9Profile0; }
+
+    std::vector<BufferData> frame(unsigned index, VASurfaceID, VASurfaceID) const override
+    {
+        static constexpr unsigned compressed_header_size = 8;
+
+        std::vector<uint8_t> data;
+        unsigned bit = 0;
+        auto put = [&](uint32_t value, unsigned bits) {
+            while (bits--) {
+                if (bit % 8 == 0) {
+                    data.push_back(0);
+                }
+                data.back() |= ((value >> bits) & 1) << (7 - bit % 8);
+                bit++;
+            }
+        };
+
+        put(2, 2); // frame_marker
+        put(0, 2); // profile
+        put(0, 1); // show_existing_frame
+        put(0, 1); // frame_type: key frame
+        put(1, 1); // show_frame
+        put(0, 1); // error_resilient_mode
+        put(0x498342, 24); // frame_sync_code
+        put(1, 3); // color_space: BT.601
+        put(0, 1); // color_range
+        put(width - 1, 16);
+        put(height - 1, 16);
+        put(0, 1); // render_and_frame_size_different
+        put(1, 1); // refresh_frame_context
+        put(1, 1); // frame_parallel_decoding_mode
+        put(0, 2); // frame_context_idx
+        put(10, 6); // loop_filter_level
+        put(0, 3); // loop_filter_sharpness
+        put(0, 1); // loop_filter_delta_enabled
+        put(60, 8); // base_q_idx
+        put(0, 3); // delta_q_{y_dc,uv_dc,uv_ac} not coded
+        put(0, 1); // segmentation_enabled
+        const unsigned sb64_cols = (width + 63) / 64;
+        unsigned min_log2_tile_cols = 0, max_log2_tile_cols = 1;
+        while ((64u << min_log2_tile_cols) < sb64_cols) {
+            min_log2_tile_cols++;
+        }
+        while ((sb64_cols >> max_log2_tile_cols) >= 4) {
+            max_log2_tile_cols++;
+        }
+        if (max_log2_tile_cols - 1 > min_log2_tile_cols) {
+            put(0, 1); // increment_tile_cols_log2
+        }
+        put(0, 1); // tile_rows_log2
+        put(compressed_header_size, 16);
+        const unsigned uncompressed_header_size = data.size();
+
+        data.resize(std::max<size_t>(slice_size, uncompressed_header_size + compressed_header_size), 0);
+        const auto payload = slice_bytes(data.size() - uncompressed_header_size - compressed_header_size, index);
+        std::ranges::copy(payload, data.begin() + uncompressed_header_size + compressed_header_size);
+
+        VADecPictureParameterBufferVP9 picture = {};
+        picture.frame_width = width;
+        picture.frame_height = height;
+        std::fill_n(picture.reference_frames, 8, VA_INVALID_SURFACE);
+        picture.pic_fields.bits.subsampling_x = 1;
+        picture.pic_fields.bits.subsampling_y = 1;
+        picture.pic_fields.bits.frame_type = 0;
+        picture.pic_fields.bits.show_frame = 1;
+        picture.pic_fields.bits.refresh_frame_context = 1;
+        picture.pic_fields.bits.frame_parallel_decoding_mode = 1;
+        picture.filter_level = 10;
+        picture.frame_header_length_in_bytes = uncompressed_header_size;
+        picture.first_partition_size = compressed_header_size;
+        picture.profile = 0;
+        picture.bit_depth = 8;
+
+        VASliceParameterBufferVP9 slice = {};
+        slice.slice_data_size = data.size();
+        slice.slice_data_flag = VA_SLICE_DATA_FLAG_ALL;
+
+        return {
+            buffer_data(VAPictureParameterBufferType, picture),
+            buffer_data(VASliceParameterBufferType, slice),
+            { VASliceDataBufferType, std::move(data) },
+        };
+    }
+};
+
+std::unique_ptr<Stream> Stream::create(const std::string& codec, const Options& options)
+{
+    if (codec == "mpeg2") {
+        return std::make_unique<MPEG2Stream>(options);
+    } else if (codec == "h264") {
+        return std::make_unique<H264Stream>(options);
+    } else if (codec == "vp8") {
+        return std::make_unique<VP8Stream>(options);
+    } else if (codec == "vp9") {
+        return std::make_unique<VP9Stream>(options);
+    }
+    throw std::invalid_argument("Unknown codec " + codec);
+}
+
+bool profile_supported(InitFunction init, VAProfile profile)
+{
+    Display display(init);
+    std::vector<VAProfile> profiles(display.get()->max_profiles);
+    int count = 0;
+    check(display->vaQueryConfigProfiles(display.get(), profiles.data(), &count), "vaQueryConfigProfiles");
+    return std::find(profiles.begin(), profiles.begin() + count, profile) != profiles.begin() + count;
+}
+
+/**
+ * A decoding session: config, surfaces and context on a display of its own. Contexts are not reused, since the driver
+ * keeps a device's OUTPUT queue allocated until the display is terminated.
+ */
+class Session {
+public:
+    Session(InitFunction init, const Stream& stream, const Options& options, unsigned depth)
+        : display(init)
+        , stream(stream)
+        , depth(depth)
+        , surfaces(depth + 1) // one more, so the reference survives
+    {
+        check(display->vaCreateConfig(display.get(), stream.profile(), VAEntrypointVLD, nullptr, 0, &config),
+            "vaCreateConfig");
+        check(display->vaCreateSurfaces2(display.get(), VA_RT_FORMAT_YUV420, options.width, options.height,
+                  surfaces.data(), surfaces.size(), nullptr, 0),
+            "vaCreateSurfaces2");
+        check(display->vaCreateContext(display.get(), config, options.width, options.height, VA_PROGRESSIVE,
+                  surfaces.data(), surfaces.size(), &context),
+            "vaCreateContext");
+
+        for (unsigned i = 0; i < 16; i++) {
+            frames.push_back(
+                stream.frame(i, surfaces[i % surfaces.size()], surfaces[(i + surfaces.size() - 1) % surfaces.size()]));
+        }
+    }
+
+    ~Session()
+    {
+        display->vaDestroyContext(display.get(), context);
+        display->vaDestroySurfaces(display.get(), surfaces.data(), surfaces.size());
+        display->vaDestroyConfig(display.get(), config);
+    }
+
+    /**
+     * Submit one frame, first waiting for the oldest one if `depth` frames are in flight. Returns the surface.
+     */
+    VASurfaceID decode(unsigned index)
+    {
+        while (in_flight.size() >= depth) {
+            sync();
+        }
+
+        const auto target = surfaces[index % surfaces.size()];
+        const auto& buffers = frames[index % frames.size()];
+
+        check(display->vaBeginPicture(display.get(), context, target), "vaBeginPicture");
+        std::vector<VABufferID> ids(buffers.size());
+        for (unsigned i = 0; i < buffers.size(); i++) {
+            check(display->vaCreateBuffer(display.get(), context, buffers[i].type, buffers[i].data.size(), 1,
+                      const_cast<uint8_t*>(buffers[i].data.data()), &ids[i]),
+                "vaCreateBuffer");
+        }
+        check(display->vaRenderPicture(display.get(), context, ids.data(), ids.size()), "vaRenderPicture");
+        check(display->vaEndPicture(display.get(), context), "vaEndPicture");
+        for (auto&& id : ids) {
+            display->vaDestroyBuffer(display.get(), id);
+        }
+
+        in_flight.push_back(target);
+        return target;
+    }
+
+    void sync()
+    {
+        check(display->vaSyncSurface(display.get(), in_flight.front()), "vaSyncSurface");
+        in_flight.pop_front();
+    }
+
+    void drain()
+    {
+        while (!in_flight.empty()) {
+            sync();
+        }
+    }
+
+    Display display;
+    const Stream& stream;
+    const unsigned depth;
+    std::vector<VASurfaceID> surfaces;
+    VAConfigID config;
+    VAContextID context;
+    std::vector<std::vector<BufferData>> frames;
+    std::deque<VASurfaceID> in_flight;
+};
+
+/**
+ * Minimal JSON object builder, results are flat.
+ */
+class JsonObject {
+public:
+    JsonObject& add(const std::string& key, const std::string& value)
+    {
+        fields.push_back("\"" + key + "\": \"" + value + "\"");
+        return *this;
+    }
+
+    JsonObject& add(const std::string& key, double value)
+    {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%.3f", value);
+        fields.push_back("\"" + key + "\": " + buffer);
+        return *this;
+    }
+
+    JsonObject& add(const std::string& key, unsigned value)
+    {
+        fields.push_back("\"" + key + "\": " + std::to_string(value));
+        return *this;
+    }
+
+    std::string str() const
+    {
+        std::string result = "{";
+        for (size_t i = 0; i < fields.size(); i++) {
+            result += (i ? ", " : "") + fields[i];
+        }
+        return result + "}";
+    }
+
+private:
+    std::vector<std::string> fields;
+};
+
+/**
+ * Per-frame CPU time spent in the driver on the calling thread, with nothing to wait for.
+ */
+std::vector<JsonObject> run_overhead(InitFunction init, const Options& options)
+{
+    std::vector<JsonObject> results;
+
+    for (auto&& codec : options.codecs) {
+        const auto stream = Stream::create(codec, options);
+        if (!profile_supported(init, stream->profile())) {
+            results.push_back(
+                JsonObject().add("scenario", "overhead").add("codec", codec).add("skipped", "unsupported"));
+            continue;
+        }
+
+        Session session(init, *stream, options, 1);
+        std::vector<double> cpu(options.frames);
+        std::vector<double> wall(options.frames);
+
+        for (unsigned i = 0; i < options.frames; i++) {
+            const auto cpu_start = thread_cpu_us();
+            const auto wall_start = Clock::now();
+            session.decode(i);
+            session.drain();
+            wall[i] = elapsed_us(wall_start);
+            cpu[i] = thread_cpu_us() - cpu_start;
+        }
+
+        results.push_back(JsonObject()
+                              .add("scenario", "overhead")
+                              .add("codec", codec)
+                              .add("frames", options.frames)
+                              .add("cpu_us_per_frame", std::accumulate(cpu.begin(), cpu.end(), 0.0) / cpu.size())
+                              .add("cpu_us_p50", percentile(cpu, 50))
+                              .add("cpu_us_p99", percentile(cpu, 99))
+                              .add("wall_us_p50", percentile(wall, 50))
+                              .add("wall_us_p99", percentile(wall, 99)));
+    }
+
+    return results;
+}
+
+/**
+ * Throughput for increasing numbers of frames in flight, with a simulated decode time.
+ */
+std::vector<JsonObject> run_pipeline(InitFunction init, const Options& options)
+{
+    std::vector<JsonObject> results;
+
+    for (auto&& codec : options.codecs) {
+        const auto stream = Stream::create(codec, options);
+        if (!profile_supported(init, stream->profile())) {
+            continue;
+        }
+
+        for (auto depth : options.depths) {
+            Session session(init, *stream, options, depth);
+
+            const auto start = Clock::now();
+            for (unsigned i = 0; i < options.frames; i++) {
+                session.decode(i);
+            }
+            session.drain();
+            const auto wall = elapsed_us(start);
+
+            results.push_back(JsonObject()
+                                  .add("scenario", "pipeline")
+                                  .add("codec", codec)
+                                  .add("depth", depth)
+                                  .add("decode_time_us", options.decode_time_us)
+                                  .add("frames", options.frames)
+                                  .add("fps", options.frames / wall * 1e6));
+        }
+    }
+
+    return results;
+}
+
+/**
+ * Aggregate throughput of independent sessions, one display and thread each.
+ */
+std::vector<JsonObject> run_scaling(InitFunction init, const Options& options)
+{
+    std::vector<JsonObject> results;
+    const auto& codec = options.codecs.front();
+    const auto stream = Stream::create(codec, options);
+    if (!profile_supported(init, stream->profile())) {
+        return results;
+    }
+
+    for (auto count : options.contexts) {
+        std::barrier start_line(count + 1);
+        std::barrier finish_line(count + 1);
+        std::atomic<double> cpu_total = 0;
+        std::atomic<bool> failed = false;
+        std::vector<std::thread> threads;
+
+        for (unsigned t = 0; t < count; t++) {
+            threads.emplace_back([&] {
+                std::optional<Session> session;
+                try {
+                    session.emplace(init, *stream, options, 1);
+                } catch (std::exception& e) {
+                    fprintf(stderr, "%s\n", e.what());
+                    failed = true;
+                }
+
+                start_line.arrive_and_wait();
+                const auto cpu_start = thread_cpu_us();
+                // Failures must not skip the barrier, the other threads would wait for this one forever
+                try {
+                    for (unsigned i = 0; session && i < options.frames; i++) {
+                        session->decode(i);
+                    }
+                    if (session) {
+                        session->drain();
+                    }
+                } catch (std::exception& e) {
+                    fprintf(stderr, "%s\n", e.what());
+                    failed = true;
+                }
+                cpu_total = cpu_total + (thread_cpu_us() - cpu_start);
+                finish_line.arrive_and_wait();
+            });
+        }
+
+        start_line.arrive_and_wait();
+        const auto start = Clock::now();
+        finish_line.arrive_and_wait();
+        const auto wall = elapsed_us(start);
+        for (auto&& thread : threads) {
+            thread.join();
+        }
+
+        if (failed) {
+            results.push_back(JsonObject().add("scenario", "scaling").add("codec", codec).add("contexts", count).add(
+                "skipped", "failed"));
+            continue;
+        }
+
+        const unsigned frames = count * options.frames;
+        results.push_back(JsonObject()
+                              .add("scenario", "scaling")
+                              .add("codec", codec)
+                              .add("contexts", count)
+                              .add("decode_time_us", options.decode_time_us)
+                              .add("frames", frames)
+                              .add("fps", frames / wall * 1e6)
+                              .add("cpu_us_per_frame", cpu_total / frames));
+    }
+
+    return results;
+}
+
+uint64_t consume(const uint8_t* data, size_t size)
+{
+    uint64_t sum = 0;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t value;
+        memcpy(&value, data + i, sizeof(value));
+        sum += value;
+    }
+    for (; i < size; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+/**
+ * Image readback through vaDeriveImage, vaGetImage and vaLockSurface, and surface export, after each decoded frame.
+ */
+std::vector<JsonObject> run_readback(InitFunction init, const Options& options)
+{
+    const auto& codec = options.codecs.front();
+    const auto stream = Stream::create(codec, options);
+    if (!profile_supported(init, stream->profile())) {
+        return {};
+    }
+    Session session(init, *stream, options, 1);
+    auto& display = session.display;
+    volatile uint64_t sink = 0;
+
+    VAImageFormat format = { .fourcc = VA_FOURCC_NV12, .byte_order = VA_LSB_FIRST, .bits_per_pixel = 12 };
+    VAImage get_image;
+    check(display->vaCreateImage(display.get(), &format, options.width, options.height, &get_image), "vaCreateImage");
+
+    double derive_us = 0, get_us = 0, lock_us = 0, export_us = 0;
+    uint64_t derive_bytes = 0, get_bytes = 0;
+
+    for (unsigned i = 0; i < options.frames; i++) {
+        const auto surface = session.decode(i);
+        session.drain();
+
+        auto start = Clock::now();
+        VAImage image;
+        void* data;
+        check(display->vaDeriveImage(display.get(), surface, &image), "vaDeriveImage");
+        check(display->vaMapBuffer(display.get(), image.buf, &data), "vaMapBuffer");
+        sink = sink + consume(static_cast<uint8_t*>(data), image.data_size);
+        display->vaUnmapBuffer(display.get(), image.buf);
+        display->vaDestroyImage(display.get(), image.image_id);
+        derive_us += elapsed_us(start);
+        derive_bytes += image.data_size;
+
+        start = Clock::now();
+        check(display->vaGetImage(display.get(), surface, 0, 0, options.width, options.height, get_image.image_id),
+            "vaGetImage");
+        check(display->vaMapBuffer(display.get(), get_image.buf, &data), "vaMapBuffer");
+        sink = sink + consume(static_cast<uint8_t*>(data), get_image.data_size);
+        display->vaUnmapBuffer(display.get(), get_image.buf);
+        get_us += elapsed_us(start);
+        get_bytes += get_image.data_size;
+
+        start = Clock::now();
+        unsigned fourcc, luma_stride, u_stride, v_stride, luma_offset, u_offset, v_offset, buffer_name;
+        check(display->vaLockSurface(display.get(), surface, &fourcc, &luma_stride, &u_stride, &v_stride, &luma_offset,
+                  &u_offset, &v_offset, &buffer_name, &data),
+            "vaLockSurface");
+        sink = sink + consume(static_cast<uint8_t*>(data) + luma_offset, luma_stride * options.height);
+        check(display->vaUnlockSurface(display.get(), surface), "vaUnlockSurface");
+        lock_us += elapsed_us(start);
+
+        start = Clock::now();
+        VADRMPRIMESurfaceDescriptor descriptor = {};
+        if (display->vaExportSurfaceHandle(display.get(), surface, VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
+                VA_EXPORT_SURFACE_READ_ONLY | VA_EXPORT_SURFACE_COMPOSED_LAYERS, &descriptor)
+            == VA_STATUS_SUCCESS) {
+            for (unsigned j = 0; j < descriptor.num_objects; j++) {
+                close(descriptor.objects[j].fd);
+            }
+        }
+        export_us += elapsed_us(start);
+    }
+
+    display->vaDestroyImage(display.get(), get_image.image_id);
+
+    return {
+        JsonObject()
+            .add("scenario", "readback")
+            .add("codec", codec)
+            .add("frames", options.frames)
+            .add("derive_image_mb_per_s", derive_bytes / derive_us)
+            .add("get_image_mb_per_s", get_bytes / get_us)
+            .add("lock_us_per_frame", lock_us / options.frames)
+            .add("export_us_per_frame", export_us / options.frames),
+    };
+}
+
+/**
+ * Run a scenario in a child process with the given simulated decode time, collecting its JSON lines.
+ */
+std::vector<std::string> run_isolated(const Options& options, unsigned decode_time_us,
+    std::vector<JsonObject> (*scenario)(InitFunction, const Options&))
+{
+    int fds[2];
+    if (pipe(fds) < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+
+    const pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        setenv("LIBVA_V4L2_FAKE_DECODE_TIME_US", std::to_string(decode_time_us).c_str(), 1);
+
+        int status = EXIT_SUCCESS;
+        try {
+            void* handle = dlopen(options.driver.c_str(), RTLD_NOW | RTLD_LOCAL);
+            if (!handle) {
+                throw std::runtime_error(dlerror());
+            }
+            auto init = reinterpret_cast<InitFunction>(dlsym(handle, STRINGIFY(VA_DRIVER_INIT_FUNC)));
+            if (!init) {
+                throw std::runtime_error(dlerror());
+            }
+            for (auto&& result : scenario(init, options)) {
+                const auto line = result.str() + "\n";
+                if (write(fds[1], line.data(), line.size()) < 0) {
+                    status = EXIT_FAILURE;
+                }
+            }
+        } catch (std::exception& e) {
+            fprintf(stderr, "%s\n", e.what());
+            status = EXIT_FAILURE;
+        }
+        _exit(status);
+    }
+    close(fds[1]);
+
+    std::string output;
+    char buffer[4096];
+    for (ssize_t n; (n = read(fds[0], buffer, sizeof(buffer))) > 0;) {
+        output.append(buffer, n);
+    }
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        throw std::runtime_error("Scenario failed");
+    }
+
+    std::vector<std::string> lines;
+    for (size_t start = 0, end; (end = output.find('\n', start)) != std::string::npos; start = end + 1) {
+        lines.push_back(output.substr(start, end - start));
+    }
+    return lines;
+}
+
+std::vector<unsigned> parse_list(const std::string& value)
+{
+    std::vector<unsigned> result;
+    for (size_t start = 0; start < value.size();) {
+        size_t end = value.find(',', start);
+        result.push_back(std::stoul(value.substr(start, end - start)));
+        start = (end == std::string::npos) ? value.size() : end + 1;
+    }
+    return result;
+}
+
+std::vector<std::string> parse_names(const std::string& value)
+{
+    std::vector<std::string> result;
+    for (size_t start = 0; start < value.size();) {
+        size_t end = value.find(',', start);
+        result.push_back(value.substr(start, end - start));
+        start = (end == std::string::npos) ? value.size() : end + 1;
+    }
+    return result;
+}
+
+void usage(const char* name)
+{
+    fprintf(stderr,
+        "Usage: %s [options] DRIVER\n"
+        "  --codecs LIST        codecs to run (mpeg2,h264,vp8,vp9)\n"
+        "  --size WxH           picture size (1280x720)\n"
+        "  --frames N           frames per measurement (300)\n"
+        "  --slice-size BYTES   slice data per frame (32768)\n"
+        "  --decode-time-us N   simulated decode time for pipeline and scaling runs (500)\n"
+        "  --depths LIST        frames in flight for the pipeline run (1,2,4,8)\n"
+        "  --contexts LIST      concurrent contexts for the scaling run (1,2,4,8,16,32)\n"
+        "  --output FILE        write JSON there instead of stdout\n",
+        name);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+            auto value = [&] {
+                if (i + 1 >= argc) {
+                    throw std::invalid_argument("Missing value for " + arg);
+                }
+                return std::string(argv[++i]);
+            };
+
+            if (arg == "--codecs") {
+                options.codecs = parse_names(value());
+            } else if (arg == "--size") {
+                const auto size = value();
+                if (sscanf(size.c_str(), "%ux%u", &options.width, &options.height) != 2) {
+                    throw std::invalid_argument("Invalid size " + size);
+                }
+            } else if (arg == "--frames") {
+                options.frames = std::stoul(value());
+            } else if (arg == "--slice-size") {
+                options.slice_size = std::stoul(value());
+            } else if (arg == "--decode-time-us") {
+                options.decode_time_us = std::stoul(value());
+            } else if (arg == "--depths") {
+                options.depths = parse_list(value());
+            } else if (arg == "--contexts") {
+                options.contexts = parse_list(value());
+            } else if (arg == "--output") {
+                options.output = value();
+            } else if (arg == "--help" || arg[0] == '-') {
+                usage(argv[0]);
+                return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+            } else {
+                options.driver = arg;
+            }
+        }
+        if (options.driver.empty() || options.codecs.empty()) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        std::vector<std::string> results;
+        for (auto&& [decode_time_us, scenario] : {
+                 std::pair { 0u, &run_overhead },
+                 std::pair { options.decode_time_us, &run_pipeline },
+                 std::pair { options.decode_time_us, &run_scaling },
+                 std::pair { 0u, &run_readback },
+             }) {
+            for (auto&& line : run_isolated(options, decode_time_us, scenario)) {
+                results.push_back(line);
+            }
+        }
+
+        if (std::ranges::all_of(results, [](auto&& line) { return line.find("\"skipped\"") != std::string::npos; })) {
+            fprintf(stderr, "No device decodes any of the requested codecs\n");
+            return exit_skipped;
+        }
+
+        FILE* output = options.output ? fopen(options.output->c_str(), "w") : stdout;
+        if (!output) {
+            throw std::system_error(errno, std::generic_category(), options.output.value());
+        }
+        fprintf(output, "{\n  \"width\": %u,\n  \"height\": %u,\n  \"results\": [\n", options.width, options.height);
+        for (size_t i = 0; i < results.size(); i++) {
+            fprintf(output, "    %s%s\n", results[i].c_str(), (i + 1 < results.size()) ? "," : "");
+        }
+        fprintf(output, "  ]\n}\n");
+        if (output != stdout) {
+            fclose(output);
+        }
+    } catch (std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
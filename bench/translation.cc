@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Microbenchmarks for the translation of VA parameter buffers into V4L2 controls, which runs for every frame.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+#include <benchmark/benchmark.h>
+
+extern "C" {
+#include <linux/v4l2-controls.h>
+
+#include <va/va.h>
+#include <va/va_dec_vp8.h>
+}
+
+#include "h264.h"
+#include "mpeg2.h"
+#include "surface.h"
+#include "vp8.h"
+#ifdef ENABLE_VP9
+#include "vp9.h"
+#endif
+
+namespace {
+
+/**
+ * As many surfaces as a typical player allocates, so that reference lookups are not unrealistically cheap.
+ */
+std::map<VASurfaceID, Surface> make_surfaces()
+{
+    std::map<VASurfaceID, Surface> surfaces;
+    for (VASurfaceID id = 0; id < 24; id++) {
+        surfaces[id].timestamp = { .tv_sec = id, .tv_usec = 0 };
+    }
+    return surfaces;
+}
+
+void BM_MPEG2(benchmark::State& state)
+{
+    const auto surfaces = make_surfaces();
+
+    VAPictureParameterBufferMPEG2 picture = {};
+    picture.horizontal_size = 1920;
+    picture.vertical_size = 1080;
+    picture.forward_reference_picture = 3;
+    picture.backward_reference_picture = 7;
+    picture.picture_coding_type = 3;
+    picture.f_code = 0x2222;
+    picture.picture_coding_extension.bits.picture_structure = 3;
+    picture.picture_coding_extension.bits.progressive_frame = 1;
+
+    VAIQMatrixBufferMPEG2 iqmatrix = {};
+    iqmatrix.load_intra_quantiser_matrix = 1;
+    iqmatrix.load_non_intra_quantiser_matrix = 1;
+
+    for (auto _ : state) {
+        auto sequence = mpeg2_va_to_v4l2_sequence(&picture);
+        auto v4l2_picture = mpeg2_va_to_v4l2_picture(surfaces, surfaces.at(10), &picture);
+        auto quantisation = mpeg2_va_to_v4l2_quantisation(&iqmatrix);
+        benchmark::DoNotOptimize(sequence);
+        benchmark::DoNotOptimize(v4l2_picture);
+        benchmark::DoNotOptimize(quantisation);
+    }
+}
+BENCHMARK(BM_MPEG2);
+
+/**
+ * Steady state of an IPPP stream with `state.range(0)` reference frames, going through the same steps as
+ * `H264Context::set_controls`.
+ */
+void BM_H264(benchmark::State& state)
+{
+    auto surfaces = make_surfaces();
+    const unsigned surface_count = surfaces.size();
+    const unsigned references = state.range(0);
+    const VAPictureH264 invalid = { .picture_id = VA_INVALID_SURFACE, .flags = VA_PICTURE_H264_INVALID };
+    h264_dpb dpb = {};
+
+    VAIQMatrixBufferH264 matrix = {};
+    memset(matrix.ScalingList4x4, 16, sizeof(matrix.ScalingList4x4));
+    memset(matrix.ScalingList8x8, 16, sizeof(matrix.ScalingList8x8));
+
+    VAPictureParameterBufferH264 picture = {};
+    picture.picture_width_in_mbs_minus1 = 119;
+    picture.picture_height_in_mbs_minus1 = 67;
+    picture.num_ref_frames = references;
+    picture.seq_fields.bits.chroma_format_idc = 1;
+    picture.seq_fields.bits.frame_mbs_only_flag = 1;
+    picture.pic_fields.bits.entropy_coding_mode_flag = 1;
+    picture.pic_fields.bits.reference_pic_flag = 1;
+
+    VASliceParameterBufferH264 slice = {};
+    slice.slice_type = 0;
+    slice.num_ref_idx_l0_active_minus1 = references - 1;
+    std::fill_n(slice.RefPicList1, 32, invalid);
+
+    unsigned frame = 0;
+    for (auto _ : state) {
+        picture.CurrPic = {
+            .picture_id = frame % surface_count,
+            .frame_idx = frame % 16,
+            .TopFieldOrderCnt = static_cast<int32_t>(2 * frame),
+            .BottomFieldOrderCnt = static_cast<int32_t>(2 * frame),
+        };
+        std::fill_n(picture.ReferenceFrames, 16, invalid);
+        std::fill_n(slice.RefPicList0, 32, invalid);
+        for (unsigned i = 0; i < std::min(frame, references); i++) {
+            const unsigned reference = frame - 1 - i;
+            picture.ReferenceFrames[i] = slice.RefPicList0[i] = {
+                .picture_id = reference % surface_count,
+                .frame_idx = reference % 16,
+                .flags = VA_PICTURE_H264_SHORT_TERM_REFERENCE,
+                .TopFieldOrderCnt = static_cast<int32_t>(2 * reference),
+                .BottomFieldOrderCnt = static_cast<int32_t>(2 * reference),
+            };
+        }
+
+        auto& surface = surfaces.at(picture.CurrPic.picture_id);
+        surface.params.h264.picture = &picture;
+        surface.params.h264.matrix = &matrix;
+        surface.params.h264.slice = &slice;
+
+        auto controls = h264_va_to_v4l2(surfaces, dpb, surface, 100);
+        h264_dpb_insert(dpb, &picture.CurrPic, controls.output);
+
+        benchmark::DoNotOptimize(controls);
+        frame++;
+    }
+}
+BENCHMARK(BM_H264)->Arg(1)->Arg(4)->Arg(8)->Arg(16);
+
+void BM_VP8(benchmark::State& state)
+{
+    const auto surfaces = make_surfaces();
+
+    VAPictureParameterBufferVP8 picture = {};
+    picture.frame_width = 1920;
+    picture.frame_height = 1080;
+    picture.last_ref_frame = 1;
+    picture.golden_ref_frame = 2;
+    picture.alt_ref_frame = 3;
+    picture.pic_fields.bits.key_frame = 1;
+
+    VASliceParameterBufferVP8 slice = {};
+    slice.slice_data_size = 100000;
+    slice.num_of_partitions = 2;
+    slice.partition_size[0] = 10000;
+    slice.partition_size[1] = 90000;
+
+    VAIQMatrixBufferVP8 iqmatrix = {};
+    VAProbabilityDataBufferVP8 probabilities = {};
+    uint8_t prefix[16];
+
+    for (auto _ : state) {
+        auto frame = vp8_va_to_v4l2_frame(surfaces, &picture, &slice, &iqmatrix, &probabilities);
+        benchmark::DoNotOptimize(frame);
+        benchmark::DoNotOptimize(vp8_prefix_data(prefix, &picture, &slice));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_VP8);
+
+#ifdef ENABLE_VP9
+void BM_VP9(benchmark::State& state)
+{
+    const auto surfaces = make_surfaces();
+    GstVp9FrameHeader header = {};
+
+    VADecPictureParameterBufferVP9 picture = {};
+    picture.frame_width = 1920;
+    picture.frame_height = 1080;
+    for (unsigned i = 0; i < 8; i++) {
+        picture.reference_frames[i] = i;
+    }
+    picture.pic_fields.bits.frame_type = 1;
+    picture.pic_fields.bits.golden_ref_frame = 1;
+    picture.pic_fields.bits.alt_ref_frame = 2;
+
+    VASliceParameterBufferVP9 slice = {};
+
+    for (auto _ : state) {
+        auto frame = vp9_va_to_v4l2_frame(surfaces, &picture, &slice, &header);
+        auto compressed_header = gst_to_v4l2_compressed_header(&header);
+        benchmark::DoNotOptimize(frame);
+        benchmark::DoNotOptimize(compressed_header);
+    }
+}
+BENCHMARK(BM_VP9);
+#endif
+
+} // namespace
+
+BENCHMARK_MAIN();
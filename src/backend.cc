@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "backend.h"
+
+#include <algorithm>
+#include <memory>
+#include <string_view>
+
+extern "C" {
+#include <fcntl.h>
+#include <linux/media.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <libudev.h>
+}
+
+#include "fake.h"
+#include "utils.h"
+
+namespace {
+
+std::vector<std::string> enumerate_video_devices(udev* ctx, const std::string& media_device)
+{
+    int fd = errno_wrapper(::open, media_device.c_str(), O_RDONLY);
+
+    media_device_info device_info = {};
+    errno_wrapper(::ioctl, fd, MEDIA_IOC_DEVICE_INFO, &device_info);
+
+    media_v2_topology topology = {};
+    errno_wrapper(::ioctl, fd, MEDIA_IOC_G_TOPOLOGY, &topology);
+
+    std::vector<media_v2_entity> entities(topology.num_entities);
+    std::vector<media_v2_interface> interfaces(topology.num_interfaces);
+    topology.ptr_entities = reinterpret_cast<uint64_t>(entities.data());
+    topology.ptr_interfaces = reinterpret_cast<uint64_t>(interfaces.data());
+
+    errno_wrapper(::ioctl, fd, MEDIA_IOC_G_TOPOLOGY, &topology);
+    ::close(fd);
+
+    if (std::ranges::find_if(entities, [](auto&& entity) { return entity.function == MEDIA_ENT_F_PROC_VIDEO_DECODER; })
+        == entities.end()) {
+        return {};
+    }
+
+    std::vector<std::string> result;
+    for (auto&& interface : interfaces) {
+        auto devnum = makedev(interface.devnode.major, interface.devnode.minor);
+        std::unique_ptr<udev_device, decltype(&udev_device_unref)> device(
+            udev_device_new_from_devnum(ctx, 'c', devnum), &udev_device_unref);
+        if (device && interface.intf_type == MEDIA_INTF_T_V4L_VIDEO) {
+            result.push_back(udev_device_get_property_value(device.get(), "DEVNAME"));
+        }
+    }
+
+    return result;
+}
+
+std::vector<std::string> enumerate_media_devices(udev* ctx)
+{
+    std::unique_ptr<udev_enumerate, decltype(&udev_enumerate_unref)> enumerate(
+        udev_enumerate_new(ctx), &udev_enumerate_unref);
+
+    udev_enumerate_add_match_subsystem(enumerate.get(), "media");
+    udev_enumerate_scan_devices(enumerate.get());
+
+    std::vector<std::string> result;
+    for (auto entry = udev_enumerate_get_list_entry(enumerate.get()); entry != nullptr;
+         entry = udev_list_entry_get_next(entry)) {
+        auto name = udev_list_entry_get_name(entry);
+
+        std::unique_ptr<udev_device, decltype(&udev_device_unref)> device(
+            udev_device_new_from_syspath(ctx, name), &udev_device_unref);
+
+        if (device) {
+            result.push_back(udev_device_get_property_value(device.get(), "DEVNAME"));
+        }
+    }
+
+    return result;
+}
+
+std::vector<std::string> enumerate_video4linux_devices(udev* ctx)
+{
+    std::unique_ptr<udev_enumerate, decltype(&udev_enumerate_unref)> enumerate(
+        udev_enumerate_new(ctx), &udev_enumerate_unref);
+
+    udev_enumerate_add_match_subsystem(enumerate.get(), "video4linux");
+    udev_enumerate_scan_devices(enumerate.get());
+
+    std::vector<std::string> result;
+    for (auto entry = udev_enumerate_get_list_entry(enumerate.get()); entry != nullptr;
+         entry = udev_list_entry_get_next(entry)) {
+        std::unique_ptr<udev_device, decltype(&udev_device_unref)> device(
+            udev_device_new_from_syspath(ctx, udev_list_entry_get_name(entry)), &udev_device_unref);
+
+        // Sub-devices, radio and VBI nodes share the subsystem
+        const char* name = device ? udev_device_get_property_value(device.get(), "DEVNAME") : nullptr;
+        if (name && std::string_view(name).starts_with("/dev/video")) {
+            result.push_back(name);
+        }
+    }
+
+    return result;
+}
+
+class KernelBackend : public Backend {
+public:
+    std::vector<std::pair<std::string, std::optional<std::string>>> enumerate_devices() override
+    {
+        std::vector<std::pair<std::string, std::optional<std::string>>> result;
+
+        std::unique_ptr<udev, decltype(&udev_unref)> ctx(udev_new(), &udev_unref);
+        for (auto&& media_device : enumerate_media_devices(ctx.get())) {
+            for (auto&& video_device : enumerate_video_devices(ctx.get(), media_device)) {
+                result.emplace_back(video_device, media_device);
+            }
+        }
+
+        return result;
+    }
+
+    std::vector<std::string> enumerate_processors() override
+    {
+        std::unique_ptr<udev, decltype(&udev_unref)> ctx(udev_new(), &udev_unref);
+        return enumerate_video4linux_devices(ctx.get());
+    }
+
+    int open(const char* path, int flags) override { return ::open(path, flags); }
+    int close(int fd) override { return ::close(fd); }
+    int ioctl(int fd, unsigned long request, void* arg) override { return ::ioctl(fd, request, arg); }
+    void* mmap(size_t length, int prot, int flags, int fd, off_t offset) override
+    {
+        return ::mmap(nullptr, length, prot, flags, fd, offset);
+    }
+    int poll(pollfd* fds, nfds_t count, int timeout) override { return ::poll(fds, count, timeout); }
+};
+
+std::unique_ptr<Backend> create_backend()
+{
+    if (getenv_opt("LIBVA_V4L2_BACKEND").value_or("kernel") == "fake") {
+        return std::make_unique<FakeBackend>();
+    }
+    return std::make_unique<KernelBackend>();
+}
+
+} // namespace
+
+Backend& backend()
+{
+    static const std::unique_ptr<Backend> instance = create_backend();
+    return *instance;
+}
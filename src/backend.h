@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <poll.h>
+#include <sys/types.h>
+}
+
+/**
+ * The system calls the V4L2 and media layers issue against device and request file descriptors.
+ *
+ * The kernel implementation forwards them unchanged; `LIBVA_V4L2_BACKEND=fake` selects an in-process stateless decoder
+ * instead (see fake.h), which allows running the driver without hardware. All functions follow the calling
+ * conventions of their system call counterparts, i.e. return -1 and set `errno` on failure.
+ */
+class Backend {
+public:
+    virtual ~Backend() = default;
+
+    /**
+     * Pairs of video and (optional) media device paths to consider for decoding.
+     */
+    virtual std::vector<std::pair<std::string, std::optional<std::string>>> enumerate_devices() = 0;
+    /**
+     * Video device paths to consider for video processing, i.e. memory-to-memory scalers and color converters.
+     */
+    virtual std::vector<std::string> enumerate_processors() = 0;
+
+    virtual int open(const char* path, int flags) = 0;
+    virtual int close(int fd) = 0;
+    virtual int ioctl(int fd, unsigned long request, void* arg) = 0;
+    virtual void* mmap(size_t length, int prot, int flags, int fd, off_t offset) = 0;
+    virtual int poll(pollfd* fds, nfds_t count, int timeout) = 0;
+};
+
+/**
+ * The process-wide backend, selected on first use.
+ */
+Backend& backend();
+
+/* Free-standing forms, for use with `errno_wrapper`. */
+inline int backend_open(const char* path, int flags) { return backend().open(path, flags); }
+inline int backend_close(int fd) { return backend().close(fd); }
+inline int backend_ioctl(int fd, unsigned long request, void* arg) { return backend().ioctl(fd, request, arg); }
+inline int backend_poll(pollfd* fds, nfds_t count, int timeout) { return backend().poll(fds, count, timeout); }
@@ -33,9 +33,11 @@
 #include <cstring>
 #include <mutex>
 #include <stdexcept>
+#include <system_error>
 
 extern "C" {
 #include <fcntl.h>
+#include <linux/dma-buf.h>
 #include <linux/videodev2.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -46,6 +48,7 @@ extern "C" {
 }
 
 #include "driver.h"
+#include "log.h"
 #include "utils.h"
 #include "v4l2.h"
 
@@ -59,6 +62,44 @@ Buffer::Buffer(VABufferType type, unsigned count, unsigned size, VASurfaceID der
 {
 }
 
+Buffer::Buffer(const V4L2M2MDevice::Buffer& capture_buffer, unsigned plane, VASurfaceID derived_surface_id)
+    : type(VAImageBufferType)
+    , count(1)
+    , size(capture_buffer.plane_size(plane))
+    , derived_surface_id(derived_surface_id)
+    , info({ .handle = static_cast<uintptr_t>(-1) })
+    , capture_buffer(capture_buffer)
+    , capture_plane(plane)
+{
+}
+
+Buffer::Buffer(std::unique_ptr<HeapAllocation> allocation, unsigned size)
+    : type(VAImageBufferType)
+    , count(1)
+    , size(size)
+    , derived_surface_id(VA_INVALID_ID)
+    , info({ .handle = static_cast<uintptr_t>(-1) })
+    , allocation(std::move(allocation))
+{
+}
+
+uint8_t* Buffer::memory() const
+{
+    if (capture_buffer) {
+        return capture_buffer->get().mapping()[capture_plane].data();
+    }
+    return allocation ? allocation->data() : data.get();
+}
+
+void Buffer::sync(uint64_t flags) const
+{
+    if (capture_buffer) {
+        capture_buffer->get().sync(flags);
+    } else if (allocation) {
+        allocation->sync(flags);
+    }
+}
+
 VAStatus createBuffer(VADriverContextP context, VAContextID context_id, VABufferType type, unsigned int size,
     unsigned int count, void* data, VABufferID* buffer_id)
 {
@@ -71,21 +112,35 @@ VAStatus createBuffer(VADriverContextP context, VAContextID context_id, VABuffer
     case VASliceDataBufferType:
     case VAImageBufferType:
     case VAProbabilityBufferType:
+    case VAProcPipelineParameterBufferType:
         break;
 
     default:
         return VA_STATUS_ERROR_UNSUPPORTED_BUFFERTYPE;
     }
 
+    // Images come from the dma-buf heap, so that they can be handed to other APIs without copying
+    std::unique_ptr<HeapAllocation> allocation;
+    if (type == VAImageBufferType && count == 1 && driver_data->dma_heap) {
+        try {
+            allocation = driver_data->dma_heap->allocate(size);
+        } catch (std::system_error& e) {
+            LOG_RATELIMITED(LogLevel::Warning, context, "Failed to allocate image from dma-buf heap: %s\n", e.what());
+        }
+    }
+
     std::lock_guard<std::mutex> guard(driver_data->mutex);
     *buffer_id = smallest_free_key(driver_data->buffers);
-    auto [buffer, inserted] = driver_data->buffers.emplace(std::make_pair(*buffer_id, Buffer(type, count, size)));
-    if (!inserted || !buffer->second.data) {
+    auto [buffer, inserted] = driver_data->buffers.emplace(std::make_pair(*buffer_id,
+        allocation ? Buffer(std::move(allocation), size) : Buffer(type, count, size)));
+    if (!inserted || !buffer->second.memory()) {
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
     }
 
     if (data) {
-        std::copy_n(static_cast<uint8_t*>(data), size * count, buffer->second.data.get());
+        buffer->second.sync(DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+        std::copy_n(static_cast<uint8_t*>(data), size * count, buffer->second.memory());
+        buffer->second.sync(DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
     }
 
     return VA_STATUS_SUCCESS;
@@ -100,6 +155,10 @@ VAStatus destroyBuffer(VADriverContextP context, VABufferID buffer_id)
     if (buffer_it == driver_data->buffers.end()) {
         return VA_STATUS_ERROR_INVALID_BUFFER;
     }
+    // Handles still acquired go away with the buffer
+    if (buffer_it->second.handle_references) {
+        close(static_cast<int>(buffer_it->second.info.handle));
+    }
     driver_data->buffers.erase(buffer_it);
 
     return VA_STATUS_SUCCESS;
@@ -113,8 +172,15 @@ VAStatus mapBuffer(VADriverContextP context, VABufferID buffer_id, void** data_m
         return VA_STATUS_ERROR_INVALID_BUFFER;
     }
 
-    /* Our buffers are always mapped. */
-    *data_map = driver_data->buffers.at(buffer_id).data.get();
+    /* Derived images map the CAPTURE buffer on first use, and need its cache synchronized. */
+    auto& buffer = driver_data->buffers.at(buffer_id);
+    try {
+        *data_map = buffer.memory();
+    } catch (std::system_error& e) {
+        LOG_RATELIMITED(LogLevel::Error, context, "Failed to map buffer: %s\n", e.what());
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+    buffer.sync(DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW);
 
     return VA_STATUS_SUCCESS;
 }
@@ -127,6 +193,8 @@ VAStatus unmapBuffer(VADriverContextP context, VABufferID buffer_id)
     if (!driver_data->buffers.contains(buffer_id)) {
         return VA_STATUS_ERROR_INVALID_BUFFER;
     }
+    auto& buffer = driver_data->buffers.at(buffer_id);
+    buffer.sync(DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW);
 
     return VA_STATUS_SUCCESS;
 }
@@ -139,6 +207,9 @@ VAStatus bufferSetNumElements(VADriverContextP context, VABufferID buffer_id, un
         return VA_STATUS_ERROR_INVALID_BUFFER;
     }
     auto& buffer = driver_data->buffers.at(buffer_id);
+    if (buffer.capture_buffer || buffer.allocation) {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
 
     buffer.data.reset(static_cast<uint8_t*>(reallocarray(buffer.data.release(), buffer.size, count)));
     buffer.count = count;
@@ -165,10 +236,68 @@ VAStatus bufferInfo(
 
 VAStatus acquireBufferHandle(VADriverContextP context, VABufferID buffer_id, VABufferInfo* buffer_info)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    std::lock_guard<std::mutex> guard(driver_data->mutex);
+    if (!driver_data->buffers.contains(buffer_id)) {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+    auto& buffer = driver_data->buffers.at(buffer_id);
+
+    if (buffer.type != VAImageBufferType) {
+        return VA_STATUS_ERROR_UNSUPPORTED_BUFFERTYPE;
+    }
+    const auto mem_type = buffer_info->mem_type ? buffer_info->mem_type : VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME;
+    if (!(mem_type & VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME)) {
+        return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+    }
+
+    // Derived images share the CAPTURE buffer's dma-buf, created ones their heap allocation; copies of the descriptor
+    // are handed out, to be closed on release.
+    if (!buffer.handle_references) {
+        int fd = -1;
+        try {
+            if (buffer.capture_buffer) {
+                fd = buffer.capture_buffer->get().export_plane(buffer.capture_plane, O_RDWR | O_CLOEXEC);
+            } else if (buffer.allocation) {
+                fd = errno_wrapper(fcntl, buffer.allocation->fd(), F_DUPFD_CLOEXEC, 0);
+            } else {
+                return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+            }
+        } catch (std::system_error& e) {
+            LOG_RATELIMITED(LogLevel::Error, context, "Failed to export buffer: %s\n", e.what());
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+        buffer.info = {
+            .handle = static_cast<uintptr_t>(fd),
+            .type = buffer.type,
+            .mem_type = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME,
+            .mem_size = buffer.size,
+        };
+    }
+    buffer.handle_references++;
+    *buffer_info = buffer.info;
+
+    return VA_STATUS_SUCCESS;
 }
 
 VAStatus releaseBufferHandle(VADriverContextP context, VABufferID buffer_id)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    std::lock_guard<std::mutex> guard(driver_data->mutex);
+    if (!driver_data->buffers.contains(buffer_id)) {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+    auto& buffer = driver_data->buffers.at(buffer_id);
+
+    if (!buffer.handle_references) {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+    if (--buffer.handle_references == 0) {
+        close(static_cast<int>(buffer.info.handle));
+        buffer.info.handle = static_cast<uintptr_t>(-1);
+    }
+
+    return VA_STATUS_SUCCESS;
 }
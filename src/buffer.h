@@ -28,22 +28,42 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <optional>
 
 extern "C" {
 #include <va/va.h>
 #include <va/va_backend.h>
 }
 
+#include "heap.h"
+#include "v4l2.h"
+
 struct Buffer {
     Buffer(VABufferType type, unsigned count, unsigned size, VASurfaceID derived_surface_id);
+    /** Image buffer backed by a plane of a decoded surface's CAPTURE buffer, rather than by `data`. */
+    Buffer(const V4L2M2MDevice::Buffer& capture_buffer, unsigned plane, VASurfaceID derived_surface_id);
+    /** Image buffer backed by a dma-buf heap allocation, rather than by `data`. */
+    Buffer(std::unique_ptr<HeapAllocation> allocation, unsigned size);
+
+    /** Memory handed out by vaMapBuffer. */
+    uint8_t* memory() const;
+    /** Synchronize the cache of dma-buf backed memory around CPU access, see `V4L2M2MDevice::Buffer::sync()`. */
+    void sync(uint64_t flags) const;
 
     VABufferType type;
     unsigned count;
     std::unique_ptr<uint8_t> data;
     unsigned int size;
     VASurfaceID derived_surface_id;
+    /** Handle handed out by vaAcquireBufferHandle, valid while `handle_references` is non-zero. */
     VABufferInfo info;
+    unsigned handle_references = 0;
+
+    std::optional<std::reference_wrapper<const V4L2M2MDevice::Buffer>> capture_buffer;
+    unsigned capture_plane = 0;
+    std::unique_ptr<HeapAllocation> allocation;
 };
 
 VAStatus createBuffer(VADriverContextP context, VAContextID context_id, VABufferType type, unsigned int size,
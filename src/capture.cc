@@ -0,0 +1,605 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "capture.h"
+
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+extern "C" {
+#include <unistd.h>
+}
+
+#include "buffer.h"
+#include "config.h"
+#include "context.h"
+#include "driver.h"
+#include "image.h"
+#include "log.h"
+#include "picture.h"
+#include "subpicture.h"
+#include "surface.h"
+
+namespace {
+
+const uint8_t padding[8] = {};
+
+size_t padded(size_t size)
+{
+    return (size + 7) & ~size_t(7);
+}
+
+template <typename T> std::span<const uint8_t> bytes(const T* data, size_t count)
+{
+    return { reinterpret_cast<const uint8_t*>(data), data ? count * sizeof(T) : 0 };
+}
+
+Capture* capture_of(VADriverContextP va_context)
+{
+    return static_cast<DriverData*>(va_context->pDriverData)->capture.get();
+}
+
+VAStatus capture_terminate(VADriverContextP va_context)
+{
+    capture_of(va_context)->write(CaptureCall::Terminate, VA_STATUS_SUCCESS, Capture::now(), {});
+    return terminate(va_context);
+}
+
+VAStatus capture_createConfig(VADriverContextP va_context, VAProfile profile, VAEntrypoint entrypoint,
+    VAConfigAttrib* attributes, int attributes_count, VAConfigID* config_id)
+{
+    const auto start = Capture::now();
+    const auto status = createConfig(va_context, profile, entrypoint, attributes, attributes_count, config_id);
+    capture_of(va_context)->write(CaptureCall::CreateConfig, status, start,
+        { static_cast<uint32_t>(profile), static_cast<uint32_t>(entrypoint), static_cast<uint32_t>(attributes_count),
+            (status == VA_STATUS_SUCCESS) ? *config_id : VA_INVALID_ID },
+        { bytes(attributes, attributes_count) });
+    return status;
+}
+
+VAStatus capture_destroyConfig(VADriverContextP va_context, VAConfigID config_id)
+{
+    const auto start = Capture::now();
+    const auto status = destroyConfig(va_context, config_id);
+    capture_of(va_context)->write(CaptureCall::DestroyConfig, status, start, { config_id });
+    return status;
+}
+
+VAStatus capture_createSurfaces2(VADriverContextP va_context, unsigned int format, unsigned int width,
+    unsigned int height, VASurfaceID* surfaces_ids, unsigned int surfaces_count, VASurfaceAttrib* attributes,
+    unsigned int attributes_count)
+{
+    const auto start = Capture::now();
+    const auto status = createSurfaces2(
+        va_context, format, width, height, surfaces_ids, surfaces_count, attributes, attributes_count);
+    capture_of(va_context)->write(CaptureCall::CreateSurfaces, status, start, { format, width, height, surfaces_count },
+        { bytes(surfaces_ids, (status == VA_STATUS_SUCCESS) ? surfaces_count : 0) });
+    return status;
+}
+
+VAStatus capture_createSurfaces(
+    VADriverContextP va_context, int width, int height, int format, int surfaces_count, VASurfaceID* surfaces_ids)
+{
+    return capture_createSurfaces2(va_context, format, width, height, surfaces_ids, surfaces_count, nullptr, 0);
+}
+
+VAStatus capture_destroySurfaces(VADriverContextP va_context, VASurfaceID* surfaces_ids, int surfaces_count)
+{
+    const auto start = Capture::now();
+    const auto status = destroySurfaces(va_context, surfaces_ids, surfaces_count);
+    capture_of(va_context)->write(CaptureCall::DestroySurfaces, status, start,
+        { static_cast<uint32_t>(surfaces_count) }, { bytes(surfaces_ids, surfaces_count) });
+    return status;
+}
+
+VAStatus capture_createContext(VADriverContextP va_context, VAConfigID config_id, int picture_width,
+    int picture_height, int flags, VASurfaceID* surfaces_ids, int surfaces_count, VAContextID* context_id)
+{
+    const auto start = Capture::now();
+    const auto status = createContext(
+        va_context, config_id, picture_width, picture_height, flags, surfaces_ids, surfaces_count, context_id);
+    capture_of(va_context)->write(CaptureCall::CreateContext, status, start,
+        { config_id, static_cast<uint32_t>(picture_width), static_cast<uint32_t>(picture_height),
+            static_cast<uint32_t>(flags), static_cast<uint32_t>(surfaces_count),
+            (status == VA_STATUS_SUCCESS) ? *context_id : VA_INVALID_ID },
+        { bytes(surfaces_ids, surfaces_count) });
+    return status;
+}
+
+VAStatus capture_destroyContext(VADriverContextP va_context, VAContextID context_id)
+{
+    const auto start = Capture::now();
+    const auto status = destroyContext(va_context, context_id);
+    capture_of(va_context)->write(CaptureCall::DestroyContext, status, start, { context_id });
+    return status;
+}
+
+/*
+ * Buffer contents are recorded when the buffer is rendered rather than when it is created, as players commonly fill
+ * them through vaMapBuffer.
+ */
+VAStatus capture_createBuffer(VADriverContextP va_context, VAContextID context_id, VABufferType type,
+    unsigned int size, unsigned int count, void* data, VABufferID* buffer_id)
+{
+    const auto start = Capture::now();
+    const auto status = createBuffer(va_context, context_id, type, size, count, data, buffer_id);
+    capture_of(va_context)->write(CaptureCall::CreateBuffer, status, start,
+        { context_id, static_cast<uint32_t>(type), size, count,
+            (status == VA_STATUS_SUCCESS) ? *buffer_id : VA_INVALID_ID });
+    return status;
+}
+
+VAStatus capture_bufferSetNumElements(VADriverContextP va_context, VABufferID buffer_id, unsigned int count)
+{
+    const auto start = Capture::now();
+    const auto status = bufferSetNumElements(va_context, buffer_id, count);
+    capture_of(va_context)->write(CaptureCall::BufferSetNumElements, status, start, { buffer_id, count });
+    return status;
+}
+
+VAStatus capture_mapBuffer(VADriverContextP va_context, VABufferID buffer_id, void** data_map)
+{
+    const auto start = Capture::now();
+    const auto status = mapBuffer(va_context, buffer_id, data_map);
+    capture_of(va_context)->write(CaptureCall::MapBuffer, status, start, { buffer_id });
+    return status;
+}
+
+VAStatus capture_unmapBuffer(VADriverContextP va_context, VABufferID buffer_id)
+{
+    const auto start = Capture::now();
+    const auto status = unmapBuffer(va_context, buffer_id);
+    capture_of(va_context)->write(CaptureCall::UnmapBuffer, status, start, { buffer_id });
+    return status;
+}
+
+VAStatus capture_destroyBuffer(VADriverContextP va_context, VABufferID buffer_id)
+{
+    const auto start = Capture::now();
+    const auto status = destroyBuffer(va_context, buffer_id);
+    capture_of(va_context)->write(CaptureCall::DestroyBuffer, status, start, { buffer_id });
+    return status;
+}
+
+VAStatus capture_beginPicture(VADriverContextP va_context, VAContextID context_id, VASurfaceID surface_id)
+{
+    const auto start = Capture::now();
+    const auto status = beginPicture(va_context, context_id, surface_id);
+    capture_of(va_context)->write(CaptureCall::BeginPicture, status, start, { context_id, surface_id });
+    return status;
+}
+
+VAStatus capture_renderPicture(
+    VADriverContextP va_context, VAContextID context_id, VABufferID* buffers_ids, int buffers_count)
+{
+    auto driver_data = static_cast<DriverData*>(va_context->pDriverData);
+
+    const auto start = Capture::now();
+    const auto status = renderPicture(va_context, context_id, buffers_ids, buffers_count);
+
+    std::vector<uint8_t> payload;
+    std::lock_guard<std::mutex> guard(driver_data->mutex);
+    for (int i = 0; i < buffers_count; i++) {
+        const auto buffer = driver_data->buffers.find(buffers_ids[i]);
+        if (buffer == driver_data->buffers.end()) {
+            continue;
+        }
+        const CaptureBuffer header = {
+            .id = buffers_ids[i],
+            .type = static_cast<uint32_t>(buffer->second.type),
+            .size = buffer->second.size * buffer->second.count,
+            .count = buffer->second.count,
+        };
+        const auto offset = payload.size();
+        payload.resize(offset + sizeof(header) + padded(header.size));
+        memcpy(payload.data() + offset, &header, sizeof(header));
+        memcpy(payload.data() + offset + sizeof(header), buffer->second.memory(), header.size);
+    }
+
+    capture_of(va_context)->write(CaptureCall::RenderPicture, status, start,
+        { context_id, static_cast<uint32_t>(buffers_count) }, { payload });
+    return status;
+}
+
+VAStatus capture_endPicture(VADriverContextP va_context, VAContextID context_id)
+{
+    const auto start = Capture::now();
+    const auto status = endPicture(va_context, context_id);
+    capture_of(va_context)->write(CaptureCall::EndPicture, status, start, { context_id });
+    return status;
+}
+
+VAStatus capture_syncSurface(VADriverContextP va_context, VASurfaceID surface_id)
+{
+    const auto start = Capture::now();
+    const auto status = syncSurface(va_context, surface_id);
+    capture_of(va_context)->write(CaptureCall::SyncSurface, status, start, { surface_id });
+    return status;
+}
+
+VAStatus capture_querySurfaceStatus(VADriverContextP va_context, VASurfaceID surface_id, VASurfaceStatus* status_)
+{
+    const auto start = Capture::now();
+    const auto status = querySurfaceStatus(va_context, surface_id, status_);
+    capture_of(va_context)->write(CaptureCall::QuerySurfaceStatus, status, start,
+        { surface_id, (status == VA_STATUS_SUCCESS) ? static_cast<uint32_t>(*status_) : 0 });
+    return status;
+}
+
+VAStatus capture_exportSurfaceHandle(
+    VADriverContextP va_context, VASurfaceID surface_id, uint32_t mem_type, uint32_t flags, void* descriptor)
+{
+    const auto start = Capture::now();
+    const auto status = exportSurfaceHandle(va_context, surface_id, mem_type, flags, descriptor);
+    capture_of(va_context)->write(CaptureCall::ExportSurfaceHandle, status, start, { surface_id, mem_type, flags });
+    return status;
+}
+
+VAStatus capture_createImage(VADriverContextP va_context, VAImageFormat* format, int width, int height, VAImage* image)
+{
+    const auto start = Capture::now();
+    const auto status = createImage(va_context, format, width, height, image);
+    const bool success = status == VA_STATUS_SUCCESS;
+    capture_of(va_context)->write(CaptureCall::CreateImage, status, start,
+        { format->fourcc, static_cast<uint32_t>(width), static_cast<uint32_t>(height),
+            success ? image->image_id : VA_INVALID_ID, success ? image->buf : VA_INVALID_ID });
+    return status;
+}
+
+VAStatus capture_deriveImage(VADriverContextP va_context, VASurfaceID surface_id, VAImage* image)
+{
+    const auto start = Capture::now();
+    const auto status = deriveImage(va_context, surface_id, image);
+    const bool success = status == VA_STATUS_SUCCESS;
+    capture_of(va_context)->write(CaptureCall::DeriveImage, status, start,
+        { surface_id, success ? image->image_id : VA_INVALID_ID, success ? image->buf : VA_INVALID_ID });
+    return status;
+}
+
+VAStatus capture_destroyImage(VADriverContextP va_context, VAImageID image_id)
+{
+    const auto start = Capture::now();
+    const auto status = destroyImage(va_context, image_id);
+    capture_of(va_context)->write(CaptureCall::DestroyImage, status, start, { image_id });
+    return status;
+}
+
+VAStatus capture_getImage(VADriverContextP va_context, VASurfaceID surface_id, int x, int y, unsigned int width,
+    unsigned int height, VAImageID image_id)
+{
+    const auto start = Capture::now();
+    const auto status = getImage(va_context, surface_id, x, y, width, height, image_id);
+    capture_of(va_context)->write(CaptureCall::GetImage, status, start,
+        { surface_id, static_cast<uint32_t>(x), static_cast<uint32_t>(y), width, height, image_id });
+    return status;
+}
+
+VAStatus capture_putImage(VADriverContextP va_context, VASurfaceID surface_id, VAImageID image, int src_x, int src_y,
+    unsigned int src_width, unsigned int src_height, int dst_x, int dst_y, unsigned int dst_width,
+    unsigned int dst_height)
+{
+    const auto start = Capture::now();
+    const auto status = putImage(
+        va_context, surface_id, image, src_x, src_y, src_width, src_height, dst_x, dst_y, dst_width, dst_height);
+    capture_of(va_context)->write(CaptureCall::PutImage, status, start,
+        { surface_id, image, static_cast<uint32_t>(src_x), static_cast<uint32_t>(src_y), src_width, src_height,
+            static_cast<uint32_t>(dst_x), static_cast<uint32_t>(dst_y) });
+    return status;
+}
+
+VAStatus capture_lockSurface(VADriverContextP va_context, VASurfaceID surface_id, unsigned int* fourcc,
+    unsigned int* luma_stride, unsigned int* chroma_u_stride, unsigned int* chroma_v_stride, unsigned int* luma_offset,
+    unsigned int* chroma_u_offset, unsigned int* chroma_v_offset, unsigned int* buffer_name, void** buffer)
+{
+    const auto start = Capture::now();
+    const auto status = lockSurface(va_context, surface_id, fourcc, luma_stride, chroma_u_stride, chroma_v_stride,
+        luma_offset, chroma_u_offset, chroma_v_offset, buffer_name, buffer);
+    capture_of(va_context)->write(CaptureCall::LockSurface, status, start, { surface_id });
+    return status;
+}
+
+VAStatus capture_unlockSurface(VADriverContextP va_context, VASurfaceID surface_id)
+{
+    const auto start = Capture::now();
+    const auto status = unlockSurface(va_context, surface_id);
+    capture_of(va_context)->write(CaptureCall::UnlockSurface, status, start, { surface_id });
+    return status;
+}
+
+VAStatus capture_acquireBufferHandle(VADriverContextP va_context, VABufferID buffer_id, VABufferInfo* buffer_info)
+{
+    const auto start = Capture::now();
+    const uint32_t mem_type = buffer_info ? buffer_info->mem_type : 0;
+    const auto status = acquireBufferHandle(va_context, buffer_id, buffer_info);
+    capture_of(va_context)->write(CaptureCall::AcquireBufferHandle, status, start, { buffer_id, mem_type });
+    return status;
+}
+
+VAStatus capture_releaseBufferHandle(VADriverContextP va_context, VABufferID buffer_id)
+{
+    const auto start = Capture::now();
+    const auto status = releaseBufferHandle(va_context, buffer_id);
+    capture_of(va_context)->write(CaptureCall::ReleaseBufferHandle, status, start, { buffer_id });
+    return status;
+}
+
+VAStatus capture_setImagePalette(VADriverContextP va_context, VAImageID image_id, unsigned char* palette)
+{
+    auto driver_data = static_cast<DriverData*>(va_context->pDriverData);
+
+    const auto start = Capture::now();
+    const auto status = setImagePalette(va_context, image_id, palette);
+
+    size_t size = 0;
+    if (status == VA_STATUS_SUCCESS) {
+        std::lock_guard<std::mutex> guard(driver_data->mutex);
+        size = 3 * driver_data->palettes.at(image_id).size();
+    }
+    capture_of(va_context)->write(CaptureCall::SetImagePalette, status, start, { image_id }, { bytes(palette, size) });
+    return status;
+}
+
+VAStatus capture_createSubpicture(VADriverContextP va_context, VAImageID image_id, VASubpictureID* subpicture_id)
+{
+    const auto start = Capture::now();
+    const auto status = createSubpicture(va_context, image_id, subpicture_id);
+    capture_of(va_context)->write(CaptureCall::CreateSubpicture, status, start,
+        { image_id, (status == VA_STATUS_SUCCESS) ? *subpicture_id : VA_INVALID_ID });
+    return status;
+}
+
+VAStatus capture_destroySubpicture(VADriverContextP va_context, VASubpictureID subpicture_id)
+{
+    const auto start = Capture::now();
+    const auto status = destroySubpicture(va_context, subpicture_id);
+    capture_of(va_context)->write(CaptureCall::DestroySubpicture, status, start, { subpicture_id });
+    return status;
+}
+
+VAStatus capture_setSubpictureImage(VADriverContextP va_context, VASubpictureID subpicture_id, VAImageID image_id)
+{
+    const auto start = Capture::now();
+    const auto status = setSubpictureImage(va_context, subpicture_id, image_id);
+    capture_of(va_context)->write(CaptureCall::SetSubpictureImage, status, start, { subpicture_id, image_id });
+    return status;
+}
+
+VAStatus capture_setSubpictureChromakey(VADriverContextP va_context, VASubpictureID subpicture_id,
+    unsigned int chromakey_min, unsigned int chromakey_max, unsigned int chromakey_mask)
+{
+    const auto start = Capture::now();
+    const auto status
+        = setSubpictureChromakey(va_context, subpicture_id, chromakey_min, chromakey_max, chromakey_mask);
+    capture_of(va_context)->write(CaptureCall::SetSubpictureChromakey, status, start,
+        { subpicture_id, chromakey_min, chromakey_max, chromakey_mask });
+    return status;
+}
+
+VAStatus capture_setSubpictureGlobalAlpha(VADriverContextP va_context, VASubpictureID subpicture_id, float global_alpha)
+{
+    const auto start = Capture::now();
+    const auto status = setSubpictureGlobalAlpha(va_context, subpicture_id, global_alpha);
+    capture_of(va_context)->write(CaptureCall::SetSubpictureGlobalAlpha, status, start,
+        { subpicture_id, std::bit_cast<uint32_t>(global_alpha) });
+    return status;
+}
+
+/** Two 16 bit coordinates in one argument. */
+uint32_t pack(int low, int high)
+{
+    return static_cast<uint16_t>(low) | static_cast<uint32_t>(static_cast<uint16_t>(high)) << 16;
+}
+
+VAStatus capture_associateSubpicture(VADriverContextP va_context, VASubpictureID subpicture_id,
+    VASurfaceID* surfaces_ids, int surfaces_count, short src_x, short src_y, unsigned short src_width,
+    unsigned short src_height, short dst_x, short dst_y, unsigned short dst_width, unsigned short dst_height,
+    unsigned int flags)
+{
+    const auto start = Capture::now();
+    const auto status = associateSubpicture(va_context, subpicture_id, surfaces_ids, surfaces_count, src_x, src_y,
+        src_width, src_height, dst_x, dst_y, dst_width, dst_height, flags);
+    capture_of(va_context)->write(CaptureCall::AssociateSubpicture, status, start,
+        { subpicture_id, static_cast<uint32_t>(surfaces_count), pack(src_x, src_y), pack(src_width, src_height),
+            pack(dst_x, dst_y), pack(dst_width, dst_height), flags },
+        { bytes(surfaces_ids, surfaces_count) });
+    return status;
+}
+
+VAStatus capture_deassociateSubpicture(
+    VADriverContextP va_context, VASubpictureID subpicture_id, VASurfaceID* surfaces_ids, int surfaces_count)
+{
+    const auto start = Capture::now();
+    const auto status = deassociateSubpicture(va_context, subpicture_id, surfaces_ids, surfaces_count);
+    capture_of(va_context)->write(CaptureCall::DeassociateSubpicture, status, start,
+        { subpicture_id, static_cast<uint32_t>(surfaces_count) }, { bytes(surfaces_ids, surfaces_count) });
+    return status;
+}
+
+/**
+ * Entry points that don't change driver state are only recorded by their position in the vtable.
+ */
+template <size_t offset, auto function> struct CaptureOther;
+
+template <size_t offset, typename... Args, VAStatus (*function)(VADriverContextP, Args...)>
+struct CaptureOther<offset, function> {
+    static VAStatus call(VADriverContextP va_context, Args... args)
+    {
+        const auto start = Capture::now();
+        const auto status = function(va_context, args...);
+        capture_of(va_context)->write(CaptureCall::Other, status, start, { offset });
+        return status;
+    }
+};
+
+#define CAPTURE_OTHER(vtable, entry, function)                                                                         \
+    (vtable)->entry = CaptureOther<offsetof(VADriverVTable, entry), function>::call
+
+std::atomic<unsigned> capture_count = 0;
+
+} // namespace
+
+std::unique_ptr<Capture> Capture::open(VADriverContextP va_context, const std::optional<std::string>& directory)
+{
+    if (!directory) {
+        return nullptr;
+    }
+
+    const auto path = directory.value() + "/libva-v4l2-" + std::to_string(getpid()) + "-"
+        + std::to_string(capture_count.fetch_add(1)) + ".vacap";
+    FILE* file = fopen(path.c_str(), "wbx");
+    if (!file) {
+        error_log(va_context, "Failed to create capture %s: %s\n", path.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    const CaptureHeader header = {
+        .magic = CAPTURE_MAGIC,
+        .version = CAPTURE_VERSION,
+        .va_version = VA_MAJOR_VERSION << 16 | VA_MINOR_VERSION,
+        .start = now(),
+    };
+    setvbuf(file, nullptr, _IOFBF, 1 << 20);
+    fwrite(&header, sizeof(header), 1, file);
+
+    info_log(va_context, "Capturing to %s\n", path.c_str());
+    return std::unique_ptr<Capture>(new Capture(file, header.start));
+}
+
+Capture::Capture(FILE* file, uint64_t start)
+    : file(file)
+    , start(start)
+{
+}
+
+Capture::~Capture()
+{
+    fclose(file);
+}
+
+uint64_t Capture::now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void Capture::write(CaptureCall call, VAStatus status, uint64_t start, std::initializer_list<uint32_t> args,
+    std::initializer_list<std::span<const uint8_t>> payload)
+{
+    const auto end = now();
+    CaptureRecord record = {
+        .call = call,
+        .status = status,
+        .time = start - this->start,
+        .duration = end - start,
+    };
+    std::copy_n(args.begin(), std::min(args.size(), std::size(record.args)), record.args);
+    for (auto&& part : payload) {
+        record.size += part.size();
+    }
+
+    std::lock_guard<std::mutex> guard(mutex);
+    fwrite(&record, sizeof(record), 1, file);
+    for (auto&& part : payload) {
+        fwrite(part.data(), 1, part.size(), file);
+    }
+    fwrite(padding, 1, padded(record.size) - record.size, file);
+}
+
+void Capture::write_controls(int request_fd, std::span<const v4l2_ext_control> controls, int error)
+{
+    std::vector<uint8_t> payload;
+    for (auto&& control : controls) {
+        const CaptureControl header = {
+            .id = control.id,
+            .size = control.size,
+        };
+        const auto offset = payload.size();
+        payload.resize(offset + sizeof(header) + padded(header.size));
+        memcpy(payload.data() + offset, &header, sizeof(header));
+        memcpy(payload.data() + offset + sizeof(header), control.ptr, header.size);
+    }
+
+    write(CaptureCall::Controls, error, now(),
+        { static_cast<uint32_t>(request_fd), static_cast<uint32_t>(controls.size()) }, { payload });
+}
+
+void capture_install(VADriverVTable* vtable)
+{
+    vtable->vaTerminate = capture_terminate;
+    vtable->vaCreateConfig = capture_createConfig;
+    vtable->vaDestroyConfig = capture_destroyConfig;
+    vtable->vaCreateSurfaces = capture_createSurfaces;
+    vtable->vaCreateSurfaces2 = capture_createSurfaces2;
+    vtable->vaDestroySurfaces = capture_destroySurfaces;
+    vtable->vaCreateContext = capture_createContext;
+    vtable->vaDestroyContext = capture_destroyContext;
+    vtable->vaCreateBuffer = capture_createBuffer;
+    vtable->vaBufferSetNumElements = capture_bufferSetNumElements;
+    vtable->vaMapBuffer = capture_mapBuffer;
+    vtable->vaUnmapBuffer = capture_unmapBuffer;
+    vtable->vaDestroyBuffer = capture_destroyBuffer;
+    vtable->vaBeginPicture = capture_beginPicture;
+    vtable->vaRenderPicture = capture_renderPicture;
+    vtable->vaEndPicture = capture_endPicture;
+    vtable->vaSyncSurface = capture_syncSurface;
+    vtable->vaQuerySurfaceStatus = capture_querySurfaceStatus;
+    vtable->vaExportSurfaceHandle = capture_exportSurfaceHandle;
+    vtable->vaCreateImage = capture_createImage;
+    vtable->vaDeriveImage = capture_deriveImage;
+    vtable->vaDestroyImage = capture_destroyImage;
+    vtable->vaGetImage = capture_getImage;
+    vtable->vaPutImage = capture_putImage;
+    vtable->vaLockSurface = capture_lockSurface;
+    vtable->vaUnlockSurface = capture_unlockSurface;
+    vtable->vaAcquireBufferHandle = capture_acquireBufferHandle;
+    vtable->vaReleaseBufferHandle = capture_releaseBufferHandle;
+    vtable->vaSetImagePalette = capture_setImagePalette;
+    vtable->vaCreateSubpicture = capture_createSubpicture;
+    vtable->vaDestroySubpicture = capture_destroySubpicture;
+    vtable->vaSetSubpictureImage = capture_setSubpictureImage;
+    vtable->vaSetSubpictureChromakey = capture_setSubpictureChromakey;
+    vtable->vaSetSubpictureGlobalAlpha = capture_setSubpictureGlobalAlpha;
+    vtable->vaAssociateSubpicture = capture_associateSubpicture;
+    vtable->vaDeassociateSubpicture = capture_deassociateSubpicture;
+
+    CAPTURE_OTHER(vtable, vaQueryConfigProfiles, queryConfigProfiles);
+    CAPTURE_OTHER(vtable, vaQueryConfigEntrypoints, queryConfigEntrypoints);
+    CAPTURE_OTHER(vtable, vaQueryConfigAttributes, queryConfigAttributes);
+    CAPTURE_OTHER(vtable, vaGetConfigAttributes, getConfigAttributes);
+    CAPTURE_OTHER(vtable, vaBufferInfo, bufferInfo);
+    CAPTURE_OTHER(vtable, vaQuerySurfaceAttributes, querySurfaceAttributes);
+    CAPTURE_OTHER(vtable, vaPutSurface, putSurface);
+    CAPTURE_OTHER(vtable, vaQueryImageFormats, queryImageFormats);
+    CAPTURE_OTHER(vtable, vaQuerySubpictureFormats, querySubpictureFormats);
+    CAPTURE_OTHER(vtable, vaQueryDisplayAttributes, queryDisplayAttributes);
+    CAPTURE_OTHER(vtable, vaGetDisplayAttributes, getDisplayAttributes);
+    CAPTURE_OTHER(vtable, vaSetDisplayAttributes, setDisplayAttributes);
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+
+extern "C" {
+#include <linux/videodev2.h>
+
+#include <va/va.h>
+#include <va/va_backend.h>
+}
+
+/*
+ * Capture files record the VA calls made on one display, including the parameter buffers and slice data submitted
+ * for each picture, and the V4L2 controls the driver derived from them. They consist of a `CaptureHeader` followed by
+ * `CaptureRecord`s, each trailed by `size` bytes of payload and padded to 8 bytes, so that they can be mapped and
+ * walked in place. All values are in host byte order.
+ */
+
+#define CAPTURE_MAGIC "VACAPT\0"
+#define CAPTURE_VERSION 2
+
+struct CaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t va_version; // VA_MAJOR_VERSION << 16 | VA_MINOR_VERSION
+    uint64_t start; // CLOCK_MONOTONIC, ns
+};
+
+/**
+ * Recorded calls. The comments list the `args` of each, outputs in brackets, and the payload after the colon.
+ */
+enum class CaptureCall : uint32_t {
+    Terminate = 1,
+    CreateConfig, // profile, entrypoint, attribute count, [config]: VAConfigAttrib[]
+    DestroyConfig, // config
+    CreateSurfaces, // format, width, height, count: [VASurfaceID[]]
+    DestroySurfaces, // count: VASurfaceID[]
+    CreateContext, // config, width, height, flags, surface count, [context]: VASurfaceID[]
+    DestroyContext, // context
+    CreateBuffer, // context, type, size, count, [buffer]
+    BufferSetNumElements, // buffer, count
+    MapBuffer, // buffer
+    UnmapBuffer, // buffer
+    DestroyBuffer, // buffer
+    BeginPicture, // context, surface
+    RenderPicture, // context, buffer count: (CaptureBuffer, data)[]
+    EndPicture, // context
+    SyncSurface, // surface
+    QuerySurfaceStatus, // surface, [status]
+    ExportSurfaceHandle, // surface, memory type, flags
+    CreateImage, // fourcc, width, height, [image], [buffer]
+    DeriveImage, // surface, [image], [buffer]
+    DestroyImage, // image
+    GetImage, // surface, x, y, width, height, image
+    PutImage, // surface, image, source x, y, width, height, destination x, y; the destination size is not kept
+    Other, // queries, vaPutSurface and display attributes, which aren't replayed; the vtable offset
+    LockSurface, // surface
+    UnlockSurface, // surface
+    AcquireBufferHandle, // buffer, memory type
+    ReleaseBufferHandle, // buffer
+    SetImagePalette, // image: palette, 3 bytes per entry
+    CreateSubpicture, // image, [subpicture]
+    DestroySubpicture, // subpicture
+    SetSubpictureImage, // subpicture, image
+    SetSubpictureChromakey, // subpicture, minimum, maximum, mask
+    SetSubpictureGlobalAlpha, // subpicture, alpha as float bits
+    // subpicture, surface count, source x | y << 16, width | height << 16, destination x | y << 16,
+    // width | height << 16, flags: VASurfaceID[]
+    AssociateSubpicture,
+    DeassociateSubpicture, // subpicture, surface count: VASurfaceID[]
+    Controls = 0x100, // request fd, control count: (CaptureControl, data)[]; precedes the call that set them
+};
+
+struct CaptureRecord {
+    CaptureCall call;
+    int32_t status; // VAStatus, for `Controls` 0 or the errno
+    uint64_t time; // Since `CaptureHeader::start`, ns
+    uint64_t duration; // Spent in the driver, ns
+    uint32_t args[8];
+    uint32_t size;
+    uint32_t reserved;
+};
+
+struct CaptureBuffer {
+    uint32_t id;
+    uint32_t type; // VABufferType
+    uint32_t size; // Element size times count; data follows, padded to 8 bytes
+    uint32_t count;
+};
+
+struct CaptureControl {
+    uint32_t id;
+    uint32_t size; // Data follows, padded to 8 bytes
+};
+
+/**
+ * Writer for one capture file, enabled by `LIBVA_V4L2_CAPTURE=<directory>`.
+ */
+class Capture {
+public:
+    static std::unique_ptr<Capture> open(VADriverContextP va_context, const std::optional<std::string>& directory);
+    ~Capture();
+
+    Capture(const Capture&) = delete;
+    Capture& operator=(const Capture&) = delete;
+
+    /** Monotonic time, to be passed back as `start` of a record. */
+    static uint64_t now();
+
+    void write(CaptureCall call, VAStatus status, uint64_t start, std::initializer_list<uint32_t> args,
+        std::initializer_list<std::span<const uint8_t>> payload = {});
+    void write_controls(int request_fd, std::span<const v4l2_ext_control> controls, int error);
+
+private:
+    Capture(FILE* file, uint64_t start);
+
+    std::mutex mutex;
+    FILE* file;
+    const uint64_t start;
+};
+
+/** Route the vtable's entry points through recording wrappers. */
+void capture_install(VADriverVTable* vtable);
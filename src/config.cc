@@ -43,6 +43,11 @@ extern "C" {
 #include "driver.h"
 #include "utils.h"
 
+uint32_t rt_formats(VAProfile profile)
+{
+    return (profile == VAProfileVP9Profile2) ? VA_RT_FORMAT_YUV420_10 : VA_RT_FORMAT_YUV420;
+}
+
 VAStatus createConfig(VADriverContextP context, VAProfile profile, VAEntrypoint entrypoint, VAConfigAttrib* attributes,
     int attributes_count, VAConfigID* config_id)
 {
@@ -50,10 +55,11 @@ VAStatus createConfig(VADriverContextP context, VAProfile profile, VAEntrypoint
     int i, index;
 
     const auto& supported = Context::supported_profiles(driver_data->devices);
-    if (std::ranges::find(supported, profile) == supported.end()) {
+    const bool video_processing = profile == VAProfileNone && !driver_data->processors.empty();
+    if (!video_processing && std::ranges::find(supported, profile) == supported.end()) {
         return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
     }
-    if (entrypoint != VAEntrypointVLD) {
+    if (entrypoint != (video_processing ? VAEntrypointVideoProc : VAEntrypointVLD)) {
         return VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT;
     }
 
@@ -61,13 +67,23 @@ VAStatus createConfig(VADriverContextP context, VAProfile profile, VAEntrypoint
         attributes_count = Config::max_attributes;
     }
 
+    uint32_t rt_format = rt_formats(profile);
+    for (int i = 0; i < attributes_count; i++) {
+        if (attributes[i].type == VAConfigAttribRTFormat) {
+            if (!(attributes[i].value & rt_format)) {
+                return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
+            }
+            rt_format = attributes[i].value & rt_format;
+        }
+    }
+
     std::lock_guard<std::mutex> guard(driver_data->mutex);
     *config_id = smallest_free_key(driver_data->configs);
     auto [config, inserted] = driver_data->configs.emplace(std::make_pair(*config_id,
         Config {
             .profile = profile,
             .entrypoint = entrypoint,
-            .attributes { { VAConfigAttribRTFormat, VA_RT_FORMAT_YUV420 } },
+            .attributes { { VAConfigAttribRTFormat, rt_format } },
             .attributes_count = 1,
         }));
     if (!inserted) {
@@ -100,7 +116,10 @@ VAStatus queryConfigProfiles(VADriverContextP context, VAProfile* profiles_, int
     auto driver_data = static_cast<DriverData*>(context->pDriverData);
 
     std::span<VAProfile> profiles(profiles_, V4L2_MAX_PROFILES);
-    const auto& supported = Context::supported_profiles(driver_data->devices);
+    auto supported = Context::supported_profiles(driver_data->devices);
+    if (!driver_data->processors.empty()) {
+        supported.insert(VAProfileNone);
+    }
 
     *profile_count = std::min(profiles.size(), supported.size());
 
@@ -117,6 +136,9 @@ VAStatus queryConfigEntrypoints(
     if (std::ranges::find(supported, profile) != supported.end()) {
         entrypoints[0] = VAEntrypointVLD;
         *entrypoints_count = 1;
+    } else if (profile == VAProfileNone && !driver_data->processors.empty()) {
+        entrypoints[0] = VAEntrypointVideoProc;
+        *entrypoints_count = 1;
     } else {
         *entrypoints_count = 0;
     }
@@ -158,7 +180,7 @@ VAStatus getConfigAttributes(VADriverContextP context, VAProfile profile, VAEntr
     for (int i = 0; i < attributes_count; i++) {
         switch (attributes[i].type) {
         case VAConfigAttribRTFormat:
-            attributes[i].value = VA_RT_FORMAT_YUV420;
+            attributes[i].value = rt_formats(profile);
             break;
         default:
             attributes[i].value = VA_ATTRIB_NOT_SUPPORTED;
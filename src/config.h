@@ -40,6 +40,12 @@ struct Config {
     int attributes_count;
 };
 
+/**
+ * Render target formats (`VA_RT_FORMAT_*`) pictures of the profile are decoded into, or processed into for
+ * `VAProfileNone`.
+ */
+uint32_t rt_formats(VAProfile profile);
+
 VAStatus createConfig(VADriverContextP context, VAProfile profile, VAEntrypoint entrypoint, VAConfigAttrib* attributes,
     int attributes_count, VAConfigID* config_id);
 VAStatus destroyConfig(VADriverContextP context, VAConfigID config_id);
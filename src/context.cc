@@ -43,11 +43,14 @@ extern "C" {
 #include "config.h"
 #include "driver.h"
 #include "h264.h"
+#include "log.h"
 #include "mpeg2.h"
+#include "stats.h"
 #include "surface.h"
 #include "utils.h"
 #include "v4l2.h"
 #include "vp8.h"
+#include "vpp.h"
 #ifdef ENABLE_VP9
 #include "vp9.h"
 #endif
@@ -77,6 +80,10 @@ std::set<VAProfile> Context::supported_profiles(const std::vector<V4L2M2MDevice>
 Context* Context::create(DriverData* driver_data, VAProfile profile, int picture_width, int picture_height,
     std::span<VASurfaceID> surface_ids)
 {
+    if (profile == VAProfileNone && !driver_data->processors.empty()) {
+        return new VPPContext(driver_data, driver_data->processors.front(), picture_width, picture_height, surface_ids);
+    }
+
     for (auto&& device : driver_data->devices) {
         if (MPEG2Context::supported_profiles(device).contains(profile)) {
             return new MPEG2Context(driver_data, device, picture_width, picture_height, surface_ids);
@@ -104,25 +111,69 @@ Context::Context(DriverData* driver_data, V4L2M2MDevice& dev, fourcc pixelformat
     , picture_height(picture_height)
     , driver_data(driver_data)
     , device(dev)
+    , statistics(driver_data->statistics.acquire())
 {
-    device.set_format(device.output_buf_type, pixelformat, picture_width, picture_height);
+    // The destructor doesn't run when the constructor throws, so the statistics slot is released here
+    try {
+        device.statistics = statistics;
+        device.recording = driver_data->capture.get();
+        device.set_format(device.output_buf_type, pixelformat, picture_width, picture_height);
+
+#ifdef ENABLE_VP9
+        // Decoders only offer their 10-bit CAPTURE formats once the stream is known to need them
+        if (pixelformat == V4L2_PIX_FMT_VP9_FRAME && !surface_ids.empty()
+            && driver_data->surfaces.at(surface_ids[0]).format == VA_RT_FORMAT_YUV420_10) {
+            try {
+                VP9Context::announce_bit_depth(device, 10);
+            } catch (std::system_error& e) {
+                info_log(driver_data->va_context, "Failed to announce the bit depth: %s\n", e.what());
+            }
+        }
+#endif
 
-    // Now that the output format is set, we can set the capture format and allocate the surfaces.
-    createSurfacesDeferred(driver_data, *this, surface_ids);
+        // Now that the output format is set, we can set the capture format and allocate the surfaces.
+        createSurfacesDeferred(driver_data, *this, surface_ids);
 
-    device.request_buffers(device.output_buf_type, surface_ids.size());
+        device.request_buffers(device.output_buf_type, surface_ids.size());
 
-    for (unsigned i = 0; i < surface_ids.size(); i++) {
-        driver_data->surfaces.at(i).source_buffer = std::cref(device.buffer(device.output_buf_type, i));
+        for (unsigned i = 0; i < surface_ids.size(); i++) {
+            driver_data->surfaces.at(surface_ids[i]).source_buffer
+                = std::cref(device.buffer(device.output_buf_type, i));
+        }
+
+        device.set_streaming(true);
+    } catch (...) {
+        device.statistics = nullptr;
+        device.recording = nullptr;
+        driver_data->statistics.release(statistics);
+        throw;
     }
+}
 
-    device.set_streaming(true);
+Context::Context(DriverData* driver_data, V4L2M2MDevice& dev, int picture_width, int picture_height)
+    : render_surface_id(VA_INVALID_ID)
+    , picture_width(picture_width)
+    , picture_height(picture_height)
+    , driver_data(driver_data)
+    , device(dev)
+    , statistics(driver_data->statistics.acquire())
+{
+    device.statistics = statistics;
 }
 
 Context::~Context()
 {
     device.set_streaming(false);
     device.request_buffers(device.capture_buf_type, 0);
+    device.statistics = nullptr;
+    device.recording = nullptr;
+    driver_data->statistics.release(statistics);
+}
+
+void Context::queue_buffers(Surface& surface)
+{
+    surface.destination_buffer->get().queue(-1, nullptr, 0, cache_hints(surface));
+    surface.source_buffer->get().queue(surface.request_fd, &surface.timestamp, surface.source_size_used);
 }
 
 VAStatus createContext(VADriverContextP va_context, VAConfigID config_id, int picture_width, int picture_height,
@@ -152,6 +203,10 @@ VAStatus createContext(VADriverContextP va_context, VAConfigID config_id, int pi
             error_log(va_context, "Failed to create context\n");
             return VA_STATUS_ERROR_ALLOCATION_FAILED;
         }
+        if (auto statistics = context->second->statistics; statistics) {
+            statistics->context_id.store(*context_id, std::memory_order_relaxed);
+            statistics->profile.store(config.profile, std::memory_order_relaxed);
+        }
     } catch (std::exception& e) {
         error_log(va_context, "Failed to create context: %s\n", e.what());
         return VA_STATUS_ERROR_OPERATION_FAILED;
@@ -168,7 +223,26 @@ VAStatus destroyContext(VADriverContextP va_context, VAContextID context_id)
     if (!driver_data->contexts.contains(context_id)) {
         return VA_STATUS_ERROR_INVALID_CONTEXT;
     }
+    auto& device = driver_data->contexts.at(context_id)->device;
+
+    // The context frees its CAPTURE buffers, which derived images and locks may still alias
+    auto owned = [&](const Surface& surface) {
+        return surface.destination_buffer && &surface.destination_buffer->get().owner() == &device;
+    };
+    for (auto&& [id, surface] : driver_data->surfaces) {
+        if (owned(surface) && (surface.mappings || surface.locked_image)) {
+            return VA_STATUS_ERROR_SURFACE_BUSY;
+        }
+    }
+
     driver_data->contexts.erase(context_id);
+    for (auto&& [id, surface] : driver_data->surfaces) {
+        if (owned(surface)) {
+            surface.source_buffer.reset();
+            surface.destination_buffer.reset();
+            surface.status = VASurfaceReady;
+        }
+    }
 
     return VA_STATUS_SUCCESS;
 }
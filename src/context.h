@@ -36,7 +36,9 @@ extern "C" {
 #include "buffer.h"
 #include "v4l2.h"
 
+struct ContextStatistics;
 struct DriverData;
+struct Surface;
 
 class Context {
 public:
@@ -50,12 +52,19 @@ public:
 
     virtual VAStatus store_buffer(const Buffer& buffer) const = 0;
     virtual int set_controls() = 0;
+    /** Hand the surface's picture to the device, its CAPTURE buffer first; throws `std::system_error`. */
+    virtual void queue_buffers(Surface& surface);
 
     VASurfaceID render_surface_id;
     int picture_width;
     int picture_height;
     DriverData* driver_data;
     V4L2M2MDevice& device;
+    ContextStatistics* statistics;
+
+protected:
+    /** For contexts that configure the device themselves, and set no controls to be captured. */
+    Context(DriverData* driver_data, V4L2M2MDevice& device, int picture_width, int picture_height);
 };
 
 VAStatus createContext(VADriverContextP va_context, VAConfigID config_id, int picture_width, int picture_height,
@@ -0,0 +1,625 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "convert.h"
+
+#include <algorithm>
+#include <cstring>
+
+extern "C" {
+#include <va/va.h>
+}
+
+#include "copy.h"
+#include "format.h"
+
+/*
+ * The kernels are written with the compiler's generic vector extensions, which lower to NEON on ARM and SSE on x86,
+ * and work on a pair of luma rows at a time so that the chroma row they share is read only once. Widths that are not
+ * a multiple of the block size are finished by running the block on a zero-padded copy of the remaining pixels.
+ */
+
+namespace {
+
+typedef uint8_t u8x8 __attribute__((vector_size(8)));
+typedef uint8_t u8x16 __attribute__((vector_size(16)));
+typedef uint8_t u8x32 __attribute__((vector_size(32)));
+typedef int32_t i32x8 __attribute__((vector_size(32)));
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+typedef uint16_t u16x8 __attribute__((vector_size(16)));
+typedef int16_t i16x8 __attribute__((vector_size(16)));
+
+template <typename T> T load(const uint8_t* source)
+{
+    T result;
+    memcpy(&result, source, sizeof(result));
+    return result;
+}
+
+template <typename T> void store(uint8_t* destination, const T& value)
+{
+    memcpy(destination, &value, sizeof(value));
+}
+
+/** Rows of one chroma row's worth of output: two luma rows, the second absent for odd heights. */
+struct RowPair {
+    const uint8_t* luma[2];
+    const uint8_t* chroma;
+    uint8_t* destination[3][2];
+    unsigned rows;
+};
+
+void copy_luma(const RowPair& pair, unsigned width)
+{
+    const auto copy = copy_kernel().copy;
+    for (unsigned i = 0; i < pair.rows; i++) {
+        copy(pair.destination[0][i], pair.luma[i], width);
+    }
+}
+
+void convert_nv12(const RowPair& pair, unsigned width)
+{
+    copy_luma(pair, width);
+    copy_kernel().copy(pair.destination[1][0], pair.chroma, (width + 1) & ~1u);
+}
+
+/** I420 and YV12, which only differ in the order of the chroma planes. */
+void convert_planar(const RowPair& pair, unsigned width, uint8_t* u, uint8_t* v)
+{
+    copy_luma(pair, width);
+
+    const auto chroma_width = (width + 1) / 2;
+    unsigned i = 0;
+    for (; i + 16 <= chroma_width; i += 16) {
+        const auto a = load<u8x16>(pair.chroma + 2 * i);
+        const auto b = load<u8x16>(pair.chroma + 2 * i + 16);
+        store(u + i,
+            __builtin_shufflevector(a, b, 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30));
+        store(v + i,
+            __builtin_shufflevector(a, b, 1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31));
+    }
+    for (; i < chroma_width; i++) {
+        u[i] = pair.chroma[2 * i];
+        v[i] = pair.chroma[2 * i + 1];
+    }
+}
+
+/** 16 pixels of packed Y0 U Y1 V from 16 luma and 8 chroma pairs. */
+void yuy2_block(uint8_t* destination, const uint8_t* luma, const uint8_t* chroma)
+{
+    const auto y = load<u8x16>(luma);
+    const auto uv = load<u8x16>(chroma);
+    store(destination,
+        __builtin_shufflevector(y, uv, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23, 8, 24, 9, 25, 10, 26,
+            11, 27, 12, 28, 13, 29, 14, 30, 15, 31));
+}
+
+void convert_yuy2(const RowPair& pair, unsigned width)
+{
+    for (unsigned row = 0; row < pair.rows; row++) {
+        const auto luma = pair.luma[row];
+        const auto destination = pair.destination[0][row];
+        unsigned i = 0;
+        for (; i + 16 <= width; i += 16) {
+            yuy2_block(destination + 2 * i, luma + i, pair.chroma + i);
+        }
+        if (i < width) {
+            const auto rest = width - i;
+            const auto padded = (rest + 1) & ~1u;
+            uint8_t y[16] = {}, uv[16] = {}, out[32];
+            memcpy(y, luma + i, rest);
+            y[rest] = y[rest - 1]; // The last pair of odd widths repeats the last pixel.
+            memcpy(uv, pair.chroma + i, padded);
+            yuy2_block(out, y, uv);
+            memcpy(destination + 2 * i, out, 2 * padded);
+        }
+    }
+}
+
+/** Chroma contributions to R, G and B of 8 pixels, shared by both rows of a pair. */
+struct ChromaTerms {
+    i32x8 r, g, b;
+};
+
+ChromaTerms chroma_terms(const uint8_t* chroma)
+{
+    const auto uv = __builtin_convertvector(load<u8x8>(chroma), i32x8);
+    const auto u = __builtin_shufflevector(uv, uv, 0, 0, 2, 2, 4, 4, 6, 6) - 128;
+    const auto v = __builtin_shufflevector(uv, uv, 1, 1, 3, 3, 5, 5, 7, 7) - 128;
+    return { 409 * v, -100 * u - 208 * v, 516 * u };
+}
+
+u8x8 clamp(const i32x8& sum)
+{
+    auto value = sum >> 8;
+    value = value < 0 ? 0 : value;
+    value = value > 255 ? 255 : value;
+    return __builtin_convertvector(value, u8x8);
+}
+
+/** 8 pixels of BGRA or RGBA. */
+template <bool bgra> void rgb_block(uint8_t* destination, const uint8_t* luma, const ChromaTerms& chroma)
+{
+    const auto y = (__builtin_convertvector(load<u8x8>(luma), i32x8) - 16) * 298 + 128;
+    const auto r = clamp(y + chroma.r);
+    const auto g = clamp(y + chroma.g);
+    const auto b = clamp(y + chroma.b);
+    const u8x8 a = { 255, 255, 255, 255, 255, 255, 255, 255 };
+
+    const auto first = bgra ? b : r;
+    const auto third = bgra ? r : b;
+    const auto low = __builtin_shufflevector(first, g, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const auto high = __builtin_shufflevector(third, a, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    store(destination,
+        __builtin_shufflevector(low, high, 0, 8, 16, 24, 1, 9, 17, 25, 2, 10, 18, 26, 3, 11, 19, 27, 4, 12, 20, 28,
+            5, 13, 21, 29, 6, 14, 22, 30, 7, 15, 23, 31));
+}
+
+template <bool bgra> void convert_rgb(const RowPair& pair, unsigned width)
+{
+    unsigned i = 0;
+    for (; i + 8 <= width; i += 8) {
+        const auto chroma = chroma_terms(pair.chroma + i);
+        for (unsigned row = 0; row < pair.rows; row++) {
+            rgb_block<bgra>(pair.destination[0][row] + 4 * i, pair.luma[row] + i, chroma);
+        }
+    }
+    if (i < width) {
+        const auto rest = width - i;
+        uint8_t uv[8] = {}, y[8] = {}, out[32];
+        memcpy(uv, pair.chroma + i, (rest + 1) & ~1u);
+        const auto chroma = chroma_terms(uv);
+        for (unsigned row = 0; row < pair.rows; row++) {
+            memcpy(y, pair.luma[row] + i, rest);
+            rgb_block<bgra>(out, y, chroma);
+            memcpy(pair.destination[0][row] + 4 * i, out, 4 * rest);
+        }
+    }
+}
+
+/**
+ * Unpack `count` samples of 10 bits, packed four to five bytes in little endian order, into the most significant bits
+ * of the 16-bit samples of P010.
+ */
+void unpack_nv15(uint8_t* destination, const uint8_t* source, unsigned count)
+{
+    // Eight samples from ten bytes, with loads of 16 that stay within the row. Each sample is moved to the top of the
+    // 16 bits it straddles by a multiplication, as few instruction sets shift lanes by different amounts.
+    const unsigned row_size = (count + 3) / 4 * 5;
+    const u16x8 factors = { 64, 16, 4, 1, 64, 16, 4, 1 };
+    unsigned i = 0;
+    for (; i + 8 <= count && i / 4 * 5 + 16 <= row_size; i += 8) {
+        const auto bytes = load<u8x16>(source + i / 4 * 5);
+        const auto pairs = (u16x8)__builtin_shufflevector(bytes, bytes, 0, 1, 1, 2, 2, 3, 3, 4, 5, 6, 6, 7, 7, 8, 8, 9);
+        store(destination + 2 * i, (pairs * factors) & 0xffc0);
+    }
+    for (; i < count; i++) {
+        const auto bit = 10 * i;
+        const auto bytes = source + bit / 8;
+        const uint16_t sample = ((bytes[0] | bytes[1] << 8) >> (bit % 8) & 0x3ff) << 6;
+        memcpy(destination + 2 * i, &sample, sizeof(sample));
+    }
+}
+
+/** P010 from P010 or NV15. */
+void convert_p010(const RowPair& pair, unsigned width, bool packed)
+{
+    const auto chroma_width = (width + 1) & ~1u;
+    if (packed) {
+        for (unsigned i = 0; i < pair.rows; i++) {
+            unpack_nv15(pair.destination[0][i], pair.luma[i], width);
+        }
+        unpack_nv15(pair.destination[1][0], pair.chroma, chroma_width);
+    } else {
+        const auto copy = copy_kernel().copy;
+        for (unsigned i = 0; i < pair.rows; i++) {
+            copy(pair.destination[0][i], pair.luma[i], 2 * width);
+        }
+        copy(pair.destination[1][0], pair.chroma, 2 * chroma_width);
+    }
+}
+
+/**
+ * Rows of one chroma row's worth of input for uploading: two image rows, the first repeated for odd heights so that
+ * chroma can always average a pair, and the rows they are written to.
+ */
+struct UploadPair {
+    const uint8_t* source[3][2];
+    uint8_t* luma[2];
+    uint8_t* chroma;
+    unsigned rows;
+};
+
+void upload_luma(const UploadPair& pair, unsigned bytes)
+{
+    const auto copy = copy_kernel().copy;
+    for (unsigned i = 0; i < pair.rows; i++) {
+        copy(pair.luma[i], pair.source[0][i], bytes);
+    }
+}
+
+/** Rounding average of unsigned bytes, without widening. */
+u8x16 average(const u8x16& a, const u8x16& b)
+{
+    return (a | b) - ((a ^ b) >> 1);
+}
+
+void upload_planar(const UploadPair& pair, unsigned width, const uint8_t* u, const uint8_t* v)
+{
+    upload_luma(pair, width);
+
+    const auto chroma_width = (width + 1) / 2;
+    unsigned i = 0;
+    for (; i + 16 <= chroma_width; i += 16) {
+        const auto a = load<u8x16>(u + i);
+        const auto b = load<u8x16>(v + i);
+        store(pair.chroma + 2 * i,
+            __builtin_shufflevector(a, b, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23));
+        store(pair.chroma + 2 * i + 16,
+            __builtin_shufflevector(a, b, 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31));
+    }
+    for (; i < chroma_width; i++) {
+        pair.chroma[2 * i] = u[i];
+        pair.chroma[2 * i + 1] = v[i];
+    }
+}
+
+/** 16 pixels of packed Y0 U Y1 V from both rows into 16 luma samples per row and 8 averaged chroma pairs. */
+void yuy2_upload_block(uint8_t* const luma[2], uint8_t* chroma, const uint8_t* const source[2], unsigned rows)
+{
+    u8x16 uv[2];
+    for (unsigned row = 0; row < 2; row++) {
+        const auto a = load<u8x16>(source[row]);
+        const auto b = load<u8x16>(source[row] + 16);
+        if (row < rows) {
+            store(luma[row],
+                __builtin_shufflevector(a, b, 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30));
+        }
+        uv[row] = __builtin_shufflevector(a, b, 1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+    }
+    store(chroma, average(uv[0], uv[1]));
+}
+
+void upload_yuy2(const UploadPair& pair, unsigned width)
+{
+    unsigned i = 0;
+    for (; i + 16 <= width; i += 16) {
+        uint8_t* const luma[2] = { pair.luma[0] + i, pair.rows > 1 ? pair.luma[1] + i : nullptr };
+        const uint8_t* const source[2] = { pair.source[0][0] + 2 * i, pair.source[0][1] + 2 * i };
+        yuy2_upload_block(luma, pair.chroma + i, source, pair.rows);
+    }
+    if (i < width) {
+        const auto rest = width - i;
+        const auto padded = (rest + 1) & ~1u;
+        uint8_t in[2][32] = {}, y[2][16], uv[16];
+        for (unsigned row = 0; row < 2; row++) {
+            memcpy(in[row], pair.source[0][row] + 2 * i, 2 * padded);
+        }
+        uint8_t* const luma[2] = { y[0], y[1] };
+        const uint8_t* const source[2] = { in[0], in[1] };
+        yuy2_upload_block(luma, uv, source, pair.rows);
+        for (unsigned row = 0; row < pair.rows; row++) {
+            memcpy(pair.luma[row] + i, y[row], rest);
+        }
+        memcpy(pair.chroma + i, uv, padded);
+    }
+}
+
+struct Rgb {
+    u16x8 r, g, b;
+};
+
+/** 8 pixels of BGRA or RGBA, widened. */
+template <bool bgra> Rgb unpack_rgb(const uint8_t* source)
+{
+    const auto low = load<u8x16>(source);
+    const auto high = load<u8x16>(source + 16);
+    const auto first = __builtin_shufflevector(low, high, 0, 4, 8, 12, 16, 20, 24, 28);
+    const auto g = __builtin_shufflevector(low, high, 1, 5, 9, 13, 17, 21, 25, 29);
+    const auto third = __builtin_shufflevector(low, high, 2, 6, 10, 14, 18, 22, 26, 30);
+    return {
+        __builtin_convertvector(bgra ? third : first, u16x8),
+        __builtin_convertvector(g, u16x8),
+        __builtin_convertvector(bgra ? first : third, u16x8),
+    };
+}
+
+/**
+ * 8 pixels of both rows into BT.601 limited range luma, and 4 chroma pairs from the average of each 2x2 block. All
+ * intermediate values fit 16 bits, and the results lie within 16 to 240 without clamping.
+ */
+template <bool bgra>
+void rgb_upload_block(uint8_t* const luma[2], uint8_t* chroma, const uint8_t* const source[2], unsigned rows)
+{
+    const Rgb pixels[2] = { unpack_rgb<bgra>(source[0]), unpack_rgb<bgra>(source[1]) };
+    for (unsigned row = 0; row < rows; row++) {
+        const auto& p = pixels[row];
+        store(luma[row], __builtin_convertvector(((66 * p.r + 129 * p.g + 25 * p.b + 128) >> 8) + 16, u8x8));
+    }
+
+    const auto average = [&](const u16x8& a, const u16x8& b) {
+        const auto sum = a + b;
+        return (i16x8)((__builtin_shufflevector(sum, sum, 0, 2, 4, 6, 0, 2, 4, 6)
+                           + __builtin_shufflevector(sum, sum, 1, 3, 5, 7, 1, 3, 5, 7) + 2)
+            >> 2);
+    };
+    const auto r = average(pixels[0].r, pixels[1].r);
+    const auto g = average(pixels[0].g, pixels[1].g);
+    const auto b = average(pixels[0].b, pixels[1].b);
+    const auto u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+    const auto v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    store(chroma, __builtin_convertvector(__builtin_shufflevector(u, v, 0, 8, 1, 9, 2, 10, 3, 11), u8x8));
+}
+
+template <bool bgra> void upload_rgb(const UploadPair& pair, unsigned width)
+{
+    unsigned i = 0;
+    for (; i + 8 <= width; i += 8) {
+        uint8_t* const luma[2] = { pair.luma[0] + i, pair.rows > 1 ? pair.luma[1] + i : nullptr };
+        const uint8_t* const source[2] = { pair.source[0][0] + 4 * i, pair.source[0][1] + 4 * i };
+        rgb_upload_block<bgra>(luma, pair.chroma + i, source, pair.rows);
+    }
+    if (i < width) {
+        // The last pair of odd widths repeats the last pixel
+        const auto rest = width - i;
+        uint8_t in[2][32] = {}, y[2][8], uv[8];
+        for (unsigned row = 0; row < 2; row++) {
+            memcpy(in[row], pair.source[0][row] + 4 * i, 4 * rest);
+            if (rest % 2) {
+                memcpy(in[row] + 4 * rest, in[row] + 4 * (rest - 1), 4);
+            }
+        }
+        uint8_t* const luma[2] = { y[0], y[1] };
+        const uint8_t* const source[2] = { in[0], in[1] };
+        rgb_upload_block<bgra>(luma, uv, source, pair.rows);
+        for (unsigned row = 0; row < pair.rows; row++) {
+            memcpy(pair.luma[row] + i, y[row], rest);
+        }
+        memcpy(pair.chroma + i, uv, (rest + 1) & ~1u);
+    }
+}
+
+/** Rows of four 4x4 tiles at once, as a transposition of 32-bit elements. */
+void detile_4x4(uint8_t* destination, const uint8_t* source, size_t pitch)
+{
+    const auto tiles = pitch / 4;
+    unsigned tile = 0;
+    for (; tile + 4 <= tiles; tile += 4, source += 64) {
+        const auto a = load<u32x4>(source);
+        const auto b = load<u32x4>(source + 16);
+        const auto c = load<u32x4>(source + 32);
+        const auto d = load<u32x4>(source + 48);
+        const auto ab_low = __builtin_shufflevector(a, b, 0, 4, 1, 5);
+        const auto ab_high = __builtin_shufflevector(a, b, 2, 6, 3, 7);
+        const auto cd_low = __builtin_shufflevector(c, d, 0, 4, 1, 5);
+        const auto cd_high = __builtin_shufflevector(c, d, 2, 6, 3, 7);
+        store(destination + 4 * tile, __builtin_shufflevector(ab_low, cd_low, 0, 1, 4, 5));
+        store(destination + pitch + 4 * tile, __builtin_shufflevector(ab_low, cd_low, 2, 3, 6, 7));
+        store(destination + 2 * pitch + 4 * tile, __builtin_shufflevector(ab_high, cd_high, 0, 1, 4, 5));
+        store(destination + 3 * pitch + 4 * tile, __builtin_shufflevector(ab_high, cd_high, 2, 3, 6, 7));
+    }
+    for (; tile < tiles; tile++, source += 16) {
+        for (unsigned row = 0; row < 4; row++) {
+            memcpy(destination + row * pitch + 4 * tile, source + 4 * row, 4);
+        }
+    }
+}
+
+/** One 32x32 tile, two vectors per row. */
+void detile_32x32(uint8_t* destination, const uint8_t* source, size_t pitch)
+{
+    for (unsigned row = 0; row < 32; row++, source += 32) {
+        store(destination + row * pitch, load<u8x16>(source));
+        store(destination + row * pitch + 16, load<u8x16>(source + 16));
+    }
+}
+
+} // namespace
+
+bool convert_supported(uint32_t source, uint32_t destination)
+{
+    if (source == VA_FOURCC_P010 || source == VA_FOURCC_NV15) {
+        return destination == VA_FOURCC_P010;
+    }
+    if (source != VA_FOURCC_NV12) {
+        return false;
+    }
+    switch (destination) {
+    case VA_FOURCC_NV12:
+    case VA_FOURCC_I420:
+    case VA_FOURCC_YV12:
+    case VA_FOURCC_YUY2:
+    case VA_FOURCC_BGRA:
+    case VA_FOURCC_RGBA:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void convert_rows(
+    const ConvertDestination& destination, const ConvertSource& source, unsigned width, unsigned first, unsigned last)
+{
+    for (unsigned row = first; row < last; row += 2) {
+        RowPair pair = {};
+        pair.rows = (row + 1 < last) ? 2 : 1;
+        pair.chroma = source.chroma + row / 2 * source.chroma_pitch;
+        for (unsigned i = 0; i < pair.rows; i++) {
+            pair.luma[i] = source.luma + (row + i) * source.luma_pitch;
+            pair.destination[0][i] = destination.planes[0] + (row + i) * destination.pitches[0];
+        }
+        for (unsigned plane = 1; plane < 3; plane++) {
+            if (destination.planes[plane]) {
+                pair.destination[plane][0] = destination.planes[plane] + row / 2 * destination.pitches[plane];
+            }
+        }
+
+        if (source.fourcc != VA_FOURCC_NV12) {
+            convert_p010(pair, width, source.fourcc == VA_FOURCC_NV15);
+            continue;
+        }
+        switch (destination.fourcc) {
+        case VA_FOURCC_NV12:
+            convert_nv12(pair, width);
+            break;
+        case VA_FOURCC_I420:
+            convert_planar(pair, width, pair.destination[1][0], pair.destination[2][0]);
+            break;
+        case VA_FOURCC_YV12:
+            convert_planar(pair, width, pair.destination[2][0], pair.destination[1][0]);
+            break;
+        case VA_FOURCC_YUY2:
+            convert_yuy2(pair, width);
+            break;
+        case VA_FOURCC_BGRA:
+            convert_rgb<true>(pair, width);
+            break;
+        case VA_FOURCC_RGBA:
+            convert_rgb<false>(pair, width);
+            break;
+        }
+    }
+}
+
+bool upload_supported(uint32_t source, uint32_t destination)
+{
+    if (destination == VA_FOURCC_P010) {
+        return source == VA_FOURCC_P010;
+    }
+    if (destination != VA_FOURCC_NV12) {
+        return false;
+    }
+    switch (source) {
+    case VA_FOURCC_NV12:
+    case VA_FOURCC_I420:
+    case VA_FOURCC_YV12:
+    case VA_FOURCC_YUY2:
+    case VA_FOURCC_BGRA:
+    case VA_FOURCC_RGBA:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void upload_rows(
+    const UploadDestination& destination, const UploadSource& source, unsigned width, unsigned first, unsigned last)
+{
+    const auto chroma_width = (width + 1) & ~1u;
+    for (unsigned row = first; row < last; row += 2) {
+        UploadPair pair = {};
+        pair.rows = (row + 1 < last) ? 2 : 1;
+        pair.chroma = destination.chroma + row / 2 * destination.chroma_pitch;
+        for (unsigned i = 0; i < 2; i++) {
+            pair.source[0][i] = source.planes[0] + (row + std::min(i, pair.rows - 1)) * source.pitches[0];
+        }
+        for (unsigned i = 0; i < pair.rows; i++) {
+            pair.luma[i] = destination.luma + (row + i) * destination.luma_pitch;
+        }
+        for (unsigned plane = 1; plane < 3; plane++) {
+            if (source.planes[plane]) {
+                pair.source[plane][0] = source.planes[plane] + row / 2 * source.pitches[plane];
+            }
+        }
+
+        switch (source.fourcc) {
+        case VA_FOURCC_NV12:
+            upload_luma(pair, width);
+            copy_kernel().copy(pair.chroma, pair.source[1][0], chroma_width);
+            break;
+        case VA_FOURCC_P010:
+            upload_luma(pair, 2 * width);
+            copy_kernel().copy(pair.chroma, pair.source[1][0], 2 * chroma_width);
+            break;
+        case VA_FOURCC_I420:
+            upload_planar(pair, width, pair.source[1][0], pair.source[2][0]);
+            break;
+        case VA_FOURCC_YV12:
+            upload_planar(pair, width, pair.source[2][0], pair.source[1][0]);
+            break;
+        case VA_FOURCC_YUY2:
+            upload_yuy2(pair, width);
+            break;
+        case VA_FOURCC_BGRA:
+            upload_rgb<true>(pair, width);
+            break;
+        case VA_FOURCC_RGBA:
+            upload_rgb<false>(pair, width);
+            break;
+        }
+    }
+}
+
+ConvertDestination skip_rows(const ConvertDestination& destination, unsigned rows)
+{
+    auto result = destination;
+    result.planes[0] += rows * destination.pitches[0];
+    for (unsigned plane = 1; plane < 3; plane++) {
+        if (result.planes[plane]) {
+            result.planes[plane] += rows / 2 * destination.pitches[plane];
+        }
+    }
+    return result;
+}
+
+void detile_rows(uint8_t* destination, const uint8_t* source, size_t pitch, unsigned tile_width, unsigned tile_height,
+    unsigned tile_rows)
+{
+    const auto tile_size = tile_width * tile_height;
+    for (unsigned tile_row = 0; tile_row < tile_rows; tile_row++) {
+        auto row = destination + tile_row * tile_height * pitch;
+        if (tile_width == 4 && tile_height == 4) {
+            detile_4x4(row, source, pitch);
+            source += 4 * pitch;
+            continue;
+        }
+        for (unsigned x = 0; x + tile_width <= pitch; x += tile_width, source += tile_size) {
+            if (tile_width == 32 && tile_height == 32) {
+                detile_32x32(row + x, source, pitch);
+                continue;
+            }
+            for (unsigned i = 0; i < tile_height; i++) {
+                memcpy(row + i * pitch + x, source + i * tile_width, tile_width);
+            }
+        }
+    }
+}
+
+void blend_row(uint8_t* destination, const uint8_t* source, const uint8_t* alpha, unsigned count)
+{
+    // d * (255 - a) + s * a fits 16 bits, and (t + 128 + ((t + 128) >> 8)) >> 8 divides it by 255, rounded
+    unsigned i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const auto d = __builtin_convertvector(load<u8x8>(destination + i), u16x8);
+        const auto s = __builtin_convertvector(load<u8x8>(source + i), u16x8);
+        const auto a = __builtin_convertvector(load<u8x8>(alpha + i), u16x8);
+        const auto t = d * (255 - a) + s * a + 128;
+        store(destination + i, __builtin_convertvector((t + (t >> 8)) >> 8, u8x8));
+    }
+    for (; i < count; i++) {
+        const unsigned t = destination[i] * (255 - alpha[i]) + source[i] * alpha[i] + 128;
+        destination[i] = (t + (t >> 8)) >> 8;
+    }
+}
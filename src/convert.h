@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+#include <va/va.h>
+}
+
+/**
+ * A region of a decoded 4:2:0 picture with interleaved chroma, starting at an even row and column, or one of four
+ * samples for `NV15`.
+ */
+struct ConvertSource {
+    const uint8_t* luma;
+    size_t luma_pitch;
+    const uint8_t* chroma;
+    size_t chroma_pitch;
+    /** `NV12`, or `P010` or `NV15` for 10 bits. */
+    uint32_t fourcc = VA_FOURCC_NV12;
+};
+
+/**
+ * The planes of a VAImage to convert into, in the order of the image's fourcc.
+ */
+struct ConvertDestination {
+    uint32_t fourcc;
+    uint8_t* planes[3];
+    size_t pitches[3];
+};
+
+/** Whether `convert_rows()` produces images of the `destination` VA fourcc from pictures of the `source` one. */
+bool convert_supported(uint32_t source, uint32_t destination);
+
+/**
+ * Convert rows `first` (even) to `last` of a `width` pixels wide region, reading each source byte once. RGB output uses
+ * BT.601 limited range coefficients; 10-bit pictures are only converted into `P010`.
+ */
+void convert_rows(
+    const ConvertDestination& destination, const ConvertSource& source, unsigned width, unsigned first, unsigned last);
+
+/** The destination rows from `rows` (even) on, for converting a region in parts. */
+ConvertDestination skip_rows(const ConvertDestination& destination, unsigned rows);
+
+/** A region of a picture to upload into, laid out like `ConvertSource`, starting at an even row and column. */
+struct UploadDestination {
+    uint8_t* luma;
+    size_t luma_pitch;
+    uint8_t* chroma;
+    size_t chroma_pitch;
+};
+
+/** The planes of a VAImage to upload from, in the order of the image's fourcc. */
+struct UploadSource {
+    uint32_t fourcc;
+    const uint8_t* planes[3];
+    size_t pitches[3];
+};
+
+/** Whether `upload_rows()` writes images of the `source` VA fourcc into pictures of the `destination` one. */
+bool upload_supported(uint32_t source, uint32_t destination);
+
+/**
+ * Convert rows `first` (even) to `last` of a `width` pixels wide region of an image into a picture, the inverse of
+ * `convert_rows()`. Chroma is averaged over each 2x2 block of pixels, for packed and RGB images.
+ */
+void upload_rows(
+    const UploadDestination& destination, const UploadSource& source, unsigned width, unsigned first, unsigned last);
+
+/**
+ * Copy `tile_rows` rows of tiles, each tile `tile_width` bytes by `tile_height` rows stored contiguously, into linear
+ * rows of the plane's `pitch`, reading the source sequentially.
+ */
+void detile_rows(uint8_t* destination, const uint8_t* source, size_t pitch, unsigned tile_width, unsigned tile_height,
+    unsigned tile_rows);
+
+/**
+ * Blend `count` bytes of `source` over `destination` by the matching bytes of `alpha`, 255 being opaque, as for
+ * compositing subpictures over a plane.
+ */
+void blend_row(uint8_t* destination, const uint8_t* source, const uint8_t* alpha, unsigned count);
@@ -0,0 +1,321 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "copy.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COPY_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define COPY_NEON
+#endif
+
+#include "utils.h"
+
+namespace {
+
+/* Distance in bytes at which source data is prefetched ahead of the loads. */
+constexpr size_t prefetch_distance = 512;
+
+/*
+ * On ARM, CAPTURE buffers are commonly mapped uncached. On x86 they are cached, where the C library's memcpy() beats
+ * the streaming loads, which only pay off for write-combined mappings; the x86 kernels have to be selected explicitly.
+ */
+#ifdef COPY_NEON
+const std::string default_kernel = "neon";
+#else
+const std::string default_kernel = "scalar";
+#endif
+
+void copy_scalar(uint8_t* destination, const uint8_t* source, size_t size)
+{
+    memcpy(destination, source, size);
+}
+
+/** Bytes to copy before `source` reaches the given alignment, bounded by `size`. */
+size_t head_size(const uint8_t* source, size_t alignment, size_t size)
+{
+    return std::min(size, (alignment - reinterpret_cast<uintptr_t>(source) % alignment) % alignment);
+}
+
+#ifdef COPY_X86
+
+__attribute__((target("sse4.1"))) void copy_sse41(uint8_t* destination, const uint8_t* source, size_t size)
+{
+    const auto head = head_size(source, 16, size);
+    memcpy(destination, source, head);
+    destination += head;
+    source += head;
+    size -= head;
+
+    for (; size >= 64; size -= 64, source += 64, destination += 64) {
+        _mm_prefetch(reinterpret_cast<const char*>(source + prefetch_distance), _MM_HINT_NTA);
+        auto src = reinterpret_cast<__m128i*>(const_cast<uint8_t*>(source));
+        const auto a = _mm_stream_load_si128(src);
+        const auto b = _mm_stream_load_si128(src + 1);
+        const auto c = _mm_stream_load_si128(src + 2);
+        const auto d = _mm_stream_load_si128(src + 3);
+        auto dst = reinterpret_cast<__m128i*>(destination);
+        _mm_storeu_si128(dst, a);
+        _mm_storeu_si128(dst + 1, b);
+        _mm_storeu_si128(dst + 2, c);
+        _mm_storeu_si128(dst + 3, d);
+    }
+    memcpy(destination, source, size);
+}
+
+__attribute__((target("avx2"))) void copy_avx2(uint8_t* destination, const uint8_t* source, size_t size)
+{
+    const auto head = head_size(source, 32, size);
+    memcpy(destination, source, head);
+    destination += head;
+    source += head;
+    size -= head;
+
+    for (; size >= 128; size -= 128, source += 128, destination += 128) {
+        _mm_prefetch(reinterpret_cast<const char*>(source + prefetch_distance), _MM_HINT_NTA);
+        _mm_prefetch(reinterpret_cast<const char*>(source + prefetch_distance + 64), _MM_HINT_NTA);
+        auto src = reinterpret_cast<__m256i*>(const_cast<uint8_t*>(source));
+        const auto a = _mm256_stream_load_si256(src);
+        const auto b = _mm256_stream_load_si256(src + 1);
+        const auto c = _mm256_stream_load_si256(src + 2);
+        const auto d = _mm256_stream_load_si256(src + 3);
+        auto dst = reinterpret_cast<__m256i*>(destination);
+        _mm256_storeu_si256(dst, a);
+        _mm256_storeu_si256(dst + 1, b);
+        _mm256_storeu_si256(dst + 2, c);
+        _mm256_storeu_si256(dst + 3, d);
+    }
+    memcpy(destination, source, size);
+}
+
+#endif
+
+#ifdef COPY_NEON
+
+void copy_neon(uint8_t* destination, const uint8_t* source, size_t size)
+{
+    const auto head = head_size(source, 64, size);
+    memcpy(destination, source, head);
+    destination += head;
+    source += head;
+    size -= head;
+
+    for (; size >= 64; size -= 64, source += 64, destination += 64) {
+        __builtin_prefetch(source + prefetch_distance, 0, 0);
+        const auto a = vld1q_u8(source);
+        const auto b = vld1q_u8(source + 16);
+        const auto c = vld1q_u8(source + 32);
+        const auto d = vld1q_u8(source + 48);
+        vst1q_u8(destination, a);
+        vst1q_u8(destination + 16, b);
+        vst1q_u8(destination + 32, c);
+        vst1q_u8(destination + 48, d);
+    }
+    memcpy(destination, source, size);
+}
+
+#endif
+
+std::vector<CopyKernel> detect_kernels()
+{
+    std::vector<CopyKernel> result = { { "scalar", copy_scalar } };
+#ifdef COPY_X86
+    if (__builtin_cpu_supports("sse4.1")) {
+        result.push_back({ "sse4.1", copy_sse41 });
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        result.push_back({ "avx2", copy_avx2 });
+    }
+#endif
+#ifdef COPY_NEON
+    result.push_back({ "neon", copy_neon });
+#endif
+    return result;
+}
+
+} // namespace
+
+std::span<const CopyKernel> copy_kernels()
+{
+    static const auto kernels = detect_kernels();
+    return kernels;
+}
+
+const CopyKernel& copy_kernel()
+{
+    static const CopyKernel& kernel = []() -> const CopyKernel& {
+        const auto kernels = copy_kernels();
+        const auto name = getenv_opt("LIBVA_V4L2_COPY").value_or(default_kernel);
+        const auto it = std::ranges::find_if(kernels, [&](auto&& kernel) { return name == kernel.name; });
+        return (it != kernels.end()) ? *it : kernels.front();
+    }();
+    return kernel;
+}
+
+void copy_plane(uint8_t* destination, size_t destination_pitch, const uint8_t* source, size_t source_pitch,
+    size_t width, size_t rows)
+{
+    const auto copy = copy_kernel().copy;
+
+    if (destination_pitch == source_pitch && width == source_pitch) {
+        copy(destination, source, width * rows);
+        return;
+    }
+    for (size_t row = 0; row < rows; row++) {
+        copy(destination + row * destination_pitch, source + row * source_pitch, width);
+    }
+}
+
+namespace {
+
+unsigned default_threads()
+{
+    return std::clamp(std::thread::hardware_concurrency(), 1u, 8u);
+}
+
+} // namespace
+
+CopyPool::CopyPool()
+    : CopyPool(strtoul(getenv_opt("LIBVA_V4L2_COPY_THREADS").value_or(std::to_string(default_threads())).c_str(),
+                   nullptr, 10),
+        strtoull(getenv_opt("LIBVA_V4L2_COPY_THRESHOLD").value_or("2097152").c_str(), nullptr, 10))
+{
+}
+
+CopyPool::CopyPool(unsigned threads, size_t threshold)
+    : threads_(std::max(threads, 1u))
+    , threshold_(threshold)
+{
+}
+
+CopyPool::~CopyPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto&& worker : workers) {
+        worker.join();
+    }
+}
+
+void CopyPool::start()
+{
+    if (workers.empty()) {
+        for (unsigned i = 1; i < threads_; i++) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+}
+
+/** Take bands of the current job until none are left. */
+void CopyPool::help()
+{
+    for (unsigned band; (band = next_band.fetch_add(1)) < bands;) {
+        (*job)(band, bands);
+
+        std::lock_guard<std::mutex> guard(mutex);
+        if (++done_bands == bands) {
+            finished.notify_all();
+        }
+    }
+}
+
+void CopyPool::work()
+{
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping) {
+            return;
+        }
+        seen = generation;
+        if (!job) {
+            continue; // Woke up after the job was finished by others.
+        }
+        active++;
+        lock.unlock();
+        help();
+        lock.lock();
+        if (--active == 0) {
+            finished.notify_all();
+        }
+    }
+}
+
+void CopyPool::run(unsigned count, const std::function<void(unsigned, unsigned)>& work)
+{
+    std::unique_lock<std::mutex> exclusive(busy, std::try_to_lock);
+    if (!exclusive || threads_ == 1 || count <= 1) {
+        for (unsigned band = 0; band < count; band++) {
+            work(band, count);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        start();
+        job = &work;
+        bands = count;
+        done_bands = 0;
+        next_band = 0;
+        generation++;
+    }
+    wake.notify_all();
+
+    help();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&] { return done_bands == bands && active == 0; });
+    job = nullptr;
+}
+
+void CopyPool::copy_plane(uint8_t* destination, size_t destination_pitch, const uint8_t* source, size_t source_pitch,
+    size_t width, size_t rows)
+{
+    if (threads_ == 1 || width * rows < threshold_) {
+        ::copy_plane(destination, destination_pitch, source, source_pitch, width, rows);
+        return;
+    }
+
+    run(std::min<size_t>(threads_, rows), [&](unsigned band, unsigned bands) {
+        const size_t first = rows * band / bands;
+        const size_t last = rows * (band + 1) / bands;
+        ::copy_plane(destination + first * destination_pitch, destination_pitch, source + first * source_pitch,
+            source_pitch, width, last - first);
+    });
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+/**
+ * Copy routine for reading back decoded pictures. CAPTURE buffers are frequently mapped uncached or write-combined,
+ * where ordinary loads are slow; the vector kernels use wide (and, on x86, non-temporal) loads with prefetching.
+ */
+struct CopyKernel {
+    const char* name;
+    void (*copy)(uint8_t* destination, const uint8_t* source, size_t size);
+};
+
+/** Kernels usable on this CPU, starting with the scalar fallback. */
+std::span<const CopyKernel> copy_kernels();
+
+/** The kernel used by `copy_plane()`: the platform's default, unless `LIBVA_V4L2_COPY` names another. */
+const CopyKernel& copy_kernel();
+
+/**
+ * Copy `rows` rows of `width` bytes between planes of possibly different pitches.
+ */
+void copy_plane(uint8_t* destination, size_t destination_pitch, const uint8_t* source, size_t source_pitch,
+    size_t width, size_t rows);
+
+/**
+ * Worker threads that split large plane copies into row bands, so that readback of 4K and larger pictures is not
+ * bound to the bandwidth of a single core. Threads are started on first use.
+ *
+ * Configured through `LIBVA_V4L2_COPY_THREADS` (total threads including the caller, default: online CPUs, at most 8;
+ * 1 disables the pool) and `LIBVA_V4L2_COPY_THRESHOLD` (plane size in bytes from which copies are split, default
+ * 2 MiB).
+ */
+class CopyPool {
+public:
+    CopyPool();
+    CopyPool(unsigned threads, size_t threshold);
+    ~CopyPool();
+
+    CopyPool(const CopyPool&) = delete;
+    CopyPool& operator=(const CopyPool&) = delete;
+
+    /** `copy_plane()`, spread over the pool when the plane is large enough. */
+    void copy_plane(uint8_t* destination, size_t destination_pitch, const uint8_t* source, size_t source_pitch,
+        size_t width, size_t rows);
+
+    /**
+     * Call `work(band, bands)` for each of `bands` bands, on the workers and the calling thread. Runs everything on the
+     * calling thread while another caller is using the pool.
+     */
+    void run(unsigned bands, const std::function<void(unsigned, unsigned)>& work);
+
+    unsigned threads() const { return threads_; }
+    size_t threshold() const { return threshold_; }
+
+private:
+    void start();
+    void work();
+    void help();
+
+    const unsigned threads_;
+    const size_t threshold_;
+
+    std::mutex busy;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    /*
+     * The current job, guarded by `mutex`. `job` and `bands` don't change while workers are `active`, which the
+     * caller waits for before returning.
+     */
+    const std::function<void(unsigned, unsigned)>* job = nullptr;
+    uint64_t generation = 0;
+    unsigned bands = 0;
+    std::atomic<unsigned> next_band = 0;
+    unsigned done_bands = 0;
+    unsigned active = 0;
+};
@@ -27,6 +27,7 @@
 
 #include "driver.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstdarg>
 #include <cstdio>
@@ -39,6 +40,7 @@ extern "C" {
 #include <sys/ioctl.h>
 #include <unistd.h>
 
+#include <libdrm/drm_fourcc.h>
 #include <va/va.h>
 #include <va/va_backend.h>
 }
@@ -46,28 +48,49 @@ extern "C" {
 #include "buffer.h"
 #include "config.h"
 #include "context.h"
+#include "format.h"
 #include "image.h"
+#include "log.h"
 #include "picture.h"
 #include "subpicture.h"
 #include "surface.h"
 #include "utils.h"
-
-namespace {
-
-std::optional<std::string> getenv_opt(const std::string& name)
+#include "vpp.h"
+
+DriverData::DriverData(VADriverContextP va_context,
+    const std::vector<std::pair<std::string, std::optional<std::string>>>& device_paths,
+    const std::vector<std::string>& processor_paths)
+    : va_context(va_context)
+    , statistics(getenv_opt("LIBVA_V4L2_STATS_SHM"))
+    , capture(Capture::open(va_context, getenv_opt("LIBVA_V4L2_CAPTURE")))
+    , devices()
 {
-    auto val = getenv(name.c_str());
-    return val ? std::optional<std::string>(val) : std::optional<std::string>();
-}
+    if (const auto value = getenv_opt("LIBVA_V4L2_NON_COHERENT"); value) {
+        non_coherent = (value != "0");
+    }
 
-} // namespace
+    dma_heap = DmaHeap::open(getenv_opt("LIBVA_V4L2_DMA_HEAP").value_or("system"));
+    if (!dma_heap) {
+        info_log(va_context, "No dma-buf heap, images can't be shared as dma-bufs\n");
+    }
 
-DriverData::DriverData(const std::vector<std::pair<std::string, std::optional<std::string>>>& device_paths)
-    : devices()
-{
     for (auto&& [video_path, media_path] : device_paths) {
         devices.emplace_back(video_path, media_path);
     }
+    for (auto&& video_path : processor_paths) {
+        processors.emplace_back(video_path, std::nullopt);
+    }
+
+    drm_modifiers.push_back(DRM_FORMAT_MOD_LINEAR);
+    for (auto&& format : formats) {
+        if (format.drm.modifier != DRM_FORMAT_MOD_LINEAR && format.drm.modifier != DRM_FORMAT_MOD_INVALID
+            && std::ranges::find(drm_modifiers, format.drm.modifier) == drm_modifiers.end()
+            && std::ranges::any_of(devices,
+                [&](auto&& device) { return device.format_supported(device.capture_buf_type, format.v4l2.format); })) {
+            drm_modifiers.push_back(format.drm.modifier);
+        }
+    }
+    drm_modifier_list = { static_cast<uint32_t>(drm_modifiers.size()), drm_modifiers.data() };
 }
 
 /* Set default visibility for the init function only. */
@@ -75,8 +98,9 @@ VAStatus __attribute__((visibility("default"))) VA_DRIVER_INIT_FUNC(VADriverCont
 
 extern "C" VAStatus VA_DRIVER_INIT_FUNC(VADriverContextP context)
 {
+    log_init();
 
-    auto devices = V4L2M2MDevice::enumerate_devices();
+    auto devices = V4L2M2MDevice::enumerate_devices(getenv_opt("LIBVA_V4L2_DEVICE_DRIVER"));
 
     if (const auto video_path_env = getenv_opt("LIBVA_V4L2_VIDEO_PATH"); video_path_env) {
         const auto media_path_env = getenv_opt("LIBVA_V4L2_MEDIA_PATH");
@@ -85,7 +109,14 @@ extern "C" VAStatus VA_DRIVER_INIT_FUNC(VADriverContextP context)
         devices.clear();
         devices.push_back({ video_path_env.value(), media_path_env });
     }
-    auto driver_data = new DriverData(devices);
+
+    auto processors = V4L2M2MDevice::enumerate_processors();
+    if (const auto vpp_path_env = getenv_opt("LIBVA_V4L2_VPP_PATH"); vpp_path_env) {
+        info_log(context, "Overriding V4L2 video processing device with %s.\n", vpp_path_env.value().c_str());
+        processors.assign(1, vpp_path_env.value());
+    }
+
+    auto driver_data = new DriverData(context, devices, processors);
 
     struct VADriverVTable* vtable = context->vtable;
 
@@ -149,6 +180,17 @@ extern "C" VAStatus VA_DRIVER_INIT_FUNC(VADriverContextP context)
     vtable->vaLockSurface = lockSurface;
     vtable->vaUnlockSurface = unlockSurface;
 
+    if (struct VADriverVTableVPP* vtable_vpp = context->vtable_vpp; vtable_vpp) {
+        vtable_vpp->version = VA_DRIVER_VTABLE_VPP_VERSION;
+        vtable_vpp->vaQueryVideoProcFilters = queryVideoProcFilters;
+        vtable_vpp->vaQueryVideoProcFilterCaps = queryVideoProcFilterCaps;
+        vtable_vpp->vaQueryVideoProcPipelineCaps = queryVideoProcPipelineCaps;
+    }
+
+    if (driver_data->capture) {
+        capture_install(vtable);
+    }
+
     context->pDriverData = driver_data;
 
     return VA_STATUS_SUCCESS;
@@ -158,28 +200,43 @@ VAStatus terminate(VADriverContextP va_context)
 {
     auto driver_data = static_cast<DriverData*>(va_context->pDriverData);
 
-    /* Cleanup leftover buffers. */
-    for (auto&& [id, config] : driver_data->configs) {
-        destroyConfig(va_context, id);
+    /*
+     * Cleanup leftover buffers, images first as those derived from surfaces keep them and their contexts busy. The
+     * destroy functions erase the entry, so iterators are advanced past it first.
+     */
+    for (auto&& [id, surface] : driver_data->surfaces) {
+        if (surface.locked_image) {
+            unlockSurface(va_context, id);
+        }
     }
 
-    for (auto&& [id, ctx] : driver_data->contexts) {
-        destroyContext(va_context, id);
+    for (auto it = driver_data->images.begin(); it != driver_data->images.end();) {
+        destroyImage(va_context, (it++)->first);
     }
 
-    for (auto&& [id, surface] : driver_data->surfaces) {
-        VASurfaceID id_ = id;
-        destroySurfaces(va_context, &id_, 1);
+    for (auto it = driver_data->configs.begin(); it != driver_data->configs.end();) {
+        destroyConfig(va_context, (it++)->first);
     }
 
-    for (auto&& [id, buffer] : driver_data->buffers) {
-        destroyBuffer(va_context, id);
+    for (auto it = driver_data->contexts.begin(); it != driver_data->contexts.end();) {
+        destroyContext(va_context, (it++)->first);
     }
 
-    for (auto&& [id, image] : driver_data->images) {
-        destroyImage(va_context, id);
+    for (auto it = driver_data->surfaces.begin(); it != driver_data->surfaces.end();) {
+        VASurfaceID id = (it++)->first;
+        destroySurfaces(va_context, &id, 1);
     }
 
+    for (auto it = driver_data->buffers.begin(); it != driver_data->buffers.end();) {
+        destroyBuffer(va_context, (it++)->first);
+    }
+
+    if (getenv_opt("LIBVA_V4L2_STATS")) {
+        driver_data->statistics.dump(va_context);
+    }
+
+    log_flush();
+
     delete driver_data;
     va_context->pDriverData = nullptr;
 
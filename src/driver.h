@@ -27,40 +27,73 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
 
 extern "C" {
 #include <linux/videodev2.h>
 
 #include <va/va.h>
+#include <va/va_drmcommon.h>
 }
 
 #include "buffer.h"
+#include "capture.h"
 #include "config.h"
+#include "copy.h"
 #include "context.h"
+#include "heap.h"
+#include "stats.h"
+#include "subpicture.h"
 #include "surface.h"
 #include "v4l2.h"
 
 class Context;
 
 #define V4L2_STR_VENDOR "v4l2"
-#define V4L2_MAX_PROFILES 11
+#define V4L2_MAX_PROFILES 12
 #define V4L2_MAX_ENTRYPOINTS 5
 #define V4L2_MAX_IMAGE_FORMATS 10
 #define V4L2_MAX_SUBPIC_FORMATS 4
 #define V4L2_MAX_DISPLAY_ATTRIBUTES 4
 
 struct DriverData {
-    DriverData(const std::vector<std::pair<std::string, std::optional<std::string>>>& device_paths);
+    DriverData(VADriverContextP va_context,
+        const std::vector<std::pair<std::string, std::optional<std::string>>>& device_paths,
+        const std::vector<std::string>& processor_paths);
 
+    /** Owning libVA context, for logging from code that is not handed one. */
+    VADriverContextP va_context;
+    Statistics statistics;
+    std::unique_ptr<Capture> capture;
     std::map<VAConfigID, Config> configs;
     std::map<VAContextID, std::unique_ptr<Context>> contexts;
     std::map<VASurfaceID, Surface> surfaces;
     std::map<VABufferID, Buffer> buffers;
     std::map<VAImageID, VAImage> images;
+    /** Colors of palettized images as `0xRRGGBB`, black until set with `vaSetImagePalette()`. */
+    std::map<VAImageID, std::array<uint32_t, 16>> palettes;
+    std::map<VASubpictureID, Subpicture> subpictures;
     std::vector<V4L2M2MDevice> devices;
+    /** Scalers and color converters for `VAEntrypointVideoProc`. */
+    std::vector<V4L2M2MDevice> processors;
+    CopyPool copy_pool;
+    /**
+     * Whether CAPTURE buffers are allocated non-coherent, i.e. cached for the CPU: always or never as set with
+     * `LIBVA_V4L2_NON_COHERENT` (`1` or `0`), otherwise for contexts created after the application first accessed
+     * pictures on the CPU, as recorded in `cpu_access`.
+     */
+    std::optional<bool> non_coherent;
+    std::atomic<bool> cpu_access = false;
+    /** Heap image buffers are allocated from, to be shareable with `vaAcquireBufferHandle()`, if available. */
+    std::unique_ptr<DmaHeap> dma_heap;
+    /** DRM format modifiers of the CAPTURE formats the devices offer, as advertised by `querySurfaceAttributes()`. */
+    std::vector<uint64_t> drm_modifiers;
+    VADRMFormatModifierList drm_modifier_list;
     std::mutex mutex;
 };
 
@@ -0,0 +1,1482 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "fake.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+
+extern "C" {
+#include <fcntl.h>
+#include <linux/dma-heap.h>
+#include <linux/media.h>
+#include <linux/videodev2.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+}
+
+#include "format.h"
+#include "utils.h"
+
+namespace {
+
+constexpr unsigned max_buffers = 32;
+constexpr uint32_t default_width = 1280;
+constexpr uint32_t default_height = 720;
+constexpr uint32_t default_coded_size = 1024 * 1024;
+constexpr uint32_t buffer_capabilities
+    = V4L2_BUF_CAP_SUPPORTS_MMAP | V4L2_BUF_CAP_SUPPORTS_REQUESTS | V4L2_BUF_CAP_SUPPORTS_MMAP_CACHE_HINTS;
+constexpr uint32_t processor_buffer_capabilities
+    = V4L2_BUF_CAP_SUPPORTS_MMAP | V4L2_BUF_CAP_SUPPORTS_DMABUF | V4L2_BUF_CAP_SUPPORTS_MMAP_CACHE_HINTS;
+
+/* Raw formats the processor takes and produces. */
+constexpr uint32_t processor_formats[] = { V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_NV12M };
+
+const std::string video_path = "fake:video0";
+const std::string media_path = "fake:media0";
+const std::string processor_path = "fake:video1";
+const std::string heap_prefix = "/dev/dma_heap/";
+
+std::vector<uint32_t> parse_formats(const std::optional<std::string>& value, const std::string& fallback)
+{
+    const auto list = value.value_or(fallback);
+    std::vector<uint32_t> result;
+
+    for (size_t start = 0; start <= list.size();) {
+        auto end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        if (end - start == 4) {
+            result.push_back(v4l2_fourcc(list[start], list[start + 1], list[start + 2], list[start + 3]));
+        }
+        start = end + 1;
+    }
+
+    return result;
+}
+
+FakeBackend::Config read_config()
+{
+    return {
+        .output_formats = parse_formats(getenv_opt("LIBVA_V4L2_FAKE_OUTPUT_FORMATS"), "MG2S,S264,VP8F,VP9F"),
+        .capture_formats = parse_formats(getenv_opt("LIBVA_V4L2_FAKE_CAPTURE_FORMATS"), "NV12"),
+        .decode_time = std::chrono::microseconds(
+            strtoul(getenv_opt("LIBVA_V4L2_FAKE_DECODE_TIME_US").value_or("0").c_str(), nullptr, 10)),
+        .h264_decode_mode = (getenv_opt("LIBVA_V4L2_FAKE_H264_DECODE_MODE").value_or("frame") == "slice")
+            ? V4L2_STATELESS_H264_DECODE_MODE_SLICE_BASED
+            : V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED,
+        .pitch_alignment = static_cast<unsigned>(std::max(
+            1ul, strtoul(getenv_opt("LIBVA_V4L2_FAKE_PITCH_ALIGNMENT").value_or("64").c_str(), nullptr, 10))),
+        .processor = getenv_opt("LIBVA_V4L2_FAKE_PROCESSOR").value_or("0") != "0",
+    };
+}
+
+int fail(int error)
+{
+    errno = error;
+    return -1;
+}
+
+/* Validation mirrors (a subset of) std_validate_compound() in drivers/media/v4l2-core/v4l2-ctrls-core.c. */
+
+bool validate_mpeg2_sequence(const void* data)
+{
+    auto sequence = static_cast<const v4l2_ctrl_mpeg2_sequence*>(data);
+    return sequence->chroma_format >= 1 && sequence->chroma_format <= 3;
+}
+
+bool validate_mpeg2_picture(const void* data)
+{
+    auto picture = static_cast<const v4l2_ctrl_mpeg2_picture*>(data);
+    return picture->picture_structure >= V4L2_MPEG2_PIC_TOP_FIELD && picture->picture_structure <= V4L2_MPEG2_PIC_FRAME
+        && picture->picture_coding_type >= V4L2_MPEG2_PIC_CODING_TYPE_I
+        && picture->picture_coding_type <= V4L2_MPEG2_PIC_CODING_TYPE_B;
+}
+
+bool validate_h264_sps(const void* data)
+{
+    auto sps = static_cast<const v4l2_ctrl_h264_sps*>(data);
+    return sps->chroma_format_idc <= 3 && sps->bit_depth_luma_minus8 <= 6 && sps->bit_depth_chroma_minus8 <= 6
+        && sps->log2_max_frame_num_minus4 <= 12 && sps->pic_order_cnt_type <= 2
+        && sps->log2_max_pic_order_cnt_lsb_minus4 <= 12 && sps->max_num_ref_frames <= V4L2_H264_REF_LIST_LEN;
+}
+
+bool validate_h264_pps(const void* data)
+{
+    auto pps = static_cast<const v4l2_ctrl_h264_pps*>(data);
+    return pps->num_ref_idx_l0_default_active_minus1 < V4L2_H264_REF_LIST_LEN
+        && pps->num_ref_idx_l1_default_active_minus1 < V4L2_H264_REF_LIST_LEN && pps->weighted_bipred_idc <= 2;
+}
+
+bool validate_vp8_frame(const void* data)
+{
+    auto frame = static_cast<const v4l2_ctrl_vp8_frame*>(data);
+    return frame->width > 0 && frame->height > 0 && frame->version <= 3
+        && (frame->num_dct_parts == 1 || frame->num_dct_parts == 2 || frame->num_dct_parts == 4
+            || frame->num_dct_parts == 8);
+}
+
+bool validate_vp9_frame(const void* data)
+{
+    auto frame = static_cast<const v4l2_ctrl_vp9_frame*>(data);
+    return frame->profile <= 3 && (frame->bit_depth == 8 || frame->bit_depth == 10 || frame->bit_depth == 12)
+        && frame->interpolation_filter <= V4L2_VP9_INTERP_FILTER_SWITCHABLE && frame->reset_frame_context <= 2;
+}
+
+bool validate_vp9_compressed_hdr(const void* data)
+{
+    auto hdr = static_cast<const v4l2_ctrl_vp9_compressed_hdr*>(data);
+    return hdr->tx_mode <= V4L2_VP9_TX_MODE_SELECT;
+}
+
+bool validate_fwht_params(const void* data)
+{
+    auto params = static_cast<const v4l2_ctrl_fwht_params*>(data);
+    // The uAPI mask needs GENMASK()
+    const auto components = (params->flags >> V4L2_FWHT_FL_COMPONENTS_NUM_OFFSET) & 0x7;
+    return params->version == V4L2_FWHT_VERSION && params->width > 0 && params->height > 0 && components >= 1
+        && components <= 4;
+}
+
+struct ControlInfo {
+    uint32_t id;
+    uint32_t coded_format;
+    size_t size;
+    bool required;
+    bool (*validate)(const void* data);
+};
+
+const ControlInfo control_infos[] = {
+    { V4L2_CID_STATELESS_MPEG2_SEQUENCE, V4L2_PIX_FMT_MPEG2_SLICE, sizeof(v4l2_ctrl_mpeg2_sequence), true,
+        validate_mpeg2_sequence },
+    { V4L2_CID_STATELESS_MPEG2_PICTURE, V4L2_PIX_FMT_MPEG2_SLICE, sizeof(v4l2_ctrl_mpeg2_picture), true,
+        validate_mpeg2_picture },
+    { V4L2_CID_STATELESS_MPEG2_QUANTISATION, V4L2_PIX_FMT_MPEG2_SLICE, sizeof(v4l2_ctrl_mpeg2_quantisation), false,
+        nullptr },
+    { V4L2_CID_STATELESS_H264_SPS, V4L2_PIX_FMT_H264_SLICE, sizeof(v4l2_ctrl_h264_sps), true, validate_h264_sps },
+    { V4L2_CID_STATELESS_H264_PPS, V4L2_PIX_FMT_H264_SLICE, sizeof(v4l2_ctrl_h264_pps), true, validate_h264_pps },
+    { V4L2_CID_STATELESS_H264_SCALING_MATRIX, V4L2_PIX_FMT_H264_SLICE, sizeof(v4l2_ctrl_h264_scaling_matrix), false,
+        nullptr },
+    { V4L2_CID_STATELESS_H264_PRED_WEIGHTS, V4L2_PIX_FMT_H264_SLICE, sizeof(v4l2_ctrl_h264_pred_weights), false,
+        nullptr },
+    { V4L2_CID_STATELESS_H264_SLICE_PARAMS, V4L2_PIX_FMT_H264_SLICE, sizeof(v4l2_ctrl_h264_slice_params), false,
+        nullptr },
+    { V4L2_CID_STATELESS_H264_DECODE_PARAMS, V4L2_PIX_FMT_H264_SLICE, sizeof(v4l2_ctrl_h264_decode_params), true,
+        nullptr },
+    { V4L2_CID_STATELESS_VP8_FRAME, V4L2_PIX_FMT_VP8_FRAME, sizeof(v4l2_ctrl_vp8_frame), true, validate_vp8_frame },
+    { V4L2_CID_STATELESS_VP9_FRAME, V4L2_PIX_FMT_VP9_FRAME, sizeof(v4l2_ctrl_vp9_frame), true, validate_vp9_frame },
+    { V4L2_CID_STATELESS_VP9_COMPRESSED_HDR, V4L2_PIX_FMT_VP9_FRAME, sizeof(v4l2_ctrl_vp9_compressed_hdr), false,
+        validate_vp9_compressed_hdr },
+    { V4L2_CID_STATELESS_FWHT_PARAMS, V4L2_PIX_FMT_FWHT_STATELESS, sizeof(v4l2_ctrl_fwht_params), true,
+        validate_fwht_params },
+};
+
+const ControlInfo* lookup_control(const FakeBackend::Config& config, uint32_t id)
+{
+    auto it = std::ranges::find_if(control_infos, [&](auto&& info) {
+        return info.id == id
+            && std::ranges::find(config.output_formats, info.coded_format) != config.output_formats.end();
+    });
+    return (it != std::end(control_infos)) ? &*it : nullptr;
+}
+
+bool control_required(const FakeBackend::Config& config, const ControlInfo& info)
+{
+    if (info.id == V4L2_CID_STATELESS_H264_SLICE_PARAMS) {
+        return config.h264_decode_mode == V4L2_STATELESS_H264_DECODE_MODE_SLICE_BASED;
+    }
+    return info.required;
+}
+
+/**
+ * Fill in the plane layout the way typical stateless decoders do: pictures are padded to whole macroblocks, rows to the
+ * pitch alignment, like DMA engines commonly require. Larger pitches asked for are kept.
+ */
+void fill_format(v4l2_pix_format_mplane& format, bool capture, unsigned pitch_alignment, unsigned pitch = 0)
+{
+    if (!capture) {
+        format.num_planes = 1;
+        format.plane_fmt[0].bytesperline = 0;
+        format.plane_fmt[0].sizeimage = std::max(format.plane_fmt[0].sizeimage, default_coded_size);
+        return;
+    }
+
+    auto it = std::ranges::find_if(formats, [&](auto&& f) { return f.v4l2.format == format.pixelformat; });
+    const auto& spec = (it != formats.end()) ? *it : lookup_format(V4L2_PIX_FMT_NV12);
+    const auto block = std::max(16u, unsigned(spec.tile.height));
+    format.width = (format.width + 15) & ~15u;
+    format.height = (format.height + block - 1) / block * block;
+
+    auto row_size = spec.planes[0].row_size(format.width);
+    if (spec.tiled()) {
+        row_size = (row_size + spec.tile.width - 1) / spec.tile.width * spec.tile.width;
+    }
+    const auto layout = derive_layout(spec,
+        std::max(pitch, (row_size + pitch_alignment - 1) / pitch_alignment * pitch_alignment), format.height);
+    if (spec.v4l2.multiplanar) {
+        format.num_planes = layout.size();
+        for (unsigned i = 0; i < layout.size(); i++) {
+            format.plane_fmt[i] = { .sizeimage = layout[i].size, .bytesperline = layout[i].pitch };
+        }
+    } else {
+        format.num_planes = 1;
+        format.plane_fmt[0] = { .sizeimage = layout.back().offset + layout.back().size,
+            .bytesperline = layout[0].pitch };
+    }
+}
+
+/** Flips and rotation (clockwise, in degrees) the processor applies, in this order. */
+struct Transform {
+    bool hflip;
+    bool vflip;
+    int32_t rotate;
+};
+
+/**
+ * Scale the `crop` rectangle of a picture into the `compose` rectangle of another by nearest neighbour. Both are
+ * `NV12` or `NV12M`, given by the start of their memory planes.
+ */
+void scale_picture(std::span<uint8_t* const> source, const v4l2_pix_format_mplane& source_format, const v4l2_rect& crop,
+    std::span<uint8_t* const> destination, const v4l2_pix_format_mplane& destination_format, const v4l2_rect& compose,
+    const Transform& transform)
+{
+    const auto source_layout = derive_layout(lookup_format(source_format.pixelformat), source_format);
+    const auto destination_layout = derive_layout(lookup_format(destination_format.pixelformat), destination_format);
+
+    // Chroma has pairs of bytes at half the resolution
+    for (unsigned plane = 0; plane < 2; plane++) {
+        const unsigned scale = plane + 1;
+        const auto& from = source_layout[plane];
+        const auto& to = destination_layout[plane];
+        const uint8_t* input = source[from.physical_plane_index] + from.offset + crop.top / scale * from.pitch
+            + crop.left / scale * scale;
+        uint8_t* output = destination[to.physical_plane_index] + to.offset + compose.top / scale * to.pitch
+            + compose.left / scale * scale;
+        const unsigned input_width = std::max(crop.width / scale, 1u);
+        const unsigned input_height = std::max(crop.height / scale, 1u);
+        const unsigned output_width = compose.width / scale;
+        const unsigned output_height = compose.height / scale;
+
+        for (unsigned y = 0; y < output_height; y++) {
+            for (unsigned x = 0; x < output_width; x++) {
+                // Back from the sample's center in the output to the flipped input, in units of the rectangles
+                const double u = (x + 0.5) / output_width;
+                const double v = (y + 0.5) / output_height;
+                double s = u;
+                double t = v;
+                switch (transform.rotate) {
+                case 90:
+                    s = v;
+                    t = 1 - u;
+                    break;
+                case 180:
+                    s = 1 - u;
+                    t = 1 - v;
+                    break;
+                case 270:
+                    s = 1 - v;
+                    t = u;
+                    break;
+                }
+                s = transform.hflip ? 1 - s : s;
+                t = transform.vflip ? 1 - t : t;
+
+                const auto input_x = std::min(static_cast<unsigned>(s * input_width), input_width - 1);
+                const auto input_y = std::min(static_cast<unsigned>(t * input_height), input_height - 1);
+                memcpy(output + y * to.pitch + x * scale, input + input_y * from.pitch + input_x * scale, scale);
+            }
+        }
+    }
+}
+
+} // namespace
+
+class FakeBackend::File {
+public:
+    File()
+        : fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+    {
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
+    virtual ~File() { ::close(fd); }
+
+    virtual int ioctl(unsigned long, void*) { return fail(ENOTTY); }
+
+    const int fd;
+};
+
+class FakeBackend::Request : public File, public std::enable_shared_from_this<Request> {
+public:
+    enum class State {
+        Idle,
+        Queued,
+        Complete,
+    };
+
+    int ioctl(unsigned long request, void* arg) override;
+
+    int reinit()
+    {
+        uint64_t value;
+
+        if (state == State::Queued) {
+            return fail(EBUSY);
+        }
+        if (read(fd, &value, sizeof(value)) < 0) {
+            // Not completed yet, nothing to reset.
+        }
+        state = State::Idle;
+        controls.clear();
+        output_index.reset();
+        return 0;
+    }
+
+    void complete()
+    {
+        const uint64_t value = 1;
+        state = State::Complete;
+        if (write(fd, &value, sizeof(value)) < 0) {
+            // The counter cannot overflow for a single completion.
+        }
+    }
+
+    /* Guarded by the mutex of the bound device. */
+    State state = State::Idle;
+    std::map<uint32_t, std::vector<uint8_t>> controls;
+    std::optional<unsigned> output_index;
+
+    /* The device the request was first used with. */
+    std::mutex binding_mutex;
+    std::weak_ptr<Video> video;
+};
+
+class FakeBackend::Media : public File {
+public:
+    explicit Media(FakeBackend& backend)
+        : backend(backend)
+    {
+    }
+
+    int ioctl(unsigned long request, void* arg) override
+    {
+        if (request != MEDIA_IOC_REQUEST_ALLOC) {
+            return fail(ENOTTY);
+        }
+        *static_cast<int*>(arg) = backend.insert(std::make_shared<Request>());
+        return 0;
+    }
+
+private:
+    FakeBackend& backend;
+};
+
+/* Any dma-buf heap, handing out memfds, which the driver maps and shares like dma-bufs. */
+class FakeBackend::Heap : public File {
+public:
+    int ioctl(unsigned long request, void* arg) override
+    {
+        if (request != DMA_HEAP_IOCTL_ALLOC) {
+            return fail(ENOTTY);
+        }
+        auto allocation = static_cast<dma_heap_allocation_data*>(arg);
+        const int memfd = memfd_create("libva-v4l2-fake-heap", (allocation->fd_flags & O_CLOEXEC) ? MFD_CLOEXEC : 0);
+        if (memfd < 0) {
+            return -1;
+        }
+        if (ftruncate(memfd, allocation->len) < 0) {
+            const int error = errno;
+            ::close(memfd);
+            return fail(error);
+        }
+        allocation->fd = memfd;
+        return 0;
+    }
+};
+
+class FakeBackend::Video : public File, public std::enable_shared_from_this<Video> {
+public:
+    Video(FakeBackend& backend, bool nonblocking, bool processor);
+    ~Video() override;
+
+    int ioctl(unsigned long request, void* arg) override;
+    int queue_request(Request& request);
+    int reinit_request(Request& request);
+    void* mmap(size_t length, int prot, int flags, off_t offset);
+
+private:
+    struct Plane {
+        /** The imported dma-buf with `V4L2_MEMORY_DMABUF`, -1 until queued. */
+        int memfd;
+        size_t length;
+        uint32_t bytesused;
+    };
+
+    struct BufferState {
+        enum { Dequeued, Queued, Done } state = Dequeued;
+        std::vector<Plane> planes;
+        timeval timestamp = {};
+        uint32_t flags = 0;
+    };
+
+    struct Queue {
+        v4l2_format format = {};
+        std::vector<BufferState> buffers;
+        std::deque<unsigned> queued;
+        std::deque<unsigned> done;
+        bool streaming = false;
+        uint32_t memory = V4L2_MEMORY_MMAP;
+    };
+
+    static uint32_t mem_offset(bool capture, unsigned index, unsigned plane)
+    {
+        return ((((capture ? 1u : 0u) << 8 | index) << 4) | plane) * 4096;
+    }
+
+    Queue* queue(uint32_t type);
+    void free_buffers(Queue& queue);
+    bool ready() const;
+    void update_readable();
+    void run();
+    bool process(const BufferState& source, const BufferState& destination);
+
+    int querycap(v4l2_capability& capability);
+    int enum_fmt(v4l2_fmtdesc& fmtdesc);
+    int s_fmt(v4l2_format& format);
+    int reqbufs(v4l2_requestbuffers& requestbuffers);
+    int querybuf(v4l2_buffer& buffer);
+    int qbuf(v4l2_buffer& buffer);
+    int queue_picture(v4l2_buffer& buffer, BufferState& state);
+    int dqbuf(v4l2_buffer& buffer);
+    int expbuf(v4l2_exportbuffer& exportbuffer);
+    int streamon(uint32_t type, bool enable);
+    int g_ctrl(v4l2_control& control);
+    int g_selection(v4l2_selection& selection);
+    int s_selection(v4l2_selection& selection);
+    int s_ext_ctrls(v4l2_ext_controls& controls);
+
+    FakeBackend& backend;
+    const bool nonblocking;
+    /** A scaler without requests instead of a decoder. */
+    const bool processor;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    Queue output;
+    Queue capture;
+    /** The requested picture size, which CAPTURE pads to the block size like decoders do. */
+    v4l2_rect compose = { .width = default_width, .height = default_height };
+    /** The part of OUTPUT pictures the processor scales into the compose rectangle. */
+    v4l2_rect crop = { .width = default_width, .height = default_height };
+    Transform transform = {};
+    std::deque<std::shared_ptr<Request>> pending;
+    std::map<uint32_t, std::vector<uint8_t>> controls;
+    bool stopping = false;
+    /** Whether the descriptor polls readable, as it does while CAPTURE buffers are done. */
+    bool readable = false;
+    std::thread worker;
+};
+
+FakeBackend::Video::Video(FakeBackend& backend, bool nonblocking, bool processor)
+    : backend(backend)
+    , nonblocking(nonblocking)
+    , processor(processor)
+{
+    const auto& config = backend.config;
+
+    output.format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    output.format.fmt.pix_mp = {
+        .width = default_width,
+        .height = default_height,
+        .pixelformat = processor              ? processor_formats[0]
+            : config.output_formats.empty() ? 0
+                                            : config.output_formats[0],
+    };
+    fill_format(output.format.fmt.pix_mp, processor, config.pitch_alignment);
+
+    capture.format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    capture.format.fmt.pix_mp = {
+        .width = default_width,
+        .height = default_height,
+        .pixelformat = processor              ? processor_formats[0]
+            : config.capture_formats.empty() ? 0
+                                             : config.capture_formats[0],
+    };
+    fill_format(capture.format.fmt.pix_mp, true, config.pitch_alignment);
+
+    worker = std::thread([this] { run(); });
+}
+
+FakeBackend::Video::~Video()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+
+    free_buffers(output);
+    free_buffers(capture);
+}
+
+FakeBackend::Video::Queue* FakeBackend::Video::queue(uint32_t type)
+{
+    switch (type) {
+    case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+        return &output;
+    case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
+        return &capture;
+    default:
+        return nullptr;
+    }
+}
+
+void FakeBackend::Video::free_buffers(Queue& queue)
+{
+    for (auto&& buffer : queue.buffers) {
+        for (auto&& plane : buffer.planes) {
+            if (plane.memfd >= 0) {
+                ::close(plane.memfd);
+            }
+        }
+    }
+    queue.buffers.clear();
+    queue.queued.clear();
+    queue.done.clear();
+    update_readable();
+}
+
+bool FakeBackend::Video::ready() const
+{
+    const bool input = processor ? !output.queued.empty() : !pending.empty();
+    return input && output.streaming && capture.streaming && !capture.queued.empty();
+}
+
+void FakeBackend::Video::update_readable()
+{
+    uint64_t value = 1;
+
+    if (capture.done.empty() == !readable) {
+        return;
+    }
+    readable = !readable;
+    if (readable ? write(fd, &value, sizeof(value)) < 0 : read(fd, &value, sizeof(value)) < 0) {
+        // The counter only ever holds one, and is known to be set when reset.
+    }
+}
+
+void FakeBackend::Video::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        wake.wait(lock, [this] { return stopping || ready(); });
+        if (stopping) {
+            return;
+        }
+
+        if (processor) {
+            const unsigned output_index = output.queued.front();
+            output.queued.pop_front();
+            const unsigned capture_index = capture.queued.front();
+            capture.queued.pop_front();
+
+            auto& source = output.buffers[output_index];
+            auto& destination = capture.buffers[capture_index];
+            destination.flags = process(source, destination) ? 0 : V4L2_BUF_FLAG_ERROR;
+            destination.timestamp = source.timestamp;
+            for (auto&& plane : destination.planes) {
+                plane.bytesused = plane.length;
+            }
+            source.state = BufferState::Done;
+            output.done.push_back(output_index);
+            destination.state = BufferState::Done;
+            capture.done.push_back(capture_index);
+            update_readable();
+            done.notify_all();
+            continue;
+        }
+
+        auto request = std::move(pending.front());
+        pending.pop_front();
+        const unsigned capture_index = capture.queued.front();
+        capture.queued.pop_front();
+
+        if (backend.config.decode_time.count() > 0) {
+            lock.unlock();
+            std::this_thread::sleep_for(backend.config.decode_time);
+            lock.lock();
+        }
+
+        /* Streaming may have been stopped meanwhile, which returned all buffers. */
+        const auto output_index = request->output_index.value();
+        if (output.streaming && output_index < output.buffers.size()) {
+            auto& source = output.buffers[output_index];
+            source.state = BufferState::Done;
+            output.done.push_back(output_index);
+
+            if (capture.streaming && capture_index < capture.buffers.size()) {
+                auto& destination = capture.buffers[capture_index];
+                destination.state = BufferState::Done;
+                destination.timestamp = source.timestamp;
+                for (auto&& plane : destination.planes) {
+                    plane.bytesused = plane.length;
+                }
+                capture.done.push_back(capture_index);
+                update_readable();
+            }
+        }
+
+        request->complete();
+        done.notify_all();
+    }
+}
+
+/** Scale the picture of an OUTPUT buffer into a CAPTURE buffer, false if either can't be mapped. */
+bool FakeBackend::Video::process(const BufferState& source, const BufferState& destination)
+{
+    std::vector<std::span<uint8_t>> mappings;
+    auto map = [&](const BufferState& buffer) {
+        std::vector<uint8_t*> result;
+        for (auto&& plane : buffer.planes) {
+            void* data = ::mmap(nullptr, plane.length, PROT_READ | PROT_WRITE, MAP_SHARED, plane.memfd, 0);
+            if (data == MAP_FAILED) {
+                return std::vector<uint8_t*>();
+            }
+            mappings.emplace_back(static_cast<uint8_t*>(data), plane.length);
+            result.push_back(static_cast<uint8_t*>(data));
+        }
+        return result;
+    };
+
+    const auto input = map(source);
+    const auto result = map(destination);
+    const bool mapped = input.size() == source.planes.size() && result.size() == destination.planes.size();
+    if (mapped) {
+        scale_picture(input, output.format.fmt.pix_mp, crop, result, capture.format.fmt.pix_mp, compose, transform);
+    }
+
+    for (auto&& mapping : mappings) {
+        munmap(mapping.data(), mapping.size());
+    }
+    return mapped;
+}
+
+int FakeBackend::Video::ioctl(unsigned long request, void* arg)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    switch (request) {
+    case VIDIOC_QUERYCAP:
+        return querycap(*static_cast<v4l2_capability*>(arg));
+    case VIDIOC_ENUM_FMT:
+        return enum_fmt(*static_cast<v4l2_fmtdesc*>(arg));
+    case VIDIOC_G_FMT: {
+        auto format = static_cast<v4l2_format*>(arg);
+        auto q = queue(format->type);
+        if (!q) {
+            return fail(EINVAL);
+        }
+        *format = q->format;
+        return 0;
+    }
+    case VIDIOC_S_FMT:
+        return s_fmt(*static_cast<v4l2_format*>(arg));
+    case VIDIOC_REQBUFS:
+        return reqbufs(*static_cast<v4l2_requestbuffers*>(arg));
+    case VIDIOC_CREATE_BUFS: {
+        /* Only the capability query is supported. */
+        auto create = static_cast<v4l2_create_buffers*>(arg);
+        if (!queue(create->format.type) || create->count != 0
+            || (create->memory != V4L2_MEMORY_MMAP && (!processor || create->memory != V4L2_MEMORY_DMABUF))) {
+            return fail(EINVAL);
+        }
+        create->capabilities = processor ? processor_buffer_capabilities : buffer_capabilities;
+        return 0;
+    }
+    case VIDIOC_QUERYBUF:
+        return querybuf(*static_cast<v4l2_buffer*>(arg));
+    case VIDIOC_QBUF:
+        return qbuf(*static_cast<v4l2_buffer*>(arg));
+    case VIDIOC_PREPARE_BUF: {
+        /* There is nothing to prepare, only the checks of vb2 apply. */
+        auto buffer = static_cast<v4l2_buffer*>(arg);
+        auto q = queue(buffer->type);
+        if (!q || buffer->index >= q->buffers.size() || buffer->memory != q->memory
+            || (buffer->flags & V4L2_BUF_FLAG_REQUEST_FD)) {
+            return fail(EINVAL);
+        }
+        return (q->buffers[buffer->index].state == BufferState::Dequeued) ? 0 : fail(EINVAL);
+    }
+    case VIDIOC_DQBUF: {
+        auto buffer = static_cast<v4l2_buffer*>(arg);
+        auto q = queue(buffer->type);
+        if (!q) {
+            return fail(EINVAL);
+        }
+        if (!nonblocking) {
+            done.wait(lock, [&] { return !q->done.empty() || !q->streaming; });
+        }
+        return dqbuf(*buffer);
+    }
+    case VIDIOC_EXPBUF:
+        return expbuf(*static_cast<v4l2_exportbuffer*>(arg));
+    case VIDIOC_STREAMON:
+        return streamon(*static_cast<uint32_t*>(arg), true);
+    case VIDIOC_STREAMOFF:
+        return streamon(*static_cast<uint32_t*>(arg), false);
+    case VIDIOC_G_CTRL:
+        return g_ctrl(*static_cast<v4l2_control*>(arg));
+    case VIDIOC_G_SELECTION:
+        return g_selection(*static_cast<v4l2_selection*>(arg));
+    case VIDIOC_S_SELECTION:
+        return s_selection(*static_cast<v4l2_selection*>(arg));
+    case VIDIOC_S_EXT_CTRLS: {
+        auto ext_controls = static_cast<v4l2_ext_controls*>(arg);
+        if (ext_controls->which != V4L2_CTRL_WHICH_REQUEST_VAL) {
+            return s_ext_ctrls(*ext_controls);
+        }
+        if (processor) {
+            return fail(EINVAL);
+        }
+
+        /* Bind before taking the request over, so that queueing it finds this device. */
+        auto request = backend.lookup_request(ext_controls->request_fd);
+        if (!request) {
+            return fail(EINVAL);
+        }
+        {
+            std::lock_guard<std::mutex> guard(request->binding_mutex);
+            request->video = weak_from_this();
+        }
+        if (request->state != Request::State::Idle) {
+            return fail(EBUSY);
+        }
+
+        const auto result = s_ext_ctrls(*ext_controls);
+        if (result == 0) {
+            for (unsigned i = 0; i < ext_controls->count; i++) {
+                const auto& control = ext_controls->controls[i];
+                const auto data = static_cast<const uint8_t*>(control.ptr);
+                request->controls[control.id].assign(data, data + control.size);
+            }
+        }
+        return result;
+    }
+    default:
+        return fail(ENOTTY);
+    }
+}
+
+int FakeBackend::Video::querycap(v4l2_capability& capability)
+{
+    capability = {};
+    snprintf(reinterpret_cast<char*>(capability.driver), sizeof(capability.driver), "%s", "libva-v4l2-fake");
+    snprintf(reinterpret_cast<char*>(capability.card), sizeof(capability.card), "%s",
+        processor ? "Fake scaler" : "Fake stateless decoder");
+    snprintf(reinterpret_cast<char*>(capability.bus_info), sizeof(capability.bus_info), "%s", "platform:fake");
+    capability.device_caps = V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING;
+    capability.capabilities = capability.device_caps | V4L2_CAP_DEVICE_CAPS;
+    return 0;
+}
+
+int FakeBackend::Video::enum_fmt(v4l2_fmtdesc& fmtdesc)
+{
+    const bool is_output = fmtdesc.type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    if (!is_output && fmtdesc.type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        return fail(EINVAL);
+    }
+
+    const auto& formats = processor ? std::vector<uint32_t>(std::begin(processor_formats), std::end(processor_formats))
+        : is_output                 ? backend.config.output_formats
+                                    : backend.config.capture_formats;
+    if (fmtdesc.index >= formats.size()) {
+        return fail(EINVAL);
+    }
+
+    fmtdesc.pixelformat = formats[fmtdesc.index];
+    fmtdesc.flags = (is_output && !processor) ? V4L2_FMT_FLAG_COMPRESSED : 0;
+    snprintf(reinterpret_cast<char*>(fmtdesc.description), sizeof(fmtdesc.description), "%.4s",
+        reinterpret_cast<const char*>(&fmtdesc.pixelformat));
+    return 0;
+}
+
+int FakeBackend::Video::s_fmt(v4l2_format& format)
+{
+    auto q = queue(format.type);
+    if (!q) {
+        return fail(EINVAL);
+    }
+    if (!q->buffers.empty()) {
+        return fail(EBUSY);
+    }
+
+    auto& pix_mp = format.fmt.pix_mp;
+    if (processor) {
+        /* Both queues are sized independently, and imported pictures keep their pitch. */
+        if (std::ranges::find(processor_formats, pix_mp.pixelformat) == std::end(processor_formats)) {
+            pix_mp.pixelformat = processor_formats[0];
+        }
+        (q == &capture ? compose : crop) = { .width = pix_mp.width, .height = pix_mp.height };
+        fill_format(pix_mp, true, backend.config.pitch_alignment, pix_mp.plane_fmt[0].bytesperline);
+        q->format = format;
+        return 0;
+    }
+
+    const bool is_capture = q == &capture;
+    const auto& formats = is_capture ? backend.config.capture_formats : backend.config.output_formats;
+    if (std::ranges::find(formats, pix_mp.pixelformat) == formats.end()) {
+        pix_mp.pixelformat = formats.empty() ? 0 : formats[0];
+    }
+    if (is_capture || capture.buffers.empty()) {
+        compose = { .width = pix_mp.width, .height = pix_mp.height };
+    }
+    fill_format(pix_mp, is_capture, backend.config.pitch_alignment);
+    q->format = format;
+
+    /* As with real stateless decoders, the coded size determines the decoded one. */
+    if (!is_capture && capture.buffers.empty()) {
+        capture.format.fmt.pix_mp.width = pix_mp.width;
+        capture.format.fmt.pix_mp.height = pix_mp.height;
+        fill_format(capture.format.fmt.pix_mp, true, backend.config.pitch_alignment);
+    }
+    return 0;
+}
+
+int FakeBackend::Video::reqbufs(v4l2_requestbuffers& requestbuffers)
+{
+    auto q = queue(requestbuffers.type);
+    const bool import = processor && q == &output && requestbuffers.memory == V4L2_MEMORY_DMABUF;
+    if (!q || (requestbuffers.memory != V4L2_MEMORY_MMAP && !import)) {
+        return fail(EINVAL);
+    }
+    if (q->streaming) {
+        return fail(EBUSY);
+    }
+
+    free_buffers(*q);
+    q->memory = requestbuffers.memory;
+
+    const auto& pix_mp = q->format.fmt.pix_mp;
+    const unsigned count = std::min(requestbuffers.count, max_buffers);
+    for (unsigned i = 0; i < count; i++) {
+        BufferState buffer;
+        for (unsigned j = 0; j < pix_mp.num_planes; j++) {
+            if (import) {
+                buffer.planes.push_back({ -1, pix_mp.plane_fmt[j].sizeimage, 0 });
+                continue;
+            }
+            const int memfd = memfd_create("libva-v4l2-fake", MFD_CLOEXEC);
+            if (memfd < 0 || ftruncate(memfd, pix_mp.plane_fmt[j].sizeimage) < 0) {
+                const int error = errno;
+                if (memfd >= 0) {
+                    ::close(memfd);
+                }
+                q->buffers.push_back(std::move(buffer));
+                free_buffers(*q);
+                return fail(error);
+            }
+            buffer.planes.push_back({ memfd, pix_mp.plane_fmt[j].sizeimage, 0 });
+        }
+        q->buffers.push_back(std::move(buffer));
+    }
+
+    requestbuffers.count = count;
+    requestbuffers.capabilities = processor ? processor_buffer_capabilities : buffer_capabilities;
+    requestbuffers.flags &= V4L2_MEMORY_FLAG_NON_COHERENT; // memfds are cached memory either way
+    return 0;
+}
+
+int FakeBackend::Video::querybuf(v4l2_buffer& buffer)
+{
+    auto q = queue(buffer.type);
+    if (!q || buffer.index >= q->buffers.size() || !buffer.m.planes) {
+        return fail(EINVAL);
+    }
+
+    const auto& state = q->buffers[buffer.index];
+    if (buffer.length < state.planes.size()) {
+        return fail(EINVAL);
+    }
+
+    buffer.memory = q->memory;
+    buffer.length = state.planes.size();
+    buffer.flags = (state.state == BufferState::Queued) ? V4L2_BUF_FLAG_QUEUED
+        : (state.state == BufferState::Done)            ? V4L2_BUF_FLAG_DONE
+                                                        : 0;
+    for (unsigned i = 0; i < state.planes.size(); i++) {
+        buffer.m.planes[i].length = state.planes[i].length;
+        buffer.m.planes[i].bytesused = state.planes[i].bytesused;
+        if (q->memory == V4L2_MEMORY_DMABUF) {
+            buffer.m.planes[i].m.fd = state.planes[i].memfd;
+        } else {
+            buffer.m.planes[i].m.mem_offset = mem_offset(q == &capture, buffer.index, i);
+        }
+    }
+    return 0;
+}
+
+int FakeBackend::Video::qbuf(v4l2_buffer& buffer)
+{
+    auto q = queue(buffer.type);
+    if (!q || buffer.index >= q->buffers.size() || buffer.memory != q->memory || !buffer.m.planes) {
+        return fail(EINVAL);
+    }
+
+    auto& state = q->buffers[buffer.index];
+    if (state.state != BufferState::Dequeued || buffer.length < state.planes.size()) {
+        return fail(EINVAL);
+    }
+
+    if (processor && q == &output) {
+        return queue_picture(buffer, state);
+    }
+
+    if (q == &capture) {
+        if (buffer.flags & V4L2_BUF_FLAG_REQUEST_FD) {
+            return fail(EINVAL);
+        }
+        state.state = BufferState::Queued;
+        capture.queued.push_back(buffer.index);
+        wake.notify_one();
+        return 0;
+    }
+
+    /* Stateless decoders only accept coded data as part of a request. */
+    if (!(buffer.flags & V4L2_BUF_FLAG_REQUEST_FD)) {
+        return fail(EBADR);
+    }
+    auto request = backend.lookup_request(buffer.request_fd);
+    if (!request) {
+        return fail(EINVAL);
+    }
+    {
+        std::lock_guard<std::mutex> guard(request->binding_mutex);
+        request->video = weak_from_this();
+    }
+    if (request->state != Request::State::Idle || request->output_index) {
+        return fail(EBUSY);
+    }
+
+    for (unsigned i = 0; i < state.planes.size(); i++) {
+        if (buffer.m.planes[i].bytesused > state.planes[i].length) {
+            return fail(EINVAL);
+        }
+        state.planes[i].bytesused = buffer.m.planes[i].bytesused;
+    }
+    state.timestamp = buffer.timestamp;
+    state.state = BufferState::Queued;
+    request->output_index = buffer.index;
+    return 0;
+}
+
+/* Processors take pictures without requests, as imported dma-bufs at least as large as the format's planes. */
+int FakeBackend::Video::queue_picture(v4l2_buffer& buffer, BufferState& state)
+{
+    if (buffer.flags & V4L2_BUF_FLAG_REQUEST_FD) {
+        return fail(EBADR);
+    }
+
+    std::vector<int> fds;
+    for (unsigned i = 0; i < state.planes.size(); i++) {
+        const int fd = buffer.m.planes[i].m.fd;
+        const auto size = lseek(fd, 0, SEEK_END);
+        const int duplicate = (size < 0 || static_cast<size_t>(size) < state.planes[i].length)
+            ? -1
+            : fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (duplicate < 0) {
+            for (auto fd : fds) {
+                ::close(fd);
+            }
+            return fail(EINVAL);
+        }
+        fds.push_back(duplicate);
+    }
+
+    for (unsigned i = 0; i < state.planes.size(); i++) {
+        if (state.planes[i].memfd >= 0) {
+            ::close(state.planes[i].memfd);
+        }
+        state.planes[i].memfd = fds[i];
+        state.planes[i].bytesused = state.planes[i].length;
+    }
+    state.timestamp = buffer.timestamp;
+    state.state = BufferState::Queued;
+    output.queued.push_back(buffer.index);
+    wake.notify_one();
+    return 0;
+}
+
+int FakeBackend::Video::dqbuf(v4l2_buffer& buffer)
+{
+    auto q = queue(buffer.type);
+    if (!q || !buffer.m.planes) {
+        return fail(EINVAL);
+    }
+    if (q->done.empty()) {
+        return fail(q->streaming ? EAGAIN : EINVAL);
+    }
+
+    const unsigned index = q->done.front();
+    q->done.pop_front();
+    update_readable();
+    auto& state = q->buffers[index];
+    state.state = BufferState::Dequeued;
+
+    buffer.index = index;
+    buffer.memory = q->memory;
+    buffer.flags = state.flags;
+    buffer.timestamp = state.timestamp;
+    buffer.length = std::min<uint32_t>(buffer.length, state.planes.size());
+    for (unsigned i = 0; i < buffer.length; i++) {
+        buffer.m.planes[i].length = state.planes[i].length;
+        buffer.m.planes[i].bytesused = state.planes[i].bytesused;
+    }
+    return 0;
+}
+
+int FakeBackend::Video::expbuf(v4l2_exportbuffer& exportbuffer)
+{
+    auto q = queue(exportbuffer.type);
+    if (!q || q->memory != V4L2_MEMORY_MMAP || exportbuffer.index >= q->buffers.size()
+        || exportbuffer.plane >= q->buffers[exportbuffer.index].planes.size()) {
+        return fail(EINVAL);
+    }
+
+    const int fd = fcntl(q->buffers[exportbuffer.index].planes[exportbuffer.plane].memfd,
+        (exportbuffer.flags & O_CLOEXEC) ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    exportbuffer.fd = fd;
+    return 0;
+}
+
+int FakeBackend::Video::streamon(uint32_t type, bool enable)
+{
+    auto q = queue(type);
+    if (!q) {
+        return fail(EINVAL);
+    }
+
+    q->streaming = enable;
+    if (!enable) {
+        for (auto&& buffer : q->buffers) {
+            buffer.state = BufferState::Dequeued;
+        }
+        q->queued.clear();
+        q->done.clear();
+        update_readable();
+
+        /* Requests still waiting for the device are cancelled. */
+        if (q == &output) {
+            for (auto&& request : pending) {
+                request->complete();
+            }
+            pending.clear();
+        }
+    }
+
+    wake.notify_one();
+    done.notify_all();
+    return 0;
+}
+
+int FakeBackend::Video::g_ctrl(v4l2_control& control)
+{
+    if (processor) {
+        switch (control.id) {
+        case V4L2_CID_HFLIP:
+            control.value = transform.hflip;
+            return 0;
+        case V4L2_CID_VFLIP:
+            control.value = transform.vflip;
+            return 0;
+        case V4L2_CID_ROTATE:
+            control.value = transform.rotate;
+            return 0;
+        default:
+            return fail(EINVAL);
+        }
+    }
+
+    const auto& formats = backend.config.output_formats;
+    const bool h264 = std::ranges::find(formats, V4L2_PIX_FMT_H264_SLICE) != formats.end();
+
+    switch (control.id) {
+    case V4L2_CID_STATELESS_H264_DECODE_MODE:
+        if (!h264) {
+            return fail(EINVAL);
+        }
+        control.value = backend.config.h264_decode_mode;
+        return 0;
+    case V4L2_CID_STATELESS_H264_START_CODE:
+        if (!h264) {
+            return fail(EINVAL);
+        }
+        control.value = V4L2_STATELESS_H264_START_CODE_ANNEX_B;
+        return 0;
+    default:
+        return fail(EINVAL);
+    }
+}
+
+int FakeBackend::Video::g_selection(v4l2_selection& selection)
+{
+    if (processor) {
+        const bool is_output = V4L2_TYPE_IS_OUTPUT(selection.type);
+        const bool crop_target = selection.target == V4L2_SEL_TGT_CROP || selection.target == V4L2_SEL_TGT_CROP_DEFAULT
+            || selection.target == V4L2_SEL_TGT_CROP_BOUNDS;
+        const auto& format = (is_output ? output : capture).format.fmt.pix_mp;
+        if (crop_target != is_output) {
+            return fail(EINVAL);
+        }
+
+        switch (selection.target) {
+        case V4L2_SEL_TGT_CROP:
+            selection.r = crop;
+            return 0;
+        case V4L2_SEL_TGT_COMPOSE:
+            selection.r = compose;
+            return 0;
+        case V4L2_SEL_TGT_CROP_DEFAULT:
+        case V4L2_SEL_TGT_CROP_BOUNDS:
+        case V4L2_SEL_TGT_COMPOSE_DEFAULT:
+        case V4L2_SEL_TGT_COMPOSE_BOUNDS:
+            selection.r = { .width = format.width, .height = format.height };
+            return 0;
+        default:
+            return fail(EINVAL);
+        }
+    }
+
+    if (selection.type != V4L2_BUF_TYPE_VIDEO_CAPTURE && selection.type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        return fail(EINVAL);
+    }
+
+    switch (selection.target) {
+    case V4L2_SEL_TGT_COMPOSE:
+    case V4L2_SEL_TGT_COMPOSE_DEFAULT:
+        selection.r = compose;
+        return 0;
+    case V4L2_SEL_TGT_COMPOSE_BOUNDS:
+    case V4L2_SEL_TGT_COMPOSE_PADDED:
+        selection.r = { .width = capture.format.fmt.pix_mp.width, .height = capture.format.fmt.pix_mp.height };
+        return 0;
+    default:
+        return fail(EINVAL);
+    }
+}
+
+/* The processor crops OUTPUT and composes into CAPTURE, on even coordinates within the pictures. */
+int FakeBackend::Video::s_selection(v4l2_selection& selection)
+{
+    if (!processor) {
+        return fail(ENOTTY);
+    }
+
+    const bool is_output = V4L2_TYPE_IS_OUTPUT(selection.type);
+    if (selection.target != (is_output ? V4L2_SEL_TGT_CROP : V4L2_SEL_TGT_COMPOSE)) {
+        return fail(EINVAL);
+    }
+
+    const auto& format = (is_output ? output : capture).format.fmt.pix_mp;
+    auto& rect = selection.r;
+    const unsigned left = std::min(unsigned(std::max(rect.left, 0)) & ~1u, format.width - 2);
+    const unsigned top = std::min(unsigned(std::max(rect.top, 0)) & ~1u, format.height - 2);
+    rect = {
+        .left = static_cast<int32_t>(left),
+        .top = static_cast<int32_t>(top),
+        .width = std::clamp(rect.width & ~1u, 2u, format.width - left),
+        .height = std::clamp(rect.height & ~1u, 2u, format.height - top),
+    };
+    (is_output ? crop : compose) = rect;
+    return 0;
+}
+
+int FakeBackend::Video::s_ext_ctrls(v4l2_ext_controls& ext_controls)
+{
+    if (processor) {
+        for (unsigned i = 0; i < ext_controls.count; i++) {
+            const auto& control = ext_controls.controls[i];
+            const bool valid = control.id == V4L2_CID_HFLIP || control.id == V4L2_CID_VFLIP
+                || (control.id == V4L2_CID_ROTATE && control.value % 90 == 0 && control.value >= 0
+                    && control.value < 360);
+            if (!valid) {
+                ext_controls.error_idx = i;
+                return fail(EINVAL);
+            }
+        }
+        for (unsigned i = 0; i < ext_controls.count; i++) {
+            const auto& control = ext_controls.controls[i];
+            if (control.id == V4L2_CID_HFLIP) {
+                transform.hflip = control.value;
+            } else if (control.id == V4L2_CID_VFLIP) {
+                transform.vflip = control.value;
+            } else {
+                transform.rotate = control.value;
+            }
+        }
+        return 0;
+    }
+
+    /* Like the kernel, check everything before applying anything. */
+    for (unsigned i = 0; i < ext_controls.count; i++) {
+        const auto& control = ext_controls.controls[i];
+        const auto info = lookup_control(backend.config, control.id);
+
+        ext_controls.error_idx = i;
+        if (!info) {
+            return fail(EINVAL);
+        }
+        if (control.size < info->size) {
+            return fail(ENOSPC);
+        }
+        if (!control.ptr) {
+            return fail(EFAULT);
+        }
+    }
+
+    ext_controls.error_idx = ext_controls.count;
+    for (unsigned i = 0; i < ext_controls.count; i++) {
+        const auto& control = ext_controls.controls[i];
+        const auto info = lookup_control(backend.config, control.id);
+        if (info->validate && !info->validate(control.ptr)) {
+            return fail(EINVAL);
+        }
+    }
+
+    if (ext_controls.which != V4L2_CTRL_WHICH_REQUEST_VAL) {
+        for (unsigned i = 0; i < ext_controls.count; i++) {
+            const auto& control = ext_controls.controls[i];
+            const auto data = static_cast<const uint8_t*>(control.ptr);
+            controls[control.id].assign(data, data + control.size);
+        }
+    }
+    return 0;
+}
+
+int FakeBackend::Video::queue_request(Request& request)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    if (request.state != Request::State::Idle) {
+        return fail(EBUSY);
+    }
+    if (!request.output_index) {
+        return fail(ENOENT);
+    }
+
+    const auto coded_format = output.format.fmt.pix_mp.pixelformat;
+    for (auto&& info : control_infos) {
+        if (info.coded_format == coded_format && control_required(backend.config, info)
+            && !request.controls.contains(info.id) && !controls.contains(info.id)) {
+            return fail(ENOENT);
+        }
+    }
+
+    request.state = Request::State::Queued;
+    pending.push_back(request.shared_from_this());
+    wake.notify_one();
+    return 0;
+}
+
+int FakeBackend::Video::reinit_request(Request& request)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    return request.reinit();
+}
+
+void* FakeBackend::Video::mmap(size_t length, int prot, int flags, off_t offset)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    for (auto* q : { &output, &capture }) {
+        if (q->memory != V4L2_MEMORY_MMAP) {
+            continue;
+        }
+        for (unsigned i = 0; i < q->buffers.size(); i++) {
+            for (unsigned j = 0; j < q->buffers[i].planes.size(); j++) {
+                if (mem_offset(q == &capture, i, j) == offset) {
+                    const auto& plane = q->buffers[i].planes[j];
+                    if (length > plane.length) {
+                        errno = EINVAL;
+                        return MAP_FAILED;
+                    }
+                    return ::mmap(nullptr, length, prot, flags, plane.memfd, 0);
+                }
+            }
+        }
+    }
+
+    errno = EINVAL;
+    return MAP_FAILED;
+}
+
+int FakeBackend::Request::ioctl(unsigned long request, void*)
+{
+    std::shared_ptr<Video> bound;
+    {
+        std::lock_guard<std::mutex> guard(binding_mutex);
+        bound = video.lock();
+    }
+
+    switch (request) {
+    case MEDIA_REQUEST_IOC_QUEUE:
+        return bound ? bound->queue_request(*this) : fail(ENOENT);
+    case MEDIA_REQUEST_IOC_REINIT:
+        return bound ? bound->reinit_request(*this) : reinit();
+    default:
+        return fail(ENOTTY);
+    }
+}
+
+FakeBackend::FakeBackend()
+    : config(read_config())
+{
+}
+
+FakeBackend::~FakeBackend() = default;
+
+std::vector<std::pair<std::string, std::optional<std::string>>> FakeBackend::enumerate_devices()
+{
+    return { { video_path, media_path } };
+}
+
+std::vector<std::string> FakeBackend::enumerate_processors()
+{
+    if (!config.processor) {
+        return {};
+    }
+    return { processor_path };
+}
+
+int FakeBackend::insert(std::shared_ptr<File> file)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    files[file->fd] = file;
+    return file->fd;
+}
+
+std::shared_ptr<FakeBackend::File> FakeBackend::lookup(int fd)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    auto it = files.find(fd);
+    return (it != files.end()) ? it->second : nullptr;
+}
+
+std::shared_ptr<FakeBackend::Request> FakeBackend::lookup_request(int fd)
+{
+    return std::dynamic_pointer_cast<Request>(lookup(fd));
+}
+
+int FakeBackend::open(const char* path, int flags)
+{
+    try {
+        if (path == video_path) {
+            return insert(std::make_shared<Video>(*this, flags & O_NONBLOCK, false));
+        } else if (path == processor_path && config.processor) {
+            return insert(std::make_shared<Video>(*this, flags & O_NONBLOCK, true));
+        } else if (path == media_path) {
+            return insert(std::make_shared<Media>(*this));
+        } else if (std::string_view(path).starts_with(heap_prefix)) {
+            return insert(std::make_shared<Heap>());
+        }
+    } catch (std::system_error& e) {
+        return fail(e.code().value());
+    }
+    return fail(ENOENT);
+}
+
+int FakeBackend::close(int fd)
+{
+    std::shared_ptr<File> file;
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = files.find(fd);
+        if (it == files.end()) {
+            return ::close(fd);
+        }
+        file = std::move(it->second);
+        files.erase(it);
+    }
+    return 0; // The descriptor is closed with the last reference to the file.
+}
+
+int FakeBackend::ioctl(int fd, unsigned long request, void* arg)
+{
+    auto file = lookup(fd);
+    return file ? file->ioctl(request, arg) : fail(EBADF);
+}
+
+void* FakeBackend::mmap(size_t length, int prot, int flags, int fd, off_t offset)
+{
+    auto video = std::dynamic_pointer_cast<Video>(lookup(fd));
+    if (!video) {
+        errno = ENODEV;
+        return MAP_FAILED;
+    }
+    return video->mmap(length, prot, flags, offset);
+}
+
+int FakeBackend::poll(pollfd* fds, nfds_t count, int timeout)
+{
+    /* Request completion is signalled with POLLPRI by the kernel, but eventfds only become readable. */
+    std::vector<bool> requests(count);
+    for (nfds_t i = 0; i < count; i++) {
+        requests[i] = lookup_request(fds[i].fd) != nullptr;
+        if (requests[i] && (fds[i].events & POLLPRI)) {
+            fds[i].events = (fds[i].events & ~POLLPRI) | POLLIN;
+        }
+    }
+
+    const int result = ::poll(fds, count, timeout);
+
+    for (nfds_t i = 0; i < count; i++) {
+        if (requests[i]) {
+            fds[i].events = (fds[i].events & ~POLLIN) | POLLPRI;
+            if (fds[i].revents & POLLIN) {
+                fds[i].revents = (fds[i].revents & ~POLLIN) | POLLPRI;
+            }
+        }
+    }
+    return result;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "backend.h"
+
+/**
+ * In-process stand-in for a V4L2 stateless decoder and its media device, selected with `LIBVA_V4L2_BACKEND=fake`.
+ *
+ * It implements the subset of the V4L2 and media request API the driver uses on the multiplanar M2M interface:
+ * buffers are backed by memfds, request completion is signalled through an eventfd, and controls are validated
+ * similar to the kernel's `std_validate_compound()`. Queued requests are completed by a worker thread per open device
+ * after the simulated decode time. No picture data is produced. Dma-buf heaps are stood in for as well, allocating
+ * memfds.
+ *
+ * Configuration is read from the environment:
+ * - `LIBVA_V4L2_FAKE_OUTPUT_FORMATS`: comma-separated coded formats, default `MG2S,S264,VP8F,VP9F`; `SFWH` (stateless
+ *   FWHT, as with vicodec) is also understood
+ * - `LIBVA_V4L2_FAKE_CAPTURE_FORMATS`: comma-separated decoded formats, default `NV12`
+ * - `LIBVA_V4L2_FAKE_DECODE_TIME_US`: simulated decode time per request, default 0
+ * - `LIBVA_V4L2_FAKE_H264_DECODE_MODE`: `frame` (default) or `slice`
+ * - `LIBVA_V4L2_FAKE_PITCH_ALIGNMENT`: bytes the decoded rows are aligned to, default 64
+ * - `LIBVA_V4L2_FAKE_PROCESSOR`: `1` to offer a scaler as well, default `0`
+ *
+ * The controls advertised follow from the coded formats. The scaler converts between `NV12` and `NM12` pictures,
+ * imported as dma-bufs on its OUTPUT queue, by nearest neighbour, with flips and rotation by multiples of 90 degrees.
+ */
+class FakeBackend : public Backend {
+public:
+    struct Config {
+        std::vector<uint32_t> output_formats;
+        std::vector<uint32_t> capture_formats;
+        std::chrono::microseconds decode_time;
+        int32_t h264_decode_mode;
+        unsigned pitch_alignment;
+        bool processor;
+    };
+
+    FakeBackend();
+    ~FakeBackend() override;
+
+    std::vector<std::pair<std::string, std::optional<std::string>>> enumerate_devices() override;
+    std::vector<std::string> enumerate_processors() override;
+    int open(const char* path, int flags) override;
+    int close(int fd) override;
+    int ioctl(int fd, unsigned long request, void* arg) override;
+    void* mmap(size_t length, int prot, int flags, int fd, off_t offset) override;
+    int poll(pollfd* fds, nfds_t count, int timeout) override;
+
+    const Config config;
+
+private:
+    class File;
+    class Video;
+    class Media;
+    class Heap;
+    class Request;
+
+    std::shared_ptr<File> lookup(int fd);
+    std::shared_ptr<Request> lookup_request(int fd);
+    int insert(std::shared_ptr<File> file);
+
+    std::mutex mutex;
+    std::map<int, std::shared_ptr<File>> files;
+};
@@ -26,6 +26,7 @@
 #include "format.h"
 
 #include <algorithm>
+#include <limits>
 #include <stdexcept>
 
 extern "C" {
@@ -35,26 +36,90 @@ extern "C" {
 #include <va/va.h>
 }
 
+#ifndef V4L2_PIX_FMT_FBC0
+#define V4L2_PIX_FMT_FBC0 v4l2_fourcc('F', 'B', 'C', '0')
+#endif
+#ifndef V4L2_PIX_FMT_NV15
+#define V4L2_PIX_FMT_NV15 v4l2_fourcc('N', 'V', '1', '5')
+#endif
+
 namespace {
 
-BufferLayout nv12_derive_layout(unsigned width, unsigned height)
+constexpr PlaneDescriptor luma = { 1, 1, 1 };
+constexpr PlaneDescriptor interleaved_chroma = { 2, 2, 2 };
+constexpr PlaneDescriptor planar_chroma = { 1, 2, 2 };
+constexpr PlaneDescriptor p010_luma = { 2, 1, 1 };
+constexpr PlaneDescriptor p010_chroma = { 4, 2, 2 };
+constexpr PlaneDescriptor nv15_luma = { 5, 4, 1 };
+constexpr PlaneDescriptor nv15_chroma = { 5, 4, 2 };
+
+constexpr Format semiplanar(fourcc v4l2_format, bool multiplanar, fourcc va_format, fourcc drm_format)
+{
+    return { { v4l2_format, multiplanar }, { va_format, VA_RT_FORMAT_YUV420 }, { drm_format, DRM_FORMAT_MOD_LINEAR },
+        2, { luma, interleaved_chroma }, {}, false };
+}
+
+/** 10-bit `NV12`, in 16-bit containers (`P010`) or packed (`NV15`). */
+constexpr Format semiplanar_10(fourcc v4l2_format, fourcc va_format, fourcc drm_format, PlaneDescriptor luma,
+    PlaneDescriptor chroma)
+{
+    return { { v4l2_format, false }, { va_format, VA_RT_FORMAT_YUV420_10 }, { drm_format, DRM_FORMAT_MOD_LINEAR }, 2,
+        { luma, chroma }, {}, false };
+}
+
+/** `NV12` in tiles, as written natively by many stateless decoders. */
+constexpr Format tiled_nv12(fourcc v4l2_format, uint8_t tile_width, uint8_t tile_height, uint64_t modifier)
 {
-    auto base_size = width * height;
-    return BufferLayout {
-        { 0, base_size, width, 0 },
-        { 0, base_size / 2, width, base_size },
-    };
+    return { { v4l2_format, false }, { VA_FOURCC_NV12, VA_RT_FORMAT_YUV420 }, { DRM_FORMAT_NV12, modifier }, 2,
+        { luma, interleaved_chroma }, { tile_width, tile_height }, false };
 }
 
+constexpr Format planar(fourcc v4l2_format, bool multiplanar, fourcc va_format, fourcc drm_format)
+{
+    return { { v4l2_format, multiplanar }, { va_format, VA_RT_FORMAT_YUV420 }, { drm_format, DRM_FORMAT_MOD_LINEAR },
+        3, { luma, planar_chroma, planar_chroma }, {}, false };
+}
+
+/**
+ * 4:2:0 in AFBC superblocks of 16x16 pixels, which the DRM describes as one plane of 12 bits per pixel. Decoders write
+ * the sparse layout, where each superblock has a body of fixed size.
+ */
+constexpr Format afbc(fourcc v4l2_format, fourcc drm_format)
+{
+    return { { v4l2_format, false }, { VA_FOURCC_NV12, VA_RT_FORMAT_YUV420 },
+        { drm_format, DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 | AFBC_FORMAT_MOD_SPARSE) }, 1,
+        { { { 3, 2, 1 } } }, {}, true };
+}
+
+constexpr unsigned afbc_superblock = 16;
+constexpr unsigned afbc_header_size = 16;
+constexpr unsigned afbc_header_alignment = 4096;
+
 } // namespace
 
-const std::array<Format, 2> formats = {
-    Format { { V4L2_PIX_FMT_NV12, &nv12_derive_layout }, { VA_FOURCC_NV12, VA_RT_FORMAT_YUV420 },
-        { DRM_FORMAT_NV12, DRM_FORMAT_MOD_LINEAR } },
-    Format { { V4L2_PIX_FMT_NV12M, nullptr }, { VA_FOURCC_NV12, VA_RT_FORMAT_YUV420 },
-        { DRM_FORMAT_NV12, DRM_FORMAT_MOD_LINEAR } },
+constexpr std::array<Format, 13> formats = {
+    semiplanar(V4L2_PIX_FMT_NV12, false, VA_FOURCC_NV12, DRM_FORMAT_NV12),
+    semiplanar(V4L2_PIX_FMT_NV12M, true, VA_FOURCC_NV12, DRM_FORMAT_NV12),
+    semiplanar(V4L2_PIX_FMT_NV21, false, VA_FOURCC_NV21, DRM_FORMAT_NV21),
+    semiplanar(V4L2_PIX_FMT_NV21M, true, VA_FOURCC_NV21, DRM_FORMAT_NV21),
+    planar(V4L2_PIX_FMT_YUV420, false, VA_FOURCC_I420, DRM_FORMAT_YUV420),
+    planar(V4L2_PIX_FMT_YUV420M, true, VA_FOURCC_I420, DRM_FORMAT_YUV420),
+    planar(V4L2_PIX_FMT_YVU420, false, VA_FOURCC_YV12, DRM_FORMAT_YVU420),
+    planar(V4L2_PIX_FMT_YVU420M, true, VA_FOURCC_YV12, DRM_FORMAT_YVU420),
+    // Allwinner (cedrus), chroma in tiles of 32 rows as well, which equal 64 luma rows
+    tiled_nv12(V4L2_PIX_FMT_NV12_32L32, 32, 32, DRM_FORMAT_MOD_ALLWINNER_TILED),
+    // Hantro G2 and rkvdec, which no DRM modifier describes: decoded for readback only
+    tiled_nv12(V4L2_PIX_FMT_NV12_4L4, 4, 4, DRM_FORMAT_MOD_INVALID),
+    // Rockchip (rkvdec, with the vendor kernel's fourcc), scanned out by the VOP and read by Mali GPUs
+    afbc(V4L2_PIX_FMT_FBC0, DRM_FORMAT_YUV420_8BIT),
+    semiplanar_10(V4L2_PIX_FMT_P010, VA_FOURCC_P010, DRM_FORMAT_P010, p010_luma, p010_chroma),
+    semiplanar_10(V4L2_PIX_FMT_NV15, VA_FOURCC_NV15, DRM_FORMAT_NV15, nv15_luma, nv15_chroma),
 };
 
+static_assert(std::ranges::all_of(formats, [](auto&& format) {
+    return std::ranges::count_if(formats, [&](auto&& other) { return other.v4l2.format == format.v4l2.format; }) == 1;
+}), "V4L2 formats must be unique");
+
 const Format& lookup_format(fourcc v4l2_fourcc)
 {
     auto it = std::ranges::find_if(formats, [&](auto&& f) { return f.v4l2.format == v4l2_fourcc; });
@@ -63,3 +128,206 @@ const Format& lookup_format(fourcc v4l2_fourcc)
     }
     return *it;
 }
+
+BufferLayout derive_layout(const Format& format, unsigned pitch, unsigned height)
+{
+    if (format.compressed) {
+        const auto width = pitch * format.planes[0].pixels / format.planes[0].bytes;
+        const auto superblocks = ((width + afbc_superblock - 1) / afbc_superblock)
+            * ((height + afbc_superblock - 1) / afbc_superblock);
+        const auto headers = (superblocks * afbc_header_size + afbc_header_alignment - 1) / afbc_header_alignment
+            * afbc_header_alignment;
+        const auto body = format.planes[0].row_size(afbc_superblock) * afbc_superblock;
+        return { { 0, headers + superblocks * body, pitch, 0 } };
+    }
+
+    BufferLayout result;
+    unsigned offset = 0;
+    for (unsigned i = 0; i < format.num_planes; i++) {
+        const auto& plane = format.planes[i];
+        const auto plane_pitch
+            = pitch * plane.bytes * format.planes[0].pixels / (plane.pixels * format.planes[0].bytes);
+        auto rows = plane.rows(height);
+        if (format.tiled()) {
+            rows = (rows + format.tile.height - 1) / format.tile.height * format.tile.height;
+        }
+        const auto size = plane_pitch * rows;
+        result.push_back({ format.v4l2.multiplanar ? i : 0, size, plane_pitch, format.v4l2.multiplanar ? 0 : offset });
+        offset += size;
+    }
+    return result;
+}
+
+BufferLayout derive_layout(const Format& format, const v4l2_pix_format_mplane& driver_format)
+{
+    auto result = derive_layout(format, driver_format.plane_fmt[0].bytesperline, driver_format.height);
+    if (format.compressed) {
+        result[0].size = driver_format.plane_fmt[0].sizeimage;
+    } else if (format.v4l2.multiplanar) {
+        for (unsigned i = 0; i < result.size() && i < driver_format.num_planes; i++) {
+            result[i].pitch = driver_format.plane_fmt[i].bytesperline;
+            result[i].size = driver_format.plane_fmt[i].sizeimage;
+        }
+    }
+    return result;
+}
+
+bool starts_on_sample(const Format& format, unsigned x, unsigned y)
+{
+    return !format.tiled() && !format.compressed
+        && std::all_of(format.planes.begin(), format.planes.begin() + format.num_planes, [&](auto&& plane) {
+               return x % plane.pixels == 0 && y % plane.vertical_subsampling == 0;
+           });
+}
+
+BufferLayout crop_layout(const Format& format, const BufferLayout& layout, unsigned x, unsigned y)
+{
+    auto result = layout;
+    for (unsigned i = 0; i < result.size(); i++) {
+        const auto skipped = format.planes[i].rows(y) * result[i].pitch + format.planes[i].row_size(x);
+        result[i].offset += skipped;
+        result[i].size -= std::min(result[i].size, skipped);
+    }
+    return result;
+}
+
+/*
+ * Importers handle a single dma-buf with NV12 (or P010) best, three planes are commonly unsupported for scanout. Tiled
+ * formats are what many decoders write natively, linear output going through a post-processor, so they are preferred
+ * whenever the consumer accepts the modifier, and AFBC even more so, which saves memory bandwidth on both sides.
+ * Readback converts from NV12, P010 and NV15 only, and prefers them linear in a single memory plane, which
+ * vaDeriveImage can hand out without copying, over detiling or unpacking.
+ */
+std::optional<unsigned> format_cost(const Format& format, FormatConsumer consumer, std::span<const uint64_t> modifiers)
+{
+    if (format.compressed || format.tiled()) {
+        if (consumer == FormatConsumer::Cpu) {
+            return format.compressed ? std::nullopt : std::optional<unsigned>(2);
+        }
+        if (format.drm.modifier == DRM_FORMAT_MOD_INVALID
+            || std::ranges::find(modifiers, format.drm.modifier) == modifiers.end()) {
+            return std::nullopt;
+        }
+        return format.compressed ? 0 : 1;
+    }
+
+    unsigned cost = format.v4l2.multiplanar ? 1 : 0;
+    if (consumer == FormatConsumer::Export) {
+        cost += 2;
+    }
+    switch (format.va.format) {
+    case VA_FOURCC_NV12:
+    case VA_FOURCC_P010:
+        return cost;
+    case VA_FOURCC_NV15:
+        return cost + 2;
+    default:
+        if (consumer == FormatConsumer::Cpu) {
+            return std::nullopt;
+        }
+        return cost + ((format.num_planes > 2) ? 4 : 2);
+    }
+}
+
+const Format* select_format(
+    const V4L2M2MDevice& device, uint32_t rt_format, FormatConsumer consumer, std::span<const uint64_t> modifiers)
+{
+    const Format* result = nullptr;
+    unsigned best = std::numeric_limits<unsigned>::max();
+    for (auto&& format : formats) {
+        if (format.va.rt_format != rt_format) {
+            continue;
+        }
+        const auto cost = format_cost(format, consumer, modifiers);
+        if (cost && *cost < best && device.format_supported(device.capture_buf_type, format.v4l2.format)) {
+            result = &format;
+            best = *cost;
+        }
+    }
+    return result;
+}
+
+const std::array<ImageFormat, 7> image_formats = {
+    ImageFormat { { .fourcc = VA_FOURCC_NV12, .byte_order = VA_LSB_FIRST, .bits_per_pixel = 12 }, 2,
+        { luma, interleaved_chroma } },
+    ImageFormat { { .fourcc = VA_FOURCC_P010, .byte_order = VA_LSB_FIRST, .bits_per_pixel = 24 }, 2,
+        { p010_luma, p010_chroma } },
+    ImageFormat { { .fourcc = VA_FOURCC_I420, .byte_order = VA_LSB_FIRST, .bits_per_pixel = 12 }, 3,
+        { luma, planar_chroma, planar_chroma } },
+    ImageFormat { { .fourcc = VA_FOURCC_YV12, .byte_order = VA_LSB_FIRST, .bits_per_pixel = 12 }, 3,
+        { luma, planar_chroma, planar_chroma } },
+    ImageFormat {
+        { .fourcc = VA_FOURCC_YUY2, .byte_order = VA_LSB_FIRST, .bits_per_pixel = 16 }, 1, { { { 4, 2, 1 } } } },
+    ImageFormat {
+        { .fourcc = VA_FOURCC_BGRA,
+            .byte_order = VA_LSB_FIRST,
+            .bits_per_pixel = 32,
+            .depth = 32,
+            .red_mask = 0x00ff0000,
+            .green_mask = 0x0000ff00,
+            .blue_mask = 0x000000ff,
+            .alpha_mask = 0xff000000 },
+        1, { { { 4, 1, 1 } } } },
+    ImageFormat {
+        { .fourcc = VA_FOURCC_RGBA,
+            .byte_order = VA_LSB_FIRST,
+            .bits_per_pixel = 32,
+            .depth = 32,
+            .red_mask = 0x000000ff,
+            .green_mask = 0x0000ff00,
+            .blue_mask = 0x00ff0000,
+            .alpha_mask = 0xff000000 },
+        1, { { { 4, 1, 1 } } } },
+};
+
+const ImageFormat* lookup_image_format(fourcc va_fourcc)
+{
+    auto it = std::ranges::find_if(image_formats, [&](auto&& f) { return f.va.fourcc == va_fourcc; });
+    return (it != image_formats.end()) ? &*it : nullptr;
+}
+
+const std::array<ImageFormat, 4> subpicture_formats = {
+    ImageFormat {
+        { .fourcc = VA_FOURCC_ARGB,
+            .byte_order = VA_LSB_FIRST,
+            .bits_per_pixel = 32,
+            .depth = 32,
+            .red_mask = 0x00ff0000,
+            .green_mask = 0x0000ff00,
+            .blue_mask = 0x000000ff,
+            .alpha_mask = 0xff000000 },
+        1, { { { 4, 1, 1 } } } },
+    ImageFormat {
+        { .fourcc = VA_FOURCC_RGBA,
+            .byte_order = VA_LSB_FIRST,
+            .bits_per_pixel = 32,
+            .depth = 32,
+            .red_mask = 0x000000ff,
+            .green_mask = 0x0000ff00,
+            .blue_mask = 0x00ff0000,
+            .alpha_mask = 0xff000000 },
+        1, { { { 4, 1, 1 } } } },
+    ImageFormat {
+        { .fourcc = VA_FOURCC_AI44, .byte_order = VA_LSB_FIRST, .bits_per_pixel = 8 }, 1, { { { 1, 1, 1 } } } },
+    ImageFormat {
+        { .fourcc = VA_FOURCC_IA44, .byte_order = VA_LSB_FIRST, .bits_per_pixel = 8 }, 1, { { { 1, 1, 1 } } } },
+};
+
+const ImageFormat* lookup_subpicture_format(fourcc va_fourcc)
+{
+    auto it = std::ranges::find_if(subpicture_formats, [&](auto&& f) { return f.va.fourcc == va_fourcc; });
+    return (it != subpicture_formats.end()) ? &*it : nullptr;
+}
+
+BufferLayout derive_layout(const ImageFormat& format, unsigned width, unsigned height)
+{
+    BufferLayout result;
+    unsigned offset = 0;
+    for (unsigned i = 0; i < format.num_planes; i++) {
+        const auto& plane = format.planes[i];
+        const auto pitch = plane.row_size(width);
+        result.push_back({ 0, pitch * plane.rows(height), pitch, offset });
+        offset += pitch * plane.rows(height);
+    }
+    return result;
+}
@@ -26,10 +26,22 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
+#include <optional>
+#include <span>
 #include <vector>
 
+extern "C" {
+#include <va/va.h>
+}
+
 #include "v4l2.h"
 
+/** 10-bit 4:2:0 with interleaved chroma, four samples packed into five bytes (rkvdec), for which VA has no fourcc. */
+#ifndef VA_FOURCC_NV15
+#define VA_FOURCC_NV15 VA_FOURCC('N', 'V', '1', '5')
+#endif
+
 struct LogicalPlane {
     unsigned physical_plane_index;
     unsigned size;
@@ -38,10 +50,27 @@ struct LogicalPlane {
 };
 using BufferLayout = std::vector<LogicalPlane>;
 
+/**
+ * Geometry of a plane: `bytes` per group of `pixels` horizontally, one row per `vertical_subsampling` rows of the
+ * picture.
+ */
+struct PlaneDescriptor {
+    uint8_t bytes;
+    uint8_t pixels;
+    uint8_t vertical_subsampling;
+
+    constexpr unsigned row_size(unsigned width) const { return (width + pixels - 1) / pixels * bytes; }
+    constexpr unsigned rows(unsigned height) const
+    {
+        return (height + vertical_subsampling - 1) / vertical_subsampling;
+    }
+};
+
 struct Format {
     struct {
         fourcc format;
-        BufferLayout (*derive_layout)(unsigned, unsigned);
+        /** Each plane lies in a memory plane of its own (e.g. `NV12M`), instead of following the previous one. */
+        bool multiplanar;
     } v4l2;
     struct {
         fourcc format;
@@ -51,7 +80,77 @@ struct Format {
         fourcc format;
         uint64_t modifier;
     } drm;
+    unsigned num_planes;
+    std::array<PlaneDescriptor, 3> planes;
+    /**
+     * Tiles of `width` bytes by `height` rows, each stored contiguously and in rows of tiles, in every plane; zero for
+     * linear formats.
+     */
+    struct {
+        uint8_t width;
+        uint8_t height;
+    } tile;
+
+    /** Compressed (AFBC) in superblocks of 16x16 pixels, which only DRM importers can read. */
+    bool compressed;
+
+    constexpr bool tiled() const { return tile.width != 0; }
 };
 
-extern const std::array<Format, 2> formats;
+extern const std::array<Format, 13> formats;
 const Format& lookup_format(fourcc v4l2_fourcc);
+
+/**
+ * Layout of a picture whose first plane has the given pitch and height. The pitches of the other planes follow from
+ * the first one's like the bytes per pixel do, as in the V4L2 definitions of contiguous formats.
+ */
+BufferLayout derive_layout(const Format& format, unsigned pitch, unsigned height);
+
+/**
+ * Layout of a picture in the format the driver settled on, with its pitches and, for multiplanar formats, plane sizes.
+ */
+BufferLayout derive_layout(const Format& format, const v4l2_pix_format_mplane& driver_format);
+
+/** Whether the pixel at `x`, `y` begins a group of samples in every plane of a linear format. */
+bool starts_on_sample(const Format& format, unsigned x, unsigned y);
+
+/** The layout of the part of a picture from `x`, `y` on, which has to satisfy `starts_on_sample()`. */
+BufferLayout crop_layout(const Format& format, const BufferLayout& layout, unsigned x, unsigned y);
+
+/** What decoded pictures are used for, which decides the CAPTURE format chosen among those a device offers. */
+enum class FormatConsumer {
+    /** Shared as dma-bufs with display, GPU or encoder. */
+    Export,
+    /** Read back by the CPU through VAImages. */
+    Cpu,
+};
+
+/**
+ * Relative cost of decoding into the format for the consumer, lower is better, nothing if it can't serve it at all.
+ * Exported tiled and compressed formats need the consumer to accept their DRM modifier, given in `modifiers`.
+ */
+std::optional<unsigned> format_cost(
+    const Format& format, FormatConsumer consumer, std::span<const uint64_t> modifiers = {});
+
+/** The cheapest format of the render target format offered by the device's CAPTURE queue, if any. */
+const Format* select_format(const V4L2M2MDevice& device, uint32_t rt_format, FormatConsumer consumer,
+    std::span<const uint64_t> modifiers = {});
+
+/**
+ * Formats offered for VAImages, which decoded pictures are converted into on readback.
+ */
+struct ImageFormat {
+    VAImageFormat va;
+    unsigned num_planes;
+    std::array<PlaneDescriptor, 3> planes;
+};
+
+extern const std::array<ImageFormat, 7> image_formats;
+const ImageFormat* lookup_image_format(fourcc va_fourcc);
+
+/** Formats of images for subpictures: `ARGB` and `RGBA`, and `AI44` and `IA44` indexing a palette of 16 colors. */
+extern const std::array<ImageFormat, 4> subpicture_formats;
+const ImageFormat* lookup_subpicture_format(fourcc va_fourcc);
+
+/** Tightly packed layout of an image. */
+BufferLayout derive_layout(const ImageFormat& format, unsigned width, unsigned height);
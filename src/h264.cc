@@ -44,7 +44,9 @@ extern "C" {
 
 #include "buffer.h"
 #include "driver.h"
+#include "log.h"
 #include "surface.h"
+#include "trace.h"
 #include "v4l2.h"
 
 enum h264_slice_type {
@@ -94,12 +96,12 @@ bool is_picture_null(VAPictureH264* pic)
     return pic->picture_id == VA_INVALID_SURFACE;
 }
 
-h264_dpb_entry* dpb_find_invalid_entry(H264Context& context)
+h264_dpb_entry* dpb_find_invalid_entry(h264_dpb& dpb)
 {
     unsigned int i;
 
     for (i = 0; i < H264_DPB_SIZE; i++) {
-        h264_dpb_entry* entry = &context.dpb.entries[i];
+        h264_dpb_entry* entry = &dpb.entries[i];
 
         if (!entry->valid && !entry->reserved)
             return entry;
@@ -108,16 +110,20 @@ h264_dpb_entry* dpb_find_invalid_entry(H264Context& context)
     return NULL;
 }
 
-h264_dpb_entry* dpb_find_oldest_unused_entry(H264Context& context)
+/*
+ * The least recently referenced entry, only among those the current picture doesn't reference if `unused`. The entry
+ * reserved for the picture being decoded is never evicted.
+ */
+h264_dpb_entry* dpb_find_oldest_entry(h264_dpb& dpb, bool unused)
 {
     unsigned int min_age = UINT_MAX;
     unsigned int i;
     h264_dpb_entry* match = NULL;
 
     for (i = 0; i < H264_DPB_SIZE; i++) {
-        h264_dpb_entry* entry = &context.dpb.entries[i];
+        h264_dpb_entry* entry = &dpb.entries[i];
 
-        if (!entry->used && (entry->age < min_age)) {
+        if (!entry->reserved && !(unused && entry->used) && (entry->age < min_age)) {
             min_age = entry->age;
             match = entry;
         }
@@ -126,23 +132,46 @@ h264_dpb_entry* dpb_find_oldest_unused_entry(H264Context& context)
     return match;
 }
 
-h264_dpb_entry* dpb_find_entry(H264Context& context)
+void h264_copy_pred_table(v4l2_h264_weight_factors* factors, unsigned int num_refs, int16_t luma_weight[32],
+    int16_t luma_offset[32], int16_t chroma_weight[32][2], int16_t chroma_offset[32][2])
+{
+    unsigned int i;
+
+    for (i = 0; i < num_refs; i++) {
+        unsigned int j;
+
+        factors->luma_weight[i] = luma_weight[i];
+        factors->luma_offset[i] = luma_offset[i];
+
+        for (j = 0; j < 2; j++) {
+            factors->chroma_weight[i][j] = chroma_weight[i][j];
+            factors->chroma_offset[i][j] = chroma_offset[i][j];
+        }
+    }
+}
+
+} // namespace
+
+h264_dpb_entry* h264_dpb_find_entry(h264_dpb& dpb)
 {
     h264_dpb_entry* entry;
 
-    entry = dpb_find_invalid_entry(context);
+    entry = dpb_find_invalid_entry(dpb);
+    if (!entry)
+        entry = dpb_find_oldest_entry(dpb, true);
+    // With all 16 entries referenced, as the previous picture may do, one of them has to go
     if (!entry)
-        entry = dpb_find_oldest_unused_entry(context);
+        entry = dpb_find_oldest_entry(dpb, false);
 
     return entry;
 }
 
-h264_dpb_entry* dpb_lookup(H264Context& context, VAPictureH264* pic, v4l2_h264_reference* ref)
+h264_dpb_entry* h264_dpb_lookup(h264_dpb& dpb, VAPictureH264* pic, v4l2_h264_reference* ref)
 {
     unsigned int i;
 
     for (i = 0; i < H264_DPB_SIZE; i++) {
-        h264_dpb_entry* entry = &context.dpb.entries[i];
+        h264_dpb_entry* entry = &dpb.entries[i];
 
         if (!entry->valid)
             continue;
@@ -165,7 +194,7 @@ h264_dpb_entry* dpb_lookup(H264Context& context, VAPictureH264* pic, v4l2_h264_r
     return NULL;
 }
 
-void dpb_clear_entry(h264_dpb_entry* entry, bool reserved)
+void h264_dpb_clear_entry(h264_dpb_entry* entry, bool reserved)
 {
     memset(entry, 0, sizeof(*entry));
 
@@ -173,19 +202,19 @@ void dpb_clear_entry(h264_dpb_entry* entry, bool reserved)
         entry->reserved = true;
 }
 
-void dpb_insert(H264Context& context, VAPictureH264* pic, h264_dpb_entry* entry)
+void h264_dpb_insert(h264_dpb& dpb, VAPictureH264* pic, h264_dpb_entry* entry)
 {
     if (is_picture_null(pic))
         return;
 
-    if (dpb_lookup(context, pic, NULL))
+    if (h264_dpb_lookup(dpb, pic, NULL))
         return;
 
     if (!entry)
-        entry = dpb_find_entry(context);
+        entry = h264_dpb_find_entry(dpb);
 
     memcpy(&entry->pic, pic, sizeof(entry->pic));
-    entry->age = context.dpb.age;
+    entry->age = dpb.age;
     entry->valid = true;
     entry->reserved = false;
 
@@ -193,13 +222,13 @@ void dpb_insert(H264Context& context, VAPictureH264* pic, h264_dpb_entry* entry)
         entry->used = true;
 }
 
-void dpb_update(H264Context& context, VAPictureParameterBufferH264* parameters)
+void h264_dpb_update(h264_dpb& dpb, VAPictureParameterBufferH264* parameters)
 {
     unsigned int i;
-    context.dpb.age++;
+    dpb.age++;
 
     for (i = 0; i < H264_DPB_SIZE; i++) {
-        h264_dpb_entry* entry = &context.dpb.entries[i];
+        h264_dpb_entry* entry = &dpb.entries[i];
 
         entry->used = false;
     }
@@ -211,32 +240,33 @@ void dpb_update(H264Context& context, VAPictureParameterBufferH264* parameters)
         if (is_picture_null(pic))
             continue;
 
-        entry = dpb_lookup(context, pic, NULL);
+        entry = h264_dpb_lookup(dpb, pic, NULL);
         if (entry) {
-            entry->age = context.dpb.age;
+            entry->age = dpb.age;
             entry->used = true;
         } else {
-            dpb_insert(context, pic, NULL);
+            h264_dpb_insert(dpb, pic, NULL);
         }
     }
 }
 
-void h264_fill_dpb(DriverData* data, H264Context& context, v4l2_ctrl_h264_decode_params* decode)
+void h264_fill_dpb(
+    const std::map<VASurfaceID, Surface>& surfaces, const h264_dpb& context_dpb, v4l2_ctrl_h264_decode_params* decode)
 {
     int i;
 
     for (i = 0; i < H264_DPB_SIZE; i++) {
         v4l2_h264_dpb_entry* dpb = &decode->dpb[i];
-        h264_dpb_entry* entry = &context.dpb.entries[i];
+        const h264_dpb_entry* entry = &context_dpb.entries[i];
 
-        const auto& surface = data->surfaces.find(entry->pic.picture_id);
+        const auto& surface = surfaces.find(entry->pic.picture_id);
 
         uint64_t timestamp;
 
         if (!entry->valid)
             continue;
 
-        if (surface != data->surfaces.end()) {
+        if (surface != surfaces.end()) {
             timestamp = v4l2_timeval_to_ns(&surface->second.timestamp);
             dpb->reference_ts = timestamp;
         }
@@ -255,10 +285,11 @@ void h264_fill_dpb(DriverData* data, H264Context& context, v4l2_ctrl_h264_decode
     }
 }
 
-void h264_va_picture_to_v4l2(DriverData* driver_data, H264Context& context, VAPictureParameterBufferH264* VAPicture,
-    v4l2_ctrl_h264_decode_params* decode, v4l2_ctrl_h264_pps* pps, v4l2_ctrl_h264_sps* sps)
+void h264_va_picture_to_v4l2(const std::map<VASurfaceID, Surface>& surfaces, const h264_dpb& dpb,
+    VAPictureParameterBufferH264* VAPicture, v4l2_ctrl_h264_decode_params* decode, v4l2_ctrl_h264_pps* pps,
+    v4l2_ctrl_h264_sps* sps)
 {
-    h264_fill_dpb(driver_data, context, decode);
+    h264_fill_dpb(surfaces, dpb, decode);
 
     decode->top_field_order_cnt = VAPicture->CurrPic.TopFieldOrderCnt;
     decode->bottom_field_order_cnt = VAPicture->CurrPic.BottomFieldOrderCnt;
@@ -314,8 +345,7 @@ void h264_va_picture_to_v4l2(DriverData* driver_data, H264Context& context, VAPi
         sps->flags |= V4L2_H264_SPS_FLAG_DELTA_PIC_ORDER_ALWAYS_ZERO;
 }
 
-void h264_va_matrix_to_v4l2(DriverData* driver_data, const H264Context& context, VAIQMatrixBufferH264* VAMatrix,
-    v4l2_ctrl_h264_scaling_matrix* v4l2_matrix)
+void h264_va_matrix_to_v4l2(VAIQMatrixBufferH264* VAMatrix, v4l2_ctrl_h264_scaling_matrix* v4l2_matrix)
 {
     memcpy(v4l2_matrix->scaling_list_4x4, &VAMatrix->ScalingList4x4, sizeof(VAMatrix->ScalingList4x4));
 
@@ -328,26 +358,7 @@ void h264_va_matrix_to_v4l2(DriverData* driver_data, const H264Context& context,
     memcpy(v4l2_matrix->scaling_list_8x8[3], &VAMatrix->ScalingList8x8[1], sizeof(v4l2_matrix->scaling_list_8x8[3]));
 }
 
-void h264_copy_pred_table(v4l2_h264_weight_factors* factors, unsigned int num_refs, int16_t luma_weight[32],
-    int16_t luma_offset[32], int16_t chroma_weight[32][2], int16_t chroma_offset[32][2])
-{
-    unsigned int i;
-
-    for (i = 0; i < num_refs; i++) {
-        unsigned int j;
-
-        factors->luma_weight[i] = luma_weight[i];
-        factors->luma_offset[i] = luma_offset[i];
-
-        for (j = 0; j < 2; j++) {
-            factors->chroma_weight[i][j] = chroma_weight[i][j];
-            factors->chroma_offset[i][j] = chroma_offset[i][j];
-        }
-    }
-}
-
-void h264_va_slice_to_v4l2(DriverData* driver_data, H264Context& context, VASliceParameterBufferH264* VASlice,
-    VAPictureParameterBufferH264* VAPicture, v4l2_ctrl_h264_slice_params* slice)
+void h264_va_slice_to_v4l2(h264_dpb& dpb, VASliceParameterBufferH264* VASlice, v4l2_ctrl_h264_slice_params* slice)
 {
     slice->header_bit_size = VASlice->slice_data_bit_offset;
     slice->first_mb_in_slice = VASlice->first_mb_in_slice;
@@ -366,7 +377,7 @@ void h264_va_slice_to_v4l2(DriverData* driver_data, H264Context& context, VASlic
             h264_dpb_entry* entry;
             v4l2_h264_reference ref = {};
 
-            entry = dpb_lookup(context, pic, &ref);
+            entry = h264_dpb_lookup(dpb, pic, &ref);
             if (!entry)
                 continue;
 
@@ -382,7 +393,7 @@ void h264_va_slice_to_v4l2(DriverData* driver_data, H264Context& context, VASlic
             h264_dpb_entry* entry;
             v4l2_h264_reference ref = {};
 
-            entry = dpb_lookup(context, pic, &ref);
+            entry = h264_dpb_lookup(dpb, pic, &ref);
             if (!entry)
                 continue;
 
@@ -410,8 +421,6 @@ void h264_va_slice_to_predicted_weights(
             VASlice->luma_weight_l1, VASlice->luma_offset_l1, VASlice->chroma_weight_l1, VASlice->chroma_offset_l1);
 }
 
-} // namespace
-
 H264Context::H264Context(DriverData* driver_data, V4L2M2MDevice& device, VAProfile profile, int picture_width,
     int picture_height, std::span<VASurfaceID> surface_ids)
     : Context(driver_data, device, V4L2_PIX_FMT_H264_SLICE, picture_width, picture_height, surface_ids)
@@ -436,6 +445,7 @@ VAStatus H264Context::store_buffer(const Buffer& buffer) const
         }
         memcpy(source_data.data() + surface.source_size_used, buffer.data.get(), buffer.size * buffer.count);
         surface.source_size_used += buffer.size * buffer.count;
+        TRACE(store_buffer, "h264", buffer.size * buffer.count);
         break;
 
     case VAPictureParameterBufferType:
@@ -457,39 +467,48 @@ VAStatus H264Context::store_buffer(const Buffer& buffer) const
     return VA_STATUS_SUCCESS;
 }
 
-int H264Context::set_controls()
+h264_controls h264_va_to_v4l2(
+    const std::map<VASurfaceID, Surface>& surfaces, h264_dpb& dpb, const Surface& surface, uint8_t profile)
 {
-    auto& surface = driver_data->surfaces.at(render_surface_id);
-
-    v4l2_ctrl_h264_scaling_matrix matrix = {};
-    v4l2_ctrl_h264_decode_params decode = {};
-    v4l2_ctrl_h264_slice_params slice = {};
-    v4l2_ctrl_h264_pps pps = {};
-    v4l2_ctrl_h264_sps sps = {};
-    h264_dpb_entry* output;
+    h264_controls result = {};
 
-    output = dpb_lookup(*this, &surface.params.h264.picture->CurrPic, NULL);
-    if (!output)
-        output = dpb_find_entry(*this);
+    result.output = h264_dpb_lookup(dpb, &surface.params.h264.picture->CurrPic, NULL);
+    if (!result.output)
+        result.output = h264_dpb_find_entry(dpb);
 
-    dpb_clear_entry(output, true);
+    h264_dpb_clear_entry(result.output, true);
 
-    dpb_update(*this, surface.params.h264.picture);
+    h264_dpb_update(dpb, surface.params.h264.picture);
 
-    h264_va_picture_to_v4l2(driver_data, *this, surface.params.h264.picture, &decode, &pps, &sps);
-    h264_va_matrix_to_v4l2(driver_data, *this, surface.params.h264.matrix, &matrix);
-    h264_va_slice_to_v4l2(driver_data, *this, surface.params.h264.slice, surface.params.h264.picture, &slice);
+    h264_va_picture_to_v4l2(surfaces, dpb, surface.params.h264.picture, &result.decode, &result.pps, &result.sps);
+    h264_va_matrix_to_v4l2(surface.params.h264.matrix, &result.matrix);
+    h264_va_slice_to_v4l2(dpb, surface.params.h264.slice, &result.slice);
 
-    sps.profile_idc = profile;
+    result.sps.profile_idc = profile;
     switch (surface.params.h264.slice->slice_type % 5) {
     case H264_SLICE_P:
-        decode.flags |= V4L2_H264_DECODE_PARAM_FLAG_PFRAME;
+        result.decode.flags |= V4L2_H264_DECODE_PARAM_FLAG_PFRAME;
         break;
     case H264_SLICE_B:
-        decode.flags |= V4L2_H264_DECODE_PARAM_FLAG_BFRAME;
+        result.decode.flags |= V4L2_H264_DECODE_PARAM_FLAG_BFRAME;
         break;
     }
 
+    if (V4L2_H264_CTRL_PRED_WEIGHTS_REQUIRED(&result.pps, &result.slice)) {
+        result.weights.emplace();
+        h264_va_slice_to_predicted_weights(surface.params.h264.slice, &result.slice, &*result.weights);
+    }
+
+    return result;
+}
+
+int H264Context::set_controls()
+{
+    auto& surface = driver_data->surfaces.at(render_surface_id);
+
+    auto [decode, pps, sps, matrix, slice, weights, output]
+        = h264_va_to_v4l2(driver_data->surfaces, dpb, surface, profile);
+
     std::vector<v4l2_ext_control> controls = {
         {
             .id = V4L2_CID_STATELESS_H264_DECODE_PARAMS,
@@ -523,24 +542,22 @@ int H264Context::set_controls()
         });
     }
 
-    if (V4L2_H264_CTRL_PRED_WEIGHTS_REQUIRED(&pps, &slice)) {
-        v4l2_ctrl_h264_pred_weights weights = {};
-        h264_va_slice_to_predicted_weights(surface.params.h264.slice, &slice, &weights);
-
+    if (weights) {
         controls.push_back({
             .id = V4L2_CID_STATELESS_H264_PRED_WEIGHTS,
-            .size = sizeof(weights),
-            .ptr = &weights,
+            .size = sizeof(*weights),
+            .ptr = &*weights,
         });
     }
 
+    LOG_CONTROLS(driver_data->va_context, controls);
     try {
         device.set_ext_controls(surface.request_fd, std::span(controls));
     } catch (std::runtime_error& e) {
         return VA_STATUS_ERROR_OPERATION_FAILED;
     }
 
-    dpb_insert(*this, &surface.params.h264.picture->CurrPic, output);
+    h264_dpb_insert(dpb, &surface.params.h264.picture->CurrPic, output);
 
     return VA_STATUS_SUCCESS;
 }
@@ -28,9 +28,13 @@
 
 #pragma once
 
+#include <map>
+#include <optional>
 #include <set>
 
 extern "C" {
+#include <linux/videodev2.h>
+
 #include <va/va.h>
 }
 
@@ -56,6 +60,40 @@ struct h264_dpb {
     unsigned int age;
 };
 
+/*
+ * DPB bookkeeping and translation of VA parameter buffers into V4L2 controls. These don't touch the device, so that
+ * they can be tested and benchmarked on their own.
+ */
+h264_dpb_entry* h264_dpb_find_entry(h264_dpb& dpb);
+h264_dpb_entry* h264_dpb_lookup(h264_dpb& dpb, VAPictureH264* pic, v4l2_h264_reference* ref);
+void h264_dpb_clear_entry(h264_dpb_entry* entry, bool reserved);
+void h264_dpb_insert(h264_dpb& dpb, VAPictureH264* pic, h264_dpb_entry* entry);
+void h264_dpb_update(h264_dpb& dpb, VAPictureParameterBufferH264* parameters);
+void h264_fill_dpb(
+    const std::map<VASurfaceID, Surface>& surfaces, const h264_dpb& dpb, v4l2_ctrl_h264_decode_params* decode);
+void h264_va_picture_to_v4l2(const std::map<VASurfaceID, Surface>& surfaces, const h264_dpb& dpb,
+    VAPictureParameterBufferH264* VAPicture, v4l2_ctrl_h264_decode_params* decode, v4l2_ctrl_h264_pps* pps,
+    v4l2_ctrl_h264_sps* sps);
+void h264_va_matrix_to_v4l2(VAIQMatrixBufferH264* VAMatrix, v4l2_ctrl_h264_scaling_matrix* v4l2_matrix);
+void h264_va_slice_to_v4l2(h264_dpb& dpb, VASliceParameterBufferH264* VASlice, v4l2_ctrl_h264_slice_params* slice);
+void h264_va_slice_to_predicted_weights(
+    VASliceParameterBufferH264* VASlice, v4l2_ctrl_h264_slice_params* slice, v4l2_ctrl_h264_pred_weights* weights);
+
+struct h264_controls {
+    v4l2_ctrl_h264_decode_params decode;
+    v4l2_ctrl_h264_pps pps;
+    v4l2_ctrl_h264_sps sps;
+    v4l2_ctrl_h264_scaling_matrix matrix;
+    v4l2_ctrl_h264_slice_params slice;
+    std::optional<v4l2_ctrl_h264_pred_weights> weights;
+    /* Reserved for the picture, to be filled with `h264_dpb_insert()` once the controls have been submitted. */
+    h264_dpb_entry* output;
+};
+
+/* The controls `H264Context::set_controls()` submits for the picture stored in `surface.params.h264`. */
+h264_controls h264_va_to_v4l2(
+    const std::map<VASurfaceID, Surface>& surfaces, h264_dpb& dpb, const Surface& surface, uint8_t profile);
+
 class H264Context : public Context {
 public:
     static std::set<VAProfile> supported_profiles(const V4L2M2MDevice& device);
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "heap.h"
+
+#include <cerrno>
+#include <system_error>
+
+extern "C" {
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+}
+
+#include "backend.h"
+#include "utils.h"
+
+HeapAllocation::HeapAllocation(int fd, size_t size)
+    : fd_(fd)
+{
+    void* data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        const int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category());
+    }
+    mapping_ = std::span(static_cast<uint8_t*>(data), size);
+}
+
+HeapAllocation::~HeapAllocation()
+{
+    munmap(mapping_.data(), mapping_.size());
+    ::close(fd_);
+}
+
+void HeapAllocation::sync(uint64_t flags) const
+{
+    dma_buf_sync sync = { .flags = flags };
+    while (ioctl(fd_, DMA_BUF_IOCTL_SYNC, &sync) < 0 && (errno == EINTR || errno == EAGAIN)) {
+    }
+}
+
+std::unique_ptr<DmaHeap> DmaHeap::open(const std::string& name)
+{
+    if (name.empty()) {
+        return nullptr;
+    }
+    const auto path = "/dev/dma_heap/" + name;
+    const int fd = backend_open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    return (fd >= 0) ? std::unique_ptr<DmaHeap>(new DmaHeap(fd)) : nullptr;
+}
+
+DmaHeap::DmaHeap(int fd)
+    : fd_(fd)
+{
+}
+
+DmaHeap::~DmaHeap() { backend_close(fd_); }
+
+std::unique_ptr<HeapAllocation> DmaHeap::allocate(size_t size) const
+{
+    dma_heap_allocation_data allocation = {
+        .len = size,
+        .fd_flags = O_RDWR | O_CLOEXEC,
+    };
+    errno_wrapper(backend_ioctl, fd_, DMA_HEAP_IOCTL_ALLOC, &allocation);
+    return std::make_unique<HeapAllocation>(allocation.fd, size);
+}
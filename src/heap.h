@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+
+/** Memory allocated from a dma-buf heap and mapped for the CPU, which other devices and APIs can import. */
+class HeapAllocation {
+public:
+    HeapAllocation(int fd, size_t size);
+    HeapAllocation(const HeapAllocation&) = delete;
+    HeapAllocation& operator=(const HeapAllocation&) = delete;
+    ~HeapAllocation();
+
+    /** The dma-buf, which stays owned by the allocation. */
+    int fd() const { return fd_; }
+    uint8_t* data() const { return mapping_.data(); }
+    /** Bracket CPU access like `V4L2M2MDevice::Buffer::sync()`, the memory being cached. */
+    void sync(uint64_t flags) const;
+
+private:
+    int fd_;
+    std::span<uint8_t> mapping_;
+};
+
+/** A dma-buf heap (`/dev/dma_heap/<name>`), e.g. `system`, or `linux,cma` for devices needing contiguous memory. */
+class DmaHeap {
+public:
+    /** Nothing if the kernel has no such heap or access to it is denied. */
+    static std::unique_ptr<DmaHeap> open(const std::string& name);
+
+    DmaHeap(const DmaHeap&) = delete;
+    DmaHeap& operator=(const DmaHeap&) = delete;
+    ~DmaHeap();
+
+    /** Zeroed memory of at least `size` bytes, throws `std::system_error` on failure. */
+    std::unique_ptr<HeapAllocation> allocate(size_t size) const;
+
+private:
+    explicit DmaHeap(int fd);
+
+    int fd_;
+};
@@ -30,44 +30,179 @@
 #include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <optional>
 #include <va/va.h>
 
 extern "C" {
+#include <linux/dma-buf.h>
 #include <linux/videodev2.h>
 }
 
 #include "buffer.h"
+#include "convert.h"
+#include "copy.h"
 #include "driver.h"
 #include "format.h"
+#include "log.h"
+#include "subpicture.h"
 #include "surface.h"
 #include "utils.h"
 #include "v4l2.h"
 
 namespace {
 
-VAStatus copy_surface_to_image(DriverData* driver_data, const Surface& surface, VAImage* image)
+/**
+ * Convert the rectangle at `x`, `y` of the surface's visible area into the top left corner of the image, in bands on
+ * the copy pool for large images.
+ */
+VAStatus copy_surface_to_image(
+    DriverData* driver_data, Surface& surface, VAImage* image, unsigned x, unsigned y, unsigned width, unsigned height)
 {
-    unsigned int i;
-
     if (!driver_data->buffers.contains(image->buf)) {
         return VA_STATUS_ERROR_INVALID_BUFFER;
     }
     auto& buffer = driver_data->buffers.at(image->buf);
 
-    assert(image->num_planes == surface.logical_destination_layout.size());
-    for (i = 0; i < surface.logical_destination_layout.size(); i++) {
-        const auto& mapping = surface.destination_buffer->get().mapping();
+    // Pictures with subpictures are converted from a composed copy instead
+    const bool composed = compose_subpictures(driver_data, surface, false);
+    const auto& capture_buffer = surface.destination_buffer->get();
+    const auto& format = composed ? lookup_format(V4L2_PIX_FMT_NV12)
+                                  : lookup_format(capture_buffer.owner().capture_format.fmt.pix_mp.pixelformat);
+    const auto& layout = composed ? surface.composed.layout : surface.logical_destination_layout;
+    if (layout.size() != 2 || !convert_supported(format.va.format, image->format.fourcc)) {
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+    }
+    x += surface.visible.left;
+    y += surface.visible.top;
+    // Packed formats can only be read from the first sample of a group on
+    if (x % format.planes[0].pixels) {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
 
-        const auto source = mapping[surface.logical_destination_layout[i].physical_plane_index].data()
-            + surface.logical_destination_layout[i].offset;
-        const auto dest = buffer.data.get() + image->offsets[i];
+    // Planes may hold fewer rows than the surface is high, when the decoder's block size allows for it
+    const auto rows = std::min(layout[0].size / layout[0].pitch, 2 * (layout[1].size / layout[1].pitch));
+    height = std::min(height, std::max(rows, y) - y);
 
-        // Image planes may be smaller than buffer due to decoding blocks
-        const auto size
-            = ((i < (surface.logical_destination_layout.size() - 1)) ? image->offsets[i + 1] : image->data_size)
-            - image->offsets[i];
-        std::copy_n(source, size, dest);
+    std::vector<std::span<uint8_t>> mapping;
+    try {
+        mapping = composed ? std::vector { std::span(surface.composed.data(), layout[1].offset + layout[1].size) }
+                           : capture_buffer.mapping();
+    } catch (std::system_error& e) {
+        LOG_RATELIMITED(LogLevel::Error, driver_data->va_context, "Failed to map surface: %s\n", e.what());
+        return VA_STATUS_ERROR_OPERATION_FAILED;
     }
+    ConvertDestination destination = { .fourcc = image->format.fourcc };
+    for (unsigned i = 0; i < image->num_planes; i++) {
+        destination.planes[i] = buffer.memory() + image->offsets[i];
+        destination.pitches[i] = image->pitches[i];
+    }
+    const auto luma = mapping[layout[0].physical_plane_index].data() + layout[0].offset;
+    const auto chroma = mapping[layout[1].physical_plane_index].data() + layout[1].offset;
+    const auto luma_x = format.planes[0].row_size(x);
+    const auto chroma_x = format.planes[1].row_size(x);
+
+    if (!composed) {
+        capture_buffer.sync(DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+    }
+    buffer.sync(DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+    auto& pool = driver_data->copy_pool;
+    if (format.tiled()) {
+        // Tile rows are detiled a unit of one chroma tile row at a time into a cached buffer, and converted from there
+        const unsigned unit = 2 * format.tile.height;
+        const unsigned first_unit = y / unit;
+        const unsigned units = (y + height + unit - 1) / unit - first_unit;
+        const unsigned luma_tile_rows = layout[0].size / (layout[0].pitch * format.tile.height);
+        const unsigned chroma_tile_rows = layout[1].size / (layout[1].pitch * format.tile.height);
+        const auto bands = (image->data_size < pool.threshold()) ? 1 : std::min(pool.threads(), units);
+        pool.run(bands, [&](unsigned band, unsigned bands) {
+            thread_local std::vector<uint8_t> scratch;
+            scratch.resize(unit * layout[0].pitch + unit / 2 * layout[1].pitch);
+            const auto scratch_chroma = scratch.data() + unit * layout[0].pitch;
+            for (auto u = first_unit + units * band / bands; u < first_unit + units * (band + 1) / bands; u++) {
+                // The last unit may hold a single luma tile row
+                const auto luma_rows = std::min(2u, luma_tile_rows - std::min(luma_tile_rows, 2 * u));
+                const auto chroma_rows = std::min(1u, chroma_tile_rows - std::min(chroma_tile_rows, u));
+                detile_rows(scratch.data(), luma + u * unit * layout[0].pitch, layout[0].pitch, format.tile.width,
+                    format.tile.height, luma_rows);
+                detile_rows(scratch_chroma, chroma + u * unit / 2 * layout[1].pitch, layout[1].pitch,
+                    format.tile.width, format.tile.height, chroma_rows);
+                const auto first = std::max(y, u * unit);
+                const auto last = std::min(y + height, (u + 1) * unit);
+                const ConvertSource source = {
+                    .luma = scratch.data() + (first - u * unit) * layout[0].pitch + luma_x,
+                    .luma_pitch = layout[0].pitch,
+                    .chroma = scratch_chroma + (first - u * unit) / 2 * layout[1].pitch + chroma_x,
+                    .chroma_pitch = layout[1].pitch,
+                    .fourcc = format.va.format,
+                };
+                convert_rows(skip_rows(destination, first - y), source, width, 0, last - first);
+            }
+        });
+    } else {
+        const ConvertSource source = {
+            .luma = luma + y * layout[0].pitch + luma_x,
+            .luma_pitch = layout[0].pitch,
+            .chroma = chroma + y / 2 * layout[1].pitch + chroma_x,
+            .chroma_pitch = layout[1].pitch,
+            .fourcc = format.va.format,
+        };
+        const unsigned pairs = (height + 1) / 2;
+        const auto bands = (image->data_size < pool.threshold()) ? 1 : std::min(pool.threads(), pairs);
+        pool.run(bands, [&](unsigned band, unsigned bands) {
+            convert_rows(destination, source, width, 2 * (pairs * band / bands),
+                std::min(height, 2 * (pairs * (band + 1) / bands)));
+        });
+    }
+    buffer.sync(DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+    if (!composed) {
+        capture_buffer.sync(DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+    }
+
+    return VA_STATUS_SUCCESS;
+}
+
+/**
+ * Derive an image that aliases the surface's CAPTURE buffer, which is possible when all planes of a linear format lie
+ * within one memory plane, as offsets into it.
+ */
+std::optional<VAStatus> derive_aliased_image(
+    DriverData* driver_data, VASurfaceID surface_id, Surface& surface, VAImage* image)
+{
+    const auto& capture_buffer = surface.destination_buffer->get();
+    const auto& format = lookup_format(capture_buffer.owner().capture_format.fmt.pix_mp.pixelformat);
+    const auto& layout = surface.logical_destination_layout;
+    // Subpictures are only blended into copies
+    if (!surface.subpictures.empty() || format.tiled() || format.compressed || layout.empty() || layout.size() > 3
+        || !std::ranges::all_of(
+            layout, [&](auto&& plane) { return plane.physical_plane_index == layout[0].physical_plane_index; })) {
+        return std::nullopt;
+    }
+    // NV15 has no VA image format applications would understand
+    const auto image_format = lookup_image_format(format.va.format);
+    if (!image_format && format.va.rt_format != VA_RT_FORMAT_YUV420) {
+        return std::nullopt;
+    }
+
+    memset(image, 0, sizeof(*image));
+    image->format = image_format
+        ? image_format->va
+        : VAImageFormat { .fourcc = format.va.format, .byte_order = VA_LSB_FIRST, .bits_per_pixel = 12 };
+    image->width = surface.visible.width;
+    image->height = surface.visible.height;
+    image->num_planes = layout.size();
+    const auto visible_layout = crop_layout(format, layout, surface.visible.left, surface.visible.top);
+    for (unsigned i = 0; i < layout.size(); i++) {
+        image->pitches[i] = visible_layout[i].pitch;
+        image->offsets[i] = visible_layout[i].offset;
+    }
+    image->data_size = capture_buffer.plane_size(layout[0].physical_plane_index);
+
+    std::lock_guard<std::mutex> guard(driver_data->mutex);
+    image->buf = smallest_free_key(driver_data->buffers);
+    image->image_id = smallest_free_key(driver_data->images);
+    driver_data->buffers.emplace(image->buf, Buffer(capture_buffer, layout[0].physical_plane_index, surface_id));
+    driver_data->images.emplace(image->image_id, *image);
+    surface.mappings++;
 
     return VA_STATUS_SUCCESS;
 }
@@ -77,25 +212,29 @@ VAStatus copy_surface_to_image(DriverData* driver_data, const Surface& surface,
 VAStatus createImage(VADriverContextP context, VAImageFormat* format, int width, int height, VAImage* image)
 {
     auto driver_data = static_cast<DriverData*>(context->pDriverData);
+    driver_data->cpu_access = true;
 
     memset(image, 0, sizeof(*image));
     image->format = *format;
     image->width = width;
     image->height = height;
 
-    BufferLayout (*derive_layout)(unsigned, unsigned) = nullptr;
-    try {
-        derive_layout = lookup_format(format->fourcc).v4l2.derive_layout;
-    } catch (std::invalid_argument& e) { // TODO decouple planarity from format layout
-        error_log(context, "Image format not specified\n");
-        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+    auto image_format = lookup_image_format(format->fourcc);
+    if (!image_format) {
+        image_format = lookup_subpicture_format(format->fourcc);
     }
-    if (!derive_layout) {
+    if (!image_format) {
         error_log(context, "Image format not specified\n");
         return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
     }
+    // Palettized formats index 16 colors, set with `vaSetImagePalette()`
+    if (image_format->va.bits_per_pixel == 8) {
+        image->num_palette_entries = 16;
+        image->entry_bytes = 3;
+        memcpy(image->component_order, "RGB", 3);
+    }
 
-    const auto layout = derive_layout(width, height);
+    const auto layout = derive_layout(*image_format, width, height);
 
     image->num_planes = layout.size();
     for (unsigned i = 0; i < image->num_planes; i += 1) {
@@ -128,6 +267,14 @@ VAStatus destroyImage(VADriverContextP context, VAImageID image_id)
     }
     auto& image = driver_data->images.at(image_id);
 
+    if (auto buffer = driver_data->buffers.find(image.buf);
+        buffer != driver_data->buffers.end() && buffer->second.capture_buffer) {
+        if (auto surface = driver_data->surfaces.find(buffer->second.derived_surface_id);
+            surface != driver_data->surfaces.end() && surface->second.mappings) {
+            surface->second.mappings--;
+        }
+    }
+
     VAStatus status = destroyBuffer(context, image.buf);
     if (status != VA_STATUS_SUCCESS) {
         return status;
@@ -137,6 +284,7 @@ VAStatus destroyImage(VADriverContextP context, VAImageID image_id)
     if (!driver_data->images.erase(image_id)) {
         return VA_STATUS_ERROR_INVALID_IMAGE;
     }
+    driver_data->palettes.erase(image_id);
 
     return VA_STATUS_SUCCESS;
 }
@@ -147,6 +295,7 @@ VAStatus deriveImage(VADriverContextP context, VASurfaceID surface_id, VAImage*
     VAImageFormat format;
     VAStatus status;
 
+    driver_data->cpu_access = true;
     if (!driver_data->surfaces.contains(surface_id)) {
         return VA_STATUS_ERROR_INVALID_SURFACE;
     }
@@ -163,20 +312,25 @@ VAStatus deriveImage(VADriverContextP context, VASurfaceID surface_id, VAImage*
             return status;
     }
 
-    format.fourcc = VA_FOURCC_NV12;
+    surface.status = VASurfaceReady;
+    surface.cpu_access = true;
 
-    status = createImage(context, &format, surface.width, surface.height, image);
-    if (status != VA_STATUS_SUCCESS)
-        return status;
+    if (const auto aliased = derive_aliased_image(driver_data, surface_id, surface, image); aliased) {
+        return aliased.value();
+    }
+
+    // The planes are spread over multiple mappings, tiled, compressed or packed, which a VAImage cannot express.
+    format.fourcc = (surface.format == VA_RT_FORMAT_YUV420_10) ? VA_FOURCC_P010 : VA_FOURCC_NV12;
 
-    status = copy_surface_to_image(driver_data, surface, image);
+    status = createImage(context, &format, surface.visible.width, surface.visible.height, image);
     if (status != VA_STATUS_SUCCESS)
         return status;
 
-    surface.status = VASurfaceReady;
-
-    if (!driver_data->buffers.contains(image->buf)) {
-        return VA_STATUS_ERROR_INVALID_BUFFER;
+    // Compressed and 3-plane pictures cannot be converted, the image is not handed out then
+    status = copy_surface_to_image(driver_data, surface, image, 0, 0, surface.visible.width, surface.visible.height);
+    if (status != VA_STATUS_SUCCESS || !driver_data->buffers.contains(image->buf)) {
+        destroyImage(context, image->image_id);
+        return (status != VA_STATUS_SUCCESS) ? status : VA_STATUS_ERROR_INVALID_BUFFER;
     }
     driver_data->buffers.at(image->buf).derived_surface_id = surface_id;
 
@@ -185,15 +339,36 @@ VAStatus deriveImage(VADriverContextP context, VASurfaceID surface_id, VAImage*
 
 VAStatus queryImageFormats(VADriverContextP context, VAImageFormat* formats, int* formats_count)
 {
-    formats[0].fourcc = VA_FOURCC_NV12;
-    *formats_count = 1;
+    *formats_count = 0;
+    for (const auto& format : image_formats) {
+        formats[(*formats_count)++] = format.va;
+    }
 
     return VA_STATUS_SUCCESS;
 }
 
 VAStatus setImagePalette(VADriverContextP context, VAImageID image_id, unsigned char* palette)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    if (!driver_data->images.contains(image_id)) {
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+    }
+    const auto& image = driver_data->images.at(image_id);
+    if (!image.num_palette_entries) {
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+    }
+    if (!palette) {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+
+    std::lock_guard<std::mutex> guard(driver_data->mutex);
+    auto& colors = driver_data->palettes[image_id];
+    for (unsigned i = 0; i < colors.size(); i++) {
+        colors[i] = palette[3 * i] << 16 | palette[3 * i + 1] << 8 | palette[3 * i + 2];
+    }
+
+    return VA_STATUS_SUCCESS;
 }
 
 VAStatus getImage(VADriverContextP context, VASurfaceID surface_id, int x, int y, unsigned int width,
@@ -209,16 +384,117 @@ VAStatus getImage(VADriverContextP context, VASurfaceID surface_id, int x, int y
         return VA_STATUS_ERROR_INVALID_IMAGE;
     }
     auto& image = driver_data->images.at(image_id);
+    auto& surface = driver_data->surfaces.at(surface_id);
 
-    if (x != 0 || y != 0 || width != image.width || height != image.height)
-        return VA_STATUS_ERROR_UNIMPLEMENTED;
+    if (!surface.destination_buffer) {
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
 
-    return copy_surface_to_image(driver_data, driver_data->surfaces.at(surface_id), &image);
+    // Chroma is subsampled in both directions, rectangles have to start on a sample
+    if (x < 0 || y < 0 || x % 2 || y % 2) {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    if (x + width > surface.visible.width || y + height > surface.visible.height || width > image.width
+        || height > image.height) {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+
+    surface.cpu_access = true;
+    return copy_surface_to_image(driver_data, surface, &image, x, y, width, height);
 }
 
-VAStatus putImage(VADriverContextP context, VASurfaceID surface_id, VAImageID image, int src_x, int src_y,
+VAStatus putImage(VADriverContextP context, VASurfaceID surface_id, VAImageID image_id, int src_x, int src_y,
     unsigned int src_width, unsigned int src_height, int dst_x, int dst_y, unsigned int dst_width,
     unsigned int dst_height)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    if (!driver_data->surfaces.contains(surface_id)) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+    if (!driver_data->images.contains(image_id)) {
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+    }
+    auto& image = driver_data->images.at(image_id);
+    auto& surface = driver_data->surfaces.at(surface_id);
+
+    // Surfaces have no memory before a context gives them one of its CAPTURE buffers, which no retry would change
+    if (!surface.destination_buffer) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+    if (!driver_data->buffers.contains(image.buf)) {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+    const auto& buffer = driver_data->buffers.at(image.buf);
+
+    const auto& capture_buffer = surface.destination_buffer->get();
+    const auto& format = lookup_format(capture_buffer.owner().capture_format.fmt.pix_mp.pixelformat);
+    const auto& layout = surface.logical_destination_layout;
+    if (format.tiled() || format.compressed || layout.size() != 2
+        || !upload_supported(image.format.fourcc, format.va.format)) {
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+    }
+    // There is no scaler, and chroma is subsampled in both directions
+    if (src_width != dst_width || src_height != dst_height) {
+        return VA_STATUS_ERROR_UNIMPLEMENTED;
+    }
+    if (src_x < 0 || src_y < 0 || dst_x < 0 || dst_y < 0 || src_x % 2 || src_y % 2 || dst_x % 2 || dst_y % 2) {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    if (src_x + src_width > image.width || src_y + src_height > image.height
+        || dst_x + dst_width > surface.visible.width || dst_y + dst_height > surface.visible.height) {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+
+    if (surface.status == VASurfaceRendering) {
+        VAStatus status = syncSurface(context, surface_id);
+        if (status != VA_STATUS_SUCCESS) {
+            return status;
+        }
+    }
+    surface.cpu_access = true;
+
+    std::vector<std::span<uint8_t>> mapping;
+    const uint8_t* memory;
+    try {
+        mapping = capture_buffer.mapping();
+        memory = buffer.memory();
+    } catch (std::system_error& e) {
+        LOG_RATELIMITED(LogLevel::Error, context, "Failed to map surface: %s\n", e.what());
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
+    const auto image_format = lookup_image_format(image.format.fourcc);
+    UploadSource source = { .fourcc = image.format.fourcc };
+    for (unsigned i = 0; i < image.num_planes; i++) {
+        const auto& plane = image_format->planes[i];
+        source.planes[i]
+            = memory + image.offsets[i] + plane.rows(src_y) * image.pitches[i] + plane.row_size(src_x);
+        source.pitches[i] = image.pitches[i];
+    }
+    const unsigned x = surface.visible.left + dst_x;
+    const unsigned y = surface.visible.top + dst_y;
+    const UploadDestination destination = {
+        .luma = mapping[layout[0].physical_plane_index].data() + layout[0].offset + y * layout[0].pitch
+            + format.planes[0].row_size(x),
+        .luma_pitch = layout[0].pitch,
+        .chroma = mapping[layout[1].physical_plane_index].data() + layout[1].offset + y / 2 * layout[1].pitch
+            + format.planes[1].row_size(x),
+        .chroma_pitch = layout[1].pitch,
+    };
+
+    // The CPU's writes are cleaned from the cache before the surface is exported or decoded into
+    buffer.sync(DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+    capture_buffer.sync(DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+    auto& pool = driver_data->copy_pool;
+    const unsigned pairs = (dst_height + 1) / 2;
+    const auto bands = (image.data_size < pool.threshold()) ? 1 : std::min(pool.threads(), pairs);
+    pool.run(bands, [&](unsigned band, unsigned bands) {
+        upload_rows(destination, source, dst_width, 2 * (pairs * band / bands),
+            std::min(dst_height, 2 * (pairs * (band + 1) / bands)));
+    });
+    capture_buffer.sync(DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+    buffer.sync(DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+    return VA_STATUS_SUCCESS;
 }
@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "log.h"
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "utils.h"
+
+namespace {
+
+/* Long enough for any message of ours, short enough to live on the stack of a decode thread. */
+constexpr size_t message_size = 512;
+
+void deliver(LogLevel level, VADriverContextP ctx, const char* text)
+{
+    if (level <= LogLevel::Warning) {
+        ctx->error_callback(ctx, text);
+    } else {
+        ctx->info_callback(ctx, text);
+    }
+}
+
+/**
+ * Bounded queue drained by a single thread, so that the decode path never blocks on whatever the application's libVA
+ * callbacks do. Messages are dropped (and counted) when the queue is full.
+ */
+class AsyncSink {
+public:
+    AsyncSink()
+        : worker([this] { run(); })
+    {
+    }
+
+    ~AsyncSink()
+    {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        ready.notify_one();
+        worker.join();
+    }
+
+    void push(LogLevel level, VADriverContextP ctx, const char* text)
+    {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (tail - head == entries.size()) {
+                dropped++;
+                return;
+            }
+            auto& entry = entries[tail++ % entries.size()];
+            entry.level = level;
+            entry.ctx = ctx;
+            strncpy(entry.text, text, sizeof(entry.text) - 1);
+            entry.text[sizeof(entry.text) - 1] = '\0';
+        }
+        ready.notify_one();
+    }
+
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        drained.wait(lock, [this] { return head == tail && !busy; });
+    }
+
+private:
+    struct Entry {
+        LogLevel level;
+        VADriverContextP ctx;
+        char text[message_size];
+    };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            ready.wait(lock, [this] { return stopping || head != tail; });
+            if (head == tail) {
+                return;
+            }
+
+            const Entry entry = entries[head++ % entries.size()];
+            const unsigned dropped_ = std::exchange(dropped, 0);
+            busy = true;
+            lock.unlock();
+
+            deliver(entry.level, entry.ctx, entry.text);
+            if (dropped_) {
+                char notice[64];
+                snprintf(notice, sizeof(notice), "%u log messages dropped\n", dropped_);
+                deliver(LogLevel::Warning, entry.ctx, notice);
+            }
+
+            lock.lock();
+            busy = false;
+            if (head == tail) {
+                drained.notify_all();
+            }
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable drained;
+    std::array<Entry, 256> entries;
+    size_t head = 0;
+    size_t tail = 0;
+    unsigned dropped = 0;
+    bool busy = false;
+    bool stopping = false;
+    std::thread worker;
+};
+
+std::unique_ptr<AsyncSink> async_sink;
+std::once_flag async_sink_once;
+
+void emit(LogLevel level, VADriverContextP ctx, const char* text)
+{
+    if (async_sink) {
+        async_sink->push(level, ctx, text);
+    } else {
+        deliver(level, ctx, text);
+    }
+}
+
+std::optional<LogLevel> parse_level(const std::string& value)
+{
+    static constexpr std::array<const char*, 4> names = { "error", "warning", "info", "debug" };
+
+    for (size_t i = 0; i < names.size(); i++) {
+        if (value == names[i] || value == std::to_string(i)) {
+            return static_cast<LogLevel>(i);
+        }
+    }
+    return std::nullopt;
+}
+
+} // namespace
+
+bool RateLimit::admit(unsigned& suppressed)
+{
+    const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+    auto start = window_start.load(std::memory_order_relaxed);
+
+    suppressed = 0;
+    if (now - start >= interval.count()
+        && window_start.compare_exchange_strong(start, now, std::memory_order_relaxed)) {
+        emitted.store(0, std::memory_order_relaxed);
+        suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    }
+
+    if (emitted.fetch_add(1, std::memory_order_relaxed) < burst) {
+        return true;
+    }
+
+    /* Lost a race against other threads entering the new window, hand the summary on. */
+    suppressed_.fetch_add(suppressed + 1, std::memory_order_relaxed);
+    return false;
+}
+
+void log_init()
+{
+    if (const auto value = getenv_opt("LIBVA_V4L2_LOG_LEVEL"); value) {
+        if (const auto level = parse_level(value.value()); level) {
+            log_level.store(level.value(), std::memory_order_relaxed);
+        }
+    }
+
+    if (getenv_opt("LIBVA_V4L2_LOG_ASYNC")) {
+        std::call_once(async_sink_once, [] { async_sink = std::make_unique<AsyncSink>(); });
+    }
+}
+
+void log_flush()
+{
+    if (async_sink) {
+        async_sink->flush();
+    }
+}
+
+void log_message_v(LogLevel level, VADriverContextP ctx, unsigned suppressed, const char* format, va_list args)
+{
+    char buffer[message_size];
+
+    const int written = vsnprintf(buffer, sizeof(buffer), format, args);
+    if (written < 0) {
+        return;
+    }
+
+    size_t length = std::min(static_cast<size_t>(written), sizeof(buffer) - 1);
+    if (static_cast<size_t>(written) >= sizeof(buffer)) {
+        buffer[length - 1] = '\n';
+    }
+
+    if (suppressed) {
+        const bool newline = length > 0 && buffer[length - 1] == '\n';
+        if (newline) {
+            length--;
+        }
+        snprintf(buffer + length, sizeof(buffer) - length, " (%u similar messages suppressed)%s", suppressed,
+            newline ? "\n" : "");
+    }
+
+    emit(level, ctx, buffer);
+}
+
+void log_message(LogLevel level, VADriverContextP ctx, unsigned suppressed, const char* format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    log_message_v(level, ctx, suppressed, format, args);
+    va_end(args);
+}
+
+void log_control(VADriverContextP ctx, uint32_t id, const void* data, size_t size)
+{
+    char buffer[message_size];
+    const auto bytes = static_cast<const uint8_t*>(data);
+
+    size_t i = 0;
+    int length = snprintf(buffer, sizeof(buffer), "control 0x%08x (%zu bytes):", id, size);
+    for (; i < size && length + 8 < static_cast<int>(sizeof(buffer)); i++) {
+        length += snprintf(buffer + length, sizeof(buffer) - length, " %02x", bytes[i]);
+    }
+    if (i < size) {
+        length += snprintf(buffer + length, sizeof(buffer) - length, " ...");
+    }
+    snprintf(buffer + length, sizeof(buffer) - length, "\n");
+
+    emit(LogLevel::Debug, ctx, buffer);
+}
+
+void info_log(VADriverContextP ctx, const char* format, ...)
+{
+    va_list args;
+
+    if (!log_enabled(LogLevel::Info)) {
+        return;
+    }
+
+    va_start(args, format);
+    log_message_v(LogLevel::Info, ctx, 0, format, args);
+    va_end(args);
+}
+
+void error_log(VADriverContextP ctx, const char* format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    log_message_v(LogLevel::Error, ctx, 0, format, args);
+    va_end(args);
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+#include <va/va_backend.h>
+}
+
+enum class LogLevel : int {
+    Error,
+    Warning,
+    Info,
+    Debug,
+};
+
+/**
+ * Most verbose level compiled into the driver, set through the `max_log_level` build option. Messages above it are
+ * removed by the compiler, including the evaluation of their arguments.
+ */
+#ifndef LIBVA_V4L2_LOG_MAX_LEVEL
+#define LIBVA_V4L2_LOG_MAX_LEVEL 3
+#endif
+
+/**
+ * Most verbose level emitted at runtime, set from `LIBVA_V4L2_LOG_LEVEL` by `log_init()`.
+ */
+inline std::atomic<LogLevel> log_level = LogLevel::Info;
+
+inline bool log_enabled(LogLevel level)
+{
+    return static_cast<int>(level) <= LIBVA_V4L2_LOG_MAX_LEVEL
+        && level <= log_level.load(std::memory_order_relaxed);
+}
+
+/**
+ * Token bucket guarding a single call site: at most `burst` messages are emitted per `interval`, the rest is counted
+ * and reported alongside the first message of the next interval.
+ */
+class RateLimit {
+public:
+    static constexpr std::chrono::steady_clock::duration interval = std::chrono::seconds(5);
+    static constexpr unsigned burst = 10;
+
+    /**
+     * Returns whether a message may be emitted, and in that case the number of messages suppressed since the last one.
+     */
+    bool admit(unsigned& suppressed);
+
+private:
+    std::atomic<std::chrono::steady_clock::rep> window_start = 0;
+    std::atomic<unsigned> emitted = 0;
+    std::atomic<unsigned> suppressed_ = 0;
+};
+
+/**
+ * Reads `LIBVA_V4L2_LOG_LEVEL` and `LIBVA_V4L2_LOG_ASYNC`.
+ */
+void log_init();
+
+/**
+ * Waits until all messages queued for the asynchronous sink have been delivered, so that the driver context can go
+ * away.
+ */
+void log_flush();
+
+/**
+ * Formats into a stack buffer and forwards to the libVA error (`Error`, `Warning`) or info (`Info`, `Debug`)
+ * callback. Messages exceeding the buffer are truncated. Does not check the level, use the macros below.
+ */
+void log_message(LogLevel level, VADriverContextP ctx, unsigned suppressed, const char* format, ...)
+    __attribute__((format(printf, 4, 5)));
+void log_message_v(LogLevel level, VADriverContextP ctx, unsigned suppressed, const char* format, va_list args);
+
+/**
+ * Hex dump of a control payload, for `LOG_CONTROL`.
+ */
+void log_control(VADriverContextP ctx, uint32_t id, const void* data, size_t size);
+
+/**
+ * Utility function to access the libVA info callback.
+ */
+void info_log(VADriverContextP ctx, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Utility function to access the libVA error callback.
+ */
+void error_log(VADriverContextP ctx, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+#define LOG(level, ctx, ...)                                                                                           \
+    do {                                                                                                               \
+        if (log_enabled(level))                                                                                        \
+            log_message(level, ctx, 0, __VA_ARGS__);                                                                   \
+    } while (0)
+
+/**
+ * Like `LOG`, but throttled per call site. Use for anything that may fire once per frame.
+ */
+#define LOG_RATELIMITED(level, ctx, ...)                                                                               \
+    do {                                                                                                               \
+        if (log_enabled(level)) {                                                                                      \
+            static RateLimit log_rate_limit_;                                                                          \
+            if (unsigned log_suppressed_; log_rate_limit_.admit(log_suppressed_))                                      \
+                log_message(level, ctx, log_suppressed_, __VA_ARGS__);                                                 \
+        }                                                                                                              \
+    } while (0)
+
+/**
+ * Debug dumps of the per-frame controls, neither formatting nor iteration happens unless debug logging is enabled.
+ */
+#define LOG_CONTROL(ctx, id, data, size)                                                                               \
+    do {                                                                                                               \
+        if (log_enabled(LogLevel::Debug))                                                                              \
+            log_control(ctx, id, data, size);                                                                          \
+    } while (0)
+
+#define LOG_CONTROLS(ctx, controls)                                                                                    \
+    do {                                                                                                               \
+        if (log_enabled(LogLevel::Debug)) {                                                                            \
+            for (const auto& log_control_ : controls)                                                                  \
+                log_control(ctx, log_control_.id, log_control_.ptr, log_control_.size);                                \
+        }                                                                                                              \
+    } while (0)
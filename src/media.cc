@@ -31,39 +31,45 @@
 
 extern "C" {
 #include <linux/media.h>
+#include <poll.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 }
 
+#include "backend.h"
+#include "trace.h"
 #include "utils.h"
 
 int media_request_alloc(int media_fd)
 {
     int fd;
-    errno_wrapper(ioctl, media_fd, MEDIA_IOC_REQUEST_ALLOC, &fd);
+    errno_wrapper(backend_ioctl, media_fd, MEDIA_IOC_REQUEST_ALLOC, &fd);
     return fd;
 }
 
 void media_request_reinit(int request_fd)
 {
-    errno_wrapper(ioctl, request_fd, MEDIA_REQUEST_IOC_REINIT, NULL);
+    errno_wrapper(backend_ioctl, request_fd, MEDIA_REQUEST_IOC_REINIT, nullptr);
 }
 
 void media_request_queue(int request_fd)
 {
-    errno_wrapper(ioctl, request_fd, MEDIA_REQUEST_IOC_QUEUE, NULL);
+    TRACE(request_queue, request_fd);
+    errno_wrapper(backend_ioctl, request_fd, MEDIA_REQUEST_IOC_QUEUE, nullptr);
 }
 
 void media_request_wait_completion(int request_fd)
 {
-    timeval tv = { 0, 300000 };
-    fd_set except_fds;
+    pollfd fds = { .fd = request_fd, .events = POLLPRI };
 
-    FD_ZERO(&except_fds);
-    FD_SET(request_fd, &except_fds);
-
-    int rc = errno_wrapper(select, request_fd + 1, nullptr, nullptr, &except_fds, &tv);
+    TRACE(request_wait, request_fd);
+    int rc = errno_wrapper(backend_poll, &fds, 1, 300);
+    TRACE(request_complete, request_fd, rc);
     if (rc == 0) {
         throw std::runtime_error("Timeout when waiting for media request\n");
     }
 }
+
+void media_request_free(int request_fd)
+{
+    backend_close(request_fd);
+}
@@ -29,3 +29,4 @@ int media_request_alloc(int media_fd);
 void media_request_reinit(int request_fd);
 void media_request_queue(int request_fd);
 void media_request_wait_completion(int request_fd);
+void media_request_free(int request_fd);
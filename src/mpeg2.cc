@@ -40,7 +40,9 @@ extern "C" {
 #include "buffer.h"
 #include "context.h"
 #include "driver.h"
+#include "log.h"
 #include "surface.h"
+#include "trace.h"
 #include "v4l2.h"
 
 namespace {
@@ -85,6 +87,7 @@ VAStatus MPEG2Context::store_buffer(const Buffer& buffer) const
         }
         memcpy(source_data.data() + surface.source_size_used, buffer.data.get(), buffer.size * buffer.count);
         surface.source_size_used += buffer.size * buffer.count;
+        TRACE(store_buffer, "mpeg2", buffer.size * buffer.count);
         break;
 
     default:
@@ -94,16 +97,9 @@ VAStatus MPEG2Context::store_buffer(const Buffer& buffer) const
     return VA_STATUS_SUCCESS;
 }
 
-int MPEG2Context::set_controls()
+v4l2_ctrl_mpeg2_sequence mpeg2_va_to_v4l2_sequence(VAPictureParameterBufferMPEG2* va_picture)
 {
-    auto& surface = driver_data->surfaces.at(render_surface_id);
-
-    VAPictureParameterBufferMPEG2* va_picture = surface.params.mpeg2.picture;
-    VAIQMatrixBufferMPEG2* iqmatrix = surface.params.mpeg2.iqmatrix;
-    v4l2_ctrl_mpeg2_picture picture = {};
     v4l2_ctrl_mpeg2_sequence sequence = {};
-    v4l2_ctrl_mpeg2_quantisation quantisation = {};
-    unsigned int i;
 
     sequence.horizontal_size = va_picture->horizontal_size;
     sequence.vertical_size = va_picture->vertical_size;
@@ -112,11 +108,13 @@ int MPEG2Context::set_controls()
     sequence.profile_and_level_indication = 0;
     sequence.chroma_format = 1; // 4:2:0
 
-    try {
-        device.set_ext_control(surface.request_fd, V4L2_CID_STATELESS_MPEG2_SEQUENCE, &sequence, sizeof(sequence));
-    } catch (std::runtime_error& e) {
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
+    return sequence;
+}
+
+v4l2_ctrl_mpeg2_picture mpeg2_va_to_v4l2_picture(
+    const std::map<VASurfaceID, Surface>& surfaces, const Surface& surface, VAPictureParameterBufferMPEG2* va_picture)
+{
+    v4l2_ctrl_mpeg2_picture picture = {};
 
     picture.picture_coding_type = va_picture->picture_coding_type;
     picture.f_code[0][0] = (va_picture->f_code >> 12) & 0x0f;
@@ -127,13 +125,13 @@ int MPEG2Context::set_controls()
     picture.intra_dc_precision = va_picture->picture_coding_extension.bits.intra_dc_precision;
     picture.picture_structure = va_picture->picture_coding_extension.bits.picture_structure;
 
-    const auto& backward_reference_surface = driver_data->surfaces.find(va_picture->backward_reference_picture);
-    picture.backward_ref_ts = v4l2_timeval_to_ns((backward_reference_surface != driver_data->surfaces.end())
+    const auto& backward_reference_surface = surfaces.find(va_picture->backward_reference_picture);
+    picture.backward_ref_ts = v4l2_timeval_to_ns((backward_reference_surface != surfaces.end())
             ? &backward_reference_surface->second.timestamp
             : &surface.timestamp);
 
-    const auto& forward_reference_surface = driver_data->surfaces.find(va_picture->forward_reference_picture);
-    picture.forward_ref_ts = v4l2_timeval_to_ns((forward_reference_surface != driver_data->surfaces.end())
+    const auto& forward_reference_surface = surfaces.find(va_picture->forward_reference_picture);
+    picture.forward_ref_ts = v4l2_timeval_to_ns((forward_reference_surface != surfaces.end())
             ? &forward_reference_surface->second.timestamp
             : &surface.timestamp);
 
@@ -148,33 +146,71 @@ int MPEG2Context::set_controls()
             | (va_picture->picture_coding_extension.bits.repeat_first_field ? V4L2_MPEG2_PIC_FLAG_REPEAT_FIRST : 0)
             | (va_picture->picture_coding_extension.bits.progressive_frame ? V4L2_MPEG2_PIC_FLAG_PROGRESSIVE : 0));
 
+    return picture;
+}
+
+v4l2_ctrl_mpeg2_quantisation mpeg2_va_to_v4l2_quantisation(VAIQMatrixBufferMPEG2* iqmatrix)
+{
+    v4l2_ctrl_mpeg2_quantisation quantisation = {};
+    unsigned int i;
+
+    for (i = 0; i < 64; i++) {
+        // The V4L2 API allows to set all or none of the quantisation matrices, so use default values for matrices
+        // that are not to be loaded.
+        quantisation.intra_quantiser_matrix[i] = iqmatrix->load_intra_quantiser_matrix
+            ? iqmatrix->intra_quantiser_matrix[i]
+            : default_non_intra_quantisation_matrix_value;
+        quantisation.non_intra_quantiser_matrix[i] = iqmatrix->load_non_intra_quantiser_matrix
+            ? iqmatrix->non_intra_quantiser_matrix[i]
+            : default_non_intra_quantisation_matrix_value;
+        quantisation.chroma_intra_quantiser_matrix[i] = iqmatrix->load_chroma_intra_quantiser_matrix
+            ? iqmatrix->chroma_intra_quantiser_matrix[i]
+            : default_intra_quantisation_matrix[i];
+        quantisation.chroma_non_intra_quantiser_matrix[i] = iqmatrix->load_chroma_non_intra_quantiser_matrix
+            ? iqmatrix->chroma_non_intra_quantiser_matrix[i]
+            : default_intra_quantisation_matrix[i];
+    }
+
+    return quantisation;
+}
+
+mpeg2_controls mpeg2_va_to_v4l2(const std::map<VASurfaceID, Surface>& surfaces, const Surface& surface)
+{
+    VAPictureParameterBufferMPEG2* va_picture = surface.params.mpeg2.picture;
+    VAIQMatrixBufferMPEG2* iqmatrix = surface.params.mpeg2.iqmatrix;
+
+    return {
+        .sequence = mpeg2_va_to_v4l2_sequence(va_picture),
+        .picture = mpeg2_va_to_v4l2_picture(surfaces, surface, va_picture),
+        .quantisation = iqmatrix ? std::optional(mpeg2_va_to_v4l2_quantisation(iqmatrix)) : std::nullopt,
+    };
+}
+
+int MPEG2Context::set_controls()
+{
+    auto& surface = driver_data->surfaces.at(render_surface_id);
+
+    auto [sequence, picture, quantisation] = mpeg2_va_to_v4l2(driver_data->surfaces, surface);
+    LOG_CONTROL(driver_data->va_context, V4L2_CID_STATELESS_MPEG2_SEQUENCE, &sequence, sizeof(sequence));
     try {
-        device.set_ext_control(surface.request_fd, V4L2_CID_STATELESS_MPEG2_PICTURE, &picture, sizeof(picture));
+        device.set_ext_control(surface.request_fd, V4L2_CID_STATELESS_MPEG2_SEQUENCE, &sequence, sizeof(sequence));
     } catch (std::runtime_error& e) {
         return VA_STATUS_ERROR_OPERATION_FAILED;
     }
 
-    if (iqmatrix) {
-        for (i = 0; i < 64; i++) {
-            // The V4L2 API allows to set all or none of the quantisation matrices, so use default values for matrices
-            // that are not to be loaded.
-            quantisation.intra_quantiser_matrix[i] = iqmatrix->load_intra_quantiser_matrix
-                ? iqmatrix->intra_quantiser_matrix[i]
-                : default_non_intra_quantisation_matrix_value;
-            quantisation.non_intra_quantiser_matrix[i] = iqmatrix->load_non_intra_quantiser_matrix
-                ? iqmatrix->non_intra_quantiser_matrix[i]
-                : default_non_intra_quantisation_matrix_value;
-            quantisation.chroma_intra_quantiser_matrix[i] = iqmatrix->load_chroma_intra_quantiser_matrix
-                ? iqmatrix->chroma_intra_quantiser_matrix[i]
-                : default_intra_quantisation_matrix[i];
-            quantisation.chroma_non_intra_quantiser_matrix[i] = iqmatrix->load_chroma_non_intra_quantiser_matrix
-                ? iqmatrix->chroma_non_intra_quantiser_matrix[i]
-                : default_intra_quantisation_matrix[i];
-        }
+    LOG_CONTROL(driver_data->va_context, V4L2_CID_STATELESS_MPEG2_PICTURE, &picture, sizeof(picture));
+    try {
+        device.set_ext_control(surface.request_fd, V4L2_CID_STATELESS_MPEG2_PICTURE, &picture, sizeof(picture));
+    } catch (std::runtime_error& e) {
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
 
+    if (quantisation) {
+        LOG_CONTROL(
+            driver_data->va_context, V4L2_CID_STATELESS_MPEG2_QUANTISATION, &*quantisation, sizeof(*quantisation));
         try {
             device.set_ext_control(
-                surface.request_fd, V4L2_CID_STATELESS_MPEG2_QUANTISATION, &quantisation, sizeof(quantisation));
+                surface.request_fd, V4L2_CID_STATELESS_MPEG2_QUANTISATION, &*quantisation, sizeof(*quantisation));
         } catch (std::runtime_error& e) {
             return VA_STATUS_ERROR_OPERATION_FAILED;
         }
@@ -26,19 +26,41 @@
 
 #pragma once
 
+#include <map>
+#include <optional>
 #include <set>
 
 extern "C" {
+#include <linux/v4l2-controls.h>
+
 #include <va/va.h>
 }
 
 #include "context.h"
+#include "surface.h"
 
 struct Buffer;
 struct DriverData;
-struct Surface;
 class V4L2M2MDevice;
 
+/*
+ * Controls for one picture. References missing from `surfaces` fall back to `surface` itself, the quantisation control
+ * is only needed if the matrices were passed.
+ */
+v4l2_ctrl_mpeg2_sequence mpeg2_va_to_v4l2_sequence(VAPictureParameterBufferMPEG2* va_picture);
+v4l2_ctrl_mpeg2_picture mpeg2_va_to_v4l2_picture(
+    const std::map<VASurfaceID, Surface>& surfaces, const Surface& surface, VAPictureParameterBufferMPEG2* va_picture);
+v4l2_ctrl_mpeg2_quantisation mpeg2_va_to_v4l2_quantisation(VAIQMatrixBufferMPEG2* iqmatrix);
+
+struct mpeg2_controls {
+    v4l2_ctrl_mpeg2_sequence sequence;
+    v4l2_ctrl_mpeg2_picture picture;
+    std::optional<v4l2_ctrl_mpeg2_quantisation> quantisation;
+};
+
+/* The controls `MPEG2Context::set_controls()` submits for the picture stored in `surface.params.mpeg2`. */
+mpeg2_controls mpeg2_va_to_v4l2(const std::map<VASurfaceID, Surface>& surfaces, const Surface& surface);
+
 class MPEG2Context : public Context {
 public:
     static std::set<VAProfile> supported_profiles(const V4L2M2MDevice& device);
@@ -28,6 +28,7 @@
 #include "picture.h"
 
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <functional>
 #include <system_error>
@@ -41,13 +42,27 @@ extern "C" {
 
 #include "context.h"
 #include "driver.h"
+#include "log.h"
 #include "media.h"
+#include "stats.h"
 #include "surface.h"
+#include "trace.h"
 #include "utils.h"
 #include "v4l2.h"
 
 using fourcc = uint32_t;
 
+namespace {
+
+void count_decode_error(const Context& context)
+{
+    if (context.statistics) {
+        context.statistics->decode_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+} // namespace
+
 VAStatus beginPicture(VADriverContextP va_context, VAContextID context_id, VASurfaceID surface_id)
 {
     auto driver_data = static_cast<DriverData*>(va_context->pDriverData);
@@ -62,13 +77,15 @@ VAStatus beginPicture(VADriverContextP va_context, VAContextID context_id, VASur
     }
     auto& surface = driver_data->surfaces.at(surface_id);
 
-    if (surface.status == VASurfaceRendering) {
+    if (surface.status == VASurfaceRendering || surface.mappings) {
         return VA_STATUS_ERROR_SURFACE_BUSY;
     }
 
     surface.status = VASurfaceRendering;
     context.render_surface_id = surface_id;
 
+    TRACE(begin_picture, context_id, surface_id);
+
     return VA_STATUS_SUCCESS;
 }
 
@@ -86,6 +103,11 @@ VAStatus renderPicture(VADriverContextP va_context, VAContextID context_id, VABu
     if (!driver_data->surfaces.contains(context.render_surface_id)) {
         return VA_STATUS_ERROR_INVALID_SURFACE;
     }
+    const auto& surface = driver_data->surfaces.at(context.render_surface_id);
+    const auto source_size_used = surface.source_size_used;
+
+    TRACE(render_picture, context_id, context.render_surface_id, buffers_count);
+
     for (i = 0; i < buffers_count; i++) {
         if (!driver_data->buffers.contains(buffers_ids[i])) {
             return VA_STATUS_ERROR_INVALID_BUFFER;
@@ -96,6 +118,11 @@ VAStatus renderPicture(VADriverContextP va_context, VAContextID context_id, VABu
             return rc;
     }
 
+    if (context.statistics) {
+        context.statistics->output_bytes_copied.fetch_add(
+            surface.source_size_used - source_size_used, std::memory_order_relaxed);
+    }
+
     return VA_STATUS_SUCCESS;
 }
 
@@ -110,41 +137,65 @@ VAStatus endPicture(VADriverContextP va_context, VAContextID context_id)
     auto& context = *driver_data->contexts.at(context_id);
     auto& surface = driver_data->surfaces.at(context.render_surface_id);
 
+    TRACE(end_picture, context_id, context.render_surface_id, surface.source_size_used);
+
     gettimeofday(&surface.timestamp, NULL);
 
     if (context.device.media_fd >= 0) {
         if (surface.request_fd < 0) {
+            count_ioctl(context.statistics, Ioctl::REQUEST_ALLOC);
             surface.request_fd = media_request_alloc(context.device.media_fd);
         }
 
         status = context.set_controls();
-        if (status != VA_STATUS_SUCCESS)
+        if (status != VA_STATUS_SUCCESS) {
+            count_decode_error(context);
             return status;
+        }
     }
 
     try {
-        surface.destination_buffer->get().queue();
-        surface.source_buffer->get().queue(surface.request_fd, &surface.timestamp, surface.source_size_used);
+        context.queue_buffers(surface);
     } catch (std::system_error& e) {
-        error_log(va_context, "Unable to queue buffer: %s\n", e.what());
+        count_decode_error(context);
+        LOG_RATELIMITED(LogLevel::Error, va_context, "Unable to queue buffer: %s\n", e.what());
         return VA_STATUS_ERROR_OPERATION_FAILED;
     }
 
+    surface.submitted = std::chrono::steady_clock::now();
+    if (context.statistics) {
+        context.statistics->enqueued();
+    }
+
     if (surface.request_fd >= 0) {
         try {
+            count_ioctl(context.statistics, Ioctl::REQUEST_QUEUE);
             media_request_queue(surface.request_fd);
             media_request_wait_completion(surface.request_fd);
+            if (context.statistics) {
+                const auto elapsed = std::chrono::steady_clock::now() - surface.submitted;
+                context.statistics->submit_to_complete.record(
+                    std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+            }
+            count_ioctl(context.statistics, Ioctl::REQUEST_REINIT);
             media_request_reinit(surface.request_fd);
         } catch (std::runtime_error& e) {
-            close(surface.request_fd);
+            media_request_free(surface.request_fd);
             surface.request_fd = -1;
-            error_log(va_context, "Failed to process request: %s\n", e.what());
+            // syncSurface() is never reached for the failed picture, which would take it off the gauge otherwise
+            if (context.statistics) {
+                context.statistics->dequeued();
+            }
+            count_decode_error(context);
+            LOG_RATELIMITED(LogLevel::Error, va_context, "Failed to process request: %s\n", e.what());
             return VA_STATUS_ERROR_OPERATION_FAILED;
         }
     }
 
     surface.source_size_used = 0;
 
+    TRACE(end_picture_done, context_id, context.render_surface_id);
+
     context.render_surface_id = VA_INVALID_ID;
     memset(&surface.params, 0, sizeof(surface.params));
 
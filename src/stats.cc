@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <new>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+}
+
+#include "log.h"
+#include "utils.h"
+
+namespace {
+
+void update_max(std::atomic<uint64_t>& max, uint64_t value)
+{
+    uint64_t current = max.load(std::memory_order_relaxed);
+    while (current < value && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) { }
+}
+
+void dump_histogram(VADriverContextP va_context, const char* name, const LatencyHistogram& histogram)
+{
+    info_log(va_context,
+        "  %s: count %llu mean %lluus p50 %lluus p90 %lluus p99 %lluus p99.9 %lluus max %lluus\n", name,
+        static_cast<unsigned long long>(histogram.count()), static_cast<unsigned long long>(histogram.mean()),
+        static_cast<unsigned long long>(histogram.percentile(50)),
+        static_cast<unsigned long long>(histogram.percentile(90)),
+        static_cast<unsigned long long>(histogram.percentile(99)),
+        static_cast<unsigned long long>(histogram.percentile(99.9)),
+        static_cast<unsigned long long>(histogram.max()));
+}
+
+} // namespace
+
+const char* ioctl_name(Ioctl ioctl)
+{
+    switch (ioctl) {
+    case Ioctl::QUERYBUF:
+        return "QUERYBUF";
+    case Ioctl::QBUF:
+        return "QBUF";
+    case Ioctl::DQBUF:
+        return "DQBUF";
+    case Ioctl::EXPBUF:
+        return "EXPBUF";
+    case Ioctl::REQBUFS:
+        return "REQBUFS";
+    case Ioctl::S_FMT:
+        return "S_FMT";
+    case Ioctl::G_CTRL:
+        return "G_CTRL";
+    case Ioctl::S_EXT_CTRLS:
+        return "S_EXT_CTRLS";
+    case Ioctl::STREAMON:
+        return "STREAMON";
+    case Ioctl::STREAMOFF:
+        return "STREAMOFF";
+    case Ioctl::REQUEST_ALLOC:
+        return "REQUEST_ALLOC";
+    case Ioctl::REQUEST_QUEUE:
+        return "REQUEST_QUEUE";
+    case Ioctl::REQUEST_REINIT:
+        return "REQUEST_REINIT";
+    case Ioctl::PREPARE_BUF:
+        return "PREPARE_BUF";
+    case Ioctl::G_SELECTION:
+        return "G_SELECTION";
+    case Ioctl::S_SELECTION:
+        return "S_SELECTION";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+unsigned LatencyHistogram::index(uint64_t value)
+{
+    if (value < sub_bucket_count) {
+        return value;
+    }
+
+    const unsigned msb = 63 - __builtin_clzll(value);
+    if (msb >= max_value_bits) {
+        return bucket_count - 1;
+    }
+
+    const unsigned shift = msb - (sub_bucket_bits - 1);
+    return sub_bucket_count + (shift - 1) * (sub_bucket_count / 2) + ((value >> shift) - sub_bucket_count / 2);
+}
+
+uint64_t LatencyHistogram::lowest_value(unsigned index)
+{
+    if (index < sub_bucket_count) {
+        return index;
+    }
+
+    const unsigned offset = index - sub_bucket_count;
+    const unsigned shift = offset / (sub_bucket_count / 2) + 1;
+    return static_cast<uint64_t>(offset % (sub_bucket_count / 2) + sub_bucket_count / 2) << shift;
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+    counts_[index(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    update_max(max_, value);
+}
+
+void LatencyHistogram::reset()
+{
+    for (auto& count : counts_) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::mean() const
+{
+    const auto n = count();
+    return n ? sum_.load(std::memory_order_relaxed) / n : 0;
+}
+
+uint64_t LatencyHistogram::percentile(double percentile) const
+{
+    const auto target = static_cast<uint64_t>(std::ceil(percentile / 100.0 * count()));
+    if (target == 0) {
+        return 0;
+    }
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < bucket_count; i++) {
+        seen += counts_[i].load(std::memory_order_relaxed);
+        if (seen >= target) { // report the highest value equivalent to the bucket, like HdrHistogram does
+            return (i + 1 < bucket_count) ? std::min(lowest_value(i + 1) - 1, max()) : max();
+        }
+    }
+    return max();
+}
+
+void ContextStatistics::reset()
+{
+    context_id.store(VA_INVALID_ID, std::memory_order_relaxed);
+    profile.store(VAProfileNone, std::memory_order_relaxed);
+    for (auto* counter : { &frames_decoded, &decode_errors, &output_bytes_copied, &in_flight, &max_in_flight,
+             &mapped_bytes, &cma_bytes }) {
+        counter->store(0, std::memory_order_relaxed);
+    }
+    for (auto& count : ioctls) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    submit_to_complete.reset();
+    sync_wait.reset();
+}
+
+void ContextStatistics::enqueued()
+{
+    update_max(max_in_flight, in_flight.fetch_add(1, std::memory_order_relaxed) + 1);
+}
+
+Statistics::Statistics(const std::optional<std::string>& shm_name)
+    : segment_(nullptr)
+    , shm_name_(shm_name)
+{
+    if (shm_name_) {
+        if (shm_name_->empty() || shm_name_->front() != '/') {
+            shm_name_ = "/libva-v4l2." + std::to_string(getpid());
+        }
+
+        // Readable by everyone, but only writable through the mapping established here.
+        int fd = shm_open(shm_name_->c_str(), O_CREAT | O_EXCL | O_RDWR, 0444);
+        if (fd >= 0) {
+            if (ftruncate(fd, sizeof(StatisticsSegment)) == 0) {
+                void* memory = mmap(nullptr, sizeof(StatisticsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (memory != MAP_FAILED) {
+                    segment_ = new (memory) StatisticsSegment();
+                }
+            }
+            close(fd);
+            if (!segment_) {
+                shm_unlink(shm_name_->c_str());
+            }
+        }
+        if (!segment_) {
+            shm_name_.reset();
+        }
+    }
+
+    if (!segment_) {
+        segment_ = new StatisticsSegment();
+    }
+
+    segment_->version = StatisticsSegment::current_version;
+    segment_->size = sizeof(StatisticsSegment);
+    segment_->pid = getpid();
+    std::atomic_thread_fence(std::memory_order_release);
+    segment_->magic = StatisticsSegment::expected_magic;
+}
+
+Statistics::~Statistics()
+{
+    if (shm_name_) {
+        segment_->~StatisticsSegment();
+        munmap(segment_, sizeof(StatisticsSegment));
+        shm_unlink(shm_name_->c_str());
+    } else {
+        delete segment_;
+    }
+}
+
+ContextStatistics* Statistics::acquire()
+{
+    for (auto preferred : { ContextStatistics::Free, ContextStatistics::Retired }) {
+        for (auto& slot : segment_->contexts) {
+            uint32_t expected = preferred;
+            // Other processes sharing the segment may race for the slot, `state` is only ever changed by the CAS
+            if (slot.state.compare_exchange_strong(expected, ContextStatistics::Active)) {
+                slot.reset();
+                return &slot;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void Statistics::release(ContextStatistics* statistics)
+{
+    if (statistics) {
+        statistics->state.store(ContextStatistics::Retired, std::memory_order_release);
+    }
+}
+
+void Statistics::dump(VADriverContextP va_context) const
+{
+    for (const auto& slot : segment_->contexts) {
+        const auto state = slot.state.load(std::memory_order_acquire);
+        if (state == ContextStatistics::Free) {
+            continue;
+        }
+
+        info_log(va_context, "Statistics for context %u (profile %d, %s):\n", slot.context_id.load(),
+            slot.profile.load(), (state == ContextStatistics::Active) ? "active" : "destroyed");
+        info_log(va_context, "  frames decoded %llu, decode errors %llu, output bytes copied %llu\n",
+            static_cast<unsigned long long>(slot.frames_decoded.load()),
+            static_cast<unsigned long long>(slot.decode_errors.load()),
+            static_cast<unsigned long long>(slot.output_bytes_copied.load()));
+        info_log(va_context, "  in flight %llu (max %llu), mapped %llu bytes, device memory %llu bytes\n",
+            static_cast<unsigned long long>(slot.in_flight.load()),
+            static_cast<unsigned long long>(slot.max_in_flight.load()),
+            static_cast<unsigned long long>(slot.mapped_bytes.load()),
+            static_cast<unsigned long long>(slot.cma_bytes.load()));
+
+        std::string ioctls;
+        for (unsigned i = 0; i < slot.ioctls.size(); i++) {
+            if (const auto n = slot.ioctls[i].load(); n > 0) {
+                ioctls += std::string(" ") + ioctl_name(static_cast<Ioctl>(i)) + "=" + std::to_string(n);
+            }
+        }
+        info_log(va_context, "  ioctls:%s\n", ioctls.c_str());
+
+        dump_histogram(va_context, "submit to complete", slot.submit_to_complete);
+        dump_histogram(va_context, "sync wait", slot.sync_wait);
+    }
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+extern "C" {
+#include <va/va_backend.h>
+}
+
+/**
+ * Ioctls issued on behalf of a context, used to index `ContextStatistics::ioctls`.
+ */
+enum class Ioctl : unsigned {
+    QUERYBUF,
+    QBUF,
+    DQBUF,
+    EXPBUF,
+    REQBUFS,
+    S_FMT,
+    G_CTRL,
+    S_EXT_CTRLS,
+    STREAMON,
+    STREAMOFF,
+    REQUEST_ALLOC,
+    REQUEST_QUEUE,
+    REQUEST_REINIT,
+    PREPARE_BUF,
+    G_SELECTION,
+    S_SELECTION,
+    count
+};
+
+const char* ioctl_name(Ioctl ioctl);
+
+/**
+ * Lock-free latency histogram in the spirit of HdrHistogram.
+ *
+ * Values are bucketed by their most significant bit, each bucket being split into linear sub-buckets. This bounds the
+ * relative error of reported percentiles to 1/32 while keeping the histogram small enough to live in shared memory.
+ */
+class LatencyHistogram {
+public:
+    static constexpr unsigned sub_bucket_bits = 5;
+    static constexpr unsigned sub_bucket_count = 1u << sub_bucket_bits;
+    static constexpr unsigned max_value_bits = 40;
+    static constexpr unsigned bucket_count
+        = sub_bucket_count + (max_value_bits - sub_bucket_bits) * (sub_bucket_count / 2);
+
+    void record(uint64_t value);
+    void reset();
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    uint64_t mean() const;
+    uint64_t percentile(double percentile) const;
+
+private:
+    static unsigned index(uint64_t value);
+    static uint64_t lowest_value(unsigned index);
+
+    std::array<std::atomic<uint64_t>, bucket_count> counts_;
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+};
+
+/**
+ * Counters of a single context.
+ *
+ * All members are plain atomics, so the structure can be placed in shared memory and scraped by external processes.
+ * Latencies are recorded in microseconds.
+ */
+struct ContextStatistics {
+    enum State : uint32_t {
+        Free,
+        Active,
+        Retired,
+    };
+
+    std::atomic<uint32_t> state;
+    std::atomic<uint32_t> context_id;
+    std::atomic<int32_t> profile;
+    std::atomic<uint64_t> frames_decoded;
+    std::atomic<uint64_t> decode_errors;
+    std::atomic<uint64_t> output_bytes_copied;
+    std::atomic<uint64_t> in_flight;
+    std::atomic<uint64_t> max_in_flight;
+    std::atomic<uint64_t> mapped_bytes;
+    std::atomic<uint64_t> cma_bytes;
+    std::array<std::atomic<uint64_t>, static_cast<unsigned>(Ioctl::count)> ioctls;
+    LatencyHistogram submit_to_complete;
+    LatencyHistogram sync_wait;
+
+    /** Zero all counters for a new context, leaving `state` to whoever owns the slot. */
+    void reset();
+    void count(Ioctl ioctl) { ioctls[static_cast<unsigned>(ioctl)].fetch_add(1, std::memory_order_relaxed); }
+    void enqueued();
+    void dequeued() { in_flight.fetch_sub(1, std::memory_order_relaxed); }
+};
+
+/**
+ * Layout of the statistics segment, shared with monitoring agents when enabled.
+ *
+ * Readers are expected to check `magic`, `version` and `size` before interpreting the remainder.
+ */
+struct StatisticsSegment {
+    static constexpr uint32_t expected_magic = 0x4c345653; // "SV4L"
+    static constexpr uint32_t current_version = 4;
+    static constexpr unsigned max_contexts = 32;
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t pid;
+    ContextStatistics contexts[max_contexts];
+};
+
+class Statistics {
+public:
+    /**
+     * Set up statistics storage, in a POSIX shared memory object called `shm_name` if given.
+     */
+    explicit Statistics(const std::optional<std::string>& shm_name);
+    Statistics(const Statistics&) = delete;
+    Statistics& operator=(const Statistics&) = delete;
+    ~Statistics();
+
+    /**
+     * Reserve a slot for a new context, preferring unused slots over retired ones. May return nullptr.
+     */
+    ContextStatistics* acquire();
+    void release(ContextStatistics* statistics);
+    void dump(VADriverContextP va_context) const;
+
+private:
+    StatisticsSegment* segment_;
+    std::optional<std::string> shm_name_;
+};
+
+/**
+ * Helper for the common case of optional statistics.
+ */
+inline void count_ioctl(ContextStatistics* statistics, Ioctl ioctl)
+{
+    if (statistics) {
+        statistics->count(ioctl);
+    }
+}
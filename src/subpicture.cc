@@ -26,52 +26,397 @@
 
 #include "subpicture.h"
 
+#include <algorithm>
+#include <cmath>
+#include <system_error>
+#include <vector>
+
+extern "C" {
+#include <linux/dma-buf.h>
+}
+
+#include "buffer.h"
+#include "convert.h"
+#include "driver.h"
+#include "format.h"
+#include "image.h"
+#include "log.h"
+#include "surface.h"
+#include "utils.h"
+
+namespace {
+
+constexpr unsigned supported_flags = VA_SUBPICTURE_CHROMA_KEYING | VA_SUBPICTURE_GLOBAL_ALPHA;
+
+/**
+ * Map picture coordinates along one axis to the subpicture image's: -1 outside the (clipped) destination or the image.
+ */
+std::vector<int> sample_positions(int first, int count, int begin, int end, int destination, unsigned destination_size,
+    int source, unsigned source_size, unsigned limit)
+{
+    std::vector<int> result(count);
+    for (int i = 0; i < count; i++) {
+        const int position = first + i;
+        const auto sample = source + static_cast<int64_t>(position - destination) * source_size / destination_size;
+        result[i] = (position >= begin && position < end && sample >= 0 && sample < limit) ? sample : -1;
+    }
+    return result;
+}
+
+/**
+ * Blend one subpicture into the linear `NV12` planes, a pair of rows at a time: the image is sampled into BGRA rows,
+ * converted to YUV like an uploaded image, and blended by its alpha, averaged over each 2x2 block for chroma.
+ */
+void blend_subpicture(DriverData* driver_data, Surface& surface, const Subpicture& subpicture)
+{
+    auto image_it = driver_data->images.find(subpicture.image_id);
+    if (image_it == driver_data->images.end() || !driver_data->buffers.contains(image_it->second.buf)) {
+        return;
+    }
+    const auto& image = image_it->second;
+    const auto& buffer = driver_data->buffers.at(image.buf);
+    static const std::array<uint32_t, 16> black = {};
+    auto palette_it = driver_data->palettes.find(subpicture.image_id);
+    const auto& palette = (palette_it != driver_data->palettes.end()) ? palette_it->second : black;
+
+    const auto& source = subpicture.source;
+    const auto& destination = subpicture.destination;
+    const auto& visible = surface.visible;
+    const auto& layout = surface.composed.layout;
+    if (!source.width || !source.height || !destination.width || !destination.height) {
+        return;
+    }
+
+    // Clipped to the visible area, in picture coordinates
+    const int left = visible.left + std::max(destination.x, short(0));
+    const int top = visible.top + std::max(destination.y, short(0));
+    const int right = visible.left + std::min<int>(destination.x + destination.width, visible.width);
+    const int bottom = visible.top + std::min<int>(destination.y + destination.height, visible.height);
+    // Whole 2x2 blocks are blended, the pixels around the rectangle transparent
+    const int x0 = left & ~1;
+    const int y0 = top & ~1;
+    const int width = std::min<int>((right + 1) & ~1, layout[0].pitch) - x0;
+    const int height = std::min<int>((bottom + 1) & ~1, layout[0].size / layout[0].pitch) - y0;
+    if (left >= right || top >= bottom || width <= 0 || height <= 0) {
+        return;
+    }
+    const auto columns = sample_positions(x0, width, left, right, visible.left + destination.x, destination.width,
+        source.x, source.width, image.width);
+    const auto rows = sample_positions(y0, height, top, bottom, visible.top + destination.y, destination.height,
+        source.y, source.height, image.height);
+
+    std::vector<uint8_t> bgra(2 * 4 * width);
+    std::vector<uint8_t> luma(2 * width);
+    std::vector<uint8_t> luma_alpha(2 * width);
+    std::vector<uint8_t> chroma(width);
+    std::vector<uint8_t> chroma_alpha(width);
+    const auto data = surface.composed.data();
+    const auto pixels = buffer.memory() + image.offsets[0];
+
+    buffer.sync(DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+    for (int y = 0; y + 1 < height; y += 2) {
+        for (int i = 0; i < 2; i++) {
+            const auto row = pixels + std::max(rows[y + i], 0) * image.pitches[0];
+            for (int x = 0; x < width; x++) {
+                uint32_t color = 0;
+                if (rows[y + i] >= 0 && columns[x] >= 0) {
+                    color = fetch_pixel(image.format.fourcc, row, palette, columns[x]);
+                    auto alpha = color >> 24;
+                    if ((subpicture.flags & VA_SUBPICTURE_CHROMA_KEYING) && chromakeyed(subpicture, color)) {
+                        alpha = 0;
+                    }
+                    if (subpicture.flags & VA_SUBPICTURE_GLOBAL_ALPHA) {
+                        alpha = (alpha * subpicture.global_alpha + 127) / 255;
+                    }
+                    color = alpha << 24 | (color & 0xffffff);
+                }
+                const auto pixel = bgra.data() + 4 * (i * width + x);
+                pixel[0] = color;
+                pixel[1] = color >> 8;
+                pixel[2] = color >> 16;
+                pixel[3] = color >> 24;
+                luma_alpha[i * width + x] = color >> 24;
+            }
+        }
+        for (int x = 0; x < width; x += 2) {
+            const auto alpha
+                = (luma_alpha[x] + luma_alpha[x + 1] + luma_alpha[width + x] + luma_alpha[width + x + 1] + 2) >> 2;
+            chroma_alpha[x] = alpha;
+            chroma_alpha[x + 1] = alpha;
+        }
+        const UploadSource upload_source
+            = { .fourcc = VA_FOURCC_BGRA, .planes = { bgra.data() }, .pitches = { 4 * size_t(width) } };
+        const UploadDestination upload_destination
+            = { .luma = luma.data(), .luma_pitch = size_t(width), .chroma = chroma.data(), .chroma_pitch = 0 };
+        upload_rows(upload_destination, upload_source, width, 0, 2);
+
+        const auto luma_row = data + layout[0].offset + (y0 + y) * layout[0].pitch + x0;
+        blend_row(luma_row, luma.data(), luma_alpha.data(), width);
+        blend_row(luma_row + layout[0].pitch, luma.data() + width, luma_alpha.data() + width, width);
+        blend_row(data + layout[1].offset + (y0 + y) / 2 * layout[1].pitch + x0, chroma.data(), chroma_alpha.data(),
+            width);
+    }
+    buffer.sync(DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
+} // namespace
+
+bool chromakeyed(const Subpicture& subpicture, uint32_t color)
+{
+    for (unsigned shift = 0; shift < 24; shift += 8) {
+        const auto mask = subpicture.chromakey_mask >> shift & 0xff;
+        const auto component = color >> shift & mask;
+        if (component < (subpicture.chromakey_min >> shift & mask)
+            || component > (subpicture.chromakey_max >> shift & mask)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t fetch_pixel(uint32_t fourcc, const uint8_t* row, const std::array<uint32_t, 16>& palette, unsigned x)
+{
+    switch (fourcc) {
+    case VA_FOURCC_ARGB:
+        return row[4 * x + 3] << 24 | row[4 * x + 2] << 16 | row[4 * x + 1] << 8 | row[4 * x];
+    case VA_FOURCC_RGBA:
+        return row[4 * x + 3] << 24 | row[4 * x] << 16 | row[4 * x + 1] << 8 | row[4 * x + 2];
+    case VA_FOURCC_AI44:
+        return (row[x] >> 4) * 17u << 24 | palette[row[x] & 0xf];
+    default:
+        return (row[x] & 0xf) * 17u << 24 | palette[row[x] >> 4];
+    }
+}
+
+bool compose_subpictures(DriverData* driver_data, Surface& surface, bool shareable)
+{
+    if (surface.subpictures.empty() || !surface.destination_buffer) {
+        return false;
+    }
+    const auto& capture_buffer = surface.destination_buffer->get();
+    const auto& format = lookup_format(capture_buffer.owner().capture_format.fmt.pix_mp.pixelformat);
+    const auto& layout = surface.logical_destination_layout;
+    if (format.va.format != VA_FOURCC_NV12 || format.compressed || layout.size() != 2) {
+        return false;
+    }
+
+    auto& composed = surface.composed;
+    // Tiled planes are copied in whole tile rows
+    const unsigned row_unit = format.tiled() ? format.tile.height : 1;
+    const unsigned luma_rows = layout[0].size / (layout[0].pitch * row_unit) * row_unit;
+    const unsigned chroma_rows = layout[1].size / (layout[1].pitch * row_unit) * row_unit;
+    const unsigned luma_size = luma_rows * layout[0].pitch;
+    composed.layout
+        = { { 0, luma_size, layout[0].pitch, 0 }, { 0, chroma_rows * layout[1].pitch, layout[1].pitch, luma_size } };
+    const auto size = luma_size + chroma_rows * layout[1].pitch;
+    // Earlier exports may still be read by their importers, each gets its own allocation sized for the picture
+    if (shareable) {
+        if (!driver_data->dma_heap) {
+            return false;
+        }
+        try {
+            composed.allocation = driver_data->dma_heap->allocate(size);
+        } catch (std::system_error& e) {
+            LOG_RATELIMITED(LogLevel::Error, driver_data->va_context, "Failed to allocate composed picture: %s\n",
+                e.what());
+            return false;
+        }
+        composed.memory = {};
+    } else {
+        composed.allocation.reset();
+        composed.memory.resize(size);
+    }
+
+    std::vector<std::span<uint8_t>> mapping;
+    try {
+        mapping = capture_buffer.mapping();
+    } catch (std::system_error& e) {
+        LOG_RATELIMITED(LogLevel::Error, driver_data->va_context, "Failed to map surface: %s\n", e.what());
+        return false;
+    }
+
+    if (composed.allocation) {
+        composed.allocation->sync(DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+    }
+    capture_buffer.sync(DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+    for (unsigned i = 0; i < 2; i++) {
+        const auto source = mapping[layout[i].physical_plane_index].data() + layout[i].offset;
+        const auto& plane = composed.layout[i];
+        const auto rows = plane.size / plane.pitch;
+        if (format.tiled()) {
+            detile_rows(composed.data() + plane.offset, source, plane.pitch, format.tile.width, format.tile.height,
+                rows / format.tile.height);
+        } else {
+            driver_data->copy_pool.copy_plane(
+                composed.data() + plane.offset, plane.pitch, source, plane.pitch, plane.pitch, rows);
+        }
+    }
+    capture_buffer.sync(DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+    for (auto subpicture_id : surface.subpictures) {
+        if (auto it = driver_data->subpictures.find(subpicture_id); it != driver_data->subpictures.end()) {
+            blend_subpicture(driver_data, surface, it->second);
+        }
+    }
+    if (composed.allocation) {
+        composed.allocation->sync(DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+    }
+
+    return true;
+}
+
 VAStatus createSubpicture(VADriverContextP context, VAImageID image_id, VASubpictureID* subpicture_id)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    if (!driver_data->images.contains(image_id)) {
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+    }
+    if (!lookup_subpicture_format(driver_data->images.at(image_id).format.fourcc)) {
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+    }
+
+    std::lock_guard<std::mutex> guard(driver_data->mutex);
+    *subpicture_id = smallest_free_key(driver_data->subpictures);
+    driver_data->subpictures.emplace(*subpicture_id, Subpicture { .image_id = image_id });
+
+    return VA_STATUS_SUCCESS;
 }
 
 VAStatus destroySubpicture(VADriverContextP context, VASubpictureID subpicture_id)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    std::lock_guard<std::mutex> guard(driver_data->mutex);
+    if (!driver_data->subpictures.erase(subpicture_id)) {
+        return VA_STATUS_ERROR_INVALID_SUBPICTURE;
+    }
+    for (auto& [id, surface] : driver_data->surfaces) {
+        std::erase(surface.subpictures, subpicture_id);
+    }
+
+    return VA_STATUS_SUCCESS;
 }
 
 VAStatus querySubpictureFormats(
     VADriverContextP context, VAImageFormat* formats, unsigned int* flags, unsigned int* formats_count)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    *formats_count = 0;
+    for (const auto& format : subpicture_formats) {
+        formats[*formats_count] = format.va;
+        flags[(*formats_count)++] = supported_flags;
+    }
+
+    return VA_STATUS_SUCCESS;
 }
 
 VAStatus setSubpictureImage(VADriverContextP context, VASubpictureID subpicture_id, VAImageID image_id)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    if (!driver_data->subpictures.contains(subpicture_id)) {
+        return VA_STATUS_ERROR_INVALID_SUBPICTURE;
+    }
+    if (!driver_data->images.contains(image_id)) {
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+    }
+    if (!lookup_subpicture_format(driver_data->images.at(image_id).format.fourcc)) {
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+    }
+    driver_data->subpictures.at(subpicture_id).image_id = image_id;
+
+    return VA_STATUS_SUCCESS;
 }
 
 VAStatus setSubpicturePalette(VADriverContextP context, VASubpictureID subpicture_id, unsigned char* palette)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    if (!driver_data->subpictures.contains(subpicture_id)) {
+        return VA_STATUS_ERROR_INVALID_SUBPICTURE;
+    }
+
+    return setImagePalette(context, driver_data->subpictures.at(subpicture_id).image_id, palette);
 }
 
 VAStatus setSubpictureChromakey(VADriverContextP context, VASubpictureID subpicture_id, unsigned int chromakey_min,
     unsigned int chromakey_max, unsigned int chromakey_mask)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    if (!driver_data->subpictures.contains(subpicture_id)) {
+        return VA_STATUS_ERROR_INVALID_SUBPICTURE;
+    }
+    auto& subpicture = driver_data->subpictures.at(subpicture_id);
+    subpicture.chromakey_min = chromakey_min;
+    subpicture.chromakey_max = chromakey_max;
+    subpicture.chromakey_mask = chromakey_mask;
+
+    return VA_STATUS_SUCCESS;
 }
 
 VAStatus setSubpictureGlobalAlpha(VADriverContextP context, VASubpictureID subpicture_id, float global_alpha)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    if (!driver_data->subpictures.contains(subpicture_id)) {
+        return VA_STATUS_ERROR_INVALID_SUBPICTURE;
+    }
+    if (!(global_alpha >= 0.0f && global_alpha <= 1.0f)) {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    driver_data->subpictures.at(subpicture_id).global_alpha = std::lround(global_alpha * 255);
+
+    return VA_STATUS_SUCCESS;
 }
 
 VAStatus associateSubpicture(VADriverContextP context, VASubpictureID subpicture_id, VASurfaceID* surfaces_ids,
     int surfaces_count, short src_x, short src_y, unsigned short src_width, unsigned short src_height, short dst_x,
     short dst_y, unsigned short dst_width, unsigned short dst_height, unsigned int flags)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    if (!driver_data->subpictures.contains(subpicture_id)) {
+        return VA_STATUS_ERROR_INVALID_SUBPICTURE;
+    }
+    // Subpictures are only blended into pictures, there is no screen
+    if (flags & ~supported_flags) {
+        return VA_STATUS_ERROR_FLAG_NOT_SUPPORTED;
+    }
+    for (int i = 0; i < surfaces_count; i++) {
+        if (!driver_data->surfaces.contains(surfaces_ids[i])) {
+            return VA_STATUS_ERROR_INVALID_SURFACE;
+        }
+    }
+
+    auto& subpicture = driver_data->subpictures.at(subpicture_id);
+    subpicture.source = { src_x, src_y, src_width, src_height };
+    subpicture.destination = { dst_x, dst_y, dst_width, dst_height };
+    subpicture.flags = flags;
+    for (int i = 0; i < surfaces_count; i++) {
+        auto& associated = driver_data->surfaces.at(surfaces_ids[i]).subpictures;
+        if (std::ranges::find(associated, subpicture_id) == associated.end()) {
+            associated.push_back(subpicture_id);
+        }
+    }
+
+    return VA_STATUS_SUCCESS;
 }
 
 VAStatus deassociateSubpicture(
     VADriverContextP context, VASubpictureID subpicture_id, VASurfaceID* surfaces_ids, int surfaces_count)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    if (!driver_data->subpictures.contains(subpicture_id)) {
+        return VA_STATUS_ERROR_INVALID_SUBPICTURE;
+    }
+    for (int i = 0; i < surfaces_count; i++) {
+        if (!driver_data->surfaces.contains(surfaces_ids[i])) {
+            return VA_STATUS_ERROR_INVALID_SURFACE;
+        }
+        std::erase(driver_data->surfaces.at(surfaces_ids[i]).subpictures, subpicture_id);
+    }
+
+    return VA_STATUS_SUCCESS;
 }
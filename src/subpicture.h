@@ -26,10 +26,44 @@
 
 #pragma once
 
+#include <array>
+#include <cstdint>
+
 extern "C" {
 #include <va/va_backend.h>
 }
 
+struct DriverData;
+struct Surface;
+
+struct Subpicture {
+    VAImageID image_id;
+    /** Where the image is blended, set by the last `vaAssociateSubpicture()` for all surfaces alike. */
+    VARectangle source;
+    VARectangle destination;
+    /** `VA_SUBPICTURE_CHROMA_KEYING` and `VA_SUBPICTURE_GLOBAL_ALPHA`, enabling the respective effect. */
+    unsigned flags = 0;
+    /** Colors with all components masked by `chromakey_mask` within the masked minimum and maximum are transparent. */
+    uint32_t chromakey_min = 0;
+    uint32_t chromakey_max = 0;
+    uint32_t chromakey_mask = 0;
+    /** Scales the alpha of each pixel, from 0 to 255. */
+    unsigned global_alpha = 255;
+};
+
+/** Whether the chroma key of the subpicture makes the `0xAARRGGBB` color transparent. */
+bool chromakeyed(const Subpicture& subpicture, uint32_t color);
+
+/** Pixel `x` of a row of a subpicture image as `0xAARRGGBB`, `palette` being used by the indexed formats. */
+uint32_t fetch_pixel(uint32_t fourcc, const uint8_t* row, const std::array<uint32_t, 16>& palette, unsigned x);
+
+/**
+ * Copy the surface's picture into `surface.composed` and blend its subpictures over the visible area, scaled with
+ * nearest neighbor sampling. With `shareable`, the copy is allocated from the dma-buf heap to be exported. False if the
+ * surface has no subpictures, or its picture isn't 8-bit `NV12`, which is then read back or exported as decoded.
+ */
+bool compose_subpictures(DriverData* driver_data, Surface& surface, bool shareable);
+
 VAStatus createSubpicture(VADriverContextP context, VAImageID image_id, VASubpictureID* subpicture_id);
 VAStatus destroySubpicture(VADriverContextP context, VASubpictureID subpicture_id);
 VAStatus querySubpictureFormats(
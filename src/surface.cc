@@ -29,9 +29,11 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <stdexcept>
+#include <utility>
 
 extern "C" {
 #include <fcntl.h>
@@ -45,19 +47,51 @@ extern "C" {
 #include <va/va_drmcommon.h>
 }
 
+#include "buffer.h"
+#include "config.h"
 #include "driver.h"
 #include "format.h"
+#include "image.h"
+#include "log.h"
 #include "media.h"
+#include "stats.h"
+#include "subpicture.h"
+#include "trace.h"
 #include "utils.h"
 #include "v4l2.h"
 
 namespace {
 
-decltype(formats)::const_iterator matching_format(const V4L2M2MDevice& device, uint32_t format)
+/** How long `syncSurface()` waits for a processing device to finish a picture before failing it, in milliseconds. */
+constexpr int processing_timeout_ms = 300;
+
+/**
+ * The visible part of the pictures decoded by the device, after the CAPTURE format is set: the driver's compose
+ * rectangle where it has one, the surface size otherwise, within the decoded size.
+ */
+v4l2_rect visible_rect(const V4L2M2MDevice& device, const Format& format, unsigned width, unsigned height)
 {
-    return std::ranges::find_if(formats, [&](auto&& f) {
-        return f.va.rt_format == format && device.format_supported(device.capture_buf_type, f.v4l2.format);
-    });
+    const auto& driver_format = device.capture_format.fmt.pix_mp;
+    auto rect = device.get_selection(device.capture_buf_type, V4L2_SEL_TGT_COMPOSE)
+                    .value_or(v4l2_rect { .width = width, .height = height });
+    unsigned left = std::max(rect.left, 0);
+    unsigned top = std::max(rect.top, 0);
+
+    // Exports and derived images can't start within a group of samples or a tile, they include the margin instead
+    if (!starts_on_sample(format, left, top)) {
+        rect.width += left;
+        rect.height += top;
+        left = top = 0;
+    }
+    left = std::min(left, driver_format.width);
+    top = std::min(top, driver_format.height);
+
+    return {
+        .left = static_cast<int32_t>(left),
+        .top = static_cast<int32_t>(top),
+        .width = std::min(rect.width, driver_format.width - left),
+        .height = std::min(rect.height, driver_format.height - top),
+    };
 }
 
 } // namespace
@@ -65,13 +99,23 @@ decltype(formats)::const_iterator matching_format(const V4L2M2MDevice& device, u
 VAStatus createSurfaces2(VADriverContextP context, unsigned int format, unsigned int width, unsigned int height,
     VASurfaceID* surfaces_ids, unsigned int surfaces_count, VASurfaceAttrib* attributes, unsigned int attributes_count)
 {
-    // TODO inspect attributes
     // TODO ensure dimensions match previous surfaces
 
     auto driver_data = static_cast<DriverData*>(context->pDriverData);
 
-    if (std::ranges::none_of(
-            driver_data->devices, [&](auto&& d) { return matching_format(d, format) != formats.end(); })) {
+    std::vector<uint64_t> drm_modifiers;
+    for (unsigned i = 0; i < attributes_count; i++) {
+        if (attributes[i].type == VASurfaceAttribDRMFormatModifiers && attributes[i].value.value.p) {
+            const auto list = static_cast<const VADRMFormatModifierList*>(attributes[i].value.value.p);
+            drm_modifiers.assign(list->modifiers, list->modifiers + list->num_modifiers);
+        }
+    }
+
+    // The CAPTURE format is chosen with the context, when devices offer those for the stream's bit depth
+    const bool processed = !driver_data->processors.empty() && (rt_formats(VAProfileNone) & format);
+    if (!processed
+        && std::ranges::none_of(
+            Context::supported_profiles(driver_data->devices), [&](auto&& p) { return rt_formats(p) & format; })) {
         error_log(context, "No matching render target supported by device.\n");
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
     }
@@ -80,8 +124,12 @@ VAStatus createSurfaces2(VADriverContextP context, unsigned int format, unsigned
     for (unsigned i = 0; i < surfaces_count; i++) {
         surfaces_ids[i] = smallest_free_key(driver_data->surfaces);
         auto [config, inserted] = driver_data->surfaces.emplace(std::make_pair(surfaces_ids[i],
-            Surface {
-                .status = VASurfaceReady, .width = width, .height = height, .format = format, .request_fd = -1 }));
+            Surface { .status = VASurfaceReady,
+                .width = width,
+                .height = height,
+                .format = format,
+                .drm_modifiers = drm_modifiers,
+                .request_fd = -1 }));
         if (!inserted) {
             return VA_STATUS_ERROR_ALLOCATION_FAILED;
         }
@@ -90,6 +138,11 @@ VAStatus createSurfaces2(VADriverContextP context, unsigned int format, unsigned
     return VA_STATUS_SUCCESS;
 }
 
+uint32_t cache_hints(const Surface& surface)
+{
+    return surface.cpu_access ? 0 : V4L2_BUF_FLAG_NO_CACHE_INVALIDATE | V4L2_BUF_FLAG_NO_CACHE_CLEAN;
+}
+
 void createSurfacesDeferred(DriverData* driver_data, const Context& context, std::span<VASurfaceID> surface_ids)
 {
     if (surface_ids.size() < 1) {
@@ -97,31 +150,32 @@ void createSurfacesDeferred(DriverData* driver_data, const Context& context, std
     }
     const auto& surface = driver_data->surfaces.at(surface_ids[0]);
 
-    auto [format, derive_layout] = matching_format(context.device, surface.format)->v4l2;
+    // Pictures are decoded for the consumer seen so far, and can still be served to the other one
+    auto consumer = driver_data->cpu_access ? FormatConsumer::Cpu : FormatConsumer::Export;
+    auto format = select_format(context.device, surface.format, consumer, surface.drm_modifiers);
+    if (!format) {
+        consumer = (consumer == FormatConsumer::Cpu) ? FormatConsumer::Export : FormatConsumer::Cpu;
+        format = select_format(context.device, surface.format, consumer, surface.drm_modifiers);
+    }
+    if (!format) {
+        throw std::invalid_argument("No matching CAPTURE format");
+    }
 
-    context.device.set_format(context.device.capture_buf_type, format, surface.width, surface.height);
+    context.device.set_format(context.device.capture_buf_type, format->v4l2.format, surface.width, surface.height);
 
-    v4l2_pix_format_mplane* driver_format = &context.device.capture_format.fmt.pix_mp;
+    // The driver may have aligned pitch and height beyond the picture size, or picked another format.
+    const auto& driver_format = context.device.capture_format.fmt.pix_mp;
+    const auto& driver_format_spec = lookup_format(driver_format.pixelformat);
+    const auto layout = derive_layout(driver_format_spec, driver_format);
+    const auto visible = visible_rect(context.device, driver_format_spec, surface.width, surface.height);
 
-    context.device.request_buffers(context.device.capture_buf_type, surface_ids.size());
+    context.device.request_buffers(context.device.capture_buf_type, surface_ids.size(),
+        driver_data->non_coherent.value_or(driver_data->cpu_access.load()));
 
     for (unsigned i = 0; i < surface_ids.size(); i++) {
         auto& surface = driver_data->surfaces.at(surface_ids[i]);
-        if (derive_layout) { // (logical) single plane
-            surface.logical_destination_layout = derive_layout(driver_format->width, driver_format->height);
-        } else {
-            for (unsigned j = 0; j < driver_format->num_planes; j += 1) {
-                surface.logical_destination_layout.push_back({
-                    j,
-                    driver_format->plane_fmt[j].sizeimage,
-                    driver_format->plane_fmt[j].bytesperline,
-                    (j > 0) ? (surface.logical_destination_layout[j - 1].offset
-                                  + surface.logical_destination_layout[j - 1].size)
-                            : 0,
-                });
-            }
-        }
-
+        surface.logical_destination_layout = layout;
+        surface.visible = visible;
         surface.destination_buffer = std::cref(context.device.buffer(context.device.capture_buf_type, i));
     }
 }
@@ -137,6 +191,14 @@ VAStatus destroySurfaces(VADriverContextP context, VASurfaceID* surfaces_ids, in
     auto driver_data = static_cast<DriverData*>(context->pDriverData);
 
     std::lock_guard<std::mutex> guard(driver_data->mutex);
+    // Derived images and locks alias the CAPTURE buffers, which have to outlive them
+    for (int i = 0; i < surfaces_count; i++) {
+        if (auto surface = driver_data->surfaces.find(surfaces_ids[i]);
+            surface != driver_data->surfaces.end() && (surface->second.mappings || surface->second.locked_image)) {
+            return VA_STATUS_ERROR_SURFACE_BUSY;
+        }
+    }
+
     for (int i = 0; i < surfaces_count; i++) {
         if (!driver_data->surfaces.contains(surfaces_ids[i])) {
             return VA_STATUS_ERROR_INVALID_SURFACE;
@@ -144,7 +206,7 @@ VAStatus destroySurfaces(VADriverContextP context, VASurfaceID* surfaces_ids, in
         auto& surface = driver_data->surfaces.at(surfaces_ids[i]);
 
         if (surface.request_fd > 0)
-            close(surface.request_fd);
+            media_request_free(surface.request_fd);
 
         driver_data->surfaces.erase(surfaces_ids[i]);
     }
@@ -165,35 +227,75 @@ VAStatus syncSurface(VADriverContextP context, VASurfaceID surface_id)
         return VA_STATUS_SUCCESS;
     }
 
+    auto statistics = surface.destination_buffer->get().owner().statistics;
+    const auto sync_start = std::chrono::steady_clock::now();
+
     try {
+        // Decoded pictures are complete with their request, processed ones have to be waited for
+        if (surface.request_fd < 0) {
+            surface.destination_buffer->get().owner().wait_for_capture(processing_timeout_ms);
+        }
         surface.source_buffer->get().dequeue();
         surface.destination_buffer->get().dequeue();
     } catch (std::runtime_error& e) {
-        error_log(context, "Failed to dequeue buffer: %s\n", e.what());
+        if (statistics) {
+            statistics->dequeued();
+            statistics->decode_errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        LOG_RATELIMITED(LogLevel::Error, context, "Failed to dequeue buffer: %s\n", e.what());
         return VA_STATUS_ERROR_OPERATION_FAILED;
     }
 
+    if (statistics) {
+        const auto now = std::chrono::steady_clock::now();
+        statistics->dequeued();
+        statistics->frames_decoded.fetch_add(1, std::memory_order_relaxed);
+        statistics->sync_wait.record(std::chrono::duration_cast<std::chrono::microseconds>(now - sync_start).count());
+        if (surface.request_fd < 0) {
+            statistics->submit_to_complete.record(
+                std::chrono::duration_cast<std::chrono::microseconds>(now - surface.submitted).count());
+        }
+    }
+
     surface.status = VASurfaceDisplaying;
 
+    // Move the buffer's preparation for the next decode out of `endPicture()`
+    if (!surface.cpu_access) {
+        surface.destination_buffer->get().prepare(cache_hints(surface));
+    }
+
     return VA_STATUS_SUCCESS;
 }
 
 VAStatus querySurfaceAttributes(
     VADriverContextP context, VAConfigID config, VASurfaceAttrib* attributes, unsigned int* attributes_count)
 {
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
     VASurfaceAttrib* attributes_list;
     unsigned int attributes_list_size = Config::max_attributes * sizeof(*attributes);
     int memory_types;
     unsigned int i = 0;
 
+    if (!driver_data->configs.contains(config)) {
+        return VA_STATUS_ERROR_INVALID_CONFIG;
+    }
+    const auto formats = rt_formats(driver_data->configs.at(config).profile);
+
     attributes_list = static_cast<VASurfaceAttrib*>(malloc(attributes_list_size));
     memset(attributes_list, 0, attributes_list_size);
 
-    attributes_list[i].type = VASurfaceAttribPixelFormat;
-    attributes_list[i].flags = VA_SURFACE_ATTRIB_GETTABLE | VA_SURFACE_ATTRIB_SETTABLE;
-    attributes_list[i].value.type = VAGenericValueTypeInteger;
-    attributes_list[i].value.value.i = VA_FOURCC_NV12;
-    i++;
+    // One pixel format per render target format of the profile
+    for (auto&& [rt_format, fourcc] : { std::pair(VA_RT_FORMAT_YUV420, VA_FOURCC_NV12),
+             std::pair(VA_RT_FORMAT_YUV420_10, VA_FOURCC_P010) }) {
+        if (!(formats & rt_format)) {
+            continue;
+        }
+        attributes_list[i].type = VASurfaceAttribPixelFormat;
+        attributes_list[i].flags = VA_SURFACE_ATTRIB_GETTABLE | VA_SURFACE_ATTRIB_SETTABLE;
+        attributes_list[i].value.type = VAGenericValueTypeInteger;
+        attributes_list[i].value.value.i = fourcc;
+        i++;
+    }
 
     attributes_list[i].type = VASurfaceAttribMinWidth;
     attributes_list[i].flags = VA_SURFACE_ATTRIB_GETTABLE;
@@ -228,6 +330,12 @@ VAStatus querySurfaceAttributes(
     attributes_list[i].value.value.i = memory_types;
     i++;
 
+    attributes_list[i].type = VASurfaceAttribDRMFormatModifiers;
+    attributes_list[i].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attributes_list[i].value.type = VAGenericValueTypePointer;
+    attributes_list[i].value.value.p = &driver_data->drm_modifier_list;
+    i++;
+
     attributes_list_size = i * sizeof(*attributes);
 
     if (attributes != NULL)
@@ -263,12 +371,69 @@ VAStatus lockSurface(VADriverContextP context, VASurfaceID surface_id, unsigned
     unsigned int* chroma_u_stride, unsigned int* chroma_v_stride, unsigned int* luma_offset,
     unsigned int* chroma_u_offset, unsigned int* chroma_v_offset, unsigned int* buffer_name, void** buffer)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    if (!driver_data->surfaces.contains(surface_id)) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+    if (driver_data->surfaces.at(surface_id).locked_image) {
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
+    // The derived image aliases the CAPTURE buffer where possible, and keeps the surface from being decoded into
+    VAImage image;
+    VAStatus status = deriveImage(context, surface_id, &image);
+    if (status != VA_STATUS_SUCCESS) {
+        return status;
+    }
+
+    status = mapBuffer(context, image.buf, buffer);
+    if (status != VA_STATUS_SUCCESS) {
+        destroyImage(context, image.image_id);
+        return status;
+    }
+
+    *fourcc = image.format.fourcc;
+    *luma_stride = image.pitches[0];
+    *luma_offset = image.offsets[0];
+    if (image.num_planes == 3) {
+        // Planar chroma, with V before U for YV12
+        const unsigned u = (image.format.fourcc == VA_FOURCC_YV12) ? 2 : 1;
+        *chroma_u_stride = image.pitches[u];
+        *chroma_u_offset = image.offsets[u];
+        *chroma_v_stride = image.pitches[3 - u];
+        *chroma_v_offset = image.offsets[3 - u];
+    } else {
+        // Interleaved chroma (NV12, NV21, P010): both components are described by the second plane
+        *chroma_u_stride = *chroma_v_stride = image.pitches[1];
+        *chroma_u_offset = *chroma_v_offset = image.offsets[1];
+    }
+    *buffer_name = image.buf;
+    driver_data->surfaces.at(surface_id).locked_image = image.image_id;
+
+    return VA_STATUS_SUCCESS;
 }
 
 VAStatus unlockSurface(VADriverContextP context, VASurfaceID surface_id)
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    auto driver_data = static_cast<DriverData*>(context->pDriverData);
+
+    if (!driver_data->surfaces.contains(surface_id)) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+    auto& surface = driver_data->surfaces.at(surface_id);
+    if (!surface.locked_image) {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    const auto image_id = surface.locked_image.value();
+    surface.locked_image.reset();
+
+    if (!driver_data->images.contains(image_id)) {
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+    }
+    unmapBuffer(context, driver_data->images.at(image_id).buf);
+
+    return destroyImage(context, image_id);
 }
 
 VAStatus exportSurfaceHandle(
@@ -284,38 +449,68 @@ VAStatus exportSurfaceHandle(
     if (!driver_data->surfaces.contains(surface_id)) {
         return VA_STATUS_ERROR_INVALID_SURFACE;
     }
-    const auto& surface = driver_data->surfaces.at(surface_id);
+    auto& surface = driver_data->surfaces.at(surface_id);
 
-    std::vector<int> export_fds;
-    try {
-        export_fds = surface.destination_buffer->get().export_(O_RDONLY);
-    } catch (std::runtime_error& e) {
-        error_log(context, "Failed to export buffer: %s\n", e.what());
+    if (!surface.destination_buffer) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+    // Subpictures are blended into a copy from the dma-buf heap, exported in place of the picture
+    const bool composed = compose_subpictures(driver_data, surface, true);
+    const auto& format_spec = composed
+        ? lookup_format(V4L2_PIX_FMT_NV12)
+        : lookup_format(surface.destination_buffer->get().owner().capture_format.fmt.pix_mp.pixelformat);
+    const auto& full_layout = composed ? surface.composed.layout : surface.logical_destination_layout;
+    if (format_spec.drm.modifier == DRM_FORMAT_MOD_INVALID) {
+        LOG_RATELIMITED(LogLevel::Error, context, "No DRM format modifier describes the decoded layout\n");
         return VA_STATUS_ERROR_OPERATION_FAILED;
     }
 
-    surface_descriptor->fourcc = VA_FOURCC_NV12;
-    surface_descriptor->width = surface.width;
-    surface_descriptor->height = surface.height;
+    std::vector<int> export_fds;
+    std::vector<size_t> sizes;
+    if (composed) {
+        const int fd = fcntl(surface.composed.allocation->fd(), F_DUPFD_CLOEXEC, 0);
+        if (fd < 0) {
+            LOG_RATELIMITED(LogLevel::Error, context, "Failed to duplicate composed picture: %s\n", strerror(errno));
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+        export_fds = { fd };
+        sizes = { full_layout[1].offset + full_layout[1].size };
+    } else {
+        try {
+            export_fds = surface.destination_buffer->get().export_(O_RDONLY);
+        } catch (std::runtime_error& e) {
+            LOG_RATELIMITED(LogLevel::Error, context, "Failed to export buffer: %s\n", e.what());
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+        for (unsigned i = 0; i < export_fds.size(); i++) {
+            sizes.push_back(surface.destination_buffer->get().plane_size(i));
+        }
+    }
+
+    TRACE(export_surface, surface_id, mem_type, export_fds.size());
+
+    surface_descriptor->fourcc = format_spec.va.format;
+    surface_descriptor->width = surface.visible.width;
+    surface_descriptor->height = surface.visible.height;
     surface_descriptor->num_objects = export_fds.size();
 
-    auto format_spec = lookup_format(surface.destination_buffer->get().owner().capture_format.fmt.pix_mp.pixelformat);
-    const auto& mapping = surface.destination_buffer->get().mapping();
     for (unsigned i = 0; i < export_fds.size(); i += 1) {
         surface_descriptor->objects[i].drm_format_modifier = format_spec.drm.modifier;
         surface_descriptor->objects[i].fd = export_fds[i];
-        surface_descriptor->objects[i].size = mapping[i].size();
+        surface_descriptor->objects[i].size = sizes[i];
     }
 
     surface_descriptor->num_layers = 1;
 
     surface_descriptor->layers[0].drm_format = format_spec.drm.format;
-    surface_descriptor->layers[0].num_planes = surface.logical_destination_layout.size();
+    // Importers get the visible part only, so that they don't have to crop it themselves
+    const auto layout = crop_layout(format_spec, full_layout, surface.visible.left, surface.visible.top);
+    surface_descriptor->layers[0].num_planes = layout.size();
 
     for (unsigned i = 0; i < surface_descriptor->layers[0].num_planes; i++) {
-        surface_descriptor->layers[0].object_index[i] = surface.logical_destination_layout[i].physical_plane_index;
-        surface_descriptor->layers[0].pitch[i] = surface.logical_destination_layout[i].pitch;
-        surface_descriptor->layers[0].offset[i] = surface.logical_destination_layout[i].offset;
+        surface_descriptor->layers[0].object_index[i] = layout[i].physical_plane_index;
+        surface_descriptor->layers[0].pitch[i] = layout[i].pitch;
+        surface_descriptor->layers[0].offset[i] = layout[i].offset;
     }
 
     return VA_STATUS_SUCCESS;
@@ -27,22 +27,43 @@
 
 #pragma once
 
+#include <chrono>
 #include <functional>
+#include <memory>
 #include <optional>
 #include <span>
+#include <vector>
 
 extern "C" {
 #include <linux/videodev2.h>
 
 #include <va/va_backend.h>
+#include <va/va_vpp.h>
 }
 
 #include "context.h"
 #include "format.h"
+#include "heap.h"
 #include "v4l2.h"
 
 struct DriverData;
 
+/**
+ * Copy of a picture in linear `NV12`, with the surface's subpictures blended in, for readback and export. The decoded
+ * picture itself stays untouched, as later pictures may reference it.
+ */
+struct ComposedPicture {
+    /**
+     * Memory from the dma-buf heap when composed for export, allocated anew each time as the dma-bufs handed out
+     * outlive it; otherwise `memory`.
+     */
+    std::unique_ptr<HeapAllocation> allocation;
+    std::vector<uint8_t> memory;
+    BufferLayout layout;
+
+    uint8_t* data() { return allocation ? allocation->data() : memory.data(); }
+};
+
 struct Surface {
     VASurfaceStatus status;
     unsigned width;
@@ -53,9 +74,14 @@ struct Surface {
 
     std::optional<std::reference_wrapper<const V4L2M2MDevice::Buffer>> destination_buffer;
     BufferLayout logical_destination_layout;
+    /** Part of the decoded picture to be shown, excluding the padding to the decoder's block size. */
+    v4l2_rect visible;
     uint32_t format;
+    /** DRM format modifiers the application can import, from `VASurfaceAttribDRMFormatModifiers`. */
+    std::vector<uint64_t> drm_modifiers;
 
     timeval timestamp;
+    std::chrono::steady_clock::time_point submitted;
 
     union {
         struct {
@@ -78,11 +104,33 @@ struct Surface {
             VADecPictureParameterBufferVP9* picture;
             VASliceParameterBufferVP9* slice;
         } vp9;
+        struct {
+            VAProcPipelineParameterBuffer* pipeline;
+        } vpp;
     } params;
 
     int request_fd;
+
+    /** Derived images and locks giving the CPU direct access to the CAPTURE buffer; no decoding into it meanwhile. */
+    unsigned mappings = 0;
+
+    /** Whether the application accessed the picture on the CPU, which requires cache maintenance from then on. */
+    bool cpu_access = false;
+
+    /** Image derived by `lockSurface()`, whose buffer stays mapped until `unlockSurface()`. */
+    std::optional<VAImageID> locked_image;
+
+    /** Subpictures associated with the surface, blended in the order they were associated. */
+    std::vector<VASubpictureID> subpictures;
+    ComposedPicture composed;
 };
 
+/**
+ * Cache hints for queueing or preparing the surface's CAPTURE buffer. Pictures only ever accessed by DMA skip cache
+ * maintenance, CPU accesses synchronize the cache themselves.
+ */
+uint32_t cache_hints(const Surface& surface);
+
 void createSurfacesDeferred(DriverData* driver_data, const Context& context, std::span<VASurfaceID> surface_ids);
 VAStatus createSurfaces2(VADriverContextP context, unsigned int format, unsigned int width, unsigned int height,
     VASurfaceID* surfaces_ids, unsigned int surfaces_count, VASurfaceAttrib* attributes, unsigned int attributes_count);
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+/*
+ * Static tracepoints for the decode hot path.
+ *
+ * When built with the `usdt` option, probes are emitted as SystemTap SDT notes in the `libva_v4l2` provider and can
+ * be attached to by perf, bpftrace, or SystemTap. A disabled probe compiles to a single nop. Without the option, the
+ * macro expands to nothing.
+ */
+
+#ifdef ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define TRACE(probe, ...) STAP_PROBEV(libva_v4l2, probe __VA_OPT__(, ) __VA_ARGS__)
+
+#else
+
+#define TRACE(probe, ...) \
+    do {                  \
+    } while (0)
+
+#endif
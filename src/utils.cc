@@ -26,44 +26,10 @@
 
 #include "utils.h"
 
-#include <cstdarg>
-#include <cstdio>
 #include <cstdlib>
 
-#include "driver.h"
-
-void info_log(VADriverContextP ctx, const char* format, ...)
-{
-    char* string;
-    va_list args;
-
-    va_start(args, format);
-    if (0 > vasprintf(&string, format, args))
-        string = NULL; // this is for logging, so failed allocation is not fatal
-    va_end(args);
-
-    if (string) {
-        ctx->info_callback(ctx, string);
-        free(string);
-    } else {
-        ctx->error_callback(ctx, "Error while logging a message: Memory allocation failed.\n");
-    }
-}
-
-void error_log(VADriverContextP ctx, const char* format, ...)
+std::optional<std::string> getenv_opt(const std::string& name)
 {
-    char* string;
-    va_list args;
-
-    va_start(args, format);
-    if (0 > vasprintf(&string, format, args))
-        string = NULL; // this is for logging, so failed allocation is not fatal
-    va_end(args);
-
-    if (string) {
-        ctx->error_callback(ctx, string);
-        free(string);
-    } else {
-        ctx->error_callback(ctx, "Error while logging a message: Memory allocation failed.\n");
-    }
+    auto val = getenv(name.c_str());
+    return val ? std::optional<std::string>(val) : std::optional<std::string>();
 }
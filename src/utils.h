@@ -27,7 +27,9 @@
 #pragma once
 
 #include <map>
+#include <optional>
 #include <stdexcept>
+#include <string>
 #include <system_error>
 
 extern "C" {
@@ -44,14 +46,9 @@ template <typename F, typename... Args> std::invoke_result_t<F, Args...> errno_w
 }
 
 /**
- * Utility function to access the libVA info callback.
+ * `getenv()` wrapper returning `std::nullopt` for unset variables.
  */
-void info_log(VADriverContextP ctx, const char* format, ...) __attribute__((format(printf, 2, 3)));
-
-/**
- * Utility function to access the libVA error callback.
- */
-void error_log(VADriverContextP ctx, const char* format, ...) __attribute__((format(printf, 2, 3)));
+std::optional<std::string> getenv_opt(const std::string& name);
 
 template <typename K, typename V> K smallest_free_key(const std::map<K, V>& map)
 {
@@ -35,25 +35,25 @@
 
 extern "C" {
 #include <fcntl.h>
-#include <linux/media.h>
+#include <linux/dma-buf.h>
 #include <linux/videodev2.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/sysmacros.h>
 #include <unistd.h>
-
-#include <libudev.h>
 }
 
+#include "backend.h"
+#include "capture.h"
+#include "format.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
 namespace {
 
-uint32_t query_capabilities(int video_fd)
+uint32_t device_capabilities(const v4l2_capability& capability)
 {
-    v4l2_capability capability = {};
-    errno_wrapper(ioctl, video_fd, VIDIOC_QUERYCAP, &capability);
-
     if ((capability.capabilities & V4L2_CAP_DEVICE_CAPS) != 0) {
         return capability.device_caps;
     } else {
@@ -61,14 +61,44 @@ uint32_t query_capabilities(int video_fd)
     }
 }
 
+uint32_t query_capabilities(int video_fd)
+{
+    v4l2_capability capability = {};
+    errno_wrapper(backend_ioctl, video_fd, VIDIOC_QUERYCAP, &capability);
+    return device_capabilities(capability);
+}
+
+/**
+ * Whether the OUTPUT queue takes buffers with requests attached, which distinguishes stateless decoders from the
+ * stateful codecs sharing their media device (e.g. vicodec). `VIDIOC_CREATE_BUFS` with a count of 0 only reports the
+ * queue's capabilities, even while another process owns it; kernels that don't report them are given the benefit of
+ * the doubt.
+ */
+bool supports_requests(int video_fd, uint32_t capabilities)
+{
+    v4l2_create_buffers create = {
+        .count = 0,
+        .memory = V4L2_MEMORY_MMAP,
+        .format = {
+            .type = (capabilities & V4L2_CAP_VIDEO_M2M) ? V4L2_BUF_TYPE_VIDEO_OUTPUT
+                                                        : V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        },
+    };
+    if (backend_ioctl(video_fd, VIDIOC_CREATE_BUFS, &create) < 0 || create.capabilities == 0) {
+        return true;
+    }
+    return create.capabilities & V4L2_BUF_CAP_SUPPORTS_REQUESTS;
+}
+
 v4l2_format get_format(int video_fd, v4l2_buf_type type)
 {
     v4l2_format result = { .type = type };
-    errno_wrapper(ioctl, video_fd, VIDIOC_G_FMT, &result);
+    errno_wrapper(backend_ioctl, video_fd, VIDIOC_G_FMT, &result);
     return result;
 }
 
-std::vector<std::span<uint8_t>> map_buffer(int video_fd, v4l2_buf_type type, unsigned index)
+/** Lengths and mmap offsets of a buffer's planes, the singleplanar API reduced to one plane. */
+std::vector<v4l2_plane> query_planes(int video_fd, v4l2_buf_type type, unsigned index)
 {
     v4l2_plane planes[VIDEO_MAX_PLANES] = {};
     v4l2_buffer buffer = {
@@ -77,122 +107,116 @@ std::vector<std::span<uint8_t>> map_buffer(int video_fd, v4l2_buf_type type, uns
         .m = { .planes = planes },
         .length = VIDEO_MAX_PLANES,
     };
-    errno_wrapper(ioctl, video_fd, VIDIOC_QUERYBUF, &buffer);
+    errno_wrapper(backend_ioctl, video_fd, VIDIOC_QUERYBUF, &buffer);
 
-    if (!V4L2_TYPE_IS_MULTIPLANAR(type)) { // reduce singleplanar API to single-plane in multiplanar buffer
-        const auto offset = buffer.m.offset;
-        buffer.m.planes = planes;
-        buffer.m.planes[0].length = buffer.length;
-        buffer.m.planes[0].m.mem_offset = offset;
+    if (!V4L2_TYPE_IS_MULTIPLANAR(type)) {
+        planes[0].length = buffer.length;
+        planes[0].m.mem_offset = buffer.m.offset;
         buffer.length = 1;
     }
-
-    std::vector<std::span<uint8_t>> result(buffer.length);
-    for (unsigned i = 0; i < buffer.length; i++) {
-        result[i] = { static_cast<uint8_t*>(mmap(NULL, buffer.m.planes[i].length, PROT_READ | PROT_WRITE, MAP_SHARED,
-                          video_fd, buffer.m.planes[i].m.mem_offset)),
-            buffer.m.planes[i].length };
-        if (result[i].data() == MAP_FAILED) {
-            throw std::system_error(errno, std::generic_category());
-        }
-    }
-    return result;
+    return std::vector<v4l2_plane>(planes, planes + buffer.length);
 }
 
-std::vector<std::string> enumerate_video_devices(udev* ctx, const std::string& media_device)
+/** Whether the queue offers a picture format the driver can read and write, see `formats`. */
+bool offers_raw_format(int video_fd, v4l2_buf_type type)
 {
-    int fd = errno_wrapper(open, media_device.c_str(), O_RDONLY);
-
-    media_device_info device_info = {};
-    errno_wrapper(ioctl, fd, MEDIA_IOC_DEVICE_INFO, &device_info);
-
-    media_v2_topology topology = {};
-    errno_wrapper(ioctl, fd, MEDIA_IOC_G_TOPOLOGY, &topology);
-
-    std::vector<media_v2_entity> entities(topology.num_entities);
-    std::vector<media_v2_interface> interfaces(topology.num_interfaces);
-    topology.ptr_entities = reinterpret_cast<uint64_t>(entities.data());
-    topology.ptr_interfaces = reinterpret_cast<uint64_t>(interfaces.data());
-
-    errno_wrapper(ioctl, fd, MEDIA_IOC_G_TOPOLOGY, &topology);
-    close(fd);
-
-    if (std::ranges::find_if(entities, [](auto&& entity) { return entity.function == MEDIA_ENT_F_PROC_VIDEO_DECODER; })
-        == entities.end()) {
-        return {};
-    }
-
-    std::vector<std::string> result;
-    for (auto&& interface : interfaces) {
-        auto devnum = makedev(interface.devnode.major, interface.devnode.minor);
-        std::unique_ptr<udev_device, decltype(&udev_device_unref)> device(
-            udev_device_new_from_devnum(ctx, 'c', devnum), &udev_device_unref);
-        if (device && interface.intf_type == MEDIA_INTF_T_V4L_VIDEO) {
-            result.push_back(udev_device_get_property_value(device.get(), "DEVNAME"));
+    for (v4l2_fmtdesc fmtdesc = { .type = type }; backend_ioctl(video_fd, VIDIOC_ENUM_FMT, &fmtdesc) >= 0;
+         fmtdesc.index += 1) {
+        if (std::ranges::any_of(formats, [&](auto&& format) { return format.v4l2.format == fmtdesc.pixelformat; })) {
+            return true;
         }
     }
-
-    return result;
+    return false;
 }
 
-std::vector<std::string> enumerate_media_devices(udev* ctx)
+std::span<uint8_t> map_plane(void* data, size_t length)
 {
-    std::unique_ptr<udev_enumerate, decltype(&udev_enumerate_unref)> enumerate(
-        udev_enumerate_new(ctx), &udev_enumerate_unref);
-
-    udev_enumerate_add_match_subsystem(enumerate.get(), "media");
-    udev_enumerate_scan_devices(enumerate.get());
+    if (data == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    return { static_cast<uint8_t*>(data), length };
+}
 
-    std::vector<std::string> result;
-    for (auto entry = udev_enumerate_get_list_entry(enumerate.get()); entry != nullptr;
-         entry = udev_list_entry_get_next(entry)) {
-        auto name = udev_list_entry_get_name(entry);
+} // namespace
 
-        std::unique_ptr<udev_device, decltype(&udev_device_unref)> device(
-            udev_device_new_from_syspath(ctx, name), &udev_device_unref);
+std::vector<std::pair<std::string, std::optional<std::string>>> V4L2M2MDevice::enumerate_devices(
+    const std::optional<std::string>& driver)
+{
+    std::vector<std::pair<std::string, std::optional<std::string>>> result;
 
-        if (device) {
-            result.push_back(udev_device_get_property_value(device.get(), "DEVNAME"));
+    for (auto&& [video_device, media_device] : backend().enumerate_devices()) {
+        int fd = errno_wrapper(backend_open, video_device.c_str(), O_RDONLY);
+        v4l2_capability capability = {};
+        const bool queried = backend_ioctl(fd, VIDIOC_QUERYCAP, &capability) == 0;
+        const auto capabilities = device_capabilities(capability);
+        const bool selected = queried && (capabilities & required_capabilities)
+            && (!driver || driver.value() == reinterpret_cast<const char*>(capability.driver))
+            && supports_requests(fd, capabilities);
+        backend_close(fd);
+        if (selected) {
+            result.emplace_back(video_device, media_device);
         }
     }
 
     return result;
 }
 
-} // namespace
-
-std::vector<std::pair<std::string, std::optional<std::string>>> V4L2M2MDevice::enumerate_devices()
+std::vector<std::string> V4L2M2MDevice::enumerate_processors()
 {
-    std::vector<std::pair<std::string, std::optional<std::string>>> result;
+    std::vector<std::string> result;
 
-    std::unique_ptr<udev, decltype(&udev_unref)> ctx(udev_new(), &udev_unref);
-    for (auto&& media_device : enumerate_media_devices(ctx.get())) {
-        for (auto&& video_device : enumerate_video_devices(ctx.get(), media_device)) {
-            int fd = errno_wrapper(open, video_device.c_str(), O_RDONLY);
-            if (query_capabilities(fd) & required_capabilities) {
-                result.emplace_back(video_device, media_device);
-            }
+    for (auto&& video_device : backend().enumerate_processors()) {
+        int fd = backend_open(video_device.c_str(), O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        v4l2_capability capability = {};
+        const bool queried = backend_ioctl(fd, VIDIOC_QUERYCAP, &capability) == 0;
+        const auto capabilities = device_capabilities(capability);
+        const bool multiplanar = !(capabilities & V4L2_CAP_VIDEO_M2M);
+        const bool selected = queried && (capabilities & required_capabilities)
+            && !supports_requests(fd, capabilities)
+            && offers_raw_format(fd, multiplanar ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT)
+            && offers_raw_format(fd, multiplanar ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE);
+        backend_close(fd);
+        if (selected) {
+            result.push_back(video_device);
         }
     }
 
     return result;
 }
 
-V4L2M2MDevice::Buffer::Buffer(V4L2M2MDevice& owner, v4l2_buf_type type, unsigned index)
+V4L2M2MDevice::Buffer::Buffer(
+    V4L2M2MDevice& owner, v4l2_buf_type type, unsigned index, bool non_coherent, uint32_t memory)
     : owner_(owner)
     , type_(type)
     , index_(index)
-    , mapping_(map_buffer(owner.video_fd, type, index))
+    , non_coherent_(non_coherent)
+    , memory_(memory)
+    , planes_(query_planes(owner.video_fd, type, index))
 {
+    if (owner_.statistics) {
+        owner_.statistics->count(Ioctl::QUERYBUF);
+        for (auto&& plane : planes_) {
+            owner_.statistics->cma_bytes.fetch_add(plane.length, std::memory_order_relaxed);
+        }
+    }
 }
 
 V4L2M2MDevice::Buffer::Buffer(V4L2M2MDevice::Buffer&& other)
     : owner_(other.owner_)
     , type_(other.type_)
     , index_(other.index_)
-    , mapping_(other.mapping_)
+    , non_coherent_(other.non_coherent_)
+    , memory_(other.memory_)
+    , planes_(std::move(other.planes_))
+    , mapping_(std::move(other.mapping_))
+    , dmabufs_(std::move(other.dmabufs_))
 {
+    other.planes_.clear();
     other.mapping_.clear();
+    other.dmabufs_.clear();
 }
 
 V4L2M2MDevice::Buffer& V4L2M2MDevice::Buffer::operator=(V4L2M2MDevice::Buffer&& other)
@@ -204,24 +228,72 @@ V4L2M2MDevice::Buffer& V4L2M2MDevice::Buffer::operator=(V4L2M2MDevice::Buffer&&
 
 V4L2M2MDevice::Buffer::~Buffer()
 {
+    for (auto fd : dmabufs_) {
+        close(fd);
+    }
     for (auto&& map : mapping_) {
         munmap(map.data(), map.size());
+        if (owner_.statistics) {
+            owner_.statistics->mapped_bytes.fetch_sub(map.size(), std::memory_order_relaxed);
+        }
+    }
+    if (owner_.statistics) {
+        for (auto&& plane : planes_) {
+            owner_.statistics->cma_bytes.fetch_sub(plane.length, std::memory_order_relaxed);
+        }
     }
 }
 
-void V4L2M2MDevice::Buffer::queue(int request_fd, timeval* timestamp, unsigned size) const
+const std::vector<std::span<uint8_t>>& V4L2M2MDevice::Buffer::mapping() const
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!mapping_.empty() || planes_.empty()) {
+        return mapping_;
+    }
+
+    // Non-coherent memory is accessed through its dma-bufs, which `sync()` maintains the cache of
+    if (non_coherent_) {
+        export_dmabufs();
+    }
+    std::vector<std::span<uint8_t>> result;
+    try {
+        for (unsigned i = 0; i < planes_.size(); i++) {
+            result.push_back(map_plane(non_coherent_
+                    ? mmap(nullptr, planes_[i].length, PROT_READ | PROT_WRITE, MAP_SHARED, dmabufs_.at(i), 0)
+                    : backend().mmap(planes_[i].length, PROT_READ | PROT_WRITE, MAP_SHARED, owner_.video_fd,
+                        planes_[i].m.mem_offset),
+                planes_[i].length));
+        }
+    } catch (std::exception&) {
+        for (auto&& map : result) {
+            munmap(map.data(), map.size());
+        }
+        throw;
+    }
+
+    if (owner_.statistics) {
+        for (auto&& map : result) {
+            owner_.statistics->mapped_bytes.fetch_add(map.size(), std::memory_order_relaxed);
+        }
+    }
+    mapping_ = std::move(result);
+    return mapping_;
+}
+
+void V4L2M2MDevice::Buffer::queue(int request_fd, timeval* timestamp, unsigned size, uint32_t flags) const
 {
     struct v4l2_plane planes[VIDEO_MAX_PLANES] = {};
     struct v4l2_buffer buffer = {
         .index = index_,
         .type = type_,
-        .memory = V4L2_MEMORY_MMAP,
+        .flags = flags,
+        .memory = memory_,
         .m = { .planes = planes },
-        .length = static_cast<uint32_t>(mapping_.size()),
+        .length = static_cast<uint32_t>(planes_.size()),
     };
 
     if (V4L2_TYPE_IS_MULTIPLANAR(type_)) {
-        for (unsigned i = 0; i < mapping_.size(); i++) {
+        for (unsigned i = 0; i < planes_.size(); i++) {
             buffer.m.planes[i].bytesused = size;
         }
     } else {
@@ -229,14 +301,53 @@ void V4L2M2MDevice::Buffer::queue(int request_fd, timeval* timestamp, unsigned s
     }
 
     if (request_fd >= 0) {
-        buffer.flags = V4L2_BUF_FLAG_REQUEST_FD;
+        buffer.flags |= V4L2_BUF_FLAG_REQUEST_FD;
         buffer.request_fd = request_fd;
     }
 
     if (timestamp != NULL)
         buffer.timestamp = *timestamp;
 
-    errno_wrapper(ioctl, owner_.video_fd, VIDIOC_QBUF, &buffer);
+    TRACE(buffer_queue, owner_.video_fd, type_, index_, size, request_fd);
+
+    count_ioctl(owner_.statistics, Ioctl::QBUF);
+    errno_wrapper(backend_ioctl, owner_.video_fd, VIDIOC_QBUF, &buffer);
+}
+
+void V4L2M2MDevice::Buffer::queue_dmabufs(
+    std::span<const int> fds, std::span<const size_t> sizes, timeval* timestamp) const
+{
+    struct v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+    struct v4l2_buffer buffer = {
+        .index = index_,
+        .type = type_,
+        .memory = V4L2_MEMORY_DMABUF,
+        .m = { .planes = planes },
+        .length = static_cast<uint32_t>(planes_.size()),
+    };
+
+    if (fds.size() != planes_.size() || sizes.size() != planes_.size()) {
+        throw std::system_error(EINVAL, std::generic_category(), "Picture and buffer planes differ");
+    }
+    if (V4L2_TYPE_IS_MULTIPLANAR(type_)) {
+        for (unsigned i = 0; i < planes_.size(); i++) {
+            planes[i].m.fd = fds[i];
+            planes[i].length = sizes[i];
+            planes[i].bytesused = sizes[i];
+        }
+    } else {
+        buffer.m.fd = fds[0];
+        buffer.length = sizes[0];
+        buffer.bytesused = sizes[0];
+    }
+
+    if (timestamp != NULL)
+        buffer.timestamp = *timestamp;
+
+    TRACE(buffer_queue, owner_.video_fd, type_, index_, buffer.bytesused, -1);
+
+    count_ioctl(owner_.statistics, Ioctl::QBUF);
+    errno_wrapper(backend_ioctl, owner_.video_fd, VIDIOC_QBUF, &buffer);
 }
 
 void V4L2M2MDevice::Buffer::dequeue() const
@@ -245,37 +356,94 @@ void V4L2M2MDevice::Buffer::dequeue() const
     struct v4l2_buffer buffer = {
         .index = index_,
         .type = type_,
-        .memory = V4L2_MEMORY_MMAP,
+        .memory = memory_,
         .m = { .planes = planes },
         .length = VIDEO_MAX_PLANES,
     };
 
-    errno_wrapper(ioctl, owner_.video_fd, VIDIOC_DQBUF, &buffer);
+    count_ioctl(owner_.statistics, Ioctl::DQBUF);
+    errno_wrapper(backend_ioctl, owner_.video_fd, VIDIOC_DQBUF, &buffer);
+    TRACE(buffer_dequeue, owner_.video_fd, type_, index_, buffer.flags);
     if (buffer.flags & V4L2_BUF_FLAG_ERROR) {
         throw std::runtime_error("Dequeued buffer marked erroneous by driver.");
     }
 }
 
+int V4L2M2MDevice::Buffer::export_plane(unsigned plane, unsigned flags) const
+{
+    v4l2_exportbuffer exportbuffer = {
+        .type = type_,
+        .index = index_,
+        .plane = plane,
+        .flags = flags,
+    };
+
+    count_ioctl(owner_.statistics, Ioctl::EXPBUF);
+    errno_wrapper(backend_ioctl, owner_.video_fd, VIDIOC_EXPBUF, &exportbuffer);
+    return exportbuffer.fd;
+}
+
+void V4L2M2MDevice::Buffer::prepare(uint32_t flags) const
+{
+    struct v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+    struct v4l2_buffer buffer = {
+        .index = index_,
+        .type = type_,
+        .flags = flags,
+        .memory = memory_,
+        .m = { .planes = planes },
+        .length = static_cast<uint32_t>(planes_.size()),
+    };
+
+    count_ioctl(owner_.statistics, Ioctl::PREPARE_BUF);
+    backend_ioctl(owner_.video_fd, VIDIOC_PREPARE_BUF, &buffer);
+}
+
 std::vector<int> V4L2M2MDevice::Buffer::export_(unsigned flags) const
 {
     std::vector<int> result;
-    for (unsigned i = 0; i < mapping_.size(); i++) {
-        v4l2_exportbuffer exportbuffer = {
-            .type = type_,
-            .index = index_,
-            .plane = i,
-            .flags = flags,
-        };
-
-        errno_wrapper(ioctl, owner_.video_fd, VIDIOC_EXPBUF, &exportbuffer);
-        result.push_back(exportbuffer.fd);
+    for (unsigned i = 0; i < planes_.size(); i++) {
+        result.push_back(export_plane(i, flags));
     }
     return result;
 }
 
+/** Export the planes for `mapping()` and `sync()`, with `mutex_` held. */
+void V4L2M2MDevice::Buffer::export_dmabufs() const
+{
+    if (dmabufs_.empty()) {
+        dmabufs_ = export_(O_RDWR | O_CLOEXEC);
+    }
+}
+
+const std::vector<int>& V4L2M2MDevice::Buffer::dmabufs() const
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    export_dmabufs();
+    return dmabufs_;
+}
+
+void V4L2M2MDevice::Buffer::sync(uint64_t flags) const
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        try {
+            export_dmabufs();
+        } catch (std::system_error&) {
+            return; // Not exportable, so not a dma-buf that would need syncing.
+        }
+    }
+
+    dma_buf_sync sync = { .flags = flags };
+    for (auto fd : dmabufs_) {
+        while (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0 && (errno == EINTR || errno == EAGAIN)) {
+        }
+    }
+}
+
 V4L2M2MDevice::V4L2M2MDevice(const std::string& video_path, const std::optional<std::string>& media_path)
-    : video_fd(errno_wrapper(open, video_path.c_str(), O_RDWR | O_NONBLOCK))
-    , media_fd((media_path) ? errno_wrapper(open, media_path->c_str(), O_RDWR | O_NONBLOCK) : -1)
+    : video_fd(errno_wrapper(backend_open, video_path.c_str(), O_RDWR | O_NONBLOCK))
+    , media_fd((media_path) ? errno_wrapper(backend_open, media_path->c_str(), O_RDWR | O_NONBLOCK) : -1)
     , capabilities(query_capabilities(video_fd))
     , capture_buf_type(
           (capabilities & V4L2_CAP_VIDEO_M2M) ? V4L2_BUF_TYPE_VIDEO_CAPTURE : V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
@@ -283,6 +451,8 @@ V4L2M2MDevice::V4L2M2MDevice(const std::string& video_path, const std::optional<
           (capabilities & V4L2_CAP_VIDEO_M2M) ? V4L2_BUF_TYPE_VIDEO_OUTPUT : V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
     , capture_format(get_format(video_fd, capture_buf_type))
     , output_format(get_format(video_fd, output_buf_type))
+    , statistics(nullptr)
+    , recording(nullptr)
 {
     if (!(capabilities & required_capabilities)) {
         std::runtime_error("Missing device capabilities");
@@ -299,6 +469,8 @@ V4L2M2MDevice::V4L2M2MDevice(V4L2M2MDevice&& other)
     , output_format(std::move(other.output_format))
     , supported_output_formats(std::move(other.supported_output_formats))
     , supported_capture_formats(std::move(other.supported_capture_formats))
+    , statistics(other.statistics)
+    , recording(other.recording)
     , capture_buffers(std::move(other.capture_buffers))
     , output_buffers(std::move(other.output_buffers))
 {
@@ -318,10 +490,10 @@ V4L2M2MDevice& V4L2M2MDevice::operator=(V4L2M2MDevice&& other)
 V4L2M2MDevice::~V4L2M2MDevice()
 {
     if (video_fd >= 0) {
-        close(video_fd);
+        backend_close(video_fd);
     }
     if (media_fd >= 0) {
-        close(media_fd);
+        backend_close(media_fd);
     }
 }
 
@@ -337,24 +509,62 @@ void V4L2M2MDevice::set_format(v4l2_buf_type type, unsigned int pixelformat, uns
     // Automatic size is insufficient for data buffers
     format->fmt.pix_mp.plane_fmt[0].sizeimage = V4L2_TYPE_IS_OUTPUT(type) ? SOURCE_SIZE_MAX : 0;
 
-    errno_wrapper(ioctl, video_fd, VIDIOC_S_FMT, format);
+    count_ioctl(statistics, Ioctl::S_FMT);
+    errno_wrapper(backend_ioctl, video_fd, VIDIOC_S_FMT, format);
 }
 
-unsigned V4L2M2MDevice::request_buffers(v4l2_buf_type type, unsigned count)
+void V4L2M2MDevice::set_picture_format(
+    v4l2_buf_type type, fourcc pixelformat, unsigned width, unsigned height, std::span<const unsigned> pitches)
+{
+    struct v4l2_format* format = V4L2_TYPE_IS_CAPTURE(type) ? &capture_format : &output_format;
+
+    *format = { .type = type };
+    if (V4L2_TYPE_IS_MULTIPLANAR(type)) {
+        format->fmt.pix_mp.pixelformat = pixelformat;
+        format->fmt.pix_mp.width = width;
+        format->fmt.pix_mp.height = height;
+        format->fmt.pix_mp.num_planes = std::min<size_t>(pitches.size(), VIDEO_MAX_PLANES);
+        for (unsigned i = 0; i < format->fmt.pix_mp.num_planes; i++) {
+            format->fmt.pix_mp.plane_fmt[i].bytesperline = pitches[i];
+        }
+    } else {
+        format->fmt.pix.pixelformat = pixelformat;
+        format->fmt.pix.width = width;
+        format->fmt.pix.height = height;
+        format->fmt.pix.bytesperline = pitches.empty() ? 0 : pitches[0];
+    }
+
+    count_ioctl(statistics, Ioctl::S_FMT);
+    errno_wrapper(backend_ioctl, video_fd, VIDIOC_S_FMT, format);
+}
+
+unsigned V4L2M2MDevice::request_buffers(v4l2_buf_type type, unsigned count, bool non_coherent, uint32_t memory)
 {
     struct v4l2_requestbuffers req_buffers = {
         .count = count,
         .type = type,
-        .memory = V4L2_MEMORY_MMAP,
+        .memory = memory,
+        .flags = static_cast<uint8_t>(non_coherent ? V4L2_MEMORY_FLAG_NON_COHERENT : 0),
     };
 
-    errno_wrapper(ioctl, video_fd, VIDIOC_REQBUFS, &req_buffers);
+    count_ioctl(statistics, Ioctl::REQBUFS);
+    errno_wrapper(backend_ioctl, video_fd, VIDIOC_REQBUFS, &req_buffers);
 
     auto& buffers = V4L2_TYPE_IS_CAPTURE(type) ? capture_buffers : output_buffers;
 
+    // The flag is cleared by queues without V4L2_BUF_CAP_SUPPORTS_MMAP_CACHE_HINTS, and by kernels predating it
+    non_coherent = (req_buffers.flags & V4L2_MEMORY_FLAG_NON_COHERENT)
+        && (req_buffers.capabilities & V4L2_BUF_CAP_SUPPORTS_MMAP_CACHE_HINTS);
     buffers.clear();
     for (unsigned i = 0; i < req_buffers.count; i += 1) {
-        buffers.emplace_back(*this, type, i);
+        buffers.emplace_back(*this, type, i, non_coherent, memory);
+    }
+
+    // The CPU writes the bitstream into every OUTPUT buffer, failures to map are better reported here
+    if (V4L2_TYPE_IS_OUTPUT(type) && memory == V4L2_MEMORY_MMAP) {
+        for (auto&& buffer : buffers) {
+            buffer.mapping();
+        }
     }
 
     return buffers.size(); // Actual amount may differ
@@ -362,7 +572,8 @@ unsigned V4L2M2MDevice::request_buffers(v4l2_buf_type type, unsigned count)
 
 bool V4L2M2MDevice::format_supported(v4l2_buf_type type, unsigned pixelformat) const
 {
-    for (v4l2_fmtdesc fmtdesc = { .type = type }; ioctl(video_fd, VIDIOC_ENUM_FMT, &fmtdesc) >= 0; fmtdesc.index += 1) {
+    for (v4l2_fmtdesc fmtdesc = { .type = type }; backend_ioctl(video_fd, VIDIOC_ENUM_FMT, &fmtdesc) >= 0;
+         fmtdesc.index += 1) {
         if (fmtdesc.pixelformat == pixelformat) {
             return true;
         }
@@ -379,10 +590,37 @@ int32_t V4L2M2MDevice::get_control(uint32_t id) const {
     v4l2_control ctrl = {
         .id = id,
     };
-    errno_wrapper(ioctl, video_fd, VIDIOC_G_CTRL, &ctrl);
+    count_ioctl(statistics, Ioctl::G_CTRL);
+    errno_wrapper(backend_ioctl, video_fd, VIDIOC_G_CTRL, &ctrl);
     return ctrl.value;
 }
 
+std::optional<v4l2_rect> V4L2M2MDevice::get_selection(v4l2_buf_type type, uint32_t target) const
+{
+    // Kernels before 4.13 only accept the single-planar buffer types
+    v4l2_selection selection = {
+        .type = V4L2_TYPE_IS_CAPTURE(type) ? V4L2_BUF_TYPE_VIDEO_CAPTURE : V4L2_BUF_TYPE_VIDEO_OUTPUT,
+        .target = target,
+    };
+    count_ioctl(statistics, Ioctl::G_SELECTION);
+    if (backend_ioctl(video_fd, VIDIOC_G_SELECTION, &selection) < 0) {
+        return std::nullopt;
+    }
+    return selection.r;
+}
+
+v4l2_rect V4L2M2MDevice::set_selection(v4l2_buf_type type, uint32_t target, const v4l2_rect& rect)
+{
+    v4l2_selection selection = {
+        .type = V4L2_TYPE_IS_CAPTURE(type) ? V4L2_BUF_TYPE_VIDEO_CAPTURE : V4L2_BUF_TYPE_VIDEO_OUTPUT,
+        .target = target,
+        .r = rect,
+    };
+    count_ioctl(statistics, Ioctl::S_SELECTION);
+    errno_wrapper(backend_ioctl, video_fd, VIDIOC_S_SELECTION, &selection);
+    return selection.r;
+}
+
 void V4L2M2MDevice::set_ext_control(int request_fd, unsigned id, void* data, unsigned size)
 {
     v4l2_ext_control control = {
@@ -405,11 +643,37 @@ void V4L2M2MDevice::set_ext_controls(int request_fd, std::span<v4l2_ext_control>
         meta.request_fd = request_fd;
     }
 
-    errno_wrapper(ioctl, video_fd, VIDIOC_S_EXT_CTRLS, &meta);
+    count_ioctl(statistics, Ioctl::S_EXT_CTRLS);
+    try {
+        errno_wrapper(backend_ioctl, video_fd, VIDIOC_S_EXT_CTRLS, &meta);
+    } catch (std::system_error& e) {
+        if (recording) {
+            recording->write_controls(request_fd, controls, e.code().value());
+        }
+        throw;
+    }
+    if (recording) {
+        recording->write_controls(request_fd, controls, 0);
+    }
 }
 
 void V4L2M2MDevice::set_streaming(bool enable)
 {
-    errno_wrapper(ioctl, video_fd, enable ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &capture_buf_type);
-    errno_wrapper(ioctl, video_fd, enable ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &output_buf_type);
+    const auto counted = enable ? Ioctl::STREAMON : Ioctl::STREAMOFF;
+    v4l2_buf_type capture_type = capture_buf_type;
+    v4l2_buf_type output_type = output_buf_type;
+
+    count_ioctl(statistics, counted);
+    errno_wrapper(backend_ioctl, video_fd, enable ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &capture_type);
+    count_ioctl(statistics, counted);
+    errno_wrapper(backend_ioctl, video_fd, enable ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &output_type);
+}
+
+void V4L2M2MDevice::wait_for_capture(int timeout_ms) const
+{
+    pollfd fds = { .fd = video_fd, .events = POLLIN };
+
+    if (errno_wrapper(backend_poll, &fds, 1, timeout_ms) == 0) {
+        throw std::runtime_error("Timeout when waiting for a processed picture");
+    }
 }
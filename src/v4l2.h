@@ -26,6 +26,7 @@
 #pragma once
 
 #include <cstdint>
+#include <mutex>
 #include <optional>
 #include <set>
 #include <span>
@@ -40,31 +41,78 @@ extern "C" {
 
 using fourcc = uint32_t;
 
+class Capture;
+struct ContextStatistics;
+
 class V4L2M2MDevice {
 public:
     class Buffer {
     public:
-        void queue(int request_fd = -1, timeval* timestamp = nullptr, unsigned size = 0) const;
+        /** `flags` are set in addition to the request's, e.g. cache hints. */
+        void queue(int request_fd = -1, timeval* timestamp = nullptr, unsigned size = 0, uint32_t flags = 0) const;
+        /**
+         * Have the kernel prepare the buffer for the next `queue()` ahead of time, with the given cache hints. Best
+         * effort; otherwise preparation happens when queueing.
+         */
+        void prepare(uint32_t flags = 0) const;
+        /** Queue a buffer of a `V4L2_MEMORY_DMABUF` queue, with the given dma-bufs as its planes. */
+        void queue_dmabufs(std::span<const int> fds, std::span<const size_t> sizes, timeval* timestamp = nullptr) const;
         void dequeue() const;
         std::vector<int> export_(unsigned flags) const;
-        std::vector<std::span<uint8_t>> mapping() const { return mapping_; }
+        int export_plane(unsigned plane, unsigned flags) const;
+        /** The planes as dma-bufs, exported on first use and closed with the buffer. */
+        const std::vector<int>& dmabufs() const;
+        /**
+         * Bracket CPU access to the mapping for non-coherent memory: `DMA_BUF_SYNC_START` or `DMA_BUF_SYNC_END`,
+         * combined with `DMA_BUF_SYNC_READ` and/or `DMA_BUF_SYNC_WRITE`. Best effort; the buffer is exported on first
+         * use.
+         */
+        void sync(uint64_t flags) const;
+        /**
+         * The planes in memory, mapped on first use: through the video device, or, for non-coherent memory, through
+         * the exported dma-bufs. Export-only pipelines never map their CAPTURE buffers.
+         */
+        const std::vector<std::span<uint8_t>>& mapping() const;
+        unsigned plane_count() const { return planes_.size(); }
+        size_t plane_size(unsigned plane) const { return planes_[plane].length; }
         V4L2M2MDevice& owner() const { return owner_; }
 
-        Buffer(V4L2M2MDevice& owner, v4l2_buf_type type, unsigned index);
+        Buffer(V4L2M2MDevice& owner, v4l2_buf_type type, unsigned index, bool non_coherent = false,
+            uint32_t memory = V4L2_MEMORY_MMAP);
         Buffer(Buffer&& other);
         Buffer& operator=(Buffer&& other);
         ~Buffer();
 
     private:
+        void export_dmabufs() const;
+
         V4L2M2MDevice& owner_;
         v4l2_buf_type type_;
         unsigned index_;
-        std::vector<std::span<uint8_t>> mapping_;
+        bool non_coherent_;
+        uint32_t memory_;
+        std::vector<v4l2_plane> planes_;
+
+        /* Guards the lazily created `mapping_` and `dmabufs_`, which don't change afterwards. */
+        mutable std::mutex mutex_;
+        mutable std::vector<std::span<uint8_t>> mapping_;
+        mutable std::vector<int> dmabufs_;
 
         friend class V4L2M2MDevice;
     };
 
-    static std::vector<std::pair<std::string, std::optional<std::string>>> enumerate_devices();
+    /**
+     * Stateless decoders with request support on their OUTPUT queue, optionally limited to those of the named kernel
+     * driver (e.g. `visl`).
+     */
+    static std::vector<std::pair<std::string, std::optional<std::string>>> enumerate_devices(
+        const std::optional<std::string>& driver = std::nullopt);
+
+    /**
+     * Memory-to-memory scalers and color converters (e.g. `rockchip-rga`), which take and produce raw pictures without
+     * requests, for video processing.
+     */
+    static std::vector<std::string> enumerate_processors();
 
     static const uint32_t required_capabilities = V4L2_CAP_VIDEO_M2M | V4L2_CAP_VIDEO_M2M_MPLANE;
 
@@ -73,13 +121,30 @@ public:
     V4L2M2MDevice& operator=(V4L2M2MDevice&& other);
     ~V4L2M2MDevice();
     void set_format(enum v4l2_buf_type type, unsigned int pixelformat, unsigned int width, unsigned int height);
-    unsigned request_buffers(enum v4l2_buf_type type, unsigned count);
+    /**
+     * Set a raw picture format with the given pitches of its memory planes, e.g. to import pictures of another device.
+     * Drivers may adjust the pitches, which is to be checked in the format they return.
+     */
+    void set_picture_format(
+        v4l2_buf_type type, fourcc pixelformat, unsigned width, unsigned height, std::span<const unsigned> pitches);
+    /**
+     * Allocate `count` buffers, the actual amount is returned. `non_coherent` asks for cacheable memory where the queue
+     * allows it, for pictures read by the CPU. Buffers of `V4L2_MEMORY_DMABUF` are queued with `queue_dmabufs()`.
+     */
+    unsigned request_buffers(enum v4l2_buf_type type, unsigned count, bool non_coherent = false,
+        uint32_t memory = V4L2_MEMORY_MMAP);
     bool format_supported(v4l2_buf_type type, unsigned pixelformat) const;
     const Buffer& buffer(v4l2_buf_type type, unsigned index);
     int32_t get_control(uint32_t id) const;
+    /** A rectangle of the queue's selection API, e.g. `V4L2_SEL_TGT_COMPOSE`; nothing if the driver has none. */
+    std::optional<v4l2_rect> get_selection(v4l2_buf_type type, uint32_t target) const;
+    /** Set a rectangle of the queue's selection API, the one the driver adjusted it to is returned. */
+    v4l2_rect set_selection(v4l2_buf_type type, uint32_t target, const v4l2_rect& rect);
     void set_ext_control(int request_fd, unsigned id, void* data, unsigned size);
     void set_ext_controls(int request_fd, std::span<v4l2_ext_control> controls);
     void set_streaming(bool enable);
+    /** Wait for a processed picture to be dequeued, for jobs that aren't tracked by a media request. */
+    void wait_for_capture(int timeout_ms) const;
 
     int video_fd;
     int media_fd;
@@ -90,6 +155,9 @@ public:
     v4l2_format output_format;
     std::set<fourcc> supported_output_formats;
     std::set<fourcc> supported_capture_formats;
+    ContextStatistics* statistics;
+    /** Set while a capturing context owns the device, to record the controls it sets. */
+    Capture* recording;
 
 private:
     std::vector<Buffer> capture_buffers;
@@ -37,7 +37,9 @@ extern "C" {
 #include "buffer.h"
 #include "context.h"
 #include "driver.h"
+#include "log.h"
 #include "surface.h"
+#include "trace.h"
 #include "v4l2.h"
 
 enum {
@@ -124,12 +126,15 @@ v4l2_vp8_entropy_coder_state coder_state(VABoolCoderContextVPX* bool_coder_conte
     return result;
 }
 
-v4l2_ctrl_vp8_frame va_to_v4l2_frame(DriverData* data, VAPictureParameterBufferVP8* picture,
-    VASliceParameterBufferVP8* slice, VAIQMatrixBufferVP8* iqmatrix, VAProbabilityDataBufferVP8* probabilities)
+} // namespace
+
+v4l2_ctrl_vp8_frame vp8_va_to_v4l2_frame(const std::map<VASurfaceID, Surface>& surfaces,
+    VAPictureParameterBufferVP8* picture, VASliceParameterBufferVP8* slice, VAIQMatrixBufferVP8* iqmatrix,
+    VAProbabilityDataBufferVP8* probabilities)
 {
-    const auto last_ref = data->surfaces.find(picture->last_ref_frame);
-    const auto golden_ref = data->surfaces.find(picture->golden_ref_frame);
-    const auto alt_ref = data->surfaces.find(picture->alt_ref_frame);
+    const auto last_ref = surfaces.find(picture->last_ref_frame);
+    const auto golden_ref = surfaces.find(picture->golden_ref_frame);
+    const auto alt_ref = surfaces.find(picture->alt_ref_frame);
 
     // FIXME
     // - resolve confusion around segments
@@ -153,9 +158,9 @@ v4l2_ctrl_vp8_frame va_to_v4l2_frame(DriverData* data, VAPictureParameterBufferV
         .first_part_size
         = slice->slice_data_size - slice->partition_size[1], // FIXME: Needs to be sum of all partitions
         .first_part_header_bits = slice->macroblock_offset,
-        .last_frame_ts = (last_ref != data->surfaces.end()) ? v4l2_timeval_to_ns(&last_ref->second.timestamp) : 0,
-        .golden_frame_ts = (golden_ref != data->surfaces.end()) ? v4l2_timeval_to_ns(&golden_ref->second.timestamp) : 0,
-        .alt_frame_ts = (alt_ref != data->surfaces.end()) ? v4l2_timeval_to_ns(&alt_ref->second.timestamp) : 0,
+        .last_frame_ts = (last_ref != surfaces.end()) ? v4l2_timeval_to_ns(&last_ref->second.timestamp) : 0,
+        .golden_frame_ts = (golden_ref != surfaces.end()) ? v4l2_timeval_to_ns(&golden_ref->second.timestamp) : 0,
+        .alt_frame_ts = (alt_ref != surfaces.end()) ? v4l2_timeval_to_ns(&alt_ref->second.timestamp) : 0,
         .flags = ((picture->pic_fields.bits.key_frame == VP8_KEYFRAME) ? V4L2_VP8_FRAME_FLAG_KEY_FRAME : 0u)
             | (false ? V4L2_VP8_FRAME_FLAG_EXPERIMENTAL : 0u) | (true ? V4L2_VP8_FRAME_FLAG_SHOW_FRAME : 0u)
             | // not provided by libva, assume all frames are shown
@@ -174,7 +179,8 @@ v4l2_ctrl_vp8_frame va_to_v4l2_frame(DriverData* data, VAPictureParameterBufferV
  * This is stripped from the data by libva, since it's (mostly) represented by the provided parsed buffers.
  * V4L2 expects it to be present though, so we reconstruct it here.
  */
-size_t prefix_data(uint8_t* data, const VAPictureParameterBufferVP8* picture, const VASliceParameterBufferVP8* slice)
+size_t vp8_prefix_data(
+    uint8_t* data, const VAPictureParameterBufferVP8* picture, const VASliceParameterBufferVP8* slice)
 {
     const uint32_t first_part_size
         = slice->slice_data_size - slice->partition_size[1]; // FIXME: Needs to be sum of all partitions
@@ -200,8 +206,6 @@ size_t prefix_data(uint8_t* data, const VAPictureParameterBufferVP8* picture, co
     return 10;
 }
 
-} // namespace
-
 VAStatus VP8Context::store_buffer(const Buffer& buffer) const
 {
     auto& surface = driver_data->surfaces.at(render_surface_id);
@@ -215,7 +219,7 @@ VAStatus VP8Context::store_buffer(const Buffer& buffer) const
          * RenderPicture), we can't use a V4L2 buffer directly
          * and have to copy from a regular buffer.
          */
-        surface.source_size_used += prefix_data(
+        surface.source_size_used += vp8_prefix_data(
             source_data.data() + surface.source_size_used, surface.params.vp8.picture, surface.params.vp8.slice);
 
         if (surface.source_size_used + buffer.size * buffer.count > source_data.size()) {
@@ -223,6 +227,7 @@ VAStatus VP8Context::store_buffer(const Buffer& buffer) const
         }
         memcpy(source_data.data() + surface.source_size_used, buffer.data.get(), buffer.size * buffer.count);
         surface.source_size_used += buffer.size * buffer.count;
+        TRACE(store_buffer, "vp8", buffer.size * buffer.count);
         break;
 
     case VAPictureParameterBufferType:
@@ -252,9 +257,10 @@ int VP8Context::set_controls()
 {
     auto& surface = driver_data->surfaces.at(render_surface_id);
 
-    v4l2_ctrl_vp8_frame frame = va_to_v4l2_frame(driver_data, surface.params.vp8.picture, surface.params.vp8.slice,
-        surface.params.vp8.iqmatrix, surface.params.vp8.probabilities);
+    v4l2_ctrl_vp8_frame frame = vp8_va_to_v4l2_frame(driver_data->surfaces, surface.params.vp8.picture,
+        surface.params.vp8.slice, surface.params.vp8.iqmatrix, surface.params.vp8.probabilities);
 
+    LOG_CONTROL(driver_data->va_context, V4L2_CID_STATELESS_VP8_FRAME, &frame, sizeof(frame));
     try {
         device.set_ext_control(surface.request_fd, V4L2_CID_STATELESS_VP8_FRAME, &frame, sizeof(frame));
     } catch (std::runtime_error& e) {
@@ -24,19 +24,32 @@
 
 #pragma once
 
+#include <map>
 #include <set>
 
 extern "C" {
+#include <linux/v4l2-controls.h>
+
 #include <va/va.h>
+#include <va/va_dec_vp8.h>
 }
 
 #include "context.h"
+#include "surface.h"
 
 struct Buffer;
 struct DriverData;
-struct Surface;
 class V4L2M2MDevice;
 
+/*
+ * VP8 is handed to V4L2 as a single frame control, plus the frame header libVA strips from the slice data.
+ */
+v4l2_ctrl_vp8_frame vp8_va_to_v4l2_frame(const std::map<VASurfaceID, Surface>& surfaces,
+    VAPictureParameterBufferVP8* picture, VASliceParameterBufferVP8* slice, VAIQMatrixBufferVP8* iqmatrix,
+    VAProbabilityDataBufferVP8* probabilities);
+size_t vp8_prefix_data(
+    uint8_t* data, const VAPictureParameterBufferVP8* picture, const VASliceParameterBufferVP8* slice);
+
 class VP8Context : public Context {
 public:
     static std::set<VAProfile> supported_profiles(const V4L2M2MDevice& device);
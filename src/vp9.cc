@@ -37,16 +37,16 @@ extern "C" {
 }
 
 #include "driver.h"
+#include "log.h"
 #include "surface.h"
+#include "trace.h"
 #include "v4l2.h"
 
-namespace {
-
 /**
  * The structured data libVA passed doesn't contain all information we need, so we parse the headers ourselves (i.e.
  * have gstreamer do it).
  */
-int parse_frame_header(std::span<uint8_t> data, GstVp9FrameHeader* header)
+int vp9_parse_frame_header(std::span<uint8_t> data, GstVp9FrameHeader* header)
 {
     std::unique_ptr<GstVp9StatefulParser, decltype(&gst_vp9_stateful_parser_free)> parser(
         gst_vp9_stateful_parser_new(), &gst_vp9_stateful_parser_free);
@@ -67,13 +67,12 @@ int parse_frame_header(std::span<uint8_t> data, GstVp9FrameHeader* header)
     return 0;
 }
 
-v4l2_ctrl_vp9_frame va_to_v4l2_frame(DriverData* data, VADecPictureParameterBufferVP9* picture,
-    VASliceParameterBufferVP9* slice, GstVp9FrameHeader* header)
+v4l2_ctrl_vp9_frame vp9_va_to_v4l2_frame(const std::map<VASurfaceID, Surface>& surfaces,
+    VADecPictureParameterBufferVP9* picture, VASliceParameterBufferVP9* slice, GstVp9FrameHeader* header)
 {
-    const auto last_ref_frame = data->surfaces.find(picture->reference_frames[picture->pic_fields.bits.last_ref_frame]);
-    const auto golden_ref_frame
-        = data->surfaces.find(picture->reference_frames[picture->pic_fields.bits.golden_ref_frame]);
-    const auto alt_ref_frame = data->surfaces.find(picture->reference_frames[picture->pic_fields.bits.alt_ref_frame]);
+    const auto last_ref_frame = surfaces.find(picture->reference_frames[picture->pic_fields.bits.last_ref_frame]);
+    const auto golden_ref_frame = surfaces.find(picture->reference_frames[picture->pic_fields.bits.golden_ref_frame]);
+    const auto alt_ref_frame = surfaces.find(picture->reference_frames[picture->pic_fields.bits.alt_ref_frame]);
 
     v4l2_ctrl_vp9_frame result = {
         .lf = {
@@ -102,11 +101,19 @@ v4l2_ctrl_vp9_frame va_to_v4l2_frame(DriverData* data, VADecPictureParameterBuff
         .frame_height_minus_1 = static_cast<uint16_t>(picture->frame_height - 1),
         .render_width_minus_1 = static_cast<uint16_t>(picture->frame_width - 1),
         .render_height_minus_1 = static_cast<uint16_t>(picture->frame_height - 1),
-        .last_frame_ts = (last_ref_frame != data->surfaces.end()) ? v4l2_timeval_to_ns(&last_ref_frame->second.timestamp) : 0,
-        .golden_frame_ts = (golden_ref_frame != data->surfaces.end()) ? v4l2_timeval_to_ns(&golden_ref_frame->second.timestamp) : 0,
-        .alt_frame_ts = (alt_ref_frame != data->surfaces.end()) ? v4l2_timeval_to_ns(&alt_ref_frame->second.timestamp) : 0,
-        .ref_frame_sign_bias = static_cast<uint8_t>(((picture->pic_fields.bits.last_ref_frame_sign_bias) ? V4L2_VP9_SIGN_BIAS_LAST : 0) | ((picture->pic_fields.bits.golden_ref_frame_sign_bias) ? V4L2_VP9_SIGN_BIAS_GOLDEN : 0) | ((picture->pic_fields.bits.alt_ref_frame_sign_bias) ? V4L2_VP9_SIGN_BIAS_ALT : 0)),
-        .reset_frame_context = static_cast<uint8_t>((picture->pic_fields.bits.reset_frame_context > 0) ? picture->pic_fields.bits.reset_frame_context - 1 : 0), // V4L2 codes the value differently
+        .last_frame_ts
+        = (last_ref_frame != surfaces.end()) ? v4l2_timeval_to_ns(&last_ref_frame->second.timestamp) : 0,
+        .golden_frame_ts
+        = (golden_ref_frame != surfaces.end()) ? v4l2_timeval_to_ns(&golden_ref_frame->second.timestamp) : 0,
+        .alt_frame_ts = (alt_ref_frame != surfaces.end()) ? v4l2_timeval_to_ns(&alt_ref_frame->second.timestamp) : 0,
+        .ref_frame_sign_bias
+        = static_cast<uint8_t>((picture->pic_fields.bits.last_ref_frame_sign_bias ? V4L2_VP9_SIGN_BIAS_LAST : 0)
+            | (picture->pic_fields.bits.golden_ref_frame_sign_bias ? V4L2_VP9_SIGN_BIAS_GOLDEN : 0)
+            | (picture->pic_fields.bits.alt_ref_frame_sign_bias ? V4L2_VP9_SIGN_BIAS_ALT : 0)),
+        // V4L2 codes the value differently
+        .reset_frame_context = static_cast<uint8_t>((picture->pic_fields.bits.reset_frame_context > 0)
+                ? picture->pic_fields.bits.reset_frame_context - 1
+                : 0),
         .profile = picture->profile,
         .bit_depth = picture->bit_depth,
         .interpolation_filter = header->interpolation_filter,
@@ -131,8 +138,6 @@ v4l2_ctrl_vp9_frame va_to_v4l2_frame(DriverData* data, VADecPictureParameterBuff
     return result;
 }
 
-} // namespace
-
 v4l2_ctrl_vp9_compressed_hdr gst_to_v4l2_compressed_header(GstVp9FrameHeader* header)
 {
     v4l2_ctrl_vp9_compressed_hdr result = {
@@ -189,6 +194,7 @@ VAStatus VP9Context::store_buffer(const Buffer& buffer) const
         }
         memcpy(source_data.data() + surface.source_size_used, buffer.data.get(), buffer.size * buffer.count);
         surface.source_size_used += buffer.size * buffer.count;
+        TRACE(store_buffer, "vp9", buffer.size * buffer.count);
         return VA_STATUS_SUCCESS;
 
     default:
@@ -202,12 +208,12 @@ int VP9Context::set_controls()
 
     GstVp9FrameHeader header = {};
 
-    if (parse_frame_header(surface.source_buffer->get().mapping()[0], &header)) {
+    if (vp9_parse_frame_header(surface.source_buffer->get().mapping()[0], &header)) {
         return VA_STATUS_ERROR_OPERATION_FAILED;
     }
 
     v4l2_ctrl_vp9_frame frame
-        = va_to_v4l2_frame(driver_data, surface.params.vp9.picture, surface.params.vp9.slice, &header);
+        = vp9_va_to_v4l2_frame(driver_data->surfaces, surface.params.vp9.picture, surface.params.vp9.slice, &header);
     v4l2_ctrl_vp9_compressed_hdr hdr = gst_to_v4l2_compressed_header(&header);
 
     v4l2_ext_control controls[2] = { {
@@ -221,6 +227,7 @@ int VP9Context::set_controls()
             .ptr = &hdr,
         } };
 
+    LOG_CONTROLS(driver_data->va_context, controls);
     try {
         device.set_ext_controls(surface.request_fd, std::span(controls, 2));
     } catch (std::runtime_error& e) {
@@ -230,6 +237,16 @@ int VP9Context::set_controls()
     return VA_STATUS_SUCCESS;
 }
 
+void VP9Context::announce_bit_depth(V4L2M2MDevice& device, uint8_t bit_depth)
+{
+    v4l2_ctrl_vp9_frame frame = {
+        .flags = V4L2_VP9_FRAME_FLAG_X_SUBSAMPLING | V4L2_VP9_FRAME_FLAG_Y_SUBSAMPLING,
+        .profile = static_cast<uint8_t>((bit_depth > 8) ? 2 : 0),
+        .bit_depth = bit_depth,
+    };
+    device.set_ext_control(-1, V4L2_CID_STATELESS_VP9_FRAME, &frame, sizeof(frame));
+}
+
 std::set<VAProfile> VP9Context::supported_profiles(const V4L2M2MDevice& device)
 {
     // TODO: query `va_profile` control for more details
@@ -24,24 +24,40 @@
 
 #pragma once
 
+#include <map>
 #include <set>
+#include <span>
+
+#include <gst/codecparsers/gstvp9parser.h>
 
 extern "C" {
 #include "linux/videodev2.h"
 
 #include <va/va.h>
+#include <va/va_dec_vp9.h>
 }
 
 #include "context.h"
+#include "surface.h"
 
 struct Buffer;
 struct DriverData;
-struct Surface;
 class V4L2M2MDevice;
 
+/*
+ * The frame control combines VA's parameters with the parsed headers, which fill in what VA leaves out. Neither step
+ * needs the device.
+ */
+int vp9_parse_frame_header(std::span<uint8_t> data, GstVp9FrameHeader* header);
+v4l2_ctrl_vp9_frame vp9_va_to_v4l2_frame(const std::map<VASurfaceID, Surface>& surfaces,
+    VADecPictureParameterBufferVP9* picture, VASliceParameterBufferVP9* slice, GstVp9FrameHeader* header);
+v4l2_ctrl_vp9_compressed_hdr gst_to_v4l2_compressed_header(GstVp9FrameHeader* header);
+
 class VP9Context : public Context {
 public:
     static std::set<VAProfile> supported_profiles(const V4L2M2MDevice& device);
+    /** Set the bit depth of the stream ahead of decoding, which decides the CAPTURE formats the device offers. */
+    static void announce_bit_depth(V4L2M2MDevice& device, uint8_t bit_depth);
 
     VP9Context(DriverData* driver_data, V4L2M2MDevice& device, int picture_width, int picture_height,
         std::span<VASurfaceID> surface_ids)
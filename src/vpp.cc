@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vpp.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <iterator>
+#include <system_error>
+#include <vector>
+
+extern "C" {
+#include <linux/videodev2.h>
+
+#include <va/va.h>
+}
+
+#include "driver.h"
+#include "format.h"
+#include "log.h"
+#include "surface.h"
+#include "v4l2.h"
+
+namespace {
+
+/** A region of a surface within its buffer, the whole visible part if none is given. */
+v4l2_rect buffer_rect(const VARectangle* region, const v4l2_rect& visible)
+{
+    if (!region) {
+        return visible;
+    }
+    return {
+        .left = visible.left + region->x,
+        .top = visible.top + region->y,
+        .width = region->width,
+        .height = region->height,
+    };
+}
+
+bool same_rect(const std::optional<v4l2_rect>& a, const v4l2_rect& b)
+{
+    return a && a->left == b.left && a->top == b.top && a->width == b.width && a->height == b.height;
+}
+
+/** Whether pictures of the formats have the same layout, and can be imported without setting the format again. */
+bool same_layout(const std::optional<v4l2_pix_format_mplane>& a, const v4l2_pix_format_mplane& b)
+{
+    if (!a || a->pixelformat != b.pixelformat || a->width != b.width || a->height != b.height
+        || a->num_planes != b.num_planes) {
+        return false;
+    }
+    for (unsigned i = 0; i < b.num_planes; i++) {
+        if (a->plane_fmt[i].bytesperline != b.plane_fmt[i].bytesperline) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** The size of plane `plane` of the pictures of `format`, as the driver settled on. */
+size_t plane_size(const v4l2_format& format, unsigned plane)
+{
+    return V4L2_TYPE_IS_MULTIPLANAR(format.type) ? format.fmt.pix_mp.plane_fmt[plane].sizeimage
+                                                 : format.fmt.pix.sizeimage;
+}
+
+bool control_supported(const V4L2M2MDevice& device, uint32_t id)
+{
+    try {
+        device.get_control(id);
+        return true;
+    } catch (std::system_error&) {
+        return false;
+    }
+}
+
+const VPPContext* lookup_vpp_context(DriverData* driver_data, VAContextID context_id)
+{
+    auto it = driver_data->contexts.find(context_id);
+    return (it != driver_data->contexts.end()) ? dynamic_cast<const VPPContext*>(it->second.get()) : nullptr;
+}
+
+/** VA fourccs of the formats offered by the queue, up to `capacity` of them stored in `fourccs`, if given. */
+uint32_t offered_fourccs(const V4L2M2MDevice& device, v4l2_buf_type type, uint32_t* fourccs, uint32_t capacity)
+{
+    std::vector<uint32_t> result;
+    for (auto&& format : formats) {
+        if (std::ranges::find(result, format.va.format) == result.end()
+            && device.format_supported(type, format.v4l2.format)) {
+            result.push_back(format.va.format);
+        }
+    }
+
+    if (!fourccs) {
+        return result.size();
+    }
+    const auto count = std::min<uint32_t>(result.size(), capacity);
+    std::copy_n(result.begin(), count, fourccs);
+    return count;
+}
+
+} // namespace
+
+VPPContext::VPPContext(DriverData* driver_data, V4L2M2MDevice& device, int picture_width, int picture_height,
+    std::span<VASurfaceID> surface_ids)
+    : Context(driver_data, device, picture_width, picture_height)
+    , rotation_flags(1 << VA_ROTATION_NONE)
+    , mirror_flags(VA_MIRROR_NONE)
+    , targets(surface_ids.begin(), surface_ids.end())
+{
+    // The OUTPUT queue is set up with the first picture, whose decoder determines the format to import
+    createSurfacesDeferred(driver_data, *this, surface_ids);
+
+    if (control_supported(device, V4L2_CID_ROTATE)) {
+        rotation_flags |= (1 << VA_ROTATION_90) | (1 << VA_ROTATION_180) | (1 << VA_ROTATION_270);
+    }
+    if (control_supported(device, V4L2_CID_HFLIP) && control_supported(device, V4L2_CID_VFLIP)) {
+        mirror_flags = VA_MIRROR_HORIZONTAL | VA_MIRROR_VERTICAL;
+    }
+}
+
+VPPContext::~VPPContext()
+{
+    // Imported pictures are let go of before the base class frees the CAPTURE buffers
+    try {
+        device.set_streaming(false);
+        device.request_buffers(device.output_buf_type, 0, false, V4L2_MEMORY_DMABUF);
+    } catch (std::system_error& e) {
+        error_log(driver_data->va_context, "Failed to release imported pictures: %s\n", e.what());
+    }
+}
+
+VAStatus VPPContext::store_buffer(const Buffer& buffer) const
+{
+    auto& surface = driver_data->surfaces.at(render_surface_id);
+
+    if (buffer.type != VAProcPipelineParameterBufferType) {
+        return VA_STATUS_ERROR_UNSUPPORTED_BUFFERTYPE;
+    }
+    auto pipeline = reinterpret_cast<VAProcPipelineParameterBuffer*>(buffer.data.get());
+
+    auto input = driver_data->surfaces.find(pipeline->surface);
+    if (input == driver_data->surfaces.end() || !input->second.destination_buffer
+        || pipeline->surface == render_surface_id) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+    if (pipeline->num_filters > 0) {
+        return VA_STATUS_ERROR_UNSUPPORTED_FILTER;
+    }
+    if (pipeline->rotation_state > VA_ROTATION_270 || !(rotation_flags & (1 << pipeline->rotation_state))
+        || (pipeline->mirror_state & ~mirror_flags) || pipeline->num_additional_outputs > 0
+        || (pipeline->blend_state && pipeline->blend_state->flags)) {
+        return VA_STATUS_ERROR_UNIMPLEMENTED;
+    }
+
+    surface.params.vpp.pipeline = pipeline;
+    return VA_STATUS_SUCCESS;
+}
+
+int VPPContext::set_controls()
+{
+    // Processors take no requests, the state is set when queueing
+    return VA_STATUS_SUCCESS;
+}
+
+/**
+ * Import pictures of the given format from now on. The OUTPUT buffers are requested anew for it, which needs the
+ * device idle: pictures still being processed are waited for.
+ */
+void VPPContext::set_input_format(const v4l2_pix_format_mplane& format)
+{
+    for (auto id : targets) {
+        auto target = driver_data->surfaces.find(id);
+        if (id != render_surface_id && target != driver_data->surfaces.end()
+            && target->second.status == VASurfaceRendering) {
+            syncSurface(driver_data->va_context, id);
+        }
+    }
+
+    input_format.reset();
+    device.set_streaming(false);
+    device.request_buffers(device.output_buf_type, 0, false, V4L2_MEMORY_DMABUF);
+
+    const auto pitches = std::span(format.plane_fmt, format.num_planes);
+    std::vector<unsigned> bytesperline;
+    std::ranges::transform(pitches, std::back_inserter(bytesperline), [](auto&& plane) { return plane.bytesperline; });
+    device.set_picture_format(device.output_buf_type, format.pixelformat, format.width, format.height, bytesperline);
+
+    // The pictures are where the decoder put them, the device has to take them as they are
+    const auto& accepted = device.output_format.fmt;
+    bool importable;
+    if (V4L2_TYPE_IS_MULTIPLANAR(device.output_buf_type)) {
+        importable = accepted.pix_mp.pixelformat == format.pixelformat
+            && accepted.pix_mp.num_planes == format.num_planes
+            && std::ranges::equal(std::span(accepted.pix_mp.plane_fmt, accepted.pix_mp.num_planes), pitches,
+                [](auto&& a, auto&& b) { return a.bytesperline == b.bytesperline; });
+    } else {
+        importable = accepted.pix.pixelformat == format.pixelformat && format.num_planes == 1
+            && accepted.pix.bytesperline == format.plane_fmt[0].bytesperline;
+    }
+    if (!importable) {
+        throw std::system_error(EINVAL, std::generic_category(), "Decoded pictures can't be imported");
+    }
+
+    if (device.request_buffers(device.output_buf_type, targets.size(), false, V4L2_MEMORY_DMABUF) < targets.size()) {
+        throw std::system_error(ENOMEM, std::generic_category(), "Too few OUTPUT buffers");
+    }
+    for (unsigned i = 0; i < targets.size(); i++) {
+        if (auto target = driver_data->surfaces.find(targets[i]); target != driver_data->surfaces.end()) {
+            target->second.source_buffer = std::cref(device.buffer(device.output_buf_type, i));
+        }
+    }
+    device.set_streaming(true);
+
+    input_format = format;
+    crop.reset(); // Setting the format reset it
+}
+
+void VPPContext::queue_buffers(Surface& surface)
+{
+    const auto& pipeline = *surface.params.vpp.pipeline;
+    auto& input = driver_data->surfaces.at(pipeline.surface);
+
+    // Decoders may still be writing the picture
+    if (input.status == VASurfaceRendering
+        && syncSurface(driver_data->va_context, pipeline.surface) != VA_STATUS_SUCCESS) {
+        throw std::system_error(EIO, std::generic_category(), "Input picture not decoded");
+    }
+
+    const auto& picture = input.destination_buffer->get();
+    const auto& format = picture.owner().capture_format.fmt.pix_mp;
+    if (!same_layout(input_format, format)) {
+        set_input_format(format);
+    }
+
+    const auto wanted_crop = buffer_rect(pipeline.surface_region, input.visible);
+    if (!same_rect(crop, wanted_crop)) {
+        device.set_selection(device.output_buf_type, V4L2_SEL_TGT_CROP, wanted_crop);
+        crop = wanted_crop;
+    }
+    const auto wanted_compose = buffer_rect(pipeline.output_region, surface.visible);
+    if (!same_rect(compose, wanted_compose)) {
+        device.set_selection(device.capture_buf_type, V4L2_SEL_TGT_COMPOSE, wanted_compose);
+        compose = wanted_compose;
+    }
+
+    const Transform wanted_transform = {
+        .rotate = static_cast<int32_t>(pipeline.rotation_state * 90),
+        .hflip = (pipeline.mirror_state & VA_MIRROR_HORIZONTAL) != 0,
+        .vflip = (pipeline.mirror_state & VA_MIRROR_VERTICAL) != 0,
+    };
+    if (transform != wanted_transform) {
+        std::vector<v4l2_ext_control> controls;
+        auto add = [&](uint32_t id, int32_t value) {
+            controls.push_back({ .id = id });
+            controls.back().value = value;
+        };
+        if (rotation_flags != (1 << VA_ROTATION_NONE)) {
+            add(V4L2_CID_ROTATE, wanted_transform.rotate);
+        }
+        if (mirror_flags) {
+            add(V4L2_CID_HFLIP, wanted_transform.hflip);
+            add(V4L2_CID_VFLIP, wanted_transform.vflip);
+        }
+        if (!controls.empty()) {
+            device.set_ext_controls(-1, controls);
+        }
+        transform = wanted_transform;
+    }
+
+    // Checked before queueing either buffer: a CAPTURE buffer queued alone would take the next picture's output
+    const auto& input_buffer = surface.source_buffer->get();
+    const auto& dmabufs = picture.dmabufs();
+    if (dmabufs.size() != input_buffer.plane_count()) {
+        throw std::system_error(EINVAL, std::generic_category(), "Picture and OUTPUT buffer planes differ");
+    }
+    std::vector<size_t> sizes;
+    for (unsigned i = 0; i < picture.plane_count(); i++) {
+        sizes.push_back(picture.plane_size(i));
+        if (sizes.back() < plane_size(device.output_format, i)) {
+            throw std::system_error(EINVAL, std::generic_category(), "Picture smaller than the OUTPUT format");
+        }
+    }
+    surface.destination_buffer->get().queue(-1, nullptr, 0, cache_hints(surface));
+    input_buffer.queue_dmabufs(dmabufs, sizes, &surface.timestamp);
+}
+
+VAStatus queryVideoProcFilters(
+    VADriverContextP va_context, VAContextID context_id, VAProcFilterType* filters, unsigned int* filters_count)
+{
+    auto driver_data = static_cast<DriverData*>(va_context->pDriverData);
+
+    if (!lookup_vpp_context(driver_data, context_id)) {
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    }
+
+    // Deinterlacing, denoising and color balance have no controls processors agree on
+    *filters_count = 0;
+    return VA_STATUS_SUCCESS;
+}
+
+VAStatus queryVideoProcFilterCaps(VADriverContextP va_context, VAContextID context_id, VAProcFilterType type,
+    void* filter_caps, unsigned int* filter_caps_count)
+{
+    auto driver_data = static_cast<DriverData*>(va_context->pDriverData);
+
+    if (!lookup_vpp_context(driver_data, context_id)) {
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    }
+    return VA_STATUS_ERROR_UNSUPPORTED_FILTER;
+}
+
+VAStatus queryVideoProcPipelineCaps(VADriverContextP va_context, VAContextID context_id, VABufferID* filters,
+    unsigned int filters_count, VAProcPipelineCaps* pipeline_caps)
+{
+    auto driver_data = static_cast<DriverData*>(va_context->pDriverData);
+
+    auto context = lookup_vpp_context(driver_data, context_id);
+    if (!context) {
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    }
+    if (filters_count > 0) {
+        return VA_STATUS_ERROR_UNSUPPORTED_FILTER;
+    }
+
+    const auto& device = context->device;
+    pipeline_caps->pipeline_flags = 0;
+    pipeline_caps->filter_flags = 0;
+    pipeline_caps->num_forward_references = 0;
+    pipeline_caps->num_backward_references = 0;
+    pipeline_caps->rotation_flags = context->rotation_flags;
+    pipeline_caps->mirror_flags = context->mirror_flags;
+    pipeline_caps->blend_flags = 0;
+    pipeline_caps->num_additional_outputs = 0;
+    pipeline_caps->num_input_pixel_formats = offered_fourccs(device, device.output_buf_type,
+        pipeline_caps->input_pixel_format, pipeline_caps->num_input_pixel_formats);
+    pipeline_caps->num_output_pixel_formats = offered_fourccs(device, device.capture_buf_type,
+        pipeline_caps->output_pixel_format, pipeline_caps->num_output_pixel_formats);
+
+    return VA_STATUS_SUCCESS;
+}
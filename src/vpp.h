@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <optional>
+#include <span>
+#include <vector>
+
+extern "C" {
+#include <linux/videodev2.h>
+
+#include <va/va_backend.h>
+#include <va/va_vpp.h>
+}
+
+#include "context.h"
+
+struct Buffer;
+struct DriverData;
+struct Surface;
+class V4L2M2MDevice;
+
+/**
+ * Video processing on a memory-to-memory scaler or color converter: cropping, scaling, flips and rotation, as far as
+ * the device has controls for the latter.
+ *
+ * The CAPTURE buffers of the device back the target surfaces given at creation. Input pictures stay where they were
+ * decoded and are imported into the OUTPUT queue as dma-bufs, whose format follows the input's decoder.
+ */
+class VPPContext : public Context {
+public:
+    VPPContext(DriverData* driver_data, V4L2M2MDevice& device, int picture_width, int picture_height,
+        std::span<VASurfaceID> surface_ids);
+    ~VPPContext() override;
+
+    VAStatus store_buffer(const Buffer& buffer) const override;
+    int set_controls() override;
+    void queue_buffers(Surface& surface) override;
+
+    /** `VA_ROTATION_*` and `VA_MIRROR_*` the device implements, as bit masks like in `VAProcPipelineCaps`. */
+    uint32_t rotation_flags;
+    uint32_t mirror_flags;
+
+private:
+    struct Transform {
+        int32_t rotate;
+        bool hflip;
+        bool vflip;
+
+        bool operator==(const Transform&) const = default;
+    };
+
+    void set_input_format(const v4l2_pix_format_mplane& format);
+
+    std::vector<VASurfaceID> targets;
+    /** The format of imported pictures, unset until the first one. */
+    std::optional<v4l2_pix_format_mplane> input_format;
+    /** The state of the device as last set, to skip setting it again for every picture. */
+    std::optional<v4l2_rect> crop;
+    std::optional<v4l2_rect> compose;
+    std::optional<Transform> transform;
+};
+
+VAStatus queryVideoProcFilters(
+    VADriverContextP va_context, VAContextID context_id, VAProcFilterType* filters, unsigned int* filters_count);
+VAStatus queryVideoProcFilterCaps(VADriverContextP va_context, VAContextID context_id, VAProcFilterType type,
+    void* filter_caps, unsigned int* filter_caps_count);
+VAStatus queryVideoProcPipelineCaps(VADriverContextP va_context, VAContextID context_id, VABufferID* filters,
+    unsigned int filters_count, VAProcPipelineCaps* pipeline_caps);
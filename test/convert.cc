@@ -0,0 +1,774 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Checks the pixel kernels of readback, upload, detiling, plane copies and subpicture blending against plain scalar
+ * implementations written from the format definitions, over odd widths and heights and the tails the vector loops
+ * leave. Destinations are surrounded by a guard pattern, so that writes beyond the region fail as well.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <linux/videodev2.h>
+
+#include <va/va.h>
+}
+
+#include "convert.h"
+#include "copy.h"
+#include "format.h"
+#include "subpicture.h"
+
+#ifndef V4L2_PIX_FMT_NV15
+#define V4L2_PIX_FMT_NV15 v4l2_fourcc('N', 'V', '1', '5')
+#endif
+
+namespace {
+
+constexpr uint8_t guard = 0xa5;
+constexpr unsigned widths[] = { 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 70 };
+constexpr unsigned heights[] = { 1, 2, 3, 4, 5, 7 };
+
+unsigned failures = 0;
+
+void fail(const std::string& test, const char* format, ...)
+{
+    if (failures++ < 20) {
+        fprintf(stderr, "%s: ", test.c_str());
+        va_list arguments;
+        va_start(arguments, format);
+        vfprintf(stderr, format, arguments);
+        va_end(arguments);
+        fprintf(stderr, "\n");
+    }
+}
+
+std::string fourcc_name(uint32_t fourcc)
+{
+    return std::string(reinterpret_cast<const char*>(&fourcc), 4);
+}
+
+std::vector<uint8_t> random_bytes(size_t size, uint32_t seed)
+{
+    std::vector<uint8_t> result(size);
+    for (auto& byte : result) {
+        seed = seed * 1103515245 + 12345;
+        byte = seed >> 16;
+    }
+    return result;
+}
+
+/** Compare whole buffers, including the guard bytes around the regions written. */
+bool compare(const std::string& test, const std::vector<uint8_t>& actual, const std::vector<uint8_t>& expected,
+    unsigned width, unsigned height)
+{
+    const auto mismatch = std::ranges::mismatch(actual, expected);
+    if (mismatch.in1 == actual.end()) {
+        return true;
+    }
+    const unsigned offset = mismatch.in1 - actual.begin();
+    fail(test + " " + std::to_string(width) + "x" + std::to_string(height), "byte %u is %u instead of %u", offset,
+        *mismatch.in1, *mismatch.in2);
+    return false;
+}
+
+uint8_t clamp(int value)
+{
+    return std::clamp(value, 0, 255);
+}
+
+/** Plane `i` of a 4:2:0 picture or image: its pitch, and rows. */
+struct Plane {
+    size_t pitch;
+    unsigned rows;
+};
+
+/*
+ * Readback
+ */
+
+/** The reference of `convert_rows()` for the whole region, from the definitions of the formats. */
+void reference_convert(std::vector<uint8_t> (&planes)[3], const Plane (&layout)[3], uint32_t fourcc,
+    uint32_t source_fourcc, const uint8_t* luma, size_t luma_pitch, const uint8_t* chroma, size_t chroma_pitch,
+    unsigned width, unsigned height)
+{
+    const unsigned pairs = (width + 1) / 2;
+    auto y = [&](unsigned x, unsigned row) { return luma[row * luma_pitch + x]; };
+    auto u = [&](unsigned pair, unsigned row) { return chroma[row / 2 * chroma_pitch + 2 * pair]; };
+    auto v = [&](unsigned pair, unsigned row) { return chroma[row / 2 * chroma_pitch + 2 * pair + 1]; };
+
+    if (source_fourcc != VA_FOURCC_NV12) {
+        // 10-bit samples in the upper bits of 16, from 16-bit containers or packed into 5 bytes per 4 samples
+        auto sample = [&](const uint8_t* row, unsigned i) -> uint16_t {
+            if (source_fourcc == VA_FOURCC_P010) {
+                return row[2 * i] | row[2 * i + 1] << 8;
+            }
+            const uint64_t group = uint64_t(row[i / 4 * 5]) | uint64_t(row[i / 4 * 5 + 1]) << 8
+                | uint64_t(row[i / 4 * 5 + 2]) << 16 | uint64_t(row[i / 4 * 5 + 3]) << 24
+                | uint64_t(row[i / 4 * 5 + 4]) << 32;
+            return (group >> (10 * (i % 4)) & 0x3ff) << 6;
+        };
+        auto put = [](uint8_t* destination, uint16_t value) {
+            destination[0] = value;
+            destination[1] = value >> 8;
+        };
+        for (unsigned row = 0; row < height; row++) {
+            for (unsigned x = 0; x < width; x++) {
+                put(&planes[0][row * layout[0].pitch + 2 * x], sample(luma + row * luma_pitch, x));
+            }
+        }
+        for (unsigned row = 0; row < (height + 1) / 2; row++) {
+            for (unsigned i = 0; i < 2 * pairs; i++) {
+                put(&planes[1][row * layout[1].pitch + 2 * i], sample(chroma + row * chroma_pitch, i));
+            }
+        }
+        return;
+    }
+
+    for (unsigned row = 0; row < height; row++) {
+        for (unsigned x = 0; x < width; x++) {
+            switch (fourcc) {
+            case VA_FOURCC_NV12:
+            case VA_FOURCC_I420:
+            case VA_FOURCC_YV12:
+                planes[0][row * layout[0].pitch + x] = y(x, row);
+                break;
+            case VA_FOURCC_YUY2: {
+                const auto pixel = &planes[0][row * layout[0].pitch + 4 * (x / 2)];
+                pixel[2 * (x % 2)] = y(x, row);
+                pixel[1] = u(x / 2, row);
+                pixel[3] = v(x / 2, row);
+                // Odd widths complete the last pair with the last pixel
+                if (x == width - 1 && x % 2 == 0) {
+                    pixel[2] = y(x, row);
+                }
+                break;
+            }
+            case VA_FOURCC_BGRA:
+            case VA_FOURCC_RGBA: {
+                const int c = 298 * (y(x, row) - 16) + 128;
+                const int d = u(x / 2, row) - 128;
+                const int e = v(x / 2, row) - 128;
+                const uint8_t r = clamp((c + 409 * e) >> 8);
+                const uint8_t g = clamp((c - 100 * d - 208 * e) >> 8);
+                const uint8_t b = clamp((c + 516 * d) >> 8);
+                const auto pixel = &planes[0][row * layout[0].pitch + 4 * x];
+                pixel[0] = (fourcc == VA_FOURCC_BGRA) ? b : r;
+                pixel[1] = g;
+                pixel[2] = (fourcc == VA_FOURCC_BGRA) ? r : b;
+                pixel[3] = 255;
+                break;
+            }
+            }
+        }
+    }
+
+    for (unsigned row = 0; row < height; row += 2) {
+        for (unsigned pair = 0; pair < pairs; pair++) {
+            switch (fourcc) {
+            case VA_FOURCC_NV12:
+                planes[1][row / 2 * layout[1].pitch + 2 * pair] = u(pair, row);
+                planes[1][row / 2 * layout[1].pitch + 2 * pair + 1] = v(pair, row);
+                break;
+            case VA_FOURCC_I420:
+            case VA_FOURCC_YV12: {
+                const unsigned u_plane = (fourcc == VA_FOURCC_I420) ? 1 : 2;
+                planes[u_plane][row / 2 * layout[u_plane].pitch + pair] = u(pair, row);
+                planes[3 - u_plane][row / 2 * layout[3 - u_plane].pitch + pair] = v(pair, row);
+                break;
+            }
+            }
+        }
+    }
+}
+
+/** Planes of an image of `fourcc`, with some slack after each row. */
+unsigned image_layout(Plane (&layout)[3], uint32_t fourcc, unsigned width, unsigned height)
+{
+    const unsigned slack = 13;
+    const unsigned pairs = (width + 1) / 2;
+    const unsigned chroma_rows = (height + 1) / 2;
+    switch (fourcc) {
+    case VA_FOURCC_NV12:
+        layout[0] = { width + slack, height };
+        layout[1] = { 2 * pairs + slack, chroma_rows };
+        return 2;
+    case VA_FOURCC_P010:
+        layout[0] = { 2 * width + slack, height };
+        layout[1] = { 4 * pairs + slack, chroma_rows };
+        return 2;
+    case VA_FOURCC_I420:
+    case VA_FOURCC_YV12:
+        layout[0] = { width + slack, height };
+        layout[1] = layout[2] = { pairs + slack, chroma_rows };
+        return 3;
+    case VA_FOURCC_YUY2:
+        layout[0] = { 4 * pairs + slack, height };
+        return 1;
+    default:
+        layout[0] = { 4 * width + slack, height };
+        return 1;
+    }
+}
+
+/** A decoded picture, linear with room for the vector loads of the kernels after each row. */
+struct Picture {
+    std::vector<uint8_t> luma;
+    size_t luma_pitch;
+    std::vector<uint8_t> chroma;
+    size_t chroma_pitch;
+};
+
+Picture random_picture(uint32_t fourcc, unsigned width, unsigned height, uint32_t seed)
+{
+    size_t row_size = (fourcc == VA_FOURCC_NV12) ? width + 1 : 2 * width + 2;
+    if (fourcc == VA_FOURCC_NV15) {
+        row_size = (width + 4) / 4 * 5;
+    }
+    Picture picture;
+    picture.luma_pitch = picture.chroma_pitch = row_size + 32;
+    picture.luma = random_bytes(picture.luma_pitch * height, seed);
+    picture.chroma = random_bytes(picture.chroma_pitch * ((height + 1) / 2), seed + 1);
+    return picture;
+}
+
+void test_convert(uint32_t source_fourcc, uint32_t fourcc, unsigned width, unsigned height)
+{
+    const auto picture = random_picture(source_fourcc, width, height, width * 31 + height);
+    Plane layout[3] = {};
+    const auto planes_count = image_layout(layout, fourcc, width, height);
+
+    std::vector<uint8_t> expected[3], actual[3];
+    for (unsigned i = 0; i < planes_count; i++) {
+        expected[i].assign(layout[i].pitch * layout[i].rows, guard);
+    }
+    reference_convert(expected, layout, fourcc, source_fourcc, picture.luma.data(), picture.luma_pitch,
+        picture.chroma.data(), picture.chroma_pitch, width, height);
+
+    const ConvertSource source = { picture.luma.data(), picture.luma_pitch, picture.chroma.data(),
+        picture.chroma_pitch, source_fourcc };
+    // Whole, and in two parts split at each even row as readback bands do
+    for (unsigned split = 0; split < height; split += 2) {
+        ConvertDestination destination = {};
+        destination.fourcc = fourcc;
+        for (unsigned i = 0; i < planes_count; i++) {
+            actual[i].assign(layout[i].pitch * layout[i].rows, guard);
+            destination.planes[i] = actual[i].data();
+            destination.pitches[i] = layout[i].pitch;
+        }
+        if (split) {
+            convert_rows(destination, source, width, 0, split);
+        }
+        convert_rows(destination, source, width, split, height);
+
+        for (unsigned i = 0; i < planes_count; i++) {
+            const auto test = "convert " + fourcc_name(source_fourcc) + " to " + fourcc_name(fourcc) + " plane "
+                + std::to_string(i) + " split " + std::to_string(split);
+            if (!compare(test, actual[i], expected[i], width, height)) {
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * Upload
+ */
+
+void reference_upload(std::vector<uint8_t>& luma, size_t luma_pitch, std::vector<uint8_t>& chroma,
+    size_t chroma_pitch, uint32_t fourcc, const std::vector<uint8_t> (&planes)[3], const Plane (&layout)[3],
+    unsigned width, unsigned height)
+{
+    const unsigned pairs = (width + 1) / 2;
+    const unsigned bytes = (fourcc == VA_FOURCC_P010) ? 2 : 1;
+    auto at = [&](unsigned plane, unsigned row, unsigned offset) {
+        return planes[plane][row * layout[plane].pitch + offset];
+    };
+
+    // Pixel `x` of `row` as R, G and B, odd widths and heights repeating the last column and row
+    auto rgb = [&](unsigned x, unsigned row, int (&result)[3]) {
+        x = std::min(x, width - 1);
+        row = std::min(row, height - 1);
+        const bool bgra = fourcc == VA_FOURCC_BGRA;
+        result[0] = at(0, row, 4 * x + (bgra ? 2 : 0));
+        result[1] = at(0, row, 4 * x + 1);
+        result[2] = at(0, row, 4 * x + (bgra ? 0 : 2));
+    };
+
+    for (unsigned row = 0; row < height; row++) {
+        for (unsigned x = 0; x < width; x++) {
+            auto pixel = &luma[row * luma_pitch + bytes * x];
+            switch (fourcc) {
+            case VA_FOURCC_NV12:
+            case VA_FOURCC_I420:
+            case VA_FOURCC_YV12:
+                pixel[0] = at(0, row, x);
+                break;
+            case VA_FOURCC_P010:
+                pixel[0] = at(0, row, 2 * x);
+                pixel[1] = at(0, row, 2 * x + 1);
+                break;
+            case VA_FOURCC_YUY2:
+                pixel[0] = at(0, row, 2 * x);
+                break;
+            default: {
+                int c[3];
+                rgb(x, row, c);
+                pixel[0] = ((66 * c[0] + 129 * c[1] + 25 * c[2] + 128) >> 8) + 16;
+                break;
+            }
+            }
+        }
+    }
+
+    for (unsigned row = 0; row < height; row += 2) {
+        const auto next = std::min(row + 1, height - 1);
+        for (unsigned pair = 0; pair < pairs; pair++) {
+            auto pixel = &chroma[row / 2 * chroma_pitch + 2 * bytes * pair];
+            switch (fourcc) {
+            case VA_FOURCC_NV12:
+                pixel[0] = at(1, row / 2, 2 * pair);
+                pixel[1] = at(1, row / 2, 2 * pair + 1);
+                break;
+            case VA_FOURCC_P010:
+                for (unsigned i = 0; i < 4; i++) {
+                    pixel[i] = at(1, row / 2, 4 * pair + i);
+                }
+                break;
+            case VA_FOURCC_I420:
+            case VA_FOURCC_YV12: {
+                const unsigned u_plane = (fourcc == VA_FOURCC_I420) ? 1 : 2;
+                pixel[0] = at(u_plane, row / 2, pair);
+                pixel[1] = at(3 - u_plane, row / 2, pair);
+                break;
+            }
+            case VA_FOURCC_YUY2:
+                // Rounding up, as the averaging instructions of SIMD instruction sets do
+                pixel[0] = (at(0, row, 4 * pair + 1) + at(0, next, 4 * pair + 1) + 1) / 2;
+                pixel[1] = (at(0, row, 4 * pair + 3) + at(0, next, 4 * pair + 3) + 1) / 2;
+                break;
+            default: {
+                int sum[3] = {};
+                for (unsigned i = 0; i < 4; i++) {
+                    int c[3];
+                    rgb(2 * pair + i % 2, row + i / 2, c);
+                    for (unsigned component = 0; component < 3; component++) {
+                        sum[component] += c[component];
+                    }
+                }
+                const int r = (sum[0] + 2) / 4, g = (sum[1] + 2) / 4, b = (sum[2] + 2) / 4;
+                pixel[0] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+                pixel[1] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+                break;
+            }
+            }
+        }
+    }
+}
+
+void test_upload(uint32_t fourcc, unsigned width, unsigned height)
+{
+    Plane layout[3] = {};
+    const auto planes_count = image_layout(layout, fourcc, width, height);
+    std::vector<uint8_t> planes[3];
+    for (unsigned i = 0; i < planes_count; i++) {
+        planes[i] = random_bytes(layout[i].pitch * layout[i].rows, width * 17 + height + i);
+    }
+
+    const unsigned bytes = (fourcc == VA_FOURCC_P010) ? 2 : 1;
+    const size_t pitch = bytes * (width + 1) + 7;
+    const unsigned chroma_rows = (height + 1) / 2;
+    std::vector<uint8_t> expected_luma(pitch * height, guard), expected_chroma(pitch * chroma_rows, guard);
+    reference_upload(expected_luma, pitch, expected_chroma, pitch, fourcc, planes, layout, width, height);
+
+    UploadSource source = {};
+    source.fourcc = fourcc;
+    for (unsigned i = 0; i < planes_count; i++) {
+        source.planes[i] = planes[i].data();
+        source.pitches[i] = layout[i].pitch;
+    }
+    for (unsigned split = 0; split < height; split += 2) {
+        std::vector<uint8_t> luma(pitch * height, guard), chroma(pitch * chroma_rows, guard);
+        const UploadDestination destination = { luma.data(), pitch, chroma.data(), pitch };
+        if (split) {
+            upload_rows(destination, source, width, 0, split);
+        }
+        upload_rows(destination, source, width, split, height);
+
+        const auto test = "upload " + fourcc_name(fourcc) + " split " + std::to_string(split);
+        if (!compare(test + " luma", luma, expected_luma, width, height)
+            || !compare(test + " chroma", chroma, expected_chroma, width, height)) {
+            return;
+        }
+    }
+}
+
+/*
+ * Detiling and copies
+ */
+
+void test_detile(unsigned tile_width, unsigned tile_height, unsigned tiles, unsigned tile_rows)
+{
+    const size_t pitch = tile_width * tiles;
+    const auto source = random_bytes(pitch * tile_height * tile_rows, tiles * 7 + tile_rows);
+    std::vector<uint8_t> expected(pitch * tile_height * tile_rows + 64, guard);
+    auto actual = expected;
+
+    // Tiles are stored one after the other, each row by row
+    for (unsigned tile_row = 0; tile_row < tile_rows; tile_row++) {
+        for (unsigned tile = 0; tile < tiles; tile++) {
+            const auto data = source.data() + (tile_row * tiles + tile) * tile_width * tile_height;
+            for (unsigned row = 0; row < tile_height; row++) {
+                for (unsigned x = 0; x < tile_width; x++) {
+                    expected[(tile_row * tile_height + row) * pitch + tile * tile_width + x]
+                        = data[row * tile_width + x];
+                }
+            }
+        }
+    }
+
+    detile_rows(actual.data(), source.data(), pitch, tile_width, tile_height, tile_rows);
+    compare("detile " + std::to_string(tile_width) + "x" + std::to_string(tile_height), actual, expected,
+        tiles * tile_width, tile_rows * tile_height);
+}
+
+void test_copy_kernels()
+{
+    const auto source = random_bytes(4096 + 64, 1);
+    for (auto&& kernel : copy_kernels()) {
+        for (size_t size = 0; size < 1100; size += (size < 300) ? 1 : 37) {
+            for (unsigned alignment = 0; alignment < 16; alignment += 5) {
+                std::vector<uint8_t> expected(size + 64, guard);
+                auto actual = expected;
+                memcpy(expected.data() + alignment, source.data() + 15 - alignment, size);
+                kernel.copy(actual.data() + alignment, source.data() + 15 - alignment, size);
+                if (!compare(std::string("copy kernel ") + kernel.name, actual, expected, size, alignment)) {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void test_copy_pool()
+{
+    for (unsigned threads = 1; threads <= 4; threads++) {
+        // Split everything, into as many bands as there are rows at most
+        CopyPool pool(threads, 1);
+        for (unsigned width : { 1u, 3u, 64u, 100u, 333u }) {
+            for (unsigned rows : { 1u, 2u, 3u, 7u, 37u, 64u }) {
+                const size_t source_pitch = width + 5;
+                const size_t destination_pitch = width + 11;
+                const auto source = random_bytes(source_pitch * rows, width + rows);
+                std::vector<uint8_t> expected(destination_pitch * rows, guard);
+                auto actual = expected;
+                for (unsigned row = 0; row < rows; row++) {
+                    memcpy(expected.data() + row * destination_pitch, source.data() + row * source_pitch, width);
+                }
+                pool.copy_plane(actual.data(), destination_pitch, source.data(), source_pitch, width, rows);
+                compare("copy pool, " + std::to_string(threads) + " threads", actual, expected, width, rows);
+            }
+        }
+
+        // Every band runs exactly once, also when the pool has more threads than bands
+        for (unsigned bands : { 1u, 2u, 3u, 5u, 16u }) {
+            std::vector<std::atomic<unsigned>> runs(bands);
+            pool.run(bands, [&](unsigned band, unsigned count) {
+                if (band < bands && count == bands) {
+                    runs[band]++;
+                }
+            });
+            for (unsigned band = 0; band < bands; band++) {
+                if (runs[band] != 1) {
+                    fail("copy pool", "band %u of %u ran %u times", band, bands, runs[band].load());
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Subpictures
+ */
+
+void test_blend_row()
+{
+    // All destination values for each source and alpha, against rounding the exact quotient
+    std::vector<uint8_t> destination(256), source(256), alpha(256), expected(256);
+    for (unsigned s = 0; s < 256; s += 3) {
+        for (unsigned a = 0; a < 256; a++) {
+            for (unsigned d = 0; d < 256; d++) {
+                destination[d] = d;
+                source[d] = s;
+                alpha[d] = a;
+                expected[d] = (d * (255 - a) + s * a + 127) / 255;
+            }
+            blend_row(destination.data(), source.data(), alpha.data(), 256);
+            if (!compare("blend s " + std::to_string(s) + " a " + std::to_string(a), destination, expected, 256, 1)) {
+                return;
+            }
+        }
+    }
+
+    // Tails, next to untouched bytes
+    for (unsigned count = 0; count < 40; count++) {
+        const auto d = random_bytes(count + 8, count), s = random_bytes(count, count + 1),
+                   a = random_bytes(count, count + 2);
+        auto actual = d, expected = d;
+        for (unsigned i = 0; i < count; i++) {
+            expected[i] = (d[i] * (255 - a[i]) + s[i] * a[i] + 127) / 255;
+        }
+        blend_row(actual.data(), s.data(), a.data(), count);
+        compare("blend tail", actual, expected, count, 1);
+    }
+}
+
+void test_fetch_pixel()
+{
+    std::array<uint32_t, 16> palette;
+    for (unsigned i = 0; i < palette.size(); i++) {
+        palette[i] = 0x010203 * (i + 1) ^ 0x5a00a5;
+    }
+    const auto row = random_bytes(4 * 64, 99);
+
+    for (unsigned x = 0; x < 64; x++) {
+        const auto pixel = &row[4 * x];
+        // ARGB and RGBA hold their components in memory from the least significant byte of the masks on
+        const uint32_t argb = pixel[3] << 24 | pixel[2] << 16 | pixel[1] << 8 | pixel[0];
+        const uint32_t rgba = pixel[3] << 24 | pixel[0] << 16 | pixel[1] << 8 | pixel[2];
+        // Alpha of 4 bits scaled to 8, in the upper nibble for AI44
+        const uint32_t ai44 = (row[x] >> 4) * 255 / 15 << 24 | palette[row[x] & 0xf];
+        const uint32_t ia44 = (row[x] & 0xf) * 255 / 15 << 24 | palette[row[x] >> 4];
+
+        const std::pair<uint32_t, uint32_t> cases[] = {
+            { VA_FOURCC_ARGB, argb },
+            { VA_FOURCC_RGBA, rgba },
+            { VA_FOURCC_AI44, ai44 },
+            { VA_FOURCC_IA44, ia44 },
+        };
+        for (auto&& [fourcc, expected] : cases) {
+            const auto actual = fetch_pixel(fourcc, row.data(), palette, x);
+            if (actual != expected) {
+                fail("fetch " + fourcc_name(fourcc), "pixel %u is 0x%08x instead of 0x%08x", x, actual, expected);
+            }
+        }
+    }
+}
+
+void test_chromakeyed()
+{
+    const auto colors = random_bytes(4 * 2000, 5);
+    for (unsigned i = 0; i + 16 <= colors.size(); i += 16) {
+        uint32_t values[4];
+        memcpy(values, &colors[i], sizeof(values));
+        Subpicture subpicture;
+        subpicture.chromakey_min = values[0];
+        subpicture.chromakey_max = values[1] | values[0];
+        // Some components unmasked, which then always match
+        subpicture.chromakey_mask = values[2] & (i % 3 ? 0xffffffff : 0xff00ff);
+
+        for (uint32_t color : { values[3], values[0], subpicture.chromakey_max, values[3] & values[1] }) {
+            bool expected = true;
+            for (unsigned component = 0; component < 3; component++) {
+                const unsigned mask = subpicture.chromakey_mask >> (8 * component) & 0xff;
+                const unsigned value = color >> (8 * component) & mask;
+                const unsigned minimum = subpicture.chromakey_min >> (8 * component) & mask;
+                const unsigned maximum = subpicture.chromakey_max >> (8 * component) & mask;
+                expected = expected && minimum <= value && value <= maximum;
+            }
+            if (chromakeyed(subpicture, color) != expected) {
+                fail("chromakey", "color 0x%08x, mask 0x%08x: expected %u", color, subpicture.chromakey_mask, expected);
+            }
+        }
+    }
+}
+
+/*
+ * Layouts
+ */
+
+/** The planes of a picture in a V4L2 format, by its definition in the kernel documentation. */
+BufferLayout reference_layout(uint32_t v4l2_format, unsigned pitch, unsigned height)
+{
+    auto align = [](unsigned value, unsigned alignment) { return (value + alignment - 1) / alignment * alignment; };
+    const unsigned chroma_rows = (height + 1) / 2;
+    switch (v4l2_format) {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_P010:
+    case V4L2_PIX_FMT_NV15:
+        return { { 0, pitch * height, pitch, 0 }, { 0, pitch * chroma_rows, pitch, pitch * height } };
+    case V4L2_PIX_FMT_NV12M:
+    case V4L2_PIX_FMT_NV21M:
+        return { { 0, pitch * height, pitch, 0 }, { 1, pitch * chroma_rows, pitch, 0 } };
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YVU420:
+        return { { 0, pitch * height, pitch, 0 }, { 0, pitch / 2 * chroma_rows, pitch / 2, pitch * height },
+            { 0, pitch / 2 * chroma_rows, pitch / 2, pitch * height + pitch / 2 * chroma_rows } };
+    case V4L2_PIX_FMT_YUV420M:
+    case V4L2_PIX_FMT_YVU420M:
+        return { { 0, pitch * height, pitch, 0 }, { 1, pitch / 2 * chroma_rows, pitch / 2, 0 },
+            { 2, pitch / 2 * chroma_rows, pitch / 2, 0 } };
+    case V4L2_PIX_FMT_NV12_4L4:
+        return { { 0, pitch * align(height, 4), pitch, 0 },
+            { 0, pitch * align(chroma_rows, 4), pitch, pitch * align(height, 4) } };
+    case V4L2_PIX_FMT_NV12_32L32:
+        return { { 0, pitch * align(height, 32), pitch, 0 },
+            { 0, pitch * align(chroma_rows, 32), pitch, pitch * align(height, 32) } };
+    default: {
+        // AFBC: 16 byte headers per 16x16 superblock, aligned to 4 KiB, then the 12 bit per pixel bodies
+        const unsigned width = pitch * 2 / 3;
+        const unsigned superblocks = (width + 15) / 16 * ((height + 15) / 16);
+        return { { 0, align(16 * superblocks, 4096) + superblocks * 16 * 16 * 3 / 2, pitch, 0 } };
+    }
+    }
+}
+
+bool operator==(const LogicalPlane& a, const LogicalPlane& b)
+{
+    return a.physical_plane_index == b.physical_plane_index && a.size == b.size && a.pitch == b.pitch
+        && a.offset == b.offset;
+}
+
+void compare_layout(const std::string& test, const BufferLayout& actual, const BufferLayout& expected)
+{
+    if (actual.size() != expected.size()) {
+        fail(test, "%zu planes instead of %zu", actual.size(), expected.size());
+        return;
+    }
+    for (unsigned i = 0; i < actual.size(); i++) {
+        if (!(actual[i] == expected[i])) {
+            fail(test, "plane %u: size %u, offset %u", i, actual[i].size, actual[i].offset);
+        }
+    }
+}
+
+void test_layouts()
+{
+    for (auto&& format : formats) {
+        const auto name = fourcc_name(format.v4l2.format);
+        // Pitches as drivers align them, for formats with 1, 2, 4 and 5 byte groups
+        for (unsigned pitch : { 96u, 160u, 480u, 1920u }) {
+            for (unsigned height : { 1u, 2u, 17u, 64u, 99u, 1080u }) {
+                const auto expected = reference_layout(format.v4l2.format, pitch, height);
+                const auto layout = derive_layout(format, pitch, height);
+                compare_layout("layout " + name + " " + std::to_string(pitch) + "x" + std::to_string(height), layout,
+                    expected);
+
+                // Cropping skips whole rows and sample groups, in every plane
+                if (!starts_on_sample(format, 0, 0)) {
+                    continue;
+                }
+                for (unsigned x = 0; x < 64; x += format.planes[0].pixels) {
+                    for (unsigned y = 0; y < std::min(height, 6u); y += 2) {
+                        if (!starts_on_sample(format, x, y)) {
+                            continue;
+                        }
+                        auto cropped = expected;
+                        for (unsigned i = 0; i < cropped.size(); i++) {
+                            const auto& plane = format.planes[i];
+                            const unsigned skipped = y / plane.vertical_subsampling * cropped[i].pitch
+                                + x / plane.pixels * plane.bytes;
+                            cropped[i].offset += skipped;
+                            cropped[i].size = (skipped < cropped[i].size) ? cropped[i].size - skipped : 0;
+                        }
+                        compare_layout("crop " + name + " at " + std::to_string(x) + "," + std::to_string(y),
+                            crop_layout(format, layout, x, y), cropped);
+                    }
+                }
+            }
+        }
+    }
+
+    // Images are packed tightly, with rounded up chroma for odd sizes
+    for (auto&& format : image_formats) {
+        for (unsigned width : widths) {
+            for (unsigned height : heights) {
+                Plane planes[3] = {};
+                const auto count = image_layout(planes, format.va.fourcc, width, height);
+                BufferLayout expected;
+                unsigned offset = 0;
+                for (unsigned i = 0; i < count; i++) {
+                    const unsigned pitch = planes[i].pitch - 13;
+                    expected.push_back({ 0, pitch * planes[i].rows, pitch, offset });
+                    offset += pitch * planes[i].rows;
+                }
+                compare_layout("image layout " + fourcc_name(format.va.fourcc) + " " + std::to_string(width) + "x"
+                        + std::to_string(height),
+                    derive_layout(format, width, height), expected);
+            }
+        }
+    }
+}
+
+} // namespace
+
+int main()
+{
+    for (unsigned width : widths) {
+        for (unsigned height : heights) {
+            for (uint32_t fourcc : { VA_FOURCC_NV12, VA_FOURCC_I420, VA_FOURCC_YV12, VA_FOURCC_YUY2, VA_FOURCC_BGRA,
+                     VA_FOURCC_RGBA }) {
+                test_convert(VA_FOURCC_NV12, fourcc, width, height);
+                test_upload(fourcc, width, height);
+            }
+            test_convert(VA_FOURCC_P010, VA_FOURCC_P010, width, height);
+            test_convert(VA_FOURCC_NV15, VA_FOURCC_P010, width, height);
+            test_upload(VA_FOURCC_P010, width, height);
+        }
+    }
+
+    for (unsigned tiles = 1; tiles <= 9; tiles++) {
+        for (unsigned tile_rows = 1; tile_rows <= 3; tile_rows++) {
+            test_detile(4, 4, tiles, tile_rows);
+            test_detile(32, 32, tiles, tile_rows);
+            test_detile(16, 2, tiles, tile_rows);
+        }
+    }
+    test_copy_kernels();
+    test_copy_pool();
+
+    test_blend_row();
+    test_fetch_pixel();
+    test_chromakeyed();
+
+    test_layouts();
+
+    if (failures) {
+        fprintf(stderr, "%u failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All kernels match their references\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Smoke test of request submission, control plumbing and buffer cycling through the driver's V4L2 layer, using the
+ * stateless FWHT decoder of vicodec (or the fake device with `LIBVA_V4L2_FAKE_OUTPUT_FORMATS=SFWH`). Frames are sent
+ * with uncompressed planes, which the decoder copies verbatim, so the result can be checked byte by byte.
+ *
+ * Exits with 77 (skipped) when no device decodes FWHT.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <linux/v4l2-controls.h>
+#include <linux/videodev2.h>
+}
+
+#include "media.h"
+#include "utils.h"
+#include "v4l2.h"
+
+namespace {
+
+constexpr unsigned width = 128;
+constexpr unsigned height = 64;
+constexpr unsigned frames = 32;
+constexpr int skipped = 77;
+
+uint8_t pattern(unsigned frame, unsigned plane, unsigned x, unsigned y)
+{
+    return static_cast<uint8_t>(frame * 7 + plane * 85 + x + y * 3);
+}
+
+struct Plane {
+    unsigned width;
+    unsigned height;
+};
+
+const Plane planes[] = { { width, height }, { width / 2, height / 2 }, { width / 2, height / 2 } };
+
+/** FWHT source data: the Y, Cb and Cr planes back to back, without padding. */
+unsigned fill_source(uint8_t* data, unsigned frame)
+{
+    unsigned offset = 0;
+    for (unsigned p = 0; p < std::size(planes); p++) {
+        for (unsigned y = 0; y < planes[p].height; y++) {
+            for (unsigned x = 0; x < planes[p].width; x++) {
+                data[offset++] = pattern(frame, p, x, y);
+            }
+        }
+    }
+    return offset;
+}
+
+/**
+ * Compare a decoded YUV420 frame, laid out according to `format`, with the source. vicodec is single-planar unless
+ * loaded with `multiplanar=1`, so the stride is taken from the member of the format matching its type.
+ */
+bool check_decoded(const uint8_t* data, const v4l2_format& format, unsigned frame)
+{
+    const bool multiplanar = V4L2_TYPE_IS_MULTIPLANAR(format.type);
+    const unsigned stride = multiplanar ? format.fmt.pix_mp.plane_fmt[0].bytesperline : format.fmt.pix.bytesperline;
+    const unsigned height = multiplanar ? format.fmt.pix_mp.height : format.fmt.pix.height;
+    const unsigned chroma_stride = stride / 2;
+    const size_t offsets[] = { 0, size_t(stride) * height, size_t(stride) * height * 5 / 4 };
+
+    for (unsigned p = 0; p < std::size(planes); p++) {
+        for (unsigned y = 0; y < planes[p].height; y++) {
+            for (unsigned x = 0; x < planes[p].width; x++) {
+                const auto value = data[offsets[p] + y * (p ? chroma_stride : stride) + x];
+                if (value != pattern(frame, p, x, y)) {
+                    fprintf(stderr, "Frame %u plane %u differs at %u,%u: %u instead of %u\n", frame, p, x, y, value,
+                        pattern(frame, p, x, y));
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    try {
+        std::optional<V4L2M2MDevice> device;
+        for (auto&& [video_path, media_path] :
+            V4L2M2MDevice::enumerate_devices(getenv_opt("LIBVA_V4L2_DEVICE_DRIVER"))) {
+            V4L2M2MDevice candidate(video_path, media_path);
+            if (media_path && candidate.format_supported(candidate.output_buf_type, V4L2_PIX_FMT_FWHT_STATELESS)) {
+                printf("Using %s\n", video_path.c_str());
+                device.emplace(std::move(candidate));
+                break;
+            }
+        }
+        if (!device) {
+            printf("No stateless FWHT decoder found\n");
+            return skipped;
+        }
+
+        device->set_format(device->output_buf_type, V4L2_PIX_FMT_FWHT_STATELESS, width, height);
+        device->set_format(device->capture_buf_type, V4L2_PIX_FMT_YUV420, width, height);
+        const auto& capture_format = device->capture_format;
+        const auto pixelformat = V4L2_TYPE_IS_MULTIPLANAR(capture_format.type) ? capture_format.fmt.pix_mp.pixelformat
+                                                                                 : capture_format.fmt.pix.pixelformat;
+        if (pixelformat != V4L2_PIX_FMT_YUV420) {
+            printf("YUV420 output not supported\n");
+            return skipped;
+        }
+        device->request_buffers(device->output_buf_type, 1);
+        device->request_buffers(device->capture_buf_type, 1);
+        device->set_streaming(true);
+
+        // The fake device accepts the requests but leaves the picture alone.
+        const bool produces_data = getenv_opt("LIBVA_V4L2_BACKEND").value_or("kernel") != "fake";
+        const auto& source = device->buffer(device->output_buf_type, 0);
+        const auto& destination = device->buffer(device->capture_buf_type, 0);
+        const int request_fd = media_request_alloc(device->media_fd);
+
+        const auto start = std::chrono::steady_clock::now();
+        for (unsigned frame = 0; frame < frames; frame++) {
+            v4l2_ctrl_fwht_params params = {
+                .version = V4L2_FWHT_VERSION,
+                .width = width,
+                .height = height,
+                .flags = V4L2_FWHT_FL_LUMA_IS_UNCOMPRESSED | V4L2_FWHT_FL_CB_IS_UNCOMPRESSED
+                    | V4L2_FWHT_FL_CR_IS_UNCOMPRESSED | V4L2_FWHT_FL_I_FRAME
+                    | (3 << V4L2_FWHT_FL_COMPONENTS_NUM_OFFSET) | V4L2_FWHT_FL_PIXENC_YUV,
+                .colorspace = V4L2_COLORSPACE_REC709,
+                .xfer_func = V4L2_XFER_FUNC_709,
+                .ycbcr_enc = V4L2_YCBCR_ENC_709,
+                .quantization = V4L2_QUANTIZATION_LIM_RANGE,
+            };
+            timeval timestamp = { .tv_sec = frame, .tv_usec = 0 };
+
+            const auto size = fill_source(source.mapping()[0].data(), frame);
+            device->set_ext_control(request_fd, V4L2_CID_STATELESS_FWHT_PARAMS, &params, sizeof(params));
+            destination.queue();
+            source.queue(request_fd, &timestamp, size);
+            media_request_queue(request_fd);
+            media_request_wait_completion(request_fd);
+            source.dequeue();
+            destination.dequeue();
+            media_request_reinit(request_fd);
+
+            if (produces_data && !check_decoded(destination.mapping()[0].data(), capture_format, frame)) {
+                return EXIT_FAILURE;
+            }
+        }
+        const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+
+        media_request_free(request_fd);
+        device->set_streaming(false);
+        printf("%u frames, %.1f us per frame\n", frames, elapsed.count() / frames);
+    } catch (std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
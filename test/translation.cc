@@ -0,0 +1,606 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Golden tests for the translation of VA parameter buffers into V4L2 controls.
+ *
+ * Each case feeds a short sequence of parameter buffers, as a player would submit them, through the functions the
+ * codec's `set_controls` builds its controls with, and compares them against a hex dump in the golden directory. Run
+ * with `--update` to rewrite the dumps after an intended change, and review the diff.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <linux/v4l2-controls.h>
+
+#include <va/va.h>
+#include <va/va_dec_vp8.h>
+}
+
+#include "h264.h"
+#include "mpeg2.h"
+#include "surface.h"
+#include "vp8.h"
+#ifdef ENABLE_VP9
+#include "vp9.h"
+#endif
+
+namespace {
+
+struct Control {
+    std::string name;
+    std::vector<uint8_t> data;
+};
+
+template <typename T> Control control(const std::string& name, const T& value)
+{
+    const auto bytes = reinterpret_cast<const uint8_t*>(&value);
+    return { name, std::vector<uint8_t>(bytes, bytes + sizeof(value)) };
+}
+
+/**
+ * Surfaces 0 to `count` - 1, with distinct timestamps so that references show up in the controls.
+ */
+std::map<VASurfaceID, Surface> make_surfaces(unsigned count = 8)
+{
+    std::map<VASurfaceID, Surface> surfaces;
+    for (VASurfaceID id = 0; id < count; id++) {
+        surfaces[id].timestamp = { .tv_sec = 1000 + id, .tv_usec = 40000 * id };
+    }
+    return surfaces;
+}
+
+/**
+ * Dump in the style of `hexdump -C`, with repeated lines collapsed to `*`.
+ */
+std::string dump(const std::vector<Control>& controls)
+{
+    std::ostringstream result;
+    char line[128];
+
+    for (auto&& control : controls) {
+        result << control.name << " (" << control.data.size() << " bytes)\n";
+
+        std::string previous;
+        bool collapsed = false;
+        for (size_t offset = 0; offset < control.data.size(); offset += 16) {
+            std::string bytes;
+            for (size_t i = offset; i < std::min(offset + 16, control.data.size()); i++) {
+                snprintf(line, sizeof(line), " %02x", control.data[i]);
+                bytes += line;
+            }
+            if (bytes == previous && offset + 16 < control.data.size()) {
+                if (!collapsed) {
+                    result << "*\n";
+                    collapsed = true;
+                }
+                continue;
+            }
+            snprintf(line, sizeof(line), "%08zx ", offset);
+            result << line << bytes << "\n";
+            previous = bytes;
+            collapsed = false;
+        }
+    }
+
+    return result.str();
+}
+
+std::vector<Control> mpeg2_ipb()
+{
+    auto surfaces = make_surfaces();
+    std::vector<Control> result;
+
+    VAIQMatrixBufferMPEG2 iqmatrix = {};
+    iqmatrix.load_intra_quantiser_matrix = 1;
+    for (unsigned i = 0; i < 64; i++) {
+        iqmatrix.intra_quantiser_matrix[i] = 8 + i / 2;
+    }
+
+    struct {
+        VASurfaceID target;
+        unsigned type;
+        VASurfaceID forward;
+        VASurfaceID backward;
+        VAIQMatrixBufferMPEG2* iqmatrix;
+    } frames[] = {
+        { 0, 1, VA_INVALID_SURFACE, VA_INVALID_SURFACE, &iqmatrix },
+        { 1, 2, 0, VA_INVALID_SURFACE, nullptr },
+        { 2, 3, 0, 1, nullptr },
+    };
+
+    for (auto&& frame : frames) {
+        VAPictureParameterBufferMPEG2 picture = {};
+        picture.horizontal_size = 720;
+        picture.vertical_size = 576;
+        picture.forward_reference_picture = frame.forward;
+        picture.backward_reference_picture = frame.backward;
+        picture.picture_coding_type = frame.type;
+        picture.f_code = (frame.type == 1) ? 0xffff : (frame.type == 2) ? 0x22ff : 0x2222;
+        picture.picture_coding_extension.bits.intra_dc_precision = 1;
+        picture.picture_coding_extension.bits.picture_structure = 3;
+        picture.picture_coding_extension.bits.top_field_first = 1;
+        picture.picture_coding_extension.bits.frame_pred_frame_dct = 1;
+        picture.picture_coding_extension.bits.q_scale_type = 1;
+        picture.picture_coding_extension.bits.intra_vlc_format = frame.type == 1;
+        picture.picture_coding_extension.bits.progressive_frame = 1;
+        picture.picture_coding_extension.bits.is_first_field = 1;
+
+        auto& surface = surfaces.at(frame.target);
+        surface.params.mpeg2.picture = &picture;
+        surface.params.mpeg2.iqmatrix = frame.iqmatrix;
+
+        const auto controls = mpeg2_va_to_v4l2(surfaces, surface);
+        result.push_back(control("MPEG2_SEQUENCE", controls.sequence));
+        result.push_back(control("MPEG2_PICTURE", controls.picture));
+        if (controls.quantisation) {
+            result.push_back(control("MPEG2_QUANTISATION", *controls.quantisation));
+        }
+    }
+
+    return result;
+}
+
+VAPictureH264 h264_picture(VASurfaceID id, unsigned frame_num, int poc, unsigned flags = 0)
+{
+    return {
+        .picture_id = id,
+        .frame_idx = frame_num,
+        .flags = flags,
+        .TopFieldOrderCnt = poc,
+        .BottomFieldOrderCnt = poc,
+    };
+}
+
+/**
+ * IDR, P, non-reference B, and a weighted P frame at 1080p.
+ */
+std::vector<Control> h264_ipbp()
+{
+    auto surfaces = make_surfaces();
+    const VAPictureH264 invalid = { .picture_id = VA_INVALID_SURFACE, .flags = VA_PICTURE_H264_INVALID };
+    std::vector<Control> result;
+    h264_dpb dpb = {};
+
+    VAIQMatrixBufferH264 matrix = {};
+    for (unsigned i = 0; i < 6; i++) {
+        for (unsigned j = 0; j < 16; j++) {
+            matrix.ScalingList4x4[i][j] = 16 + i + j;
+        }
+    }
+    for (unsigned i = 0; i < 2; i++) {
+        for (unsigned j = 0; j < 64; j++) {
+            matrix.ScalingList8x8[i][j] = 16 + i + j / 4;
+        }
+    }
+
+    struct {
+        VAPictureH264 current;
+        unsigned slice_type;
+        bool reference;
+        bool weighted;
+        std::vector<VAPictureH264> references;
+        std::vector<VAPictureH264> list0;
+        std::vector<VAPictureH264> list1;
+    } frames[] = {
+        { h264_picture(0, 0, 0), 2, true, false, {}, {}, {} },
+        {
+            h264_picture(1, 1, 8),
+            0,
+            true,
+            false,
+            { h264_picture(0, 0, 0, VA_PICTURE_H264_SHORT_TERM_REFERENCE) },
+            { h264_picture(0, 0, 0, VA_PICTURE_H264_SHORT_TERM_REFERENCE) },
+            {},
+        },
+        {
+            h264_picture(2, 2, 4),
+            1,
+            false,
+            false,
+            {
+                h264_picture(0, 0, 0, VA_PICTURE_H264_SHORT_TERM_REFERENCE),
+                h264_picture(1, 1, 8, VA_PICTURE_H264_SHORT_TERM_REFERENCE),
+            },
+            { h264_picture(0, 0, 0, VA_PICTURE_H264_SHORT_TERM_REFERENCE) },
+            { h264_picture(1, 1, 8, VA_PICTURE_H264_SHORT_TERM_REFERENCE) },
+        },
+        {
+            h264_picture(3, 2, 16),
+            0,
+            true,
+            true,
+            {
+                h264_picture(0, 0, 0, VA_PICTURE_H264_LONG_TERM_REFERENCE),
+                h264_picture(1, 1, 8, VA_PICTURE_H264_SHORT_TERM_REFERENCE),
+            },
+            {
+                h264_picture(1, 1, 8, VA_PICTURE_H264_SHORT_TERM_REFERENCE),
+                h264_picture(0, 0, 0, VA_PICTURE_H264_LONG_TERM_REFERENCE),
+            },
+            {},
+        },
+    };
+
+    for (auto&& frame : frames) {
+        VAPictureParameterBufferH264 picture = {};
+        picture.CurrPic = frame.current;
+        std::fill_n(picture.ReferenceFrames, 16, invalid);
+        std::ranges::copy(frame.references, picture.ReferenceFrames);
+        picture.picture_width_in_mbs_minus1 = 119;
+        picture.picture_height_in_mbs_minus1 = 67;
+        picture.num_ref_frames = 4;
+        picture.seq_fields.bits.chroma_format_idc = 1;
+        picture.seq_fields.bits.frame_mbs_only_flag = 1;
+        picture.seq_fields.bits.direct_8x8_inference_flag = 1;
+        picture.seq_fields.bits.log2_max_frame_num_minus4 = 2;
+        picture.seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4 = 4;
+        picture.pic_init_qp_minus26 = -3;
+        picture.chroma_qp_index_offset = -2;
+        picture.second_chroma_qp_index_offset = -2;
+        picture.pic_fields.bits.entropy_coding_mode_flag = 1;
+        picture.pic_fields.bits.weighted_pred_flag = frame.weighted;
+        picture.pic_fields.bits.transform_8x8_mode_flag = 1;
+        picture.pic_fields.bits.deblocking_filter_control_present_flag = 1;
+        picture.pic_fields.bits.reference_pic_flag = frame.reference;
+        picture.frame_num = frame.current.frame_idx;
+
+        VASliceParameterBufferH264 slice = {};
+        slice.slice_data_size = 50000;
+        slice.slice_data_bit_offset = 37;
+        slice.slice_type = frame.slice_type;
+        slice.direct_spatial_mv_pred_flag = frame.slice_type == 1;
+        slice.num_ref_idx_l0_active_minus1 = frame.list0.empty() ? 0 : frame.list0.size() - 1;
+        slice.num_ref_idx_l1_active_minus1 = frame.list1.empty() ? 0 : frame.list1.size() - 1;
+        slice.cabac_init_idc = 1;
+        slice.slice_qp_delta = 2;
+        slice.slice_alpha_c0_offset_div2 = -1;
+        slice.slice_beta_offset_div2 = -1;
+        std::fill_n(slice.RefPicList0, 32, invalid);
+        std::fill_n(slice.RefPicList1, 32, invalid);
+        std::ranges::copy(frame.list0, slice.RefPicList0);
+        std::ranges::copy(frame.list1, slice.RefPicList1);
+        if (frame.weighted) {
+            slice.luma_log2_weight_denom = 5;
+            slice.chroma_log2_weight_denom = 4;
+            for (unsigned i = 0; i < frame.list0.size(); i++) {
+                slice.luma_weight_l0[i] = 30 + i;
+                slice.luma_offset_l0[i] = -(int)i;
+                slice.chroma_weight_l0[i][0] = slice.chroma_weight_l0[i][1] = 14 + i;
+                slice.chroma_offset_l0[i][1] = i;
+            }
+        }
+
+        auto& surface = surfaces.at(frame.current.picture_id);
+        surface.params.h264.picture = &picture;
+        surface.params.h264.matrix = &matrix;
+        surface.params.h264.slice = &slice;
+
+        const auto controls = h264_va_to_v4l2(surfaces, dpb, surface, 100);
+        result.push_back(control("H264_DECODE_PARAMS", controls.decode));
+        result.push_back(control("H264_PPS", controls.pps));
+        result.push_back(control("H264_SPS", controls.sps));
+        result.push_back(control("H264_SCALING_MATRIX", controls.matrix));
+        result.push_back(control("H264_SLICE_PARAMS", controls.slice));
+        if (controls.weights) {
+            result.push_back(control("H264_PRED_WEIGHTS", *controls.weights));
+        }
+
+        h264_dpb_insert(dpb, &picture.CurrPic, controls.output);
+    }
+
+    return result;
+}
+
+/**
+ * A P-only stream referencing the 16 previous frames. The DPB also holds the picture being decoded, so once it is full,
+ * the least recently used entry makes way for it. The controls are dumped from then on.
+ */
+std::vector<Control> h264_16_references()
+{
+    const unsigned references = 16;
+    const unsigned frames = 20;
+    auto surfaces = make_surfaces(frames);
+    const VAPictureH264 invalid = { .picture_id = VA_INVALID_SURFACE, .flags = VA_PICTURE_H264_INVALID };
+    std::vector<Control> result;
+    h264_dpb dpb = {};
+
+    VAIQMatrixBufferH264 matrix = {};
+    memset(matrix.ScalingList4x4, 16, sizeof(matrix.ScalingList4x4));
+    memset(matrix.ScalingList8x8, 16, sizeof(matrix.ScalingList8x8));
+
+    for (unsigned frame = 0; frame < frames; frame++) {
+        VAPictureParameterBufferH264 picture = {};
+        picture.CurrPic = h264_picture(frame, frame % 16, 2 * frame);
+        picture.picture_width_in_mbs_minus1 = 79;
+        picture.picture_height_in_mbs_minus1 = 44;
+        picture.num_ref_frames = references;
+        picture.seq_fields.bits.chroma_format_idc = 1;
+        picture.seq_fields.bits.frame_mbs_only_flag = 1;
+        picture.seq_fields.bits.log2_max_frame_num_minus4 = 0;
+        picture.pic_fields.bits.reference_pic_flag = 1;
+        picture.frame_num = frame % 16;
+
+        VASliceParameterBufferH264 slice = {};
+        slice.slice_data_size = 20000;
+        slice.slice_type = frame ? 0 : 2;
+        std::fill_n(picture.ReferenceFrames, 16, invalid);
+        std::fill_n(slice.RefPicList0, 32, invalid);
+        std::fill_n(slice.RefPicList1, 32, invalid);
+        const unsigned count = std::min(frame, references);
+        for (unsigned i = 0; i < count; i++) {
+            const unsigned reference = frame - 1 - i;
+            picture.ReferenceFrames[i] = slice.RefPicList0[i]
+                = h264_picture(reference, reference % 16, 2 * reference, VA_PICTURE_H264_SHORT_TERM_REFERENCE);
+        }
+        slice.num_ref_idx_l0_active_minus1 = count ? count - 1 : 0;
+
+        auto& surface = surfaces.at(frame);
+        surface.params.h264.picture = &picture;
+        surface.params.h264.matrix = &matrix;
+        surface.params.h264.slice = &slice;
+
+        const auto controls = h264_va_to_v4l2(surfaces, dpb, surface, 100);
+        if (frame >= references) {
+            result.push_back(control("H264_DECODE_PARAMS", controls.decode));
+            result.push_back(control("H264_SLICE_PARAMS", controls.slice));
+        }
+
+        h264_dpb_insert(dpb, &picture.CurrPic, controls.output);
+    }
+
+    return result;
+}
+
+/**
+ * A key frame and an inter frame with three DCT partitions. The reconstructed frame header is dumped as well.
+ */
+std::vector<Control> vp8_key_inter()
+{
+    const auto surfaces = make_surfaces();
+    std::vector<Control> result;
+
+    VAProbabilityDataBufferVP8 probabilities = {};
+    for (unsigned i = 0; i < sizeof(probabilities.dct_coeff_probs); i++) {
+        reinterpret_cast<uint8_t*>(probabilities.dct_coeff_probs)[i] = 1 + i % 254;
+    }
+
+    VAIQMatrixBufferVP8 iqmatrix = {};
+    for (unsigned i = 0; i < 4; i++) {
+        for (unsigned j = 0; j < 6; j++) {
+            iqmatrix.quantization_index[i][j] = 20 + 4 * i + j;
+        }
+    }
+
+    for (unsigned index = 0; index < 2; index++) {
+        VAPictureParameterBufferVP8 picture = {};
+        picture.frame_width = 640;
+        picture.frame_height = 360;
+        picture.last_ref_frame = index ? 0 : VA_INVALID_SURFACE;
+        picture.golden_ref_frame = index ? 0 : VA_INVALID_SURFACE;
+        picture.alt_ref_frame = index ? 0 : VA_INVALID_SURFACE;
+        picture.out_of_loop_frame = VA_INVALID_SURFACE;
+        picture.pic_fields.bits.key_frame = index;
+        picture.pic_fields.bits.segmentation_enabled = 1;
+        picture.pic_fields.bits.update_mb_segmentation_map = 1;
+        picture.pic_fields.bits.sharpness_level = 2;
+        picture.pic_fields.bits.loop_filter_adj_enable = 1;
+        picture.pic_fields.bits.mode_ref_lf_delta_update = index == 0;
+        picture.pic_fields.bits.sign_bias_golden = index;
+        picture.pic_fields.bits.mb_no_coeff_skip = 1;
+        picture.mb_segment_tree_probs[0] = 120;
+        picture.mb_segment_tree_probs[1] = 130;
+        picture.mb_segment_tree_probs[2] = 140;
+        picture.loop_filter_level[0] = 24;
+        picture.loop_filter_deltas_ref_frame[0] = 2;
+        picture.loop_filter_deltas_ref_frame[2] = -2;
+        picture.loop_filter_deltas_mode[0] = 4;
+        picture.loop_filter_deltas_mode[3] = -2;
+        picture.prob_skip_false = 200;
+        picture.prob_intra = 60;
+        picture.prob_last = 250;
+        picture.prob_gf = 128;
+        picture.y_mode_probs[0] = 112;
+        picture.y_mode_probs[1] = 86;
+        picture.y_mode_probs[2] = 140;
+        picture.y_mode_probs[3] = 37;
+        picture.uv_mode_probs[0] = 162;
+        picture.uv_mode_probs[1] = 101;
+        picture.uv_mode_probs[2] = 204;
+        for (unsigned i = 0; i < 19; i++) {
+            picture.mv_probs[0][i] = 128 + i;
+            picture.mv_probs[1][i] = 128 - i;
+        }
+        picture.bool_coder_ctx = { .range = 0xd5, .value = 0x3c, .count = 5 };
+
+        VASliceParameterBufferVP8 slice = {};
+        slice.slice_data_size = 24000;
+        slice.macroblock_offset = 412;
+        slice.num_of_partitions = 4;
+        slice.partition_size[0] = 1500;
+        slice.partition_size[1] = 8000;
+        slice.partition_size[2] = 7500;
+        slice.partition_size[3] = 7000;
+
+        uint8_t prefix[16] = {};
+        const size_t prefix_size = vp8_prefix_data(prefix, &picture, &slice);
+
+        result.push_back(
+            control("VP8_FRAME", vp8_va_to_v4l2_frame(surfaces, &picture, &slice, &iqmatrix, &probabilities)));
+        result.push_back({ "frame header", std::vector<uint8_t>(prefix, prefix + prefix_size) });
+    }
+
+    return result;
+}
+
+#ifdef ENABLE_VP9
+/**
+ * An inter frame; the header fields VA does not carry are set as the parser would.
+ */
+std::vector<Control> vp9_inter()
+{
+    const auto surfaces = make_surfaces();
+
+    GstVp9FrameHeader header = {};
+    header.interpolation_filter = GST_VP9_INTERPOLATION_FILTER_EIGHTTAP_SMOOTH;
+    header.loop_filter_params.loop_filter_delta_enabled = 1;
+    header.loop_filter_params.loop_filter_ref_deltas[0] = 1;
+    header.loop_filter_params.loop_filter_ref_deltas[2] = -1;
+    header.loop_filter_params.loop_filter_ref_deltas[3] = -1;
+    header.quantization_params.base_q_idx = 92;
+    header.quantization_params.delta_q_y_dc = -2;
+    header.tx_mode = GST_VP9_TX_MODE_SELECT;
+    for (unsigned i = 0; i < sizeof(header.delta_probabilities.coef); i++) {
+        reinterpret_cast<uint8_t*>(header.delta_probabilities.coef)[i] = i % 7;
+    }
+    header.delta_probabilities.skip[1] = 3;
+    header.delta_probabilities.mv.joint[0] = 5;
+
+    VADecPictureParameterBufferVP9 picture = {};
+    picture.frame_width = 1920;
+    picture.frame_height = 1080;
+    for (unsigned i = 0; i < 8; i++) {
+        picture.reference_frames[i] = i < 3 ? i : VA_INVALID_SURFACE;
+    }
+    picture.pic_fields.bits.subsampling_x = 1;
+    picture.pic_fields.bits.subsampling_y = 1;
+    picture.pic_fields.bits.frame_type = 1;
+    picture.pic_fields.bits.show_frame = 1;
+    picture.pic_fields.bits.allow_high_precision_mv = 1;
+    picture.pic_fields.bits.refresh_frame_context = 1;
+    picture.pic_fields.bits.reset_frame_context = 2;
+    picture.pic_fields.bits.last_ref_frame = 0;
+    picture.pic_fields.bits.golden_ref_frame = 1;
+    picture.pic_fields.bits.alt_ref_frame = 2;
+    picture.pic_fields.bits.alt_ref_frame_sign_bias = 1;
+    picture.filter_level = 18;
+    picture.sharpness_level = 1;
+    picture.log2_tile_columns = 2;
+    picture.frame_header_length_in_bytes = 19;
+    picture.first_partition_size = 120;
+    for (unsigned i = 0; i < 7; i++) {
+        picture.mb_segment_tree_probs[i] = 255;
+    }
+    picture.profile = 0;
+    picture.bit_depth = 8;
+
+    VASliceParameterBufferVP9 slice = {};
+    slice.slice_data_size = 65000;
+    slice.seg_param[0].segment_flags.fields.segment_reference_enabled = 1;
+    slice.seg_param[1].segment_flags.fields.segment_reference_skipped = 1;
+
+    return {
+        control("VP9_FRAME", vp9_va_to_v4l2_frame(surfaces, &picture, &slice, &header)),
+        control("VP9_COMPRESSED_HDR", gst_to_v4l2_compressed_header(&header)),
+    };
+}
+#endif
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const std::vector<std::pair<std::string, std::function<std::vector<Control>()>>> cases = {
+        { "mpeg2-ipb", mpeg2_ipb },
+        { "h264-ipbp", h264_ipbp },
+        { "h264-16-references", h264_16_references },
+        { "vp8-key-inter", vp8_key_inter },
+#ifdef ENABLE_VP9
+        { "vp9-inter", vp9_inter },
+#endif
+    };
+
+    bool update = false;
+    std::string directory;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--update") == 0) {
+            update = true;
+        } else {
+            directory = argv[i];
+        }
+    }
+    if (directory.empty()) {
+        fprintf(stderr, "Usage: %s [--update] GOLDEN_DIRECTORY\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int failures = 0;
+    for (auto&& [name, function] : cases) {
+        const auto path = directory + "/" + name + ".txt";
+        const auto actual = dump(function());
+
+        if (update) {
+            std::ofstream(path) << actual;
+            printf("UPDATED %s\n", name.c_str());
+            continue;
+        }
+
+        std::ifstream file(path);
+        if (!file) {
+            printf("MISSING %s: %s\n", name.c_str(), path.c_str());
+            failures++;
+            continue;
+        }
+        std::stringstream expected;
+        expected << file.rdbuf();
+
+        if (expected.str() == actual) {
+            printf("PASS %s\n", name.c_str());
+            continue;
+        }
+
+        failures++;
+        std::istringstream expected_lines(expected.str()), actual_lines(actual);
+        std::string expected_line, actual_line, section;
+        for (unsigned line = 1;; line++) {
+            const bool more_expected = !!std::getline(expected_lines, expected_line);
+            const bool more_actual = !!std::getline(actual_lines, actual_line);
+            if (!more_expected && !more_actual) {
+                break;
+            }
+            if (!actual_line.empty() && !isxdigit(actual_line[0]) && actual_line[0] != '*') {
+                section = actual_line;
+            }
+            if (!more_expected || !more_actual || expected_line != actual_line) {
+                printf("FAIL %s: line %u in %s\n  expected: %s\n  actual:   %s\n", name.c_str(), line, section.c_str(),
+                    more_expected ? expected_line.c_str() : "<end>", more_actual ? actual_line.c_str() : "<end>");
+                break;
+            }
+        }
+    }
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,712 @@
+/*
+ * Copyright (C) 2024 Max Schettler <max.schettler@posteo.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Replays a capture written with `LIBVA_V4L2_CAPTURE` against the driver, either as fast as possible or with the
+ * recorded timing, and compares statuses and per-call latency with the recording.
+ *
+ * Parameter buffers are submitted as recorded, so the surface IDs embedded in them have to come out the same; the
+ * driver hands them out deterministically, and mismatching IDs are reported.
+ */
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <va/va.h>
+#include <va/va_backend.h>
+#include <va/va_drmcommon.h>
+#include <va/va_vpp.h>
+}
+
+#include "capture.h"
+#include "driver.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string path;
+    bool original_timing = false;
+    bool list = false;
+    unsigned loop = 1;
+};
+
+const char* call_name(CaptureCall call)
+{
+    switch (call) {
+    case CaptureCall::Terminate:
+        return "Terminate";
+    case CaptureCall::CreateConfig:
+        return "CreateConfig";
+    case CaptureCall::DestroyConfig:
+        return "DestroyConfig";
+    case CaptureCall::CreateSurfaces:
+        return "CreateSurfaces";
+    case CaptureCall::DestroySurfaces:
+        return "DestroySurfaces";
+    case CaptureCall::CreateContext:
+        return "CreateContext";
+    case CaptureCall::DestroyContext:
+        return "DestroyContext";
+    case CaptureCall::CreateBuffer:
+        return "CreateBuffer";
+    case CaptureCall::BufferSetNumElements:
+        return "BufferSetNumElements";
+    case CaptureCall::MapBuffer:
+        return "MapBuffer";
+    case CaptureCall::UnmapBuffer:
+        return "UnmapBuffer";
+    case CaptureCall::DestroyBuffer:
+        return "DestroyBuffer";
+    case CaptureCall::BeginPicture:
+        return "BeginPicture";
+    case CaptureCall::RenderPicture:
+        return "RenderPicture";
+    case CaptureCall::EndPicture:
+        return "EndPicture";
+    case CaptureCall::SyncSurface:
+        return "SyncSurface";
+    case CaptureCall::QuerySurfaceStatus:
+        return "QuerySurfaceStatus";
+    case CaptureCall::ExportSurfaceHandle:
+        return "ExportSurfaceHandle";
+    case CaptureCall::CreateImage:
+        return "CreateImage";
+    case CaptureCall::DeriveImage:
+        return "DeriveImage";
+    case CaptureCall::DestroyImage:
+        return "DestroyImage";
+    case CaptureCall::GetImage:
+        return "GetImage";
+    case CaptureCall::PutImage:
+        return "PutImage";
+    case CaptureCall::Other:
+        return "Other";
+    case CaptureCall::LockSurface:
+        return "LockSurface";
+    case CaptureCall::UnlockSurface:
+        return "UnlockSurface";
+    case CaptureCall::AcquireBufferHandle:
+        return "AcquireBufferHandle";
+    case CaptureCall::ReleaseBufferHandle:
+        return "ReleaseBufferHandle";
+    case CaptureCall::SetImagePalette:
+        return "SetImagePalette";
+    case CaptureCall::CreateSubpicture:
+        return "CreateSubpicture";
+    case CaptureCall::DestroySubpicture:
+        return "DestroySubpicture";
+    case CaptureCall::SetSubpictureImage:
+        return "SetSubpictureImage";
+    case CaptureCall::SetSubpictureChromakey:
+        return "SetSubpictureChromakey";
+    case CaptureCall::SetSubpictureGlobalAlpha:
+        return "SetSubpictureGlobalAlpha";
+    case CaptureCall::AssociateSubpicture:
+        return "AssociateSubpicture";
+    case CaptureCall::DeassociateSubpicture:
+        return "DeassociateSubpicture";
+    case CaptureCall::Controls:
+        return "Controls";
+    }
+    return "Unknown";
+}
+
+size_t padded(size_t size)
+{
+    return (size + 7) & ~size_t(7);
+}
+
+struct Record {
+    const CaptureRecord* record;
+    std::span<const uint8_t> payload;
+};
+
+/**
+ * Read-only mapping of a capture file, split into its records.
+ */
+class CaptureFile {
+public:
+    explicit CaptureFile(const std::string& path)
+    {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        struct stat st;
+        fstat(fd, &st);
+        size = st.st_size;
+        data = static_cast<const uint8_t*>(mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+
+        if (size < sizeof(CaptureHeader) || memcmp(header().magic, CAPTURE_MAGIC, sizeof(header().magic))) {
+            throw std::runtime_error(path + " is not a capture file");
+        }
+        // Version 1 recorded surface locks, buffer handles and subpictures as `Other`, which is still accepted.
+        if (header().version < 1 || header().version > CAPTURE_VERSION) {
+            throw std::runtime_error(path + " has unsupported version " + std::to_string(header().version));
+        }
+
+        for (size_t offset = sizeof(CaptureHeader); offset + sizeof(CaptureRecord) <= size;) {
+            const auto record = reinterpret_cast<const CaptureRecord*>(data + offset);
+            offset += sizeof(CaptureRecord);
+            if (offset + record->size > size) {
+                fprintf(stderr, "Capture truncated after %zu records\n", records.size());
+                break;
+            }
+            records.push_back({ record, { data + offset, record->size } });
+            offset += padded(record->size);
+        }
+    }
+
+    ~CaptureFile() { munmap(const_cast<uint8_t*>(data), size); }
+
+    CaptureFile(const CaptureFile&) = delete;
+    CaptureFile& operator=(const CaptureFile&) = delete;
+
+    const CaptureHeader& header() const { return *reinterpret_cast<const CaptureHeader*>(data); }
+
+    std::vector<Record> records;
+
+private:
+    const uint8_t* data;
+    size_t size;
+};
+
+/** Walks `(Header, data)[]` payloads as written for `RenderPicture` and `Controls`. */
+template <typename Header, typename F> void for_each_part(std::span<const uint8_t> payload, F f)
+{
+    for (size_t offset = 0; offset + sizeof(Header) <= payload.size();) {
+        const auto header = reinterpret_cast<const Header*>(payload.data() + offset);
+        offset += sizeof(Header);
+        f(*header, payload.subspan(offset, std::min<size_t>(header->size, payload.size() - offset)));
+        offset += padded(header->size);
+    }
+}
+
+void list(const CaptureFile& file)
+{
+    printf("VA-API %u.%u\n", file.header().va_version >> 16, file.header().va_version & 0xffff);
+    for (auto&& [record, payload] : file.records) {
+        printf("%12.3f ms %8.1f us %-24s status %d args", record->time / 1e6, record->duration / 1e3,
+            call_name(record->call), record->status);
+        for (auto arg : record->args) {
+            printf(" %u", arg);
+        }
+        printf("\n");
+
+        if (record->call == CaptureCall::RenderPicture) {
+            for_each_part<CaptureBuffer>(payload, [](const CaptureBuffer& buffer, auto) {
+                printf("%42s buffer %u type %u size %u count %u\n", "", buffer.id, buffer.type, buffer.size,
+                    buffer.count);
+            });
+        } else if (record->call == CaptureCall::Controls) {
+            for_each_part<CaptureControl>(payload, [](const CaptureControl& control, std::span<const uint8_t> data) {
+                printf("%42s control 0x%08x size %u:", "", control.id, control.size);
+                for (size_t i = 0; i < data.size(); i++) {
+                    printf("%s%02x", (i % 32) ? " " : "\n    ", data[i]);
+                }
+                printf("\n");
+            });
+        }
+    }
+}
+
+struct Latency {
+    unsigned count = 0;
+    double recorded_us = 0;
+    double replayed_us = 0;
+};
+
+struct Summary {
+    unsigned frames = 0;
+    unsigned mismatches = 0;
+    unsigned skipped = 0;
+    double elapsed_us = 0;
+    std::map<CaptureCall, Latency> latency;
+};
+
+/**
+ * One replay of a capture on a fresh driver instance. Object IDs returned by the driver are mapped to those that
+ * were recorded.
+ */
+class Replay {
+public:
+    Replay(const CaptureFile& file, const Options& options, Summary& summary)
+        : file(file)
+        , options(options)
+        , summary(summary)
+    {
+        context.vtable = &vtable;
+        context.vtable_vpp = &vtable_vpp;
+        context.error_callback = [](VADriverContextP, const char* message) { fputs(message, stderr); };
+        context.info_callback = [](VADriverContextP, const char*) {};
+        if (VA_DRIVER_INIT_FUNC(&context) != VA_STATUS_SUCCESS) {
+            throw std::runtime_error("Driver initialization failed");
+        }
+    }
+
+    ~Replay() { vtable.vaTerminate(&context); }
+
+    Replay(const Replay&) = delete;
+    Replay& operator=(const Replay&) = delete;
+
+    void run()
+    {
+        const auto start = Clock::now();
+        for (auto&& record : file.records) {
+            if (options.original_timing) {
+                std::this_thread::sleep_until(start + std::chrono::nanoseconds(record.record->time));
+            }
+            execute(record);
+        }
+        summary.elapsed_us += std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    }
+
+private:
+    static uint32_t lookup(const std::map<uint32_t, uint32_t>& ids, uint32_t id)
+    {
+        const auto it = ids.find(id);
+        return (it == ids.end()) ? id : it->second;
+    }
+
+    void map_id(std::map<uint32_t, uint32_t>& ids, uint32_t recorded, uint32_t replayed)
+    {
+        if (recorded != replayed) {
+            summary.mismatches++;
+        }
+        ids[recorded] = replayed;
+    }
+
+    /**
+     * Pipeline parameters point into the recording process, whose regions, filters and references are not captured.
+     * Those are dropped, so the whole surfaces are processed, and the input surface is mapped.
+     */
+    void sanitize_pipeline(VAProcPipelineParameterBuffer* pipeline)
+    {
+        pipeline->surface = lookup(surfaces, pipeline->surface);
+        pipeline->surface_region = nullptr;
+        pipeline->output_region = nullptr;
+        pipeline->filters = nullptr;
+        pipeline->num_filters = 0;
+        pipeline->forward_references = nullptr;
+        pipeline->num_forward_references = 0;
+        pipeline->backward_references = nullptr;
+        pipeline->num_backward_references = 0;
+        pipeline->blend_state = nullptr;
+        pipeline->additional_outputs = nullptr;
+        pipeline->num_additional_outputs = 0;
+    }
+
+    /** Copy the recorded contents into the buffers about to be rendered; not part of the measured time. */
+    void fill_buffers(std::span<const uint8_t> payload)
+    {
+        for_each_part<CaptureBuffer>(payload, [&](const CaptureBuffer& buffer, std::span<const uint8_t> data) {
+            const auto id = lookup(buffers, buffer.id);
+            void* map;
+            if (vtable.vaBufferSetNumElements(&context, id, buffer.count) != VA_STATUS_SUCCESS
+                || vtable.vaMapBuffer(&context, id, &map) != VA_STATUS_SUCCESS) {
+                return;
+            }
+            memcpy(map, data.data(), data.size());
+            if (buffer.type == VAProcPipelineParameterBufferType
+                && data.size() >= sizeof(VAProcPipelineParameterBuffer)) {
+                sanitize_pipeline(static_cast<VAProcPipelineParameterBuffer*>(map));
+            }
+            vtable.vaUnmapBuffer(&context, id);
+        });
+    }
+
+    void execute(const Record& record)
+    {
+        const auto& args = record.record->args;
+        VAStatus status = VA_STATUS_SUCCESS;
+        std::vector<uint32_t> ids;
+        VAImage image;
+        auto measure = [&](auto f) {
+            const auto start = Clock::now();
+            status = f();
+            auto& latency = summary.latency[record.record->call];
+            latency.count++;
+            latency.recorded_us += record.record->duration / 1e3;
+            latency.replayed_us += std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+        };
+        auto recorded_ids = [&] {
+            const auto data = reinterpret_cast<const uint32_t*>(record.payload.data());
+            std::vector<uint32_t> result(data, data + record.payload.size() / sizeof(uint32_t));
+            for (auto& id : result) {
+                id = lookup(surfaces, id);
+            }
+            return result;
+        };
+
+        switch (record.record->call) {
+        case CaptureCall::CreateConfig: {
+            std::vector<VAConfigAttrib> attributes(record.payload.size() / sizeof(VAConfigAttrib));
+            memcpy(attributes.data(), record.payload.data(), record.payload.size());
+            VAConfigID id;
+            measure([&] {
+                return vtable.vaCreateConfig(&context, static_cast<VAProfile>(args[0]),
+                    static_cast<VAEntrypoint>(args[1]), attributes.data(), attributes.size(), &id);
+            });
+            if (status == VA_STATUS_SUCCESS) {
+                map_id(configs, args[3], id);
+            }
+            break;
+        }
+        case CaptureCall::DestroyConfig:
+            measure([&] { return vtable.vaDestroyConfig(&context, lookup(configs, args[0])); });
+            break;
+        case CaptureCall::CreateSurfaces:
+            ids.resize(args[3]);
+            measure([&] {
+                return vtable.vaCreateSurfaces2(
+                    &context, args[0], args[1], args[2], ids.data(), ids.size(), nullptr, 0);
+            });
+            if (status == VA_STATUS_SUCCESS) {
+                const auto recorded = reinterpret_cast<const uint32_t*>(record.payload.data());
+                for (size_t i = 0; i < std::min(ids.size(), record.payload.size() / sizeof(uint32_t)); i++) {
+                    map_id(surfaces, recorded[i], ids[i]);
+                }
+            }
+            break;
+        case CaptureCall::DestroySurfaces:
+            ids = recorded_ids();
+            measure([&] { return vtable.vaDestroySurfaces(&context, ids.data(), ids.size()); });
+            break;
+        case CaptureCall::CreateContext: {
+            ids = recorded_ids();
+            VAContextID id;
+            measure([&] {
+                return vtable.vaCreateContext(
+                    &context, lookup(configs, args[0]), args[1], args[2], args[3], ids.data(), ids.size(), &id);
+            });
+            if (status == VA_STATUS_SUCCESS) {
+                map_id(contexts, args[5], id);
+            }
+            break;
+        }
+        case CaptureCall::DestroyContext:
+            measure([&] { return vtable.vaDestroyContext(&context, lookup(contexts, args[0])); });
+            break;
+        case CaptureCall::CreateBuffer: {
+            VABufferID id;
+            measure([&] {
+                return vtable.vaCreateBuffer(&context, lookup(contexts, args[0]), static_cast<VABufferType>(args[1]),
+                    args[2], args[3], nullptr, &id);
+            });
+            if (status == VA_STATUS_SUCCESS) {
+                map_id(buffers, args[4], id);
+            }
+            break;
+        }
+        case CaptureCall::BufferSetNumElements:
+            measure([&] { return vtable.vaBufferSetNumElements(&context, lookup(buffers, args[0]), args[1]); });
+            break;
+        case CaptureCall::MapBuffer: {
+            void* map;
+            measure([&] { return vtable.vaMapBuffer(&context, lookup(buffers, args[0]), &map); });
+            break;
+        }
+        case CaptureCall::UnmapBuffer:
+            measure([&] { return vtable.vaUnmapBuffer(&context, lookup(buffers, args[0])); });
+            break;
+        case CaptureCall::DestroyBuffer:
+            measure([&] { return vtable.vaDestroyBuffer(&context, lookup(buffers, args[0])); });
+            break;
+        case CaptureCall::BeginPicture:
+            measure([&] {
+                return vtable.vaBeginPicture(&context, lookup(contexts, args[0]), lookup(surfaces, args[1]));
+            });
+            break;
+        case CaptureCall::RenderPicture:
+            fill_buffers(record.payload);
+            for_each_part<CaptureBuffer>(
+                record.payload, [&](const CaptureBuffer& buffer, auto) { ids.push_back(lookup(buffers, buffer.id)); });
+            measure(
+                [&] { return vtable.vaRenderPicture(&context, lookup(contexts, args[0]), ids.data(), ids.size()); });
+            break;
+        case CaptureCall::EndPicture:
+            measure([&] { return vtable.vaEndPicture(&context, lookup(contexts, args[0])); });
+            summary.frames += status == VA_STATUS_SUCCESS;
+            break;
+        case CaptureCall::SyncSurface:
+            measure([&] { return vtable.vaSyncSurface(&context, lookup(surfaces, args[0])); });
+            break;
+        case CaptureCall::QuerySurfaceStatus: {
+            VASurfaceStatus surface_status;
+            measure([&] { return vtable.vaQuerySurfaceStatus(&context, lookup(surfaces, args[0]), &surface_status); });
+            break;
+        }
+        case CaptureCall::ExportSurfaceHandle: {
+            VADRMPRIMESurfaceDescriptor descriptor = {};
+            measure([&] {
+                return vtable.vaExportSurfaceHandle(&context, lookup(surfaces, args[0]), args[1], args[2], &descriptor);
+            });
+            if (status == VA_STATUS_SUCCESS && args[1] == VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2) {
+                for (uint32_t i = 0; i < descriptor.num_objects; i++) {
+                    close(descriptor.objects[i].fd);
+                }
+            }
+            break;
+        }
+        case CaptureCall::CreateImage: {
+            VAImageFormat format = { .fourcc = args[0] };
+            measure([&] { return vtable.vaCreateImage(&context, &format, args[1], args[2], &image); });
+            if (status == VA_STATUS_SUCCESS) {
+                map_id(images, args[3], image.image_id);
+                map_id(buffers, args[4], image.buf);
+            }
+            break;
+        }
+        case CaptureCall::DeriveImage:
+            measure([&] { return vtable.vaDeriveImage(&context, lookup(surfaces, args[0]), &image); });
+            if (status == VA_STATUS_SUCCESS) {
+                map_id(images, args[1], image.image_id);
+                map_id(buffers, args[2], image.buf);
+            }
+            break;
+        case CaptureCall::DestroyImage:
+            measure([&] { return vtable.vaDestroyImage(&context, lookup(images, args[0])); });
+            break;
+        case CaptureCall::GetImage:
+            measure([&] {
+                return vtable.vaGetImage(&context, lookup(surfaces, args[0]), args[1], args[2], args[3], args[4],
+                    lookup(images, args[5]));
+            });
+            break;
+        case CaptureCall::PutImage:
+            measure([&] {
+                return vtable.vaPutImage(&context, lookup(surfaces, args[0]), lookup(images, args[1]), args[2],
+                    args[3], args[4], args[5], args[6], args[7], args[4], args[5]);
+            });
+            break;
+        case CaptureCall::LockSurface: {
+            unsigned int fourcc, strides[3], offsets[3], buffer_name;
+            void* buffer;
+            measure([&] {
+                return vtable.vaLockSurface(&context, lookup(surfaces, args[0]), &fourcc, &strides[0], &strides[1],
+                    &strides[2], &offsets[0], &offsets[1], &offsets[2], &buffer_name, &buffer);
+            });
+            break;
+        }
+        case CaptureCall::UnlockSurface:
+            measure([&] { return vtable.vaUnlockSurface(&context, lookup(surfaces, args[0])); });
+            break;
+        case CaptureCall::AcquireBufferHandle: {
+            VABufferInfo info = { .mem_type = args[1] };
+            measure([&] { return vtable.vaAcquireBufferHandle(&context, lookup(buffers, args[0]), &info); });
+            break;
+        }
+        case CaptureCall::ReleaseBufferHandle:
+            measure([&] { return vtable.vaReleaseBufferHandle(&context, lookup(buffers, args[0])); });
+            break;
+        case CaptureCall::SetImagePalette: {
+            std::vector<unsigned char> palette(record.payload.begin(), record.payload.end());
+            measure([&] {
+                return vtable.vaSetImagePalette(
+                    &context, lookup(images, args[0]), palette.empty() ? nullptr : palette.data());
+            });
+            break;
+        }
+        case CaptureCall::CreateSubpicture: {
+            VASubpictureID id;
+            measure([&] { return vtable.vaCreateSubpicture(&context, lookup(images, args[0]), &id); });
+            if (status == VA_STATUS_SUCCESS) {
+                map_id(subpictures, args[1], id);
+            }
+            break;
+        }
+        case CaptureCall::DestroySubpicture:
+            measure([&] { return vtable.vaDestroySubpicture(&context, lookup(subpictures, args[0])); });
+            break;
+        case CaptureCall::SetSubpictureImage:
+            measure([&] {
+                return vtable.vaSetSubpictureImage(&context, lookup(subpictures, args[0]), lookup(images, args[1]));
+            });
+            break;
+        case CaptureCall::SetSubpictureChromakey:
+            measure([&] {
+                return vtable.vaSetSubpictureChromakey(
+                    &context, lookup(subpictures, args[0]), args[1], args[2], args[3]);
+            });
+            break;
+        case CaptureCall::SetSubpictureGlobalAlpha:
+            measure([&] {
+                return vtable.vaSetSubpictureGlobalAlpha(
+                    &context, lookup(subpictures, args[0]), std::bit_cast<float>(args[1]));
+            });
+            break;
+        case CaptureCall::AssociateSubpicture:
+            ids = recorded_ids();
+            measure([&] {
+                auto low = [](uint32_t arg) { return static_cast<int16_t>(arg); };
+                auto high = [](uint32_t arg) { return static_cast<int16_t>(arg >> 16); };
+                return vtable.vaAssociateSubpicture(&context, lookup(subpictures, args[0]), ids.data(), ids.size(),
+                    low(args[2]), high(args[2]), low(args[3]), high(args[3]), low(args[4]), high(args[4]),
+                    low(args[5]), high(args[5]), args[6]);
+            });
+            break;
+        case CaptureCall::DeassociateSubpicture:
+            ids = recorded_ids();
+            measure([&] {
+                return vtable.vaDeassociateSubpicture(&context, lookup(subpictures, args[0]), ids.data(), ids.size());
+            });
+            break;
+        case CaptureCall::Terminate:
+        case CaptureCall::Controls:
+            // Termination happens when the replay ends, controls are generated by the driver.
+            return;
+        default:
+            summary.skipped++;
+            return;
+        }
+
+        if (status != record.record->status) {
+            summary.mismatches++;
+            fprintf(stderr, "%s at %.3f ms returned %d, recorded %d\n", call_name(record.record->call),
+                record.record->time / 1e6, status, record.record->status);
+        }
+    }
+
+    const CaptureFile& file;
+    const Options& options;
+    Summary& summary;
+
+    VADriverContext context = {};
+    VADriverVTable vtable = {};
+    VADriverVTableVPP vtable_vpp = {};
+
+    std::map<uint32_t, uint32_t> configs;
+    std::map<uint32_t, uint32_t> surfaces;
+    std::map<uint32_t, uint32_t> contexts;
+    std::map<uint32_t, uint32_t> buffers;
+    std::map<uint32_t, uint32_t> images;
+    std::map<uint32_t, uint32_t> subpictures;
+};
+
+void report(const CaptureFile& file, const Summary& summary, unsigned loops)
+{
+    const auto& records = file.records;
+    const double recorded_us = records.empty() ? 0 : records.back().record->time / 1e3;
+
+    printf("frames: %u in %.1f ms (%.1f fps), recorded %.1f ms\n", summary.frames, summary.elapsed_us / 1e3,
+        summary.elapsed_us ? summary.frames / (summary.elapsed_us / 1e6) : 0, recorded_us * loops / 1e3);
+    printf("status or ID mismatches: %u, calls not replayed: %u\n", summary.mismatches, summary.skipped);
+    printf("%-24s %8s %14s %14s\n", "call", "count", "recorded us", "replayed us");
+    for (auto&& [call, latency] : summary.latency) {
+        printf("%-24s %8u %14.2f %14.2f\n", call_name(call), latency.count, latency.recorded_us / latency.count,
+            latency.replayed_us / latency.count);
+    }
+}
+
+void usage(const char* name)
+{
+    fprintf(stderr,
+        "Usage: %s [options] CAPTURE\n"
+        "  --timing MODE  'fast' (default) or 'original' to keep the recorded pacing\n"
+        "  --loop N       replay N times, each on a fresh driver instance (1)\n"
+        "  --list         print the recorded calls and controls instead of replaying\n",
+        name);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+            auto value = [&] {
+                if (i + 1 >= argc) {
+                    throw std::invalid_argument("Missing value for " + arg);
+                }
+                return std::string(argv[++i]);
+            };
+
+            if (arg == "--timing") {
+                const auto timing = value();
+                if (timing != "fast" && timing != "original") {
+                    throw std::invalid_argument("Invalid timing " + timing);
+                }
+                options.original_timing = timing == "original";
+            } else if (arg == "--loop") {
+                options.loop = std::stoul(value());
+            } else if (arg == "--list") {
+                options.list = true;
+            } else if (arg == "--help" || arg.starts_with("-")) {
+                usage(argv[0]);
+                return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+            } else {
+                options.path = arg;
+            }
+        }
+        if (options.path.empty()) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        const CaptureFile file(options.path);
+        if (options.list) {
+            list(file);
+            return EXIT_SUCCESS;
+        }
+
+        Summary summary;
+        for (unsigned i = 0; i < options.loop; i++) {
+            Replay(file, options, summary).run();
+        }
+        report(file, summary, options.loop);
+        return summary.mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+    } catch (std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return EXIT_FAILURE;
+    }
+}